@@ -37,8 +37,10 @@
 #include <machine/lapic.h>
 #include <machine/pic.h>
 #include <machine/pit.h>
+#include <machine/pmem.h>
 #include <machine/types.h>
 #include <vm/vm_kmem.h>
+#include <vm/vm_page.h>
 
 /*
  * Priority of the shutdown operations.
@@ -158,6 +160,75 @@ for (acpi_madt_iter_init(iter, madt); \
      acpi_madt_iter_valid(iter);      \
      acpi_madt_iter_next(iter))
 
+#define ACPI_SRAT_ENTRY_LAPIC   0
+#define ACPI_SRAT_ENTRY_MEMORY  1
+
+struct acpi_srat_entry_hdr {
+    uint8_t type;
+    uint8_t length;
+} __packed;
+
+#define ACPI_SRAT_LAPIC_ENABLED 0x1
+
+struct acpi_srat_entry_lapic {
+    struct acpi_srat_entry_hdr header;
+    uint8_t domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+} __packed;
+
+#define ACPI_SRAT_MEMORY_ENABLED    0x1
+#define ACPI_SRAT_MEMORY_HOTPLUG    0x2
+
+struct acpi_srat_entry_memory {
+    struct acpi_srat_entry_hdr header;
+    uint32_t domain;
+    uint16_t _reserved0;
+    uint64_t base;
+    uint64_t length;
+    uint32_t _reserved1;
+    uint32_t flags;
+    uint64_t _reserved2;
+} __packed;
+
+union acpi_srat_entry {
+    uint8_t type;
+    struct acpi_srat_entry_hdr header;
+    struct acpi_srat_entry_lapic lapic;
+    struct acpi_srat_entry_memory memory;
+} __packed;
+
+struct acpi_srat {
+    struct acpi_sdth header;
+    uint32_t _reserved0;
+    uint64_t _reserved1;
+    union acpi_srat_entry entries[0];
+} __packed;
+
+struct acpi_srat_iter {
+    const union acpi_srat_entry *entry;
+    const union acpi_srat_entry *end;
+};
+
+#define acpi_srat_foreach(srat, iter) \
+for (acpi_srat_iter_init(iter, srat); \
+     acpi_srat_iter_valid(iter);      \
+     acpi_srat_iter_next(iter))
+
+struct acpi_slit {
+    struct acpi_sdth header;
+    uint64_t nr_localities;
+    uint8_t entries[0];
+} __packed;
+
+/*
+ * Number of local APIC IDs, which are 8-bits wide.
+ */
+#define ACPI_NR_APIC_IDS 256
+
 #define ACPI_FADT_FL_RESET_REG_SUP  0x400
 
 struct acpi_fadt {
@@ -185,6 +256,19 @@ static struct acpi_table_addr acpi_table_addrs[] __initdata = {
 static struct acpi_gas acpi_reset_reg;
 static uint8_t acpi_reset_value;
 
+/*
+ * NUMA topology.
+ *
+ * Memory nodes are numbered in the order their proximity domains appear
+ * in the SRAT. Processors are associated to nodes using their local APIC
+ * ID. Processors in proximity domains without usable memory belong to
+ * node 0.
+ */
+static uint32_t acpi_numa_domains[PMEM_MAX_NODES] __initdata;
+static bool acpi_numa_nodes_loaded[PMEM_MAX_NODES] __initdata;
+static unsigned int acpi_numa_nr_nodes __initdata;
+static uint8_t acpi_numa_cpu_nodes[ACPI_NR_APIC_IDS] __initdata;
+
 static void __init
 acpi_table_sig(const struct acpi_sdth *table, char *sig)
 {
@@ -311,12 +395,28 @@ acpi_check_rsdp(const struct acpi_rsdp *rsdp)
     return 0;
 }
 
+/*
+ * Return a pointer to physical memory in the direct physical mapping.
+ *
+ * The BIOS memory is always part of the direct physical mapping. This
+ * function may be called before the kernel map is usable.
+ */
+static const void * __init
+acpi_map_direct(phys_addr_t pa, size_t size)
+{
+    if ((pa >= biosmem_directmap_end())
+        || (size > (biosmem_directmap_end() - pa))) {
+        return NULL;
+    }
+
+    return (const void *)vm_page_direct_va(pa);
+}
+
 static int __init
 acpi_get_rsdp(phys_addr_t start, size_t size, struct acpi_rsdp *rsdp)
 {
     const struct acpi_rsdp *src;
-    uintptr_t addr, end, map_addr;
-    size_t map_size;
+    uintptr_t addr, end;
     int error;
 
     assert(size > 0);
@@ -326,10 +426,10 @@ acpi_get_rsdp(phys_addr_t start, size_t size, struct acpi_rsdp *rsdp)
         return -1;
     }
 
-    addr = (uintptr_t)vm_kmem_map_pa(start, size, &map_addr, &map_size);
+    addr = (uintptr_t)acpi_map_direct(start, size);
 
     if (addr == 0) {
-        panic("acpi: unable to map bios memory in kernel map");
+        panic("acpi: bios memory not in direct physical mapping");
     }
 
     for (end = addr + size; addr < end; addr += ACPI_RSDP_ALIGN) {
@@ -342,34 +442,27 @@ acpi_get_rsdp(phys_addr_t start, size_t size, struct acpi_rsdp *rsdp)
     }
 
     if (!(addr < end)) {
-        error = -1;
-        goto out;
+        return -1;
     }
 
     memcpy(rsdp, src, sizeof(*rsdp));
-    error = 0;
-
-out:
-    vm_kmem_unmap_pa(map_addr, map_size);
-    return error;
+    return 0;
 }
 
 static int __init
 acpi_find_rsdp(struct acpi_rsdp *rsdp)
 {
     const uint16_t *ptr;
-    uintptr_t base, map_addr;
-    size_t map_size;
+    uintptr_t base;
     int error;
 
-    ptr = vm_kmem_map_pa(BIOSMEM_EBDA_PTR, sizeof(*ptr), &map_addr, &map_size);
+    ptr = acpi_map_direct(BIOSMEM_EBDA_PTR, sizeof(*ptr));
 
     if (ptr == NULL) {
-        panic("acpi: unable to map ebda pointer in kernel map");
+        panic("acpi: ebda pointer not in direct physical mapping");
     }
 
     base = *((const volatile uint16_t *)ptr);
-    vm_kmem_unmap_pa(map_addr, map_size);
 
     if (base != 0) {
         base <<= 4;
@@ -524,7 +617,8 @@ acpi_load_lapic(const struct acpi_madt_entry_lapic *lapic, int *is_bsp)
         return;
     }
 
-    cpu_mp_register_lapic(lapic->apic_id, *is_bsp);
+    cpu_mp_register_lapic(lapic->apic_id, *is_bsp,
+                          acpi_numa_cpu_nodes[lapic->apic_id]);
     *is_bsp = 0;
 }
 
@@ -607,6 +701,277 @@ acpi_load_madt(void)
     }
 }
 
+/*
+ * Return a pointer to a table in the direct physical mapping.
+ *
+ * Tables outside the direct physical mapping, or with an invalid checksum,
+ * are ignored.
+ */
+static const struct acpi_sdth * __init
+acpi_map_table_direct(uint32_t addr)
+{
+    const struct acpi_sdth *table;
+
+    table = acpi_map_direct(addr, sizeof(*table));
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table = acpi_map_direct(addr, table->length);
+
+    if ((table == NULL) || (acpi_checksum(table, table->length) != 0)) {
+        return NULL;
+    }
+
+    return table;
+}
+
+static const struct acpi_sdth * __init
+acpi_lookup_table_direct(const struct acpi_rsdp *rsdp, const char *sig)
+{
+    const struct acpi_sdth *table;
+    const struct acpi_rsdt *rsdt;
+    const void *entry, *end;
+    uint32_t addr;
+
+    table = acpi_map_table_direct(rsdp->rsdt_address);
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    rsdt = structof(table, struct acpi_rsdt, header);
+    entry = (const void *)rsdt + offsetof(struct acpi_rsdt, entries);
+    end = (const void *)rsdt + rsdt->header.length;
+
+    for (; entry < end; entry += sizeof(addr)) {
+        /* Entries may be unaligned */
+        memcpy(&addr, entry, sizeof(addr));
+        table = acpi_map_table_direct(addr);
+
+        if ((table != NULL)
+            && (memcmp(table->signature, sig, sizeof(table->signature)) == 0)) {
+            return table;
+        }
+    }
+
+    return NULL;
+}
+
+static void __init
+acpi_srat_iter_init(struct acpi_srat_iter *iter, const struct acpi_srat *srat)
+{
+    iter->entry = srat->entries;
+    iter->end = (void *)srat + srat->header.length;
+}
+
+static int __init
+acpi_srat_iter_valid(const struct acpi_srat_iter *iter)
+{
+    return (iter->entry < iter->end) && (iter->entry->header.length != 0);
+}
+
+static void __init
+acpi_srat_iter_next(struct acpi_srat_iter *iter)
+{
+    iter->entry = (void *)iter->entry + iter->entry->header.length;
+}
+
+static int __init
+acpi_numa_lookup_node(uint32_t domain)
+{
+    for (unsigned int i = 0; i < acpi_numa_nr_nodes; i++) {
+        if (acpi_numa_domains[i] == domain) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static bool __init
+acpi_srat_memory_usable(const struct acpi_srat_entry_memory *memory)
+{
+    /*
+     * Hot-pluggable ranges usually describe memory that isn't present,
+     * and could make node ranges overlap.
+     */
+    return (memory->flags & ACPI_SRAT_MEMORY_ENABLED)
+           && !(memory->flags & ACPI_SRAT_MEMORY_HOTPLUG)
+           && (memory->length != 0);
+}
+
+static int __init
+acpi_load_srat_domains(const struct acpi_srat *srat)
+{
+    const struct acpi_srat_entry_memory *memory;
+    struct acpi_srat_iter iter;
+
+    acpi_srat_foreach(srat, &iter) {
+        if (iter.entry->type != ACPI_SRAT_ENTRY_MEMORY) {
+            continue;
+        }
+
+        memory = &iter.entry->memory;
+
+        if (!acpi_srat_memory_usable(memory)
+            || (acpi_numa_lookup_node(memory->domain) != -1)) {
+            continue;
+        }
+
+        if (acpi_numa_nr_nodes == ARRAY_SIZE(acpi_numa_domains)) {
+            log_warning("acpi: too many proximity domains, "
+                        "ignoring NUMA topology");
+            return -1;
+        }
+
+        acpi_numa_domains[acpi_numa_nr_nodes] = memory->domain;
+        acpi_numa_nr_nodes++;
+    }
+
+    return 0;
+}
+
+static void __init
+acpi_load_srat_memory(const struct acpi_srat_entry_memory *memory)
+{
+    uint64_t start, end;
+    int node;
+
+    if (!acpi_srat_memory_usable(memory)) {
+        return;
+    }
+
+    start = memory->base;
+    end = start + memory->length;
+
+    if (end > PMEM_HIGHMEM_LIMIT) {
+        end = PMEM_HIGHMEM_LIMIT;
+    }
+
+    start = vm_page_round(start);
+    end = vm_page_trunc(end);
+
+    if (start >= end) {
+        return;
+    }
+
+    node = acpi_numa_lookup_node(memory->domain);
+    vm_page_load_node(node, start, end);
+    acpi_numa_nodes_loaded[node] = true;
+}
+
+static void __init
+acpi_load_srat_lapic(const struct acpi_srat_entry_lapic *lapic)
+{
+    uint32_t domain;
+    int node;
+
+    if (!(lapic->flags & ACPI_SRAT_LAPIC_ENABLED)) {
+        return;
+    }
+
+    domain = lapic->domain_low
+             | ((uint32_t)lapic->domain_high[0] << 8)
+             | ((uint32_t)lapic->domain_high[1] << 16)
+             | ((uint32_t)lapic->domain_high[2] << 24);
+    node = acpi_numa_lookup_node(domain);
+
+    if ((node == -1) || !acpi_numa_nodes_loaded[node]) {
+        node = 0;
+    }
+
+    acpi_numa_cpu_nodes[lapic->apic_id] = node;
+}
+
+static void __init
+acpi_load_slit(const struct acpi_slit *slit)
+{
+    uint32_t domain1, domain2;
+    uint64_t nr_localities;
+
+    nr_localities = slit->nr_localities;
+
+    if ((sizeof(*slit) + (nr_localities * nr_localities))
+        > slit->header.length) {
+        log_warning("acpi: invalid SLIT");
+        return;
+    }
+
+    for (unsigned int i = 0; i < acpi_numa_nr_nodes; i++) {
+        domain1 = acpi_numa_domains[i];
+
+        for (unsigned int j = 0; j < acpi_numa_nr_nodes; j++) {
+            domain2 = acpi_numa_domains[j];
+
+            if ((domain1 >= nr_localities) || (domain2 >= nr_localities)) {
+                continue;
+            }
+
+            vm_page_set_node_distance(i, j, slit->entries[(domain1
+                                                           * nr_localities)
+                                                          + domain2]);
+        }
+    }
+}
+
+static int __init
+acpi_setup_numa(void)
+{
+    const struct acpi_sdth *table;
+    const struct acpi_srat *srat;
+    struct acpi_srat_iter iter;
+    struct acpi_rsdp rsdp;
+    int error;
+
+    error = acpi_find_rsdp(&rsdp);
+
+    if (error) {
+        return 0;
+    }
+
+    table = acpi_lookup_table_direct(&rsdp, "SRAT");
+
+    if (table == NULL) {
+        log_debug("acpi: unable to find SRAT table");
+        return 0;
+    }
+
+    srat = structof(table, struct acpi_srat, header);
+    error = acpi_load_srat_domains(srat);
+
+    if (error || (acpi_numa_nr_nodes == 0)) {
+        acpi_numa_nr_nodes = 0;
+        return 0;
+    }
+
+    /* Load memory first, to know which nodes actually have memory */
+    acpi_srat_foreach(srat, &iter) {
+        if (iter.entry->type == ACPI_SRAT_ENTRY_MEMORY) {
+            acpi_load_srat_memory(&iter.entry->memory);
+        }
+    }
+
+    acpi_srat_foreach(srat, &iter) {
+        if (iter.entry->type == ACPI_SRAT_ENTRY_LAPIC) {
+            acpi_load_srat_lapic(&iter.entry->lapic);
+        }
+    }
+
+    table = acpi_lookup_table_direct(&rsdp, "SLIT");
+
+    if (table != NULL) {
+        acpi_load_slit(structof(table, struct acpi_slit, header));
+    }
+
+    log_info("acpi: NUMA nodes: %u", acpi_numa_nr_nodes);
+    return 0;
+}
+
+INIT_OP_DEFINE(acpi_setup_numa,
+               INIT_OP_DEP(log_setup, true));
+
 static void
 acpi_shutdown_reset_sysio(uint64_t addr)
 {
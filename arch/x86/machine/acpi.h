@@ -32,4 +32,10 @@
  */
 INIT_OP_DECLARE(acpi_setup);
 
+/*
+ * This init operation provides :
+ *  - NUMA topology reported to the vm_page module
+ */
+INIT_OP_DECLARE(acpi_setup_numa);
+
 #endif /* _X86_ACPI_H */
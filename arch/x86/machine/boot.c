@@ -540,6 +540,7 @@ boot_load_vm_page_zones(void)
 }
 
 INIT_OP_DEFINE(boot_load_vm_page_zones,
+               INIT_OP_DEP(acpi_setup_numa, true),
                INIT_OP_DEP(biosmem_setup, true));
 
 static int __init
@@ -17,6 +17,7 @@
 
 #include <assert.h>
 #include <stdalign.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -66,6 +67,21 @@
 #define CPU_CLFLUSH_SHIFT   8
 #define CPU_APIC_ID_MASK    0xff000000
 #define CPU_APIC_ID_SHIFT   24
+#define CPU_LOGICAL_MASK    0x00ff0000
+#define CPU_LOGICAL_SHIFT   16
+
+/*
+ * Extended topology enumeration leaves, V2 first.
+ */
+#define CPU_TOPO_LEAF_V2            0x1f
+#define CPU_TOPO_LEAF               0xb
+
+#define CPU_TOPO_SHIFT_MASK         0x0000001f
+#define CPU_TOPO_TYPE_MASK          0x0000ff00
+#define CPU_TOPO_TYPE_SHIFT         8
+
+#define CPU_TOPO_TYPE_INVALID       0
+#define CPU_TOPO_TYPE_SMT           1
 
 #define CPU_INVALID_APIC_ID ((unsigned int)-1)
 
@@ -173,6 +189,12 @@ cpu_delay(unsigned long usecs)
     } while (total > 0);
 }
 
+uint64_t
+cpu_get_freq(void)
+{
+    return cpu_freq;
+}
+
 void * __init
 cpu_get_boot_stack(void)
 {
@@ -184,6 +206,7 @@ cpu_preinit(struct cpu *cpu, unsigned int id, unsigned int apic_id)
 {
     cpu->id = id;
     cpu->apic_id = apic_id;
+    cpu->node = 0;
     cpu->state = CPU_STATE_OFF;
     cpu->boot_stack = NULL;
 }
@@ -430,6 +453,79 @@ cpu_load_idt(const void *idt, size_t size)
     asm volatile("lidt %0" : : "m" (idtr));
 }
 
+static bool __init
+cpu_topo_leaf_valid(unsigned int leaf, unsigned int max_basic)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (max_basic < leaf) {
+        return false;
+    }
+
+    eax = leaf;
+    ecx = 0;
+    cpu_cpuid_subleaf(&eax, &ebx, &ecx, &edx);
+    return ebx != 0;
+}
+
+/*
+ * Determine the core and package identifiers of the current processor.
+ *
+ * The x2APIC identifier is made of bit fields, one per topology level.
+ * The extended topology enumeration leaf reports, for each level, the
+ * number of bits to shift the identifier right to obtain the identifier
+ * of the next level. The last level reported is the one right below
+ * the package. If that leaf isn't available, rely on the legacy logical
+ * processor count, assuming no SMT.
+ */
+static void __init
+cpu_init_topology(struct cpu *cpu, unsigned int max_basic, unsigned int ebx1)
+{
+    unsigned int eax, ebx, ecx, edx, leaf, type, apic_id;
+    unsigned int smt_shift, pkg_shift, nr_logical;
+
+    if (cpu_topo_leaf_valid(CPU_TOPO_LEAF_V2, max_basic)) {
+        leaf = CPU_TOPO_LEAF_V2;
+    } else if (cpu_topo_leaf_valid(CPU_TOPO_LEAF, max_basic)) {
+        leaf = CPU_TOPO_LEAF;
+    } else {
+        leaf = 0;
+    }
+
+    apic_id = cpu->initial_apic_id;
+    smt_shift = 0;
+    pkg_shift = 0;
+
+    if (leaf != 0) {
+        for (unsigned int i = 0; /* no condition */; i++) {
+            eax = leaf;
+            ecx = i;
+            cpu_cpuid_subleaf(&eax, &ebx, &ecx, &edx);
+            type = (ecx & CPU_TOPO_TYPE_MASK) >> CPU_TOPO_TYPE_SHIFT;
+
+            if (type == CPU_TOPO_TYPE_INVALID) {
+                break;
+            }
+
+            if (type == CPU_TOPO_TYPE_SMT) {
+                smt_shift = eax & CPU_TOPO_SHIFT_MASK;
+            }
+
+            pkg_shift = eax & CPU_TOPO_SHIFT_MASK;
+            apic_id = edx;
+        }
+    } else if (cpu->features2 & CPU_FEATURE2_HTT) {
+        nr_logical = (ebx1 & CPU_LOGICAL_MASK) >> CPU_LOGICAL_SHIFT;
+
+        while ((1U << pkg_shift) < nr_logical) {
+            pkg_shift++;
+        }
+    }
+
+    cpu->core_id = apic_id >> smt_shift;
+    cpu->package_id = apic_id >> pkg_shift;
+}
+
 /*
  * Initialize the given cpu structure for the current processor.
  */
@@ -489,6 +585,8 @@ cpu_init(struct cpu *cpu)
     cpu->features1 = ecx;
     cpu->features2 = edx;
 
+    cpu_init_topology(cpu, max_basic, ebx);
+
     eax = 0x80000000;
     cpu_cpuid(&eax, &ebx, &ecx, &edx);
 
@@ -624,6 +722,9 @@ cpu_log_info(const struct cpu *cpu)
         log_info("cpu%u: %s", cpu->id, cpu->model_name);
     }
 
+    log_info("cpu%u: topology: package: %u, core: %u", cpu->id,
+             cpu->package_id, cpu->core_id);
+
     if ((cpu->phys_addr_width != 0) && (cpu->virt_addr_width != 0)) {
         log_info("cpu%u: address widths: physical: %hu, virtual: %hu",
                  cpu->id, cpu->phys_addr_width, cpu->virt_addr_width);
@@ -635,7 +736,7 @@ cpu_log_info(const struct cpu *cpu)
 }
 
 void __init
-cpu_mp_register_lapic(unsigned int apic_id, int is_bsp)
+cpu_mp_register_lapic(unsigned int apic_id, int is_bsp, unsigned int node)
 {
     struct cpu *cpu;
     int error;
@@ -648,6 +749,7 @@ cpu_mp_register_lapic(unsigned int apic_id, int is_bsp)
         }
 
         cpu->apic_id = apic_id;
+        cpu->node = node;
         return;
     }
 
@@ -659,6 +761,7 @@ cpu_mp_register_lapic(unsigned int apic_id, int is_bsp)
 
     cpu = percpu_ptr(cpu_desc, cpu_nr_active);
     cpu_preinit(cpu, cpu_nr_active, apic_id);
+    cpu->node = node;
     cpu_nr_active++;
 }
 
@@ -815,6 +918,16 @@ cpu_halt_intr(struct trap_frame *frame)
     cpu_halt();
 }
 
+void
+cpu_pmap_update_intr(struct trap_frame *frame)
+{
+    (void)frame;
+
+    lapic_eoi();
+
+    pmap_update_intr();
+}
+
 void
 cpu_xcall_intr(struct trap_frame *frame)
 {
@@ -101,6 +101,7 @@
 #define CPU_FEATURE2_CX8    0x00000100
 #define CPU_FEATURE2_APIC   0x00000200
 #define CPU_FEATURE2_PGE    0x00002000
+#define CPU_FEATURE2_HTT    0x10000000
 
 #define CPU_FEATURE4_1GP    0x04000000
 #define CPU_FEATURE4_LM     0x20000000
@@ -238,6 +239,9 @@ struct cpu {
     unsigned int stepping;
     unsigned int clflush_size;
     unsigned int initial_apic_id;
+    unsigned int core_id;
+    unsigned int package_id;
+    unsigned int node;
     unsigned int features1;
     unsigned int features2;
     unsigned int features3;
@@ -477,6 +481,16 @@ cpu_id(void)
     return cpu_local_read(cpu_desc.id);
 }
 
+/*
+ * Return the memory node of the local processor.
+ */
+static inline unsigned int
+cpu_node(void)
+{
+    extern struct cpu cpu_desc;
+    return cpu_local_read(cpu_desc.node);
+}
+
 static inline unsigned int
 cpu_count(void)
 {
@@ -509,6 +523,18 @@ cpu_has_global_pages(void)
     return cpu_current()->features2 & CPU_FEATURE2_PGE;
 }
 
+static inline int
+cpu_has_pse(void)
+{
+    return cpu_current()->features2 & CPU_FEATURE2_PSE;
+}
+
+static inline int
+cpu_has_1gb_pages(void)
+{
+    return cpu_current()->features4 & CPU_FEATURE4_1GP;
+}
+
 /*
  * Enable the use of global pages in the TLB.
  *
@@ -537,6 +563,18 @@ cpu_cpuid(unsigned int *eax, unsigned int *ebx, unsigned int *ecx,
                  : : "memory");
 }
 
+/*
+ * Variant of the CPUID instruction wrapper for leaves that provide
+ * sub-leaves, the sub-leaf index being passed in ecx.
+ */
+static __always_inline void
+cpu_cpuid_subleaf(unsigned int *eax, unsigned int *ebx, unsigned int *ecx,
+                  unsigned int *edx)
+{
+    asm volatile("cpuid" : "+a" (*eax), "=b" (*ebx), "+c" (*ecx), "=d" (*edx)
+                 : : "memory");
+}
+
 static __always_inline void
 cpu_get_msr(uint32_t msr, uint32_t *high, uint32_t *low)
 {
@@ -611,6 +649,14 @@ cpu_tlb_flush_va(unsigned long va)
  */
 void cpu_delay(unsigned long usecs);
 
+/*
+ * Return the frequency of the time stamp counter, in Hz.
+ *
+ * The value is measured once at boot time, and assumed fixed and equal
+ * on all processors.
+ */
+uint64_t cpu_get_freq(void);
+
 /*
  * Return the address of the boot stack allocated for the current processor.
  */
@@ -631,8 +677,11 @@ void cpu_log_info(const struct cpu *cpu);
 
 /*
  * Register the presence of a local APIC.
+ *
+ * The node is the memory node the processor belongs to, 0 if unknown.
  */
-void cpu_mp_register_lapic(unsigned int apic_id, int is_bsp);
+void cpu_mp_register_lapic(unsigned int apic_id, int is_bsp,
+                           unsigned int node);
 
 /*
  * Start application processors.
@@ -657,6 +706,75 @@ cpu_apic_id(unsigned int cpu)
     return cpu_from_id(cpu)->apic_id;
 }
 
+/*
+ * Topology accessors.
+ *
+ * Core and package identifiers are system-wide, i.e. two processors
+ * share a core (resp. a package) if and only if they have the same
+ * core (resp. package) identifier.
+ *
+ * These functions may only be used on processors that have been
+ * started.
+ */
+
+static inline unsigned int
+cpu_core_id(unsigned int cpu)
+{
+    return cpu_from_id(cpu)->core_id;
+}
+
+static inline unsigned int
+cpu_package_id(unsigned int cpu)
+{
+    return cpu_from_id(cpu)->package_id;
+}
+
+/*
+ * Local timer control.
+ *
+ * The local timer raises clock interrupts on the local processor. It may
+ * be reprogrammed to raise a single interrupt after a given number of
+ * ticks, e.g. to avoid waking up an idle processor needlessly, and later
+ * set back to periodic mode.
+ *
+ * Interrupts must be disabled when calling these functions.
+ */
+static inline void
+cpu_timer_set_oneshot(uint64_t ticks)
+{
+    lapic_timer_set_oneshot(ticks);
+}
+
+static inline void
+cpu_timer_set_periodic(void)
+{
+    lapic_timer_set_periodic();
+}
+
+/*
+ * Send a physical map update interrupt to a remote processor.
+ */
+static inline void
+cpu_send_pmap_update(unsigned int cpu)
+{
+    lapic_ipi_send(cpu_apic_id(cpu), TRAP_PMAP_UPDATE);
+}
+
+/*
+ * Send a physical map update interrupt to all processors except the
+ * local one.
+ */
+static inline void
+cpu_broadcast_pmap_update(void)
+{
+    lapic_ipi_broadcast(TRAP_PMAP_UPDATE);
+}
+
+/*
+ * Interrupt handler for physical map updates.
+ */
+void cpu_pmap_update_intr(struct trap_frame *frame);
+
 /*
  * Send a cross-call interrupt to a remote processor.
  */
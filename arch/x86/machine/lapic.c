@@ -327,6 +327,34 @@ lapic_ipi_broadcast(uint32_t vector)
                  | (vector & LAPIC_ICR_VECTOR_MASK));
 }
 
+void
+lapic_timer_set_oneshot(uint64_t ticks)
+{
+    uint64_t count;
+
+    assert(!cpu_intr_enabled());
+    assert(ticks != 0);
+
+    count = ticks * (lapic_bus_freq / CLOCK_FREQ);
+
+    if (count > LAPIC_TIMER_COUNT_MAX) {
+        count = LAPIC_TIMER_COUNT_MAX;
+    }
+
+    lapic_write(&lapic_map->lvt_timer, TRAP_LAPIC_TIMER);
+    lapic_write(&lapic_map->timer_icr, count);
+}
+
+void
+lapic_timer_set_periodic(void)
+{
+    assert(!cpu_intr_enabled());
+
+    lapic_write(&lapic_map->lvt_timer, LAPIC_LVT_TIMER_PERIODIC
+                                       | TRAP_LAPIC_TIMER);
+    lapic_write(&lapic_map->timer_icr, lapic_bus_freq / CLOCK_FREQ);
+}
+
 void
 lapic_timer_intr(struct trap_frame *frame)
 {
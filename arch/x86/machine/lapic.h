@@ -51,6 +51,16 @@ void lapic_ipi_startup(uint32_t apic_id, uint32_t vector);
 void lapic_ipi_send(uint32_t apic_id, uint32_t vector);
 void lapic_ipi_broadcast(uint32_t vector);
 
+/*
+ * Local APIC timer control.
+ *
+ * The timer normally raises periodic interrupts at the clock frequency.
+ * In one-shot mode, it raises a single interrupt after the given number
+ * of clock ticks, or the longest delay it supports if lower.
+ */
+void lapic_timer_set_oneshot(uint64_t ticks);
+void lapic_timer_set_periodic(void);
+
 /*
  * Interrupt handlers.
  */
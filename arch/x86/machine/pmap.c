@@ -21,10 +21,12 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdalign.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
+#include <kern/atomic.h>
 #include <kern/cpumap.h>
 #include <kern/init.h>
 #include <kern/kmem.h>
@@ -130,6 +132,12 @@ static alignas(PMAP_PDPT_ALIGN) pmap_pte_t
  */
 static pmap_pte_t pmap_prot_table[VM_PROT_ALL + 1] __read_mostly;
 
+/*
+ * Highest page translation level at which large pages can be used, or 0
+ * if they're not supported.
+ */
+static unsigned int pmap_large_page_level __read_mostly;
+
 /*
  * Structures related to inter-processor page table updates.
  */
@@ -141,6 +149,7 @@ static pmap_pte_t pmap_prot_table[VM_PROT_ALL + 1] __read_mostly;
 struct pmap_update_enter_args {
     uintptr_t va;
     phys_addr_t pa;
+    unsigned int level;
     int prot;
     int flags;
 };
@@ -228,6 +237,8 @@ struct pmap_syncer {
 
 static void pmap_sync(void *arg);
 
+static void pmap_flush_tlb(struct pmap *pmap, uintptr_t start, uintptr_t end);
+
 static struct pmap_syncer pmap_syncer __percpu;
 
 /*
@@ -261,11 +272,35 @@ struct pmap_update_request {
  */
 struct pmap_update_request_array {
     struct pmap_update_request requests[CONFIG_MAX_CPUS];
+    const struct pmap_update_oplist *shootdown_oplist;
+    unsigned int nr_pending_shootdowns;
     struct mutex lock;
 };
 
 static struct pmap_update_request_array pmap_update_request_array __percpu;
 
+/*
+ * Per processor shootdown mailbox.
+ *
+ * Operation lists that can't allocate page table pages are applied by
+ * target processors in interrupt context, saving the wake-up of their
+ * syncer thread. The senders cpumap contains the processors whose request
+ * array holds such a shootdown, not yet processed by the local processor.
+ */
+struct pmap_shootdown_mailbox {
+    alignas(CPU_L1_SIZE) struct cpumap senders;
+    struct syscnt sc_shootdowns;
+};
+
+static struct pmap_shootdown_mailbox pmap_shootdown_mailbox __percpu;
+
+/*
+ * Number of processors able to receive shootdown interrupts, i.e. those
+ * with their local APIC enabled. Shootdowns are only used once all
+ * processors are.
+ */
+static unsigned int pmap_nr_shootdown_cpus;
+
 static int pmap_do_remote_updates __read_mostly;
 
 static struct kmem_cache pmap_cache;
@@ -542,6 +577,14 @@ pmap_pte_set(pmap_pte_t *pte, phys_addr_t pa, pmap_pte_t pte_bits,
     *pte = ((pa & PMAP_PA_MASK) | PMAP_PTE_P | pte_bits) & pt_level->mask;
 }
 
+static inline void
+pmap_pte_set_large(pmap_pte_t *pte, phys_addr_t pa, pmap_pte_t pte_bits)
+{
+    /* Large page entries accept the same bits as the lowest level ones */
+    *pte = ((pa & PMAP_PA_MASK) | PMAP_PTE_PS | PMAP_PTE_P | pte_bits)
+           & (pmap_pt_levels[0].mask | PMAP_PTE_PS);
+}
+
 static inline void
 pmap_pte_clear(pmap_pte_t *pte)
 {
@@ -823,6 +866,32 @@ pmap_syncer_init(struct pmap_syncer *syncer, unsigned int cpu)
     syscnt_register(&syncer->sc_update_protects, name);
 }
 
+static void __init
+pmap_shootdown_mailbox_init(unsigned int cpu)
+{
+    struct pmap_shootdown_mailbox *mailbox;
+    char name[SYSCNT_NAME_SIZE];
+
+    mailbox = percpu_ptr(pmap_shootdown_mailbox, cpu);
+    cpumap_zero(&mailbox->senders);
+    snprintf(name, sizeof(name), "pmap_shootdowns/%u", cpu);
+    syscnt_register(&mailbox->sc_shootdowns, name);
+}
+
+static void __init
+pmap_bootstrap_large_pages(void)
+{
+#ifdef __LP64__
+    pmap_large_page_level = cpu_has_1gb_pages() ? 2 : 1;
+#else /* __LP64__ */
+#ifdef CONFIG_X86_PAE
+    pmap_large_page_level = 1;
+#else /* CONFIG_X86_PAE */
+    pmap_large_page_level = cpu_has_pse() ? 1 : 0;
+#endif /* CONFIG_X86_PAE */
+#endif /* __LP64__ */
+}
+
 static int __init
 pmap_bootstrap(void)
 {
@@ -848,6 +917,7 @@ pmap_bootstrap(void)
     pmap_update_request_array_init(cpu_local_ptr(pmap_update_request_array));
 
     pmap_syncer_init(cpu_local_ptr(pmap_syncer), 0);
+    pmap_shootdown_mailbox_init(0);
 
     pmap_update_oplist_ctor(&pmap_booter_oplist);
     tcb_set_pmap_update_oplist(tcb_current(), &pmap_booter_oplist);
@@ -859,6 +929,8 @@ pmap_bootstrap(void)
         pmap_setup_global_pages();
     }
 
+    pmap_bootstrap_large_pages();
+
     return 0;
 }
 
@@ -924,6 +996,8 @@ pmap_ap_setup(void)
     } else {
         cpu_tlb_flush();
     }
+
+    atomic_add(&pmap_nr_shootdown_cpus, 1, ATOMIC_RELAXED);
 }
 
 static void __init
@@ -1046,6 +1120,7 @@ pmap_mp_setup(void)
         pmap_update_request_array_init(percpu_ptr(pmap_update_request_array,
                                                   cpu));
         pmap_syncer_init(percpu_ptr(pmap_syncer, cpu), cpu);
+        pmap_shootdown_mailbox_init(cpu);
     }
 
     for (cpu = 0; cpu < cpu_count(); cpu++) {
@@ -1074,6 +1149,7 @@ pmap_mp_setup(void)
         pmap_copy_cpu_table(cpu);
     }
 
+    atomic_add(&pmap_nr_shootdown_cpus, 1, ATOMIC_RELAXED);
     pmap_do_remote_updates = 1;
 }
 
@@ -1133,7 +1209,8 @@ pmap_kextract(uintptr_t va, phys_addr_t *pap)
         ptp = pmap_pte_next(*pte);
     }
 
-    *pap = (*pte & PMAP_PA_MASK);
+    *pap = P2ALIGN(*pte & PMAP_PA_MASK, (phys_addr_t)1 << pt_level->skip)
+           | (vm_page_trunc(va) & ((1UL << pt_level->skip) - 1));
     return 0;
 }
 
@@ -1157,9 +1234,35 @@ pmap_create(struct pmap **pmapp)
     return 0;
 }
 
+/*
+ * Release a page table left empty by previous removals, along with the
+ * page tables it refers to.
+ */
+static void
+pmap_ptp_free(phys_addr_t ptp_pa, unsigned int level)
+{
+    const struct pmap_pt_level *pt_level;
+    pmap_pte_t *ptp;
+    unsigned int i;
+
+    pt_level = &pmap_pt_levels[level];
+    ptp = pmap_ptp_from_pa(ptp_pa);
+
+    for (i = 0; i < pt_level->ptes_per_pt; i++) {
+        if (!pmap_pte_valid(ptp[i])) {
+            continue;
+        }
+
+        assert((level != 0) && !pmap_pte_large(ptp[i]));
+        pmap_ptp_free(ptp[i] & PMAP_PA_MASK, level - 1);
+    }
+
+    vm_page_free(vm_page_lookup(ptp_pa), 0);
+}
+
 static int
 pmap_enter_local(struct pmap *pmap, uintptr_t va, phys_addr_t pa,
-                 int prot, int flags)
+                 unsigned int page_level, int prot, int flags)
 {
     const struct pmap_pt_level *pt_level;
     struct vm_page *page;
@@ -1183,11 +1286,12 @@ pmap_enter_local(struct pmap *pmap, uintptr_t va, phys_addr_t pa,
         pt_level = &pmap_pt_levels[level];
         pte = &ptp[pmap_pte_index(va, pt_level)];
 
-        if (level == 0) {
+        if (level == page_level) {
             break;
         }
 
         if (pmap_pte_valid(*pte)) {
+            assert(!pmap_pte_large(*pte));
             ptp = pmap_pte_next(*pte);
         } else {
             page = vm_page_alloc(0, VM_PAGE_SEL_DIRECTMAP, VM_PAGE_PMAP);
@@ -1206,25 +1310,40 @@ pmap_enter_local(struct pmap *pmap, uintptr_t va, phys_addr_t pa,
         level--;
     }
 
-    assert(!pmap_pte_valid(*pte));
+    if (pmap_pte_valid(*pte)) {
+        /*
+         * The range of a large mapping may be covered by a page table,
+         * left empty by previous removals. Release it once it can't be
+         * reached by the MMU any more.
+         */
+        assert((level != 0) && !pmap_pte_large(*pte));
+        ptp_pa = *pte & PMAP_PA_MASK;
+        pmap_pte_clear(pte);
+
+        pmap_flush_tlb(pmap, va, va + PAGE_SIZE);
+        pmap_ptp_free(ptp_pa, level - 1);
+    }
+
     pte_bits = ((pmap == pmap_get_kernel_pmap()) ? PMAP_PTE_G : PMAP_PTE_US)
                | pmap_prot_table[prot & VM_PROT_ALL];
-    pmap_pte_set(pte, pa, pte_bits, pt_level);
+
+    if (level == 0) {
+        pmap_pte_set(pte, pa, pte_bits, pt_level);
+    } else {
+        pmap_pte_set_large(pte, pa, pte_bits);
+    }
+
     return 0;
 }
 
-int
-pmap_enter(struct pmap *pmap, uintptr_t va, phys_addr_t pa,
-           int prot, int flags)
+static int
+pmap_enter_common(struct pmap *pmap, uintptr_t va, phys_addr_t pa,
+                  unsigned int level, int prot, int flags)
 {
     struct pmap_update_oplist *oplist;
     struct pmap_update_op *op;
     int error;
 
-    va = vm_page_trunc(va);
-    pa = vm_page_trunc(pa);
-    pmap_assert_range(pmap, va, va + PAGE_SIZE);
-
     oplist = pmap_update_oplist_get();
     error = pmap_update_oplist_prepare(oplist, pmap);
 
@@ -1244,48 +1363,220 @@ pmap_enter(struct pmap *pmap, uintptr_t va, phys_addr_t pa,
     op->operation = PMAP_UPDATE_OP_ENTER;
     op->enter_args.va = va;
     op->enter_args.pa = pa;
+    op->enter_args.level = level;
     op->enter_args.prot = prot;
     op->enter_args.flags = flags & ~PMAP_PEF_GLOBAL;
     pmap_update_oplist_finish_op(oplist);
     return 0;
 }
 
-static void
-pmap_remove_local_single(struct pmap *pmap, uintptr_t va)
+int
+pmap_enter(struct pmap *pmap, uintptr_t va, phys_addr_t pa,
+           int prot, int flags)
+{
+    va = vm_page_trunc(va);
+    pa = vm_page_trunc(pa);
+    pmap_assert_range(pmap, va, va + PAGE_SIZE);
+    return pmap_enter_common(pmap, va, pa, 0, prot, flags);
+}
+
+size_t
+pmap_max_page_size(size_t size)
+{
+    size_t page_size;
+    unsigned int level;
+
+    for (level = pmap_large_page_level; level != 0; level--) {
+        page_size = (size_t)1 << pmap_pt_levels[level].skip;
+
+        if (size >= page_size) {
+            return page_size;
+        }
+    }
+
+    return PAGE_SIZE;
+}
+
+int
+pmap_enter_large(struct pmap *pmap, uintptr_t va, phys_addr_t pa,
+                 size_t page_size, int prot, int flags)
+{
+    unsigned int level;
+
+    assert(P2ALIGNED(va, page_size));
+    assert(P2ALIGNED(pa, page_size));
+    assert((pmap != pmap_get_kernel_pmap()) || (flags & PMAP_PEF_GLOBAL));
+    pmap_assert_range(pmap, va, va + page_size);
+
+    for (level = 1; level <= pmap_large_page_level; level++) {
+        if (page_size == ((size_t)1 << pmap_pt_levels[level].skip)) {
+            break;
+        }
+    }
+
+    assert(level <= pmap_large_page_level);
+    return pmap_enter_common(pmap, va, pa, level, prot, flags);
+}
+
+/*
+ * Split a large mapping into mappings of the next lower level, with the
+ * same properties.
+ */
+static int
+pmap_demote(struct pmap *pmap, pmap_pte_t *pte, unsigned int level)
+{
+    const struct pmap_pt_level *pt_level;
+    pmap_pte_t *ptp, pte_bits, bits;
+    phys_addr_t ptp_pa, pa, size;
+    struct vm_page *page;
+    unsigned int i;
+
+    assert((level != 0) && pmap_pte_large(*pte));
+
+    page = vm_page_alloc(0, VM_PAGE_SEL_DIRECTMAP, VM_PAGE_PMAP);
+
+    if (page == NULL) {
+        log_warning("pmap: page table page allocation failure");
+        return ENOMEM;
+    }
+
+    ptp_pa = vm_page_to_pa(page);
+    ptp = pmap_ptp_from_pa(ptp_pa);
+    pt_level = &pmap_pt_levels[level - 1];
+    size = (phys_addr_t)1 << pt_level->skip;
+    pa = *pte & PMAP_PA_MASK;
+    bits = *pte & ~PMAP_PA_MASK;
+
+    /* At the lowest level, the large page bit is the page attribute bit */
+    if (level == 1) {
+        bits &= ~PMAP_PTE_PS;
+    }
+
+    for (i = 0; i < pt_level->ptes_per_pt; i++) {
+        ptp[i] = (pa + (i * size)) | bits;
+    }
+
+    pte_bits = PMAP_PTE_RW;
+
+    if (pmap != pmap_get_kernel_pmap()) {
+        pte_bits |= PMAP_PTE_US;
+    }
+
+    pmap_pte_set(pte, ptp_pa, pte_bits, &pmap_pt_levels[level]);
+    return 0;
+}
+
+/*
+ * Return the size of the page mapped at the given address, or PAGE_SIZE
+ * if there is no mapping.
+ */
+static size_t
+pmap_get_page_size(struct pmap *pmap, unsigned int cpu, uintptr_t va)
 {
     const struct pmap_pt_level *pt_level;
     pmap_pte_t *ptp, *pte;
     unsigned int level;
 
     level = PMAP_NR_LEVELS - 1;
-    ptp = pmap_ptp_from_pa(pmap->cpu_tables[cpu_id()]->root_ptp_pa);
+    ptp = pmap_ptp_from_pa(pmap->cpu_tables[cpu]->root_ptp_pa);
 
     for (;;) {
         pt_level = &pmap_pt_levels[level];
         pte = &ptp[pmap_pte_index(va, pt_level)];
 
-        if (!pmap_pte_valid(*pte)) {
-            return;
+        if (!pmap_pte_valid(*pte) || (level == 0)) {
+            return PAGE_SIZE;
         }
 
-        if (level == 0) {
-            break;
+        if (pmap_pte_large(*pte)) {
+            return (size_t)1 << pt_level->skip;
         }
 
         level--;
         ptp = pmap_pte_next(*pte);
     }
+}
+
+/*
+ * Return true if removing the given range may split a large mapping.
+ *
+ * Only the mappings at the boundaries of the range may be partially
+ * covered.
+ */
+static bool
+pmap_remove_may_demote(struct pmap *pmap, unsigned int cpu,
+                       uintptr_t start, uintptr_t end)
+{
+    size_t size;
+
+    if (pmap_large_page_level == 0) {
+        return false;
+    }
+
+    size = pmap_get_page_size(pmap, cpu, start);
+
+    if (!P2ALIGNED(start, size)) {
+        return true;
+    }
 
-    pmap_pte_clear(pte);
+    size = pmap_get_page_size(pmap, cpu, end - 1);
+    return !P2ALIGNED(end, size);
 }
 
-static void
+static int
 pmap_remove_local(struct pmap *pmap, uintptr_t start, uintptr_t end)
 {
+    const struct pmap_pt_level *pt_level;
+    pmap_pte_t *root_ptp, *ptp, *pte;
+    uintptr_t next, size;
+    unsigned int level;
+    int error;
+
+    root_ptp = pmap_ptp_from_pa(pmap->cpu_tables[cpu_id()]->root_ptp_pa);
+
     while (start < end) {
-        pmap_remove_local_single(pmap, start);
-        start += PAGE_SIZE;
+        level = PMAP_NR_LEVELS - 1;
+        ptp = root_ptp;
+
+        for (;;) {
+            pt_level = &pmap_pt_levels[level];
+            pte = &ptp[pmap_pte_index(start, pt_level)];
+
+            if (!pmap_pte_valid(*pte) || (level == 0)) {
+                break;
+            }
+
+            if (pmap_pte_large(*pte)) {
+                size = 1UL << pt_level->skip;
+
+                if (P2ALIGNED(start, size) && ((end - start) >= size)) {
+                    break;
+                }
+
+                error = pmap_demote(pmap, pte, level);
+
+                if (error) {
+                    return error;
+                }
+            }
+
+            level--;
+            ptp = pmap_pte_next(*pte);
+        }
+
+        /* Skip the whole range of invalid and large entries */
+        pmap_pte_clear(pte);
+        next = P2END(start, 1UL << pt_level->skip);
+
+        /* Handle the end of the address space */
+        if (next < start) {
+            break;
+        }
+
+        start = next;
     }
+
+    return 0;
 }
 
 int
@@ -1411,7 +1702,8 @@ pmap_update_enter(struct pmap *pmap, int flush,
 {
     int error;
 
-    error = pmap_enter_local(pmap, args->va, args->pa, args->prot, args->flags);
+    error = pmap_enter_local(pmap, args->va, args->pa,
+                             args->level, args->prot, args->flags);
 
     if (error) {
         return error;
@@ -1424,15 +1716,19 @@ pmap_update_enter(struct pmap *pmap, int flush,
     return 0;
 }
 
-static void
+static int
 pmap_update_remove(struct pmap *pmap, int flush,
                    const struct pmap_update_remove_args *args)
 {
-    pmap_remove_local(pmap, args->start, args->end);
+    int error;
+
+    error = pmap_remove_local(pmap, args->start, args->end);
 
     if (flush) {
         pmap_flush_tlb(pmap, args->start, args->end);
     }
+
+    return error;
 }
 
 static void
@@ -1475,8 +1771,8 @@ pmap_update_local(const struct pmap_update_oplist *oplist,
             break;
         case PMAP_UPDATE_OP_REMOVE:
             syscnt_inc(&syncer->sc_update_removes);
-            pmap_update_remove(oplist->pmap, !global_tlb_flush,
-                               &op->remove_args);
+            error = pmap_update_remove(oplist->pmap, !global_tlb_flush,
+                                       &op->remove_args);
             break;
         case PMAP_UPDATE_OP_PROTECT:
             syscnt_inc(&syncer->sc_update_protects);
@@ -1499,37 +1795,21 @@ pmap_update_local(const struct pmap_update_oplist *oplist,
     return 0;
 }
 
-int
-pmap_update(struct pmap *pmap)
+/*
+ * Queue requests on the syncer threads of the target processors, and wait
+ * for their completion.
+ */
+static int
+pmap_update_sync(struct pmap_update_request_array *array,
+                 const struct pmap_update_oplist *oplist)
 {
-    struct pmap_update_oplist *oplist;
-    struct pmap_update_request_array *array;
     struct pmap_update_request *request;
     struct pmap_update_queue *queue;
     struct pmap_syncer *syncer;
-    unsigned int nr_mappings;
     int error, cpu;
 
-    oplist = pmap_update_oplist_get();
-
-    if (pmap != oplist->pmap) {
-        /* Make sure pmap_update() is called before manipulating another pmap */
-        assert(oplist->pmap == NULL);
-        return 0;
-    }
-
-    assert(oplist->nr_ops != 0);
-
-    if (!pmap_do_remote_updates) {
-        nr_mappings = pmap_update_oplist_count_mappings(oplist, cpu_id());
-        error = pmap_update_local(oplist, nr_mappings);
-        goto out;
-    }
-
     error = 0;
 
-    array = pmap_update_request_array_acquire();
-
     cpumap_for_each(&oplist->cpumap, cpu) {
         syncer = percpu_ptr(pmap_syncer, cpu);
         queue = &syncer->queue;
@@ -1563,6 +1843,201 @@ pmap_update(struct pmap *pmap)
         spinlock_unlock(&request->lock);
     }
 
+    return error;
+}
+
+/*
+ * Return true if a remove operation can be applied with a shootdown.
+ *
+ * Large kernel mappings are global, so that the page tables of the local
+ * processor are representative of all others.
+ */
+static bool
+pmap_update_shootdown_remove_allowed(struct pmap *pmap,
+                                     const struct pmap_update_op *op)
+{
+    const struct pmap_update_remove_args *args;
+    int cpu;
+
+    args = &op->remove_args;
+
+    if (pmap == pmap_get_kernel_pmap()) {
+        return !pmap_remove_may_demote(pmap, cpu_id(), args->start, args->end);
+    }
+
+    cpumap_for_each(&op->cpumap, cpu) {
+        if (pmap_remove_may_demote(pmap, cpu, args->start, args->end)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Return true if an operation list can be applied with a shootdown.
+ *
+ * Enter operations, and remove operations splitting large mappings, may
+ * need to allocate page table pages, which can't be done from interrupt
+ * context, and are left to the syncer threads.
+ */
+static bool
+pmap_update_shootdown_allowed(const struct pmap_update_oplist *oplist)
+{
+    const struct pmap_update_op *op;
+    unsigned int i;
+
+    if (atomic_load(&pmap_nr_shootdown_cpus, ATOMIC_RELAXED) != cpu_count()) {
+        return false;
+    }
+
+    for (i = 0; i < oplist->nr_ops; i++) {
+        op = &oplist->ops[i];
+
+        switch (op->operation) {
+        case PMAP_UPDATE_OP_ENTER:
+            return false;
+        case PMAP_UPDATE_OP_REMOVE:
+            if (!pmap_update_shootdown_remove_allowed(oplist->pmap, op)) {
+                return false;
+            }
+
+            break;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Apply an operation list on the target processors from interrupt context.
+ *
+ * The local processor, if targeted, directly applies the operations. Remote
+ * processors are marked in their mailbox, interrupted, and decrement the
+ * completion counter of the request array once done, on which the calling
+ * thread spins. A single broadcast interrupt is sent when all other
+ * processors are targeted.
+ *
+ * The request array is acquired, which pins the calling thread.
+ */
+static void
+pmap_update_shootdown(struct pmap_update_request_array *array,
+                      const struct pmap_update_oplist *oplist)
+{
+    struct pmap_shootdown_mailbox *mailbox;
+    unsigned int nr_pending, nr_mappings, local_cpu;
+    bool local;
+    int cpu;
+
+    local_cpu = cpu_id();
+    local = false;
+    nr_pending = 0;
+
+    cpumap_for_each(&oplist->cpumap, cpu) {
+        if ((unsigned int)cpu == local_cpu) {
+            local = true;
+        } else {
+            nr_pending++;
+        }
+    }
+
+    array->shootdown_oplist = oplist;
+    atomic_store(&array->nr_pending_shootdowns, nr_pending, ATOMIC_RELAXED);
+
+    cpumap_for_each(&oplist->cpumap, cpu) {
+        if ((unsigned int)cpu == local_cpu) {
+            continue;
+        }
+
+        mailbox = percpu_ptr(pmap_shootdown_mailbox, cpu);
+
+        /* Enforce release ordering on the request array */
+        cpumap_set_atomic(&mailbox->senders, local_cpu);
+
+        if (nr_pending != (cpu_count() - 1)) {
+            cpu_send_pmap_update(cpu);
+        }
+    }
+
+    if ((nr_pending != 0) && (nr_pending == (cpu_count() - 1))) {
+        cpu_broadcast_pmap_update();
+    }
+
+    if (local) {
+        nr_mappings = pmap_update_oplist_count_mappings(oplist, local_cpu);
+        pmap_update_local(oplist, nr_mappings);
+    }
+
+    /* Enforce acquire ordering on the completion counter */
+    while (atomic_load(&array->nr_pending_shootdowns, ATOMIC_ACQUIRE) != 0) {
+        cpu_pause();
+    }
+}
+
+void
+pmap_update_intr(void)
+{
+    struct pmap_shootdown_mailbox *mailbox;
+    struct pmap_update_request_array *array;
+    const struct pmap_update_oplist *oplist;
+    unsigned int nr_mappings, cpu;
+
+    assert(thread_check_intr_context());
+
+    mailbox = cpu_local_ptr(pmap_shootdown_mailbox);
+    syscnt_inc(&mailbox->sc_shootdowns);
+
+    for (cpu = 0; cpu < cpu_count(); cpu++) {
+        /* Enforce acquire ordering on the request array */
+        if (!cpumap_test_atomic(&mailbox->senders, cpu)) {
+            continue;
+        }
+
+        cpumap_clear_atomic(&mailbox->senders, cpu);
+
+        array = percpu_ptr(pmap_update_request_array, cpu);
+        oplist = array->shootdown_oplist;
+        nr_mappings = pmap_update_oplist_count_mappings(oplist, cpu_id());
+        pmap_update_local(oplist, nr_mappings);
+
+        /* Enforce release ordering on the page table updates */
+        atomic_sub(&array->nr_pending_shootdowns, 1, ATOMIC_RELEASE);
+    }
+}
+
+int
+pmap_update(struct pmap *pmap)
+{
+    struct pmap_update_oplist *oplist;
+    struct pmap_update_request_array *array;
+    unsigned int nr_mappings;
+    int error;
+
+    oplist = pmap_update_oplist_get();
+
+    if (pmap != oplist->pmap) {
+        /* Make sure pmap_update() is called before manipulating another pmap */
+        assert(oplist->pmap == NULL);
+        return 0;
+    }
+
+    assert(oplist->nr_ops != 0);
+
+    if (!pmap_do_remote_updates) {
+        nr_mappings = pmap_update_oplist_count_mappings(oplist, cpu_id());
+        error = pmap_update_local(oplist, nr_mappings);
+        goto out;
+    }
+
+    array = pmap_update_request_array_acquire();
+
+    if (pmap_update_shootdown_allowed(oplist)) {
+        pmap_update_shootdown(array, oplist);
+        error = 0;
+    } else {
+        error = pmap_update_sync(array, oplist);
+    }
+
     pmap_update_request_array_release(array);
 
 out:
@@ -161,6 +161,7 @@
 
 #ifndef __ASSEMBLER__
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <kern/cpumap.h>
@@ -256,6 +257,28 @@ int pmap_create(struct pmap **pmapp);
 int pmap_enter(struct pmap *pmap, uintptr_t va, phys_addr_t pa,
                int prot, int flags);
 
+/*
+ * Return the size of the largest page that fits in a region of the given
+ * size.
+ *
+ * PAGE_SIZE is returned if large pages aren't supported, or if the region
+ * is too small.
+ */
+size_t pmap_max_page_size(size_t size);
+
+/*
+ * Create a large page mapping on a physical map.
+ *
+ * The page size must have been obtained from pmap_max_page_size(), and both
+ * the virtual and physical addresses must be aligned on it. Large kernel
+ * mappings must be global.
+ *
+ * Removing part of a large mapping splits it into smaller mappings.
+ * Otherwise, this function behaves like pmap_enter().
+ */
+int pmap_enter_large(struct pmap *pmap, uintptr_t va, phys_addr_t pa,
+                     size_t page_size, int prot, int flags);
+
 /*
  * Remove a mapping from a physical map.
  *
@@ -295,12 +318,23 @@ int pmap_protect(struct pmap *pmap, uintptr_t va, int prot,
  * when calling this function. The caller shouldn't rely on the specific
  * error value, and should consider the whole operation to have failed.
  *
- * Also note that the only operation that may fail is mapping creation.
- * Therefore, if the caller only queues removals or protection changes
- * between two calls to this function, it is guaranteed to succeed.
+ * Also note that the only operations that may fail are mapping creation,
+ * and the removal of part of a large mapping, which allocates a page table
+ * page to split it. Therefore, if the caller only queues protection changes,
+ * and removals that don't partially cover large mappings, between two calls
+ * to this function, it is guaranteed to succeed.
  */
 int pmap_update(struct pmap *pmap);
 
+/*
+ * Interrupt handler for shootdowns.
+ *
+ * Update operations that can't allocate page table pages are applied by
+ * remote processors in interrupt context, instead of being queued on
+ * their syncer thread.
+ */
+void pmap_update_intr(void);
+
 /*
  * Load the given pmap on the current processor.
  *
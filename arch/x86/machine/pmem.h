@@ -64,4 +64,16 @@
 #define PMEM_ZONE_HIGHMEM       2
 #endif /* __LP64__ */
 
+/*
+ * Maximum number of memory nodes.
+ *
+ * NUMA topology is only discovered on 64-bits, where firmware tables can
+ * normally be reached through the direct physical mapping early during boot.
+ */
+#ifdef __LP64__
+#define PMEM_MAX_NODES          4
+#else /* __LP64__ */
+#define PMEM_MAX_NODES          1
+#endif /* __LP64__ */
+
 #endif /* _X86_PMEM_H */
@@ -42,7 +42,7 @@ static struct elf_sym *strace_symtab __read_mostly;
 static struct elf_sym *strace_symtab_end __read_mostly;
 static char *strace_strtab __read_mostly;
 
-static const char *
+const char *
 strace_lookup(uintptr_t addr, uintptr_t *offset, uintptr_t *size)
 {
     struct elf_sym *sym;
@@ -23,10 +23,21 @@
 #ifndef _X86_STRACE_H
 #define _X86_STRACE_H
 
+#include <stdint.h>
+
 #include <kern/init.h>
 #include <kern/macros.h>
 #include <machine/multiboot.h>
 
+/*
+ * Look up the symbol containing the given address.
+ *
+ * Return the symbol name, or NULL if not found. On success, the offset of
+ * the address in the symbol and the symbol size are returned.
+ */
+const char * strace_lookup(uintptr_t addr, uintptr_t *offset,
+                           uintptr_t *size);
+
 /*
  * Display a call trace.
  *
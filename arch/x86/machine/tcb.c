@@ -72,7 +72,8 @@ tcb_stack_forge(struct tcb *tcb, void (*fn)(void *), void *arg)
 #endif /* __LP64__ */
 
 int
-tcb_build(struct tcb *tcb, void *stack, void (*fn)(void *), void *arg)
+tcb_build(struct tcb *tcb, void *stack, size_t stack_size,
+          void (*fn)(void *), void *arg)
 {
     int error;
 
@@ -83,7 +84,7 @@ tcb_build(struct tcb *tcb, void *stack, void (*fn)(void *), void *arg)
     }
 
     tcb->bp = 0;
-    tcb->sp = (uintptr_t)stack + TCB_STACK_SIZE;
+    tcb->sp = (uintptr_t)stack + stack_size;
     tcb_stack_forge(tcb, fn, arg);
     return 0;
 }
@@ -22,6 +22,7 @@
 #define _X86_TCB_H
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdnoreturn.h>
 
@@ -56,7 +57,8 @@ struct tcb {
  *
  * In addition, initialize any thread-local machine-specific data.
  */
-int tcb_build(struct tcb *tcb, void *stack, void (*fn)(void *), void *arg);
+int tcb_build(struct tcb *tcb, void *stack, size_t stack_size,
+              void (*fn)(void *), void *arg);
 
 /*
  * Release all resources held by a TCB.
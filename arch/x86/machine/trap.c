@@ -25,6 +25,7 @@
 #include <stdio.h>
 
 #include <kern/atomic.h>
+#include <kern/clock.h>
 #include <kern/init.h>
 #include <kern/macros.h>
 #include <kern/spinlock.h>
@@ -207,6 +208,7 @@ trap_setup(void)
     trap_install(TRAP_XM, 0, trap_default);
 
     /* System defined traps */
+    trap_install(TRAP_PMAP_UPDATE, TRAP_HF_INTR, cpu_pmap_update_intr);
     trap_install(TRAP_XCALL, TRAP_HF_INTR, cpu_xcall_intr);
     trap_install(TRAP_THREAD_SCHEDULE, TRAP_HF_INTR, cpu_thread_schedule_intr);
     trap_install(TRAP_CPU_HALT, TRAP_HF_INTR, cpu_halt_intr);
@@ -231,6 +233,7 @@ trap_main(struct trap_frame *frame)
 
     if (handler->flags & TRAP_HF_INTR) {
         thread_intr_enter();
+        clock_idle_leave();
     }
 
     fn = atomic_load(&handler->fn, ATOMIC_RELAXED);
@@ -59,6 +59,7 @@
  *
  * The local APIC assigns one priority every 16 vectors.
  */
+#define TRAP_PMAP_UPDATE        237
 #define TRAP_XCALL              238
 #define TRAP_THREAD_SCHEDULE    239
 #define TRAP_CPU_HALT           240
@@ -15,6 +15,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 
@@ -32,8 +34,28 @@
 #include <machine/boot.h>
 #include <machine/cpu.h>
 
+/*
+ * Maximum number of ticks an idle processor may skip.
+ *
+ * This value bounds the cost of looking up the next timer expiration.
+ */
+#define CLOCK_IDLE_MAX_TICKS CLOCK_FREQ
+
+/*
+ * Per-processor data.
+ *
+ * The idle member is true while the periodic clock is stopped on the
+ * processor. It's only accessed locally, with interrupts disabled.
+ */
 struct clock_cpu_data {
     struct syscnt sc_tick_intrs;
+
+#ifdef CONFIG_CLOCK_DYNTICK
+    bool idle;
+    uint64_t idle_start;
+    struct syscnt sc_idle_stops;
+    struct syscnt sc_idle_ticks;
+#endif /* CONFIG_CLOCK_DYNTICK */
 };
 
 static struct clock_cpu_data clock_cpu_data __percpu;
@@ -47,6 +69,14 @@ clock_cpu_data_init(struct clock_cpu_data *cpu_data, unsigned int cpu)
 
     snprintf(name, sizeof(name), "clock_tick_intrs/%u", cpu);
     syscnt_register(&cpu_data->sc_tick_intrs, name);
+
+#ifdef CONFIG_CLOCK_DYNTICK
+    cpu_data->idle = false;
+    snprintf(name, sizeof(name), "clock_idle_stops/%u", cpu);
+    syscnt_register(&cpu_data->sc_idle_stops, name);
+    snprintf(name, sizeof(name), "clock_idle_ticks/%u", cpu);
+    syscnt_register(&cpu_data->sc_idle_ticks, name);
+#endif /* CONFIG_CLOCK_DYNTICK */
 }
 
 static int __init
@@ -97,3 +127,94 @@ void clock_tick_intr(void)
     cpu_data = cpu_local_ptr(clock_cpu_data);
     syscnt_inc(&cpu_data->sc_tick_intrs);
 }
+
+#ifdef CONFIG_CLOCK_DYNTICK
+
+void
+clock_idle_enter(void)
+{
+    struct clock_cpu_data *cpu_data;
+    uint64_t now, next;
+    int error;
+
+    assert(!cpu_intr_enabled());
+    assert(!thread_preempt_enabled());
+
+    /* The first processor maintains the global time */
+    if (cpu_id() == 0) {
+        return;
+    }
+
+    cpu_data = cpu_local_ptr(clock_cpu_data);
+
+    if (cpu_data->idle) {
+        return;
+    }
+
+    error = sref_unregister();
+
+    if (error) {
+        return;
+    }
+
+    error = rcu_unregister();
+
+    if (error) {
+        goto error_rcu;
+    }
+
+    now = clock_get_time();
+    next = thread_idle_enter(now, now + CLOCK_IDLE_MAX_TICKS);
+    next = timer_idle_enter(next);
+
+    /* Not worth it if a timer expires on the next tick */
+    if (clock_time_occurred(next, now + 1)) {
+        goto error_timer;
+    }
+
+    cpu_timer_set_oneshot(next - now);
+    cpu_data->idle = true;
+    cpu_data->idle_start = now;
+    syscnt_inc(&cpu_data->sc_idle_stops);
+    return;
+
+error_timer:
+    timer_idle_leave();
+    rcu_register();
+error_rcu:
+    sref_register();
+}
+
+void
+clock_idle_leave(void)
+{
+    struct clock_cpu_data *cpu_data;
+    uint64_t ticks;
+
+    assert(!cpu_intr_enabled());
+    assert(!thread_preempt_enabled());
+
+    cpu_data = cpu_local_ptr(clock_cpu_data);
+
+    if (likely(!cpu_data->idle)) {
+        return;
+    }
+
+    cpu_data->idle = false;
+    ticks = clock_get_time() - cpu_data->idle_start;
+
+    /*
+     * Missed ticks are caught up by the timer module, which processes all
+     * buckets up to the current time on the next periodic event, and
+     * accounted for idle load balancing by the thread module.
+     */
+    cpu_timer_set_periodic();
+    timer_idle_leave();
+    thread_idle_leave(ticks);
+    rcu_register();
+    sref_register();
+
+    syscnt_add(&cpu_data->sc_idle_ticks, ticks);
+}
+
+#endif /* CONFIG_CLOCK_DYNTICK */
@@ -116,4 +116,41 @@ clock_time_occurred(uint64_t t, uint64_t ref)
 
 void clock_tick_intr(void);
 
+#ifdef CONFIG_CLOCK_DYNTICK
+
+/*
+ * Stop the periodic clock on the local processor before idling.
+ *
+ * The local processor unregisters from the RCU and sref modules, and its
+ * timer is programmed to raise a single interrupt when its next timer
+ * expires, or when idle load balancing is due, whichever comes first.
+ * If any of these steps can't be completed, e.g. because work is pending,
+ * the periodic clock is kept running.
+ *
+ * Interrupts and preemption must be disabled when calling this function.
+ */
+void clock_idle_enter(void);
+
+/*
+ * Restart the periodic clock on the local processor, if stopped.
+ *
+ * This function is called on interrupt entry, before the handler is run,
+ * so that the latter may use RCU and sref normally.
+ */
+void clock_idle_leave(void);
+
+#else /* CONFIG_CLOCK_DYNTICK */
+
+static inline void
+clock_idle_enter(void)
+{
+}
+
+static inline void
+clock_idle_leave(void)
+{
+}
+
+#endif /* CONFIG_CLOCK_DYNTICK */
+
 #endif /* KERN_CLOCK_H */
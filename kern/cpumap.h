@@ -87,6 +87,12 @@ cpumap_test(const struct cpumap *cpumap, int index)
     return bitmap_test(cpumap->cpus, index);
 }
 
+static inline int
+cpumap_test_atomic(const struct cpumap *cpumap, int index)
+{
+    return bitmap_test_atomic(cpumap->cpus, index);
+}
+
 static inline void
 cpumap_and(struct cpumap *a, const struct cpumap *b)
 {
@@ -34,14 +34,27 @@
  * This implementation uses per-CPU pools of objects, which service most
  * allocation requests. These pools act as caches (but are named differently
  * to avoid confusion with CPU caches) that reduce contention on multiprocessor
- * systems. When a pool is empty and cannot provide an object, it is filled by
- * transferring multiple objects from the slab layer. The symmetric case is
- * handled likewise.
+ * systems. The CPU pool layer is based on the SLQB algorithm by Nick Piggin.
+ * Slabs are owned by CPU pools, which allocate and release buffers from and
+ * to their slabs without global locking. When a pool is empty and cannot
+ * provide an object, it is filled by transferring multiple objects from its
+ * slabs, obtaining a new slab from the cache if needed. The symmetric case is
+ * handled likewise, free slabs being returned to the cache. Objects are
+ * released to the local pool without looking up their slab. When a pool
+ * releases objects to slabs it doesn't own, they're queued on the remote
+ * free list of the owning pool instead, so that slabs are only ever accessed
+ * with the lock of their owner held.
  *
- * TODO Rework the CPU pool layer to use the SLQB algorithm by Nick Piggin.
+ * Memory is returned to the VM system by a reaper thread, which periodically
+ * drains idle CPU pools and releases free slabs. The reaper is also run on
+ * behalf of the vm_page shrinker, in which case all CPU pools are drained.
+ * On each pass, the reaper also resizes CPU pools, similar to the magazine
+ * resizing described in "Magazines and Vmem" by Bonwick and Adams : pools
+ * grow when the cache lock is contended, and shrink back when it's not.
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -49,6 +62,10 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <kern/atomic.h>
+#include <kern/clock.h>
+#include <kern/hash.h>
+#include <kern/hlist.h>
 #include <kern/init.h>
 #include <kern/list.h>
 #include <kern/log2.h>
@@ -57,11 +74,14 @@
 #include <kern/macros.h>
 #include <kern/mutex.h>
 #include <kern/panic.h>
+#include <kern/rcu.h>
 #include <kern/shell.h>
 #include <kern/thread.h>
+#include <kern/work.h>
 #include <machine/cpu.h>
 #include <machine/page.h>
 #include <machine/pmap.h>
+#include <machine/strace.h>
 #include <vm/vm_kmem.h>
 #include <vm/vm_page.h>
 
@@ -96,14 +116,44 @@
 #define KMEM_CPU_POOL_TRANSFER_RATIO 2
 
 /*
- * Logarithm of the size of the smallest general cache.
+ * Interval between two reaping passes, in milliseconds.
  */
-#define KMEM_CACHES_FIRST_ORDER 5
+#define KMEM_REAP_INTERVAL 5000
+
+/*
+ * Number of contended acquisitions of the lock of a cache, during a reaping
+ * interval, from which the size of its CPU pools is doubled.
+ */
+#define KMEM_CPU_POOL_GROW_THRESHOLD 8
+
+/*
+ * Number of consecutive reaping passes without contention on the lock of a
+ * cache after which the size of its CPU pools is halved.
+ */
+#define KMEM_CPU_POOL_SHRINK_DELAY 6
 
 /*
  * Number of caches backing general purpose allocations.
  */
-#define KMEM_NR_MEM_CACHES 13
+#define KMEM_NR_MEM_CACHES 20
+
+/*
+ * Properties of the size-to-index table of general caches.
+ *
+ * The table covers sizes up to (1 << KMEM_SIZE_TABLE_ORDER), with a
+ * granularity of (1 << KMEM_SIZE_TABLE_SHIFT) bytes, which must divide
+ * all general cache sizes in that range. Larger general caches have
+ * power-of-two sizes.
+ */
+#define KMEM_SIZE_TABLE_ORDER   12
+#define KMEM_SIZE_TABLE_SHIFT   4
+#define KMEM_SIZE_TABLE_SIZE    (1 << (KMEM_SIZE_TABLE_ORDER \
+                                       - KMEM_SIZE_TABLE_SHIFT))
+
+/*
+ * Number of objects in a batch released with kmem_cache_free_rcu().
+ */
+#define KMEM_RCU_BATCH_SIZE 28
 
 /*
  * Options for kmem_cache_alloc_verify().
@@ -129,37 +179,79 @@
  * See struct kmem_cpu_pool_type for a description of the values.
  */
 static struct kmem_cpu_pool_type kmem_cpu_pool_types[] __read_mostly = {
-    {  32768,   1, 0,           NULL },
-    {   4096,   8, CPU_L1_SIZE, NULL },
-    {    256,  64, CPU_L1_SIZE, NULL },
-    {      0, 128, CPU_L1_SIZE, NULL }
+    {  32768,   1,   1,   8 },
+    {   4096,   4,   8,  32 },
+    {    256,  16,  64, 256 },
+    {      0,  32, 128, 512 }
 };
 
 /*
- * Caches where CPU pool arrays are allocated from.
+ * Cache for off slab data.
  */
-static struct kmem_cache kmem_cpu_array_caches[ARRAY_SIZE(kmem_cpu_pool_types)];
+static struct kmem_cache kmem_slab_cache;
 
 /*
- * Cache for off slab data.
+ * Batch of objects released with kmem_cache_free_rcu().
+ *
+ * A batch is deferred as soon as it's created. Objects may be added to it
+ * as long as the local RCU work window doesn't change, since they're then
+ * released after the same grace period.
  */
-static struct kmem_cache kmem_slab_cache;
+struct kmem_rcu_batch {
+    struct work work;
+    struct kmem_cache *cache;
+    unsigned int nr_objs;
+    void *objs[KMEM_RCU_BATCH_SIZE];
+};
+
+/*
+ * Cache for RCU batches.
+ */
+static struct kmem_cache kmem_rcu_batch_cache;
+
+#ifdef CONFIG_KMEM_PROFILE
+/*
+ * Cache for descriptors of sampled objects, which is never profiled.
+ */
+static struct kmem_cache kmem_prof_obj_cache;
+#endif /* CONFIG_KMEM_PROFILE */
+
+/*
+ * Sizes of the general caches.
+ *
+ * Intermediate size classes between powers of two reduce internal
+ * fragmentation for small and medium sizes.
+ */
+static const size_t kmem_cache_sizes[] = {
+    32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072,
+    4096, 8192, 16384, 32768, 65536, 131072,
+};
 
 /*
  * General caches array.
  */
 static struct kmem_cache kmem_caches[KMEM_NR_MEM_CACHES];
 
+/*
+ * Table of general cache indexes, indexed by size.
+ */
+static uint8_t kmem_size_table[KMEM_SIZE_TABLE_SIZE] __read_mostly;
+
+static_assert(ARRAY_SIZE(kmem_cache_sizes) == KMEM_NR_MEM_CACHES,
+              "invalid number of general caches");
+
 /*
  * List of all caches managed by the allocator.
  */
 static struct list kmem_cache_list;
 static struct mutex kmem_cache_list_lock;
 
+static struct vm_page_shrinker kmem_shrinker;
+
 static void kmem_cache_error(struct kmem_cache *cache, void *buf, int error,
                              void *arg);
-static void * kmem_cache_alloc_from_slab(struct kmem_cache *cache);
-static void kmem_cache_free_to_slab(struct kmem_cache *cache, void *buf);
+static struct kmem_slab * kmem_cache_get_slab(struct kmem_cache *cache,
+                                              void *buf);
 
 static void *
 kmem_buf_verify_bytes(void *buf, void *pattern, size_t size)
@@ -256,6 +348,32 @@ kmem_pagealloc(size_t size)
     }
 }
 
+/*
+ * Return the memory node of pages allocated with kmem_pagealloc().
+ *
+ * Virtually mapped allocations are assumed to belong to the node of
+ * their first page.
+ */
+static unsigned int
+kmem_pagealloc_node(void *ptr, size_t size)
+{
+    struct vm_page *page;
+    phys_addr_t pa;
+
+    if (kmem_pagealloc_is_virtual(size)) {
+        int error;
+
+        error = pmap_kextract((uintptr_t)ptr, &pa);
+        assert(!error);
+    } else {
+        pa = vm_page_direct_pa((uintptr_t)ptr);
+    }
+
+    page = vm_page_lookup(pa);
+    assert(page != NULL);
+    return vm_page_node(page);
+}
+
 static void
 kmem_pagefree(void *ptr, size_t size)
 {
@@ -325,6 +443,8 @@ kmem_slab_create(struct kmem_cache *cache, size_t color)
     slab->nr_refs = 0;
     slab->first_free = NULL;
     slab->addr = slab_buf + color;
+    slab->cpu = 0;
+    slab->node_index = kmem_pagealloc_node(slab_buf, cache->slab_size);
 
     buf_size = cache->buf_size;
     bufctl = kmem_buf_to_bufctl(slab->addr, cache);
@@ -348,15 +468,33 @@ kmem_slab_buf(const struct kmem_slab *slab)
     return P2ALIGN((uintptr_t)slab->addr, PAGE_SIZE);
 }
 
+static void
+kmem_cpu_pool_set_size(struct kmem_cpu_pool *cpu_pool, int size)
+{
+    cpu_pool->size = size;
+    cpu_pool->transfer_size = (size + KMEM_CPU_POOL_TRANSFER_RATIO - 1)
+                              / KMEM_CPU_POOL_TRANSFER_RATIO;
+}
+
 static void
 kmem_cpu_pool_init(struct kmem_cpu_pool *cpu_pool, struct kmem_cache *cache)
 {
     mutex_init(&cpu_pool->lock);
     cpu_pool->flags = cache->flags;
-    cpu_pool->size = 0;
-    cpu_pool->transfer_size = 0;
+    kmem_cpu_pool_set_size(cpu_pool, cache->cpu_pool_size);
     cpu_pool->nr_objs = 0;
-    cpu_pool->array = NULL;
+    cpu_pool->active = false;
+    cpu_pool->free_list = NULL;
+    list_init(&cpu_pool->partial_slabs);
+    cpu_pool->nr_refs = 0;
+    cpu_pool->nr_mem_objs = 0;
+    cpu_pool->mem_req_size = 0;
+#ifdef CONFIG_KMEM_PROFILE
+    cpu_pool->prof_countdown = 0;
+#endif /* CONFIG_KMEM_PROFILE */
+    cpu_pool->rcu_batch = NULL;
+    cpu_pool->rcu_batch_wid = 0;
+    cpu_pool->remote_free_list = NULL;
 }
 
 static inline struct kmem_cpu_pool *
@@ -365,200 +503,678 @@ kmem_cpu_pool_get(struct kmem_cache *cache)
     return &cache->cpu_pools[cpu_id()];
 }
 
-static inline void
-kmem_cpu_pool_build(struct kmem_cpu_pool *cpu_pool, struct kmem_cache *cache,
-                    void **array)
+static inline unsigned int
+kmem_cpu_pool_cpu(const struct kmem_cpu_pool *cpu_pool,
+                  const struct kmem_cache *cache)
 {
-    cpu_pool->size = cache->cpu_pool_type->array_size;
-    cpu_pool->transfer_size = (cpu_pool->size
-                               + KMEM_CPU_POOL_TRANSFER_RATIO - 1)
-                              / KMEM_CPU_POOL_TRANSFER_RATIO;
-    cpu_pool->array = array;
+    return cpu_pool - cache->cpu_pools;
 }
 
 static inline void *
-kmem_cpu_pool_pop(struct kmem_cpu_pool *cpu_pool)
+kmem_cpu_pool_pop(struct kmem_cpu_pool *cpu_pool, struct kmem_cache *cache)
 {
+    union kmem_bufctl *bufctl;
+
+    bufctl = cpu_pool->free_list;
+    cpu_pool->free_list = bufctl->next;
     cpu_pool->nr_objs--;
-    return cpu_pool->array[cpu_pool->nr_objs];
+    return kmem_bufctl_to_buf(bufctl, cache);
 }
 
 static inline void
-kmem_cpu_pool_push(struct kmem_cpu_pool *cpu_pool, void *obj)
+kmem_cpu_pool_push(struct kmem_cpu_pool *cpu_pool, struct kmem_cache *cache,
+                   void *obj)
 {
-    cpu_pool->array[cpu_pool->nr_objs] = obj;
+    union kmem_bufctl *bufctl;
+
+    bufctl = kmem_buf_to_bufctl(obj, cache);
+    bufctl->next = cpu_pool->free_list;
+    cpu_pool->free_list = bufctl;
     cpu_pool->nr_objs++;
 }
 
-static int
-kmem_cpu_pool_fill(struct kmem_cpu_pool *cpu_pool, struct kmem_cache *cache)
+/*
+ * Queue an object on the remote free list of its owning CPU pool.
+ *
+ * This function may be called from any processor, without locking.
+ */
+static void
+kmem_cpu_pool_push_remote(struct kmem_cpu_pool *cpu_pool,
+                          struct kmem_cache *cache, void *obj)
 {
-    kmem_ctor_fn_t ctor;
-    void *buf;
-    int i;
+    union kmem_bufctl *bufctl, *head, *prev;
 
-    ctor = (cpu_pool->flags & KMEM_CF_VERIFY) ? NULL : cache->ctor;
-
-    mutex_lock(&cache->lock);
+    bufctl = kmem_buf_to_bufctl(obj, cache);
+    head = atomic_load(&cpu_pool->remote_free_list, ATOMIC_RELAXED);
 
-    for (i = 0; i < cpu_pool->transfer_size; i++) {
-        buf = kmem_cache_alloc_from_slab(cache);
+    for (;;) {
+        bufctl->next = head;
+        prev = atomic_cas(&cpu_pool->remote_free_list, head, bufctl,
+                          ATOMIC_RELEASE);
 
-        if (buf == NULL) {
+        if (prev == head) {
             break;
         }
 
-        if (ctor != NULL) {
-            ctor(buf);
-        }
-
-        kmem_cpu_pool_push(cpu_pool, buf);
+        head = prev;
     }
-
-    mutex_unlock(&cache->lock);
-
-    return i;
 }
 
-static void
-kmem_cpu_pool_drain(struct kmem_cpu_pool *cpu_pool, struct kmem_cache *cache)
+/*
+ * Transfer the objects of the remote free list of a CPU pool to its free list.
+ *
+ * The CPU pool must be locked. Return the number of transferred objects.
+ */
+static int
+kmem_cpu_pool_drain_remote(struct kmem_cpu_pool *cpu_pool)
 {
-    void *obj;
-    int i;
+    union kmem_bufctl *bufctl, *next;
+    int nr_objs;
 
-    mutex_lock(&cache->lock);
+    if (atomic_load(&cpu_pool->remote_free_list, ATOMIC_RELAXED) == NULL) {
+        return 0;
+    }
 
-    for (i = cpu_pool->transfer_size; i > 0; i--) {
-        obj = kmem_cpu_pool_pop(cpu_pool);
-        kmem_cache_free_to_slab(cache, obj);
+    bufctl = atomic_swap(&cpu_pool->remote_free_list, NULL, ATOMIC_ACQUIRE);
+
+    for (nr_objs = 0; bufctl != NULL; nr_objs++) {
+        next = bufctl->next;
+        bufctl->next = cpu_pool->free_list;
+        cpu_pool->free_list = bufctl;
+        bufctl = next;
     }
 
-    mutex_unlock(&cache->lock);
+    cpu_pool->nr_objs += nr_objs;
+    return nr_objs;
 }
 
+/*
+ * Give the ownership of a slab to a CPU pool.
+ *
+ * The CPU pool must be locked.
+ */
 static void
-kmem_cache_error(struct kmem_cache *cache, void *buf, int error, void *arg)
+kmem_cpu_pool_add_slab(struct kmem_cpu_pool *cpu_pool,
+                       struct kmem_cache *cache, struct kmem_slab *slab)
 {
-    struct kmem_buftag *buftag;
+    assert(slab->nr_refs == 0);
+    slab->cpu = kmem_cpu_pool_cpu(cpu_pool, cache);
+    list_insert_tail(&cpu_pool->partial_slabs, &slab->node);
+}
 
-    printf("kmem: error: cache: %s, buffer: %p\n", cache->name, buf);
+/*
+ * Allocate a raw (unconstructed) buffer from the slabs owned by a CPU pool.
+ *
+ * The CPU pool must be locked before calling this function.
+ */
+static void *
+kmem_cpu_pool_alloc_from_slab(struct kmem_cpu_pool *cpu_pool,
+                              struct kmem_cache *cache)
+{
+    struct kmem_slab *slab;
+    union kmem_bufctl *bufctl;
 
-    switch(error) {
-    case KMEM_ERR_INVALID:
-        panic("kmem: freeing invalid address");
-        break;
-    case KMEM_ERR_DOUBLEFREE:
-        panic("kmem: attempting to free the same address twice");
-        break;
-    case KMEM_ERR_BUFTAG:
-        buftag = arg;
-        panic("kmem: invalid buftag content, buftag state: %p",
-              (void *)buftag->state);
-        break;
-    case KMEM_ERR_MODIFIED:
-        panic("kmem: free buffer modified, fault address: %p, "
-              "offset in buffer: %td", arg, arg - buf);
-        break;
-    case KMEM_ERR_REDZONE:
-        panic("kmem: write beyond end of buffer, fault address: %p, "
-              "offset in buffer: %td", arg, arg - buf);
-        break;
-    default:
-        panic("kmem: unknown error");
+    if (list_empty(&cpu_pool->partial_slabs)) {
+        return NULL;
     }
 
-    /*
-     * Never reached.
-     */
+    slab = list_first_entry(&cpu_pool->partial_slabs, struct kmem_slab, node);
+    assert(slab->cpu == kmem_cpu_pool_cpu(cpu_pool, cache));
+
+    bufctl = slab->first_free;
+    assert(bufctl != NULL);
+    slab->first_free = bufctl->next;
+    slab->nr_refs++;
+    cpu_pool->nr_refs++;
+
+    if (slab->nr_refs == cache->bufs_per_slab) {
+        /* The slab has become complete */
+        list_remove(&slab->node);
+    }
+
+    return kmem_bufctl_to_buf(bufctl, cache);
 }
 
 /*
- * Compute properties such as slab size for the given cache.
+ * Release a buffer to its slab, owned by the given CPU pool.
  *
- * Once the slab size is known, this function sets the related properties
- * (buffers per slab and maximum color). It can also set some KMEM_CF_xxx
- * flags depending on the resulting layout.
+ * If the slab becomes free, it's moved to the given list, so that it can
+ * be returned to the cache.
+ *
+ * The CPU pool must be locked before calling this function.
  */
 static void
-kmem_cache_compute_properties(struct kmem_cache *cache, int flags)
+kmem_cpu_pool_free_to_slab(struct kmem_cpu_pool *cpu_pool,
+                           struct kmem_cache *cache, struct kmem_slab *slab,
+                           void *buf, struct list *free_slabs)
 {
-    size_t size, waste;
-    int embed;
+    union kmem_bufctl *bufctl;
 
-    if (cache->buf_size < KMEM_BUF_SIZE_THRESHOLD) {
-        flags |= KMEM_CACHE_NOOFFSLAB;
-    }
+    assert(slab->cpu == kmem_cpu_pool_cpu(cpu_pool, cache));
+    assert(slab->nr_refs >= 1);
+    assert(slab->nr_refs <= cache->bufs_per_slab);
 
-    cache->slab_size = PAGE_SIZE;
+    bufctl = kmem_buf_to_bufctl(buf, cache);
+    bufctl->next = slab->first_free;
+    slab->first_free = bufctl;
+    slab->nr_refs--;
+    cpu_pool->nr_refs--;
 
-    for (;;) {
-        if (flags & KMEM_CACHE_NOOFFSLAB) {
-            embed = 1;
-        } else {
-            waste = cache->slab_size % cache->buf_size;
-            embed = (sizeof(struct kmem_slab) <= waste);
+    if (slab->nr_refs == 0) {
+        /* The slab has become free */
+
+        /* If it was partial, remove it from its list */
+        if (cache->bufs_per_slab != 1) {
+            list_remove(&slab->node);
         }
 
-        size = cache->slab_size;
+        list_insert_head(free_slabs, &slab->node);
+    } else if (slab->nr_refs == (cache->bufs_per_slab - 1)) {
+        /* The slab has become partial */
+        list_insert_head(&cpu_pool->partial_slabs, &slab->node);
+    }
+}
 
-        if (embed) {
-            size -= sizeof(struct kmem_slab);
-        }
+/*
+ * Lock a cache, accounting contention.
+ */
+static void
+kmem_cache_lock(struct kmem_cache *cache)
+{
+    int error;
 
-        if (size >= cache->buf_size) {
-            break;
-        }
+    error = mutex_trylock(&cache->lock);
 
-        cache->slab_size += PAGE_SIZE;
+    if (error) {
+        mutex_lock(&cache->lock);
+        cache->nr_contentions++;
     }
+}
 
-    /*
-     * A user may force page allocation in order to guarantee that virtual
-     * memory isn't used. This is normally done for objects that are used
-     * to implement virtual memory and avoid circular dependencies.
-     *
-     * When forcing the use of direct page allocation, only allow single
-     * page allocations in order to completely prevent physical memory
-     * fragmentation from making slab allocations fail.
-     */
-    if ((flags & KMEM_CACHE_PAGE_ONLY) && (cache->slab_size != PAGE_SIZE)) {
-        panic("kmem: unable to guarantee page allocation");
+/*
+ * Return free slabs to a cache.
+ *
+ * Slabs are sorted by memory node.
+ *
+ * The cache must not be locked.
+ */
+static void
+kmem_cache_release_slabs(struct kmem_cache *cache, struct list *slabs)
+{
+    struct kmem_slab *slab;
+
+    if (list_empty(slabs)) {
+        return;
     }
 
-    cache->bufs_per_slab = size / cache->buf_size;
-    cache->color_max = size % cache->buf_size;
+    kmem_cache_lock(cache);
 
-    /*
-     * Make sure the first page of a slab buffer can be found from the
-     * address of the first object.
-     *
-     * See kmem_slab_buf().
-     */
-    if (cache->color_max >= PAGE_SIZE) {
-        cache->color_max = 0;
+    while (!list_empty(slabs)) {
+        slab = list_first_entry(slabs, struct kmem_slab, node);
+        list_remove(&slab->node);
+        list_insert_head(&cache->free_slabs[slab->node_index], &slab->node);
+        cache->nr_free_slabs++;
     }
 
-    if (!embed) {
-        cache->flags |= KMEM_CF_SLAB_EXTERNAL;
-    }
+    mutex_unlock(&cache->lock);
 }
 
-void
-kmem_cache_init(struct kmem_cache *cache, const char *name, size_t obj_size,
-                size_t align, kmem_ctor_fn_t ctor, int flags)
+/*
+ * Obtain a free slab from a cache.
+ *
+ * Only free slabs from the given memory node are considered, unless
+ * fallback is true, in which case free slabs from other nodes may be
+ * returned if the given node has none.
+ *
+ * The cache must not be locked.
+ */
+static struct kmem_slab *
+kmem_cache_acquire_slab(struct kmem_cache *cache, unsigned int node_index,
+                        bool fallback)
 {
-    struct kmem_cpu_pool_type *cpu_pool_type;
-    size_t i, buf_size;
+    unsigned int nr_nodes;
+    struct list *free_slabs;
+    struct kmem_slab *slab;
 
-#ifdef CONFIG_KMEM_DEBUG
-    cache->flags = KMEM_CF_VERIFY;
-#else /* CONFIG_KMEM_DEBUG */
-    cache->flags = 0;
-#endif /* CONFIG_KMEM_DEBUG */
+    nr_nodes = fallback ? ARRAY_SIZE(cache->free_slabs) : 1;
+    slab = NULL;
 
-    if (flags & KMEM_CACHE_VERIFY) {
-        cache->flags |= KMEM_CF_VERIFY;
-    }
+    kmem_cache_lock(cache);
+
+    for (unsigned int i = 0; i < nr_nodes; i++) {
+        free_slabs = &cache->free_slabs[(node_index + i)
+                                        % ARRAY_SIZE(cache->free_slabs)];
+
+        if (!list_empty(free_slabs)) {
+            slab = list_first_entry(free_slabs, struct kmem_slab, node);
+            list_remove(&slab->node);
+            cache->nr_free_slabs--;
+            break;
+        }
+    }
+
+    mutex_unlock(&cache->lock);
+
+    return slab;
+}
+
+static int
+kmem_cpu_pool_fill(struct kmem_cpu_pool *cpu_pool, struct kmem_cache *cache)
+{
+    struct kmem_slab *slab;
+    kmem_ctor_fn_t ctor;
+    void *buf;
+    int i;
+
+    i = kmem_cpu_pool_drain_remote(cpu_pool);
+
+    if (i != 0) {
+        return i;
+    }
+
+    if (list_empty(&cpu_pool->partial_slabs)) {
+        slab = kmem_cache_acquire_slab(cache, cpu_node(), false);
+
+        if (slab == NULL) {
+            return 0;
+        }
+
+        kmem_cpu_pool_add_slab(cpu_pool, cache, slab);
+    }
+
+    ctor = (cpu_pool->flags & KMEM_CF_VERIFY) ? NULL : cache->ctor;
+
+    for (i = 0; i < cpu_pool->transfer_size; i++) {
+        buf = kmem_cpu_pool_alloc_from_slab(cpu_pool, cache);
+
+        if (buf == NULL) {
+            break;
+        }
+
+        if (ctor != NULL) {
+            ctor(buf);
+        }
+
+        kmem_cpu_pool_push(cpu_pool, cache, buf);
+    }
+
+    return i;
+}
+
+/*
+ * Release objects from the free list of a CPU pool to their slabs.
+ *
+ * Objects from slabs owned by other CPU pools are queued on their remote
+ * free list.
+ *
+ * The CPU pool must be locked.
+ */
+static void
+kmem_cpu_pool_release(struct kmem_cpu_pool *cpu_pool, struct kmem_cache *cache,
+                      int nr_objs)
+{
+    struct list free_slabs;
+    struct kmem_slab *slab;
+    unsigned int cpu;
+    void *obj;
+
+    assert(nr_objs <= cpu_pool->nr_objs);
+
+    list_init(&free_slabs);
+    cpu = kmem_cpu_pool_cpu(cpu_pool, cache);
+
+    while (nr_objs > 0) {
+        obj = kmem_cpu_pool_pop(cpu_pool, cache);
+
+        /*
+         * The owner of a slab can't change while one of its buffers is
+         * allocated, which includes buffers on CPU pool free lists.
+         */
+        slab = kmem_cache_get_slab(cache, obj);
+
+        if (slab->cpu == cpu) {
+            kmem_cpu_pool_free_to_slab(cpu_pool, cache, slab, obj,
+                                       &free_slabs);
+        } else {
+            kmem_cpu_pool_push_remote(&cache->cpu_pools[slab->cpu], cache,
+                                      obj);
+        }
+
+        nr_objs--;
+    }
+
+    kmem_cache_release_slabs(cache, &free_slabs);
+}
+
+static void
+kmem_cpu_pool_drain(struct kmem_cpu_pool *cpu_pool, struct kmem_cache *cache)
+{
+    /*
+     * Objects on the remote free list are in excess, since the free list
+     * is full. Make sure they're eventually returned to their slabs.
+     */
+    kmem_cpu_pool_drain_remote(cpu_pool);
+    kmem_cpu_pool_release(cpu_pool, cache, cpu_pool->nr_objs - cpu_pool->size
+                                           + cpu_pool->transfer_size);
+}
+
+/*
+ * Resize a CPU pool, and drain it if it has been idle since the previous
+ * reaping pass, or unconditionally if forced.
+ */
+static void
+kmem_cpu_pool_reap(struct kmem_cpu_pool *cpu_pool, struct kmem_cache *cache,
+                   int size, bool force)
+{
+    mutex_lock(&cpu_pool->lock);
+
+    kmem_cpu_pool_set_size(cpu_pool, size);
+
+    if (cpu_pool->active && !force) {
+        cpu_pool->active = false;
+
+        if (cpu_pool->nr_objs > size) {
+            kmem_cpu_pool_release(cpu_pool, cache, cpu_pool->nr_objs - size);
+        }
+    } else {
+        kmem_cpu_pool_drain_remote(cpu_pool);
+        kmem_cpu_pool_release(cpu_pool, cache, cpu_pool->nr_objs);
+    }
+
+    mutex_unlock(&cpu_pool->lock);
+}
+
+static void
+kmem_cache_error(struct kmem_cache *cache, void *buf, int error, void *arg)
+{
+    struct kmem_buftag *buftag;
+
+    printf("kmem: error: cache: %s, buffer: %p\n", cache->name, buf);
+
+    switch(error) {
+    case KMEM_ERR_INVALID:
+        panic("kmem: freeing invalid address");
+        break;
+    case KMEM_ERR_DOUBLEFREE:
+        panic("kmem: attempting to free the same address twice");
+        break;
+    case KMEM_ERR_BUFTAG:
+        buftag = arg;
+        panic("kmem: invalid buftag content, buftag state: %p",
+              (void *)buftag->state);
+        break;
+    case KMEM_ERR_MODIFIED:
+        panic("kmem: free buffer modified, fault address: %p, "
+              "offset in buffer: %td", arg, arg - buf);
+        break;
+    case KMEM_ERR_REDZONE:
+        panic("kmem: write beyond end of buffer, fault address: %p, "
+              "offset in buffer: %td", arg, arg - buf);
+        break;
+    default:
+        panic("kmem: unknown error");
+    }
+
+    /*
+     * Never reached.
+     */
+}
+
+/*
+ * Compute properties such as slab size for the given cache.
+ *
+ * Once the slab size is known, this function sets the related properties
+ * (buffers per slab and maximum color). It can also set some KMEM_CF_xxx
+ * flags depending on the resulting layout.
+ */
+static void
+kmem_cache_compute_properties(struct kmem_cache *cache, int flags)
+{
+    size_t size, waste;
+    int embed;
+
+    if (cache->buf_size < KMEM_BUF_SIZE_THRESHOLD) {
+        flags |= KMEM_CACHE_NOOFFSLAB;
+    }
+
+    cache->slab_size = PAGE_SIZE;
+
+    for (;;) {
+        if (flags & KMEM_CACHE_NOOFFSLAB) {
+            embed = 1;
+        } else {
+            waste = cache->slab_size % cache->buf_size;
+            embed = (sizeof(struct kmem_slab) <= waste);
+        }
+
+        size = cache->slab_size;
+
+        if (embed) {
+            size -= sizeof(struct kmem_slab);
+        }
+
+        if (size >= cache->buf_size) {
+            break;
+        }
+
+        cache->slab_size += PAGE_SIZE;
+    }
+
+    /*
+     * A user may force page allocation in order to guarantee that virtual
+     * memory isn't used. This is normally done for objects that are used
+     * to implement virtual memory and avoid circular dependencies.
+     *
+     * When forcing the use of direct page allocation, only allow single
+     * page allocations in order to completely prevent physical memory
+     * fragmentation from making slab allocations fail.
+     */
+    if ((flags & KMEM_CACHE_PAGE_ONLY) && (cache->slab_size != PAGE_SIZE)) {
+        panic("kmem: unable to guarantee page allocation");
+    }
+
+    cache->bufs_per_slab = size / cache->buf_size;
+    cache->color_max = size % cache->buf_size;
+
+    /*
+     * Make sure the first page of a slab buffer can be found from the
+     * address of the first object.
+     *
+     * See kmem_slab_buf().
+     */
+    if (cache->color_max >= PAGE_SIZE) {
+        cache->color_max = 0;
+    }
+
+    if (!embed) {
+        cache->flags |= KMEM_CF_SLAB_EXTERNAL;
+    }
+}
+
+#ifdef CONFIG_KMEM_PROFILE
+
+static void
+kmem_prof_init(struct kmem_cache *cache)
+{
+    struct kmem_prof *prof;
+
+    prof = &cache->prof;
+    mutex_init(&prof->lock);
+    prof->nr_objs = 0;
+    prof->nr_dropped = 0;
+    prof->snapshot_time = 0;
+    memset(prof->sites, 0, sizeof(prof->sites));
+
+    for (size_t i = 0; i < ARRAY_SIZE(prof->objs); i++) {
+        hlist_init(&prof->objs[i]);
+    }
+}
+
+/*
+ * Return true if the current allocation from the given CPU pool must be
+ * sampled.
+ *
+ * The CPU pool must be locked.
+ */
+static inline bool
+kmem_cpu_pool_sample(struct kmem_cpu_pool *cpu_pool,
+                     const struct kmem_cache *cache)
+{
+    if (cpu_pool->prof_countdown != 0) {
+        cpu_pool->prof_countdown--;
+        return false;
+    }
+
+    cpu_pool->prof_countdown = KMEM_PROF_SAMPLE_RATE - 1;
+    return (cache != &kmem_prof_obj_cache);
+}
+
+static struct hlist *
+kmem_prof_get_bucket(struct kmem_prof *prof, const void *obj)
+{
+    return &prof->objs[hash_long((uintptr_t)obj, KMEM_PROF_HTABLE_ORDER)];
+}
+
+static struct kmem_prof_site *
+kmem_prof_get_site(struct kmem_prof *prof, uintptr_t caller)
+{
+    struct kmem_prof_site *site;
+    size_t index;
+
+    index = hash_long(caller, KMEM_PROF_SITES_ORDER);
+
+    for (size_t i = 0; i < ARRAY_SIZE(prof->sites); i++) {
+        site = &prof->sites[(index + i) & (ARRAY_SIZE(prof->sites) - 1)];
+
+        if (site->caller == caller) {
+            return site;
+        } else if (site->caller == 0) {
+            site->caller = caller;
+            return site;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+kmem_prof_record(struct kmem_cache *cache, void *obj, const void *caller)
+{
+    struct kmem_prof_obj *prof_obj;
+    struct kmem_prof_site *site;
+    struct kmem_prof *prof;
+
+    prof = &cache->prof;
+    prof_obj = kmem_cache_alloc(&kmem_prof_obj_cache);
+
+    mutex_lock(&prof->lock);
+
+    site = (prof_obj == NULL) ? NULL
+                              : kmem_prof_get_site(prof, (uintptr_t)caller);
+
+    if (site == NULL) {
+        prof->nr_dropped++;
+        mutex_unlock(&prof->lock);
+
+        if (prof_obj != NULL) {
+            kmem_cache_free(&kmem_prof_obj_cache, prof_obj);
+        }
+
+        return;
+    }
+
+    prof_obj->obj = obj;
+    prof_obj->site = site;
+    hlist_insert_head(kmem_prof_get_bucket(prof, obj), &prof_obj->node);
+    site->nr_allocs++;
+    site->nr_live++;
+    atomic_store(&prof->nr_objs, prof->nr_objs + 1, ATOMIC_RELAXED);
+
+    mutex_unlock(&prof->lock);
+}
+
+static void
+kmem_prof_remove(struct kmem_cache *cache, void *obj)
+{
+    struct kmem_prof_obj *prof_obj;
+    struct kmem_prof *prof;
+
+    prof = &cache->prof;
+
+    /*
+     * A sampled object is recorded before being returned to its user, so
+     * that releasing it always observes a non-zero count.
+     */
+    if (atomic_load(&prof->nr_objs, ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    mutex_lock(&prof->lock);
+
+    hlist_for_each_entry(kmem_prof_get_bucket(prof, obj), prof_obj, node) {
+        if (prof_obj->obj == obj) {
+            hlist_remove(&prof_obj->node);
+            prof_obj->site->nr_live--;
+            atomic_store(&prof->nr_objs, prof->nr_objs - 1, ATOMIC_RELAXED);
+            mutex_unlock(&prof->lock);
+            kmem_cache_free(&kmem_prof_obj_cache, prof_obj);
+            return;
+        }
+    }
+
+    mutex_unlock(&prof->lock);
+}
+
+#else /* CONFIG_KMEM_PROFILE */
+
+static inline void
+kmem_prof_init(struct kmem_cache *cache)
+{
+    (void)cache;
+}
+
+static inline bool
+kmem_cpu_pool_sample(struct kmem_cpu_pool *cpu_pool,
+                     const struct kmem_cache *cache)
+{
+    (void)cpu_pool;
+    (void)cache;
+    return false;
+}
+
+static inline void
+kmem_prof_record(struct kmem_cache *cache, void *obj, const void *caller)
+{
+    (void)cache;
+    (void)obj;
+    (void)caller;
+}
+
+static inline void
+kmem_prof_remove(struct kmem_cache *cache, void *obj)
+{
+    (void)cache;
+    (void)obj;
+}
+
+#endif /* CONFIG_KMEM_PROFILE */
+
+void
+kmem_cache_init(struct kmem_cache *cache, const char *name, size_t obj_size,
+                size_t align, kmem_ctor_fn_t ctor, int flags)
+{
+    struct kmem_cpu_pool_type *cpu_pool_type;
+    size_t i, buf_size;
+
+#ifdef CONFIG_KMEM_DEBUG
+    cache->flags = KMEM_CF_VERIFY;
+#else /* CONFIG_KMEM_DEBUG */
+    cache->flags = 0;
+#endif /* CONFIG_KMEM_DEBUG */
+
+    if (flags & KMEM_CACHE_VERIFY) {
+        cache->flags |= KMEM_CF_VERIFY;
+    }
 
     if (align < KMEM_ALIGN_MIN) {
         align = KMEM_ALIGN_MIN;
@@ -572,14 +1188,16 @@ kmem_cache_init(struct kmem_cache *cache, const char *name, size_t obj_size,
 
     mutex_init(&cache->lock);
     list_node_init(&cache->node);
-    list_init(&cache->partial_slabs);
-    list_init(&cache->free_slabs);
+    for (i = 0; i < ARRAY_SIZE(cache->free_slabs); i++) {
+        list_init(&cache->free_slabs[i]);
+        cache->nr_node_slabs[i] = 0;
+    }
+
     cache->obj_size = obj_size;
     cache->align = align;
     cache->buf_size = buf_size;
     cache->bufctl_dist = buf_size - sizeof(union kmem_bufctl);
     cache->color = 0;
-    cache->nr_objs = 0;
     cache->nr_bufs = 0;
     cache->nr_slabs = 0;
     cache->nr_free_slabs = 0;
@@ -595,6 +1213,15 @@ kmem_cache_init(struct kmem_cache *cache, const char *name, size_t obj_size,
         buf_size += sizeof(union kmem_bufctl) + sizeof(struct kmem_buftag);
         buf_size = P2ROUND(buf_size, align);
         cache->buf_size = buf_size;
+    } else if ((ctor != NULL) && (cache->bufctl_dist < obj_size)) {
+        /*
+         * Objects on the free lists of CPU pools are linked through their
+         * bufctl, which must then not overlap with constructed data.
+         */
+        cache->bufctl_dist = buf_size;
+        buf_size += sizeof(union kmem_bufctl);
+        buf_size = P2ROUND(buf_size, align);
+        cache->buf_size = buf_size;
     }
 
     kmem_cache_compute_properties(cache, flags);
@@ -604,22 +1231,21 @@ kmem_cache_init(struct kmem_cache *cache, const char *name, size_t obj_size,
          cpu_pool_type++);
 
     cache->cpu_pool_type = cpu_pool_type;
+    cache->cpu_pool_size = cpu_pool_type->size;
+    cache->nr_contentions = 0;
+    cache->nr_quiet_reaps = 0;
 
     for (i = 0; i < ARRAY_SIZE(cache->cpu_pools); i++) {
         kmem_cpu_pool_init(&cache->cpu_pools[i], cache);
     }
 
+    kmem_prof_init(cache);
+
     mutex_lock(&kmem_cache_list_lock);
     list_insert_tail(&kmem_cache_list, &cache->node);
     mutex_unlock(&kmem_cache_list_lock);
 }
 
-static inline int
-kmem_cache_empty(struct kmem_cache *cache)
-{
-    return cache->nr_objs == cache->nr_bufs;
-}
-
 static struct kmem_slab *
 kmem_cache_buf_to_slab(const struct kmem_cache *cache, void *buf)
 {
@@ -639,8 +1265,15 @@ kmem_cache_registration_required(const struct kmem_cache *cache)
             || (cache->slab_size != PAGE_SIZE));
 }
 
+/*
+ * Associate the pages of a slab with the given private data.
+ *
+ * Registration stores the slab so that it can be looked up from the
+ * address of its buffers, and unregistration resets it to NULL.
+ */
 static void
-kmem_cache_register(struct kmem_cache *cache, struct kmem_slab *slab)
+kmem_cache_set_slab_priv(struct kmem_cache *cache, struct kmem_slab *slab,
+                         void *priv)
 {
     struct vm_page *page;
     uintptr_t va, end;
@@ -667,11 +1300,23 @@ kmem_cache_register(struct kmem_cache *cache, struct kmem_slab *slab)
         assert(page != NULL);
         assert((virtual && vm_page_type(page) == VM_PAGE_KERNEL)
                || (!virtual && vm_page_type(page) == VM_PAGE_KMEM));
-        assert(vm_page_get_priv(page) == NULL);
-        vm_page_set_priv(page, slab);
+        assert((priv == NULL) != (vm_page_get_priv(page) == NULL));
+        vm_page_set_priv(page, priv);
     }
 }
 
+static void
+kmem_cache_register(struct kmem_cache *cache, struct kmem_slab *slab)
+{
+    kmem_cache_set_slab_priv(cache, slab, slab);
+}
+
+static void
+kmem_cache_unregister(struct kmem_cache *cache, struct kmem_slab *slab)
+{
+    kmem_cache_set_slab_priv(cache, slab, NULL);
+}
+
 static struct kmem_slab *
 kmem_cache_lookup(struct kmem_cache *cache, void *buf)
 {
@@ -714,20 +1359,35 @@ kmem_cache_lookup(struct kmem_cache *cache, void *buf)
     return slab;
 }
 
-static int
-kmem_cache_grow(struct kmem_cache *cache)
+static struct kmem_slab *
+kmem_cache_get_slab(struct kmem_cache *cache, void *buf)
 {
     struct kmem_slab *slab;
-    size_t color;
-    int empty;
 
-    mutex_lock(&cache->lock);
+    slab = kmem_cache_buf_to_slab(cache, buf);
 
-    if (!kmem_cache_empty(cache)) {
-        mutex_unlock(&cache->lock);
-        return 1;
+    if (slab == NULL) {
+        slab = kmem_cache_lookup(cache, buf);
+        assert(slab != NULL);
     }
 
+    return slab;
+}
+
+/*
+ * Create a new slab for a cache.
+ *
+ * The new slab isn't inserted in the free slabs of the cache, but returned
+ * to the caller, which is expected to give its ownership to a CPU pool.
+ */
+static struct kmem_slab *
+kmem_cache_grow(struct kmem_cache *cache)
+{
+    struct kmem_slab *slab;
+    size_t color;
+
+    kmem_cache_lock(cache);
+
     color = cache->color;
     cache->color += cache->align;
 
@@ -739,114 +1399,126 @@ kmem_cache_grow(struct kmem_cache *cache)
 
     slab = kmem_slab_create(cache, color);
 
-    mutex_lock(&cache->lock);
+    if (slab == NULL) {
+        return NULL;
+    }
 
-    if (slab != NULL) {
-        list_insert_head(&cache->free_slabs, &slab->node);
-        cache->nr_bufs += cache->bufs_per_slab;
-        cache->nr_slabs++;
-        cache->nr_free_slabs++;
+    kmem_cache_lock(cache);
 
-        if (kmem_cache_registration_required(cache)) {
-            kmem_cache_register(cache, slab);
-        }
-    }
+    cache->nr_bufs += cache->bufs_per_slab;
+    cache->nr_slabs++;
+    cache->nr_node_slabs[slab->node_index]++;
 
-    /*
-     * Even if our slab creation failed, another thread might have succeeded
-     * in growing the cache.
-     */
-    empty = kmem_cache_empty(cache);
+    if (kmem_cache_registration_required(cache)) {
+        kmem_cache_register(cache, slab);
+    }
 
     mutex_unlock(&cache->lock);
 
-    return !empty;
+    return slab;
 }
 
-/*
- * Allocate a raw (unconstructed) buffer from the slab layer of a cache.
- *
- * The cache must be locked before calling this function.
- */
-static void *
-kmem_cache_alloc_from_slab(struct kmem_cache *cache)
+static void
+kmem_cache_destroy_slab(struct kmem_cache *cache, struct kmem_slab *slab)
 {
-    struct kmem_slab *slab;
-    union kmem_bufctl *bufctl;
+    void *slab_buf;
 
-    if (!list_empty(&cache->partial_slabs)) {
-        slab = list_first_entry(&cache->partial_slabs, struct kmem_slab, node);
-    } else if (!list_empty(&cache->free_slabs)) {
-        slab = list_first_entry(&cache->free_slabs, struct kmem_slab, node);
-    } else {
-        return NULL;
+    slab_buf = (void *)kmem_slab_buf(slab);
+
+    if (kmem_cache_registration_required(cache)) {
+        kmem_cache_unregister(cache, slab);
     }
 
-    bufctl = slab->first_free;
-    assert(bufctl != NULL);
-    slab->first_free = bufctl->next;
-    slab->nr_refs++;
-    cache->nr_objs++;
+    if (cache->flags & KMEM_CF_SLAB_EXTERNAL) {
+        kmem_cache_free(&kmem_slab_cache, slab);
+    }
 
-    if (slab->nr_refs == cache->bufs_per_slab) {
-        /* The slab has become complete */
-        list_remove(&slab->node);
+    kmem_pagefree(slab_buf, cache->slab_size);
+}
 
-        if (slab->nr_refs == 1) {
-            cache->nr_free_slabs--;
+/*
+ * Compute the size of the CPU pools of a cache from the contention on its
+ * lock since the previous reaping pass.
+ *
+ * Under memory pressure, i.e. when forced, the minimum size is used.
+ *
+ * The cache must be locked.
+ */
+static int
+kmem_cache_update_cpu_pool_size(struct kmem_cache *cache, bool force)
+{
+    const struct kmem_cpu_pool_type *cpu_pool_type;
+    int size;
+
+    cpu_pool_type = cache->cpu_pool_type;
+    size = cache->cpu_pool_size;
+
+    if (force) {
+        size = cpu_pool_type->min_size;
+    } else if (cache->nr_contentions >= KMEM_CPU_POOL_GROW_THRESHOLD) {
+        size = MIN(size * 2, cpu_pool_type->max_size);
+        cache->nr_quiet_reaps = 0;
+    } else if (cache->nr_contentions != 0) {
+        cache->nr_quiet_reaps = 0;
+    } else {
+        cache->nr_quiet_reaps++;
+
+        if (cache->nr_quiet_reaps == KMEM_CPU_POOL_SHRINK_DELAY) {
+            size = MAX(size / 2, cpu_pool_type->min_size);
+            cache->nr_quiet_reaps = 0;
         }
-    } else if (slab->nr_refs == 1) {
-        /*
-         * The slab has become partial. Insert the new slab at the end of
-         * the list to reduce fragmentation.
-         */
-        list_remove(&slab->node);
-        list_insert_tail(&cache->partial_slabs, &slab->node);
-        cache->nr_free_slabs--;
     }
 
-    return kmem_bufctl_to_buf(bufctl, cache);
+    cache->nr_contentions = 0;
+    cache->cpu_pool_size = size;
+    return size;
 }
 
 /*
- * Release a buffer to the slab layer of a cache.
+ * Resize and drain the CPU pools of a cache, and release its free slabs.
  *
- * The cache must be locked before calling this function.
+ * Unless forced, only idle CPU pools are drained.
  */
 static void
-kmem_cache_free_to_slab(struct kmem_cache *cache, void *buf)
+kmem_cache_reap(struct kmem_cache *cache, bool force)
 {
     struct kmem_slab *slab;
-    union kmem_bufctl *bufctl;
+    unsigned long nr_slabs;
+    struct list slabs;
+    int size;
 
-    slab = kmem_cache_buf_to_slab(cache, buf);
+    mutex_lock(&cache->lock);
+    size = kmem_cache_update_cpu_pool_size(cache, force);
+    mutex_unlock(&cache->lock);
 
-    if (slab == NULL) {
-        slab = kmem_cache_lookup(cache, buf);
-        assert(slab != NULL);
+    for (unsigned int i = 0; i < cpu_count(); i++) {
+        kmem_cpu_pool_reap(&cache->cpu_pools[i], cache, size, force);
     }
 
-    assert(slab->nr_refs >= 1);
-    assert(slab->nr_refs <= cache->bufs_per_slab);
-    bufctl = kmem_buf_to_bufctl(buf, cache);
-    bufctl->next = slab->first_free;
-    slab->first_free = bufctl;
-    slab->nr_refs--;
-    cache->nr_objs--;
+    list_init(&slabs);
 
-    if (slab->nr_refs == 0) {
-        /* The slab has become free */
+    mutex_lock(&cache->lock);
 
-        /* If it was partial, remove it from its list */
-        if (cache->bufs_per_slab != 1) {
-            list_remove(&slab->node);
+    for (unsigned int i = 0; i < ARRAY_SIZE(cache->free_slabs); i++) {
+        list_for_each_entry(&cache->free_slabs[i], slab, node) {
+            cache->nr_node_slabs[i]--;
         }
 
-        list_insert_head(&cache->free_slabs, &slab->node);
-        cache->nr_free_slabs++;
-    } else if (slab->nr_refs == (cache->bufs_per_slab - 1)) {
-        /* The slab has become partial */
-        list_insert_head(&cache->partial_slabs, &slab->node);
+        list_concat(&slabs, &cache->free_slabs[i]);
+        list_init(&cache->free_slabs[i]);
+    }
+
+    nr_slabs = cache->nr_free_slabs;
+    cache->nr_free_slabs = 0;
+    cache->nr_slabs -= nr_slabs;
+    cache->nr_bufs -= nr_slabs * cache->bufs_per_slab;
+
+    mutex_unlock(&cache->lock);
+
+    while (!list_empty(&slabs)) {
+        slab = list_first_entry(&slabs, struct kmem_slab, node);
+        list_remove(&slab->node);
+        kmem_cache_destroy_slab(cache, slab);
     }
 }
 
@@ -882,11 +1554,18 @@ kmem_cache_alloc_verify(struct kmem_cache *cache, void *buf, int construct)
     }
 }
 
-void *
-kmem_cache_alloc(struct kmem_cache *cache)
+/*
+ * Allocate an object from a cache on behalf of the given caller.
+ *
+ * The caller address is only used for profiling.
+ */
+static __always_inline void *
+kmem_cache_alloc_common(struct kmem_cache *cache, const void *caller)
 {
     struct kmem_cpu_pool *cpu_pool;
+    struct kmem_slab *slab;
     int filled, verify;
+    bool sample;
     void *buf;
 
     thread_pin();
@@ -896,8 +1575,10 @@ kmem_cache_alloc(struct kmem_cache *cache)
 
 fast_alloc:
     if (likely(cpu_pool->nr_objs > 0)) {
-        buf = kmem_cpu_pool_pop(cpu_pool);
+        buf = kmem_cpu_pool_pop(cpu_pool, cache);
+        cpu_pool->active = true;
         verify = (cpu_pool->flags & KMEM_CF_VERIFY);
+        sample = kmem_cpu_pool_sample(cpu_pool, cache);
         mutex_unlock(&cpu_pool->lock);
         thread_unpin();
 
@@ -905,57 +1586,127 @@ fast_alloc:
             kmem_cache_alloc_verify(cache, buf, KMEM_AV_CONSTRUCT);
         }
 
+        if (sample) {
+            kmem_prof_record(cache, buf, caller);
+        }
+
         return buf;
     }
 
-    if (cpu_pool->array != NULL) {
-        filled = kmem_cpu_pool_fill(cpu_pool, cache);
+    filled = kmem_cpu_pool_fill(cpu_pool, cache);
+
+    if (!filled) {
+        mutex_unlock(&cpu_pool->lock);
+        thread_unpin();
+
+        slab = kmem_cache_grow(cache);
+
+        if (slab == NULL) {
+            slab = kmem_cache_acquire_slab(cache, cpu_node(), true);
+
+            if (slab == NULL) {
+                return NULL;
+            }
+        }
+
+        thread_pin();
+        cpu_pool = kmem_cpu_pool_get(cache);
+        mutex_lock(&cpu_pool->lock);
+        kmem_cpu_pool_add_slab(cpu_pool, cache, slab);
+    }
+
+    goto fast_alloc;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *cache)
+{
+    return kmem_cache_alloc_common(cache, __builtin_return_address(0));
+}
 
-        if (!filled) {
+int
+kmem_cache_alloc_bulk(struct kmem_cache *cache, void **objs, size_t nr_objs)
+{
+    struct kmem_cpu_pool *cpu_pool;
+    struct kmem_slab *slab;
+    kmem_ctor_fn_t ctor;
+    size_t i;
+    void *buf;
+
+    i = 0;
+
+    thread_pin();
+    cpu_pool = kmem_cpu_pool_get(cache);
+    ctor = (cpu_pool->flags & KMEM_CF_VERIFY) ? NULL : cache->ctor;
+
+    mutex_lock(&cpu_pool->lock);
+
+    while (i < nr_objs) {
+        if (cpu_pool->nr_objs == 0) {
+            kmem_cpu_pool_drain_remote(cpu_pool);
+        }
+
+        while ((i < nr_objs) && (cpu_pool->nr_objs > 0)) {
+            objs[i] = kmem_cpu_pool_pop(cpu_pool, cache);
+            i++;
+        }
+
+        if (i == nr_objs) {
+            break;
+        }
+
+        buf = kmem_cpu_pool_alloc_from_slab(cpu_pool, cache);
+
+        if (buf != NULL) {
+            if (ctor != NULL) {
+                ctor(buf);
+            }
+
+            objs[i] = buf;
+            i++;
+            continue;
+        }
+
+        slab = kmem_cache_acquire_slab(cache, cpu_node(), false);
+
+        if (slab == NULL) {
             mutex_unlock(&cpu_pool->lock);
             thread_unpin();
 
-            filled = kmem_cache_grow(cache);
+            slab = kmem_cache_grow(cache);
 
-            if (!filled) {
-                return NULL;
+            if (slab == NULL) {
+                slab = kmem_cache_acquire_slab(cache, cpu_node(), true);
             }
 
             thread_pin();
             cpu_pool = kmem_cpu_pool_get(cache);
             mutex_lock(&cpu_pool->lock);
+
+            if (slab == NULL) {
+                break;
+            }
         }
 
-        goto fast_alloc;
+        kmem_cpu_pool_add_slab(cpu_pool, cache, slab);
     }
 
+    cpu_pool->active = true;
     mutex_unlock(&cpu_pool->lock);
     thread_unpin();
 
-slab_alloc:
-    mutex_lock(&cache->lock);
-    buf = kmem_cache_alloc_from_slab(cache);
-    mutex_unlock(&cache->lock);
-
-    if (buf == NULL) {
-        filled = kmem_cache_grow(cache);
-
-        if (!filled) {
-            return NULL;
-        }
-
-        goto slab_alloc;
-    }
-
     if (cache->flags & KMEM_CF_VERIFY) {
-        kmem_cache_alloc_verify(cache, buf, KMEM_AV_NOCONSTRUCT);
+        for (size_t j = 0; j < i; j++) {
+            kmem_cache_alloc_verify(cache, objs[j], KMEM_AV_CONSTRUCT);
+        }
     }
 
-    if (cache->ctor != NULL) {
-        cache->ctor(buf);
+    if (i != nr_objs) {
+        kmem_cache_free_bulk(cache, objs, i);
+        return ENOMEM;
     }
 
-    return buf;
+    return 0;
 }
 
 static void
@@ -1025,7 +1776,8 @@ void
 kmem_cache_free(struct kmem_cache *cache, void *obj)
 {
     struct kmem_cpu_pool *cpu_pool;
-    void **array;
+
+    kmem_prof_remove(cache, obj);
 
     thread_pin();
     cpu_pool = kmem_cpu_pool_get(cache);
@@ -1041,62 +1793,156 @@ kmem_cache_free(struct kmem_cache *cache, void *obj)
 
     mutex_lock(&cpu_pool->lock);
 
-fast_free:
-    if (likely(cpu_pool->nr_objs < cpu_pool->size)) {
-        kmem_cpu_pool_push(cpu_pool, obj);
-        mutex_unlock(&cpu_pool->lock);
-        thread_unpin();
-        return;
-    }
-
-    if (cpu_pool->array != NULL) {
+    if (unlikely(cpu_pool->nr_objs >= cpu_pool->size)) {
         kmem_cpu_pool_drain(cpu_pool, cache);
-        goto fast_free;
     }
 
+    kmem_cpu_pool_push(cpu_pool, cache, obj);
+    cpu_pool->active = true;
     mutex_unlock(&cpu_pool->lock);
+    thread_unpin();
+}
 
-    array = kmem_cache_alloc(cache->cpu_pool_type->array_cache);
+void
+kmem_cache_free_bulk(struct kmem_cache *cache, void **objs, size_t nr_objs)
+{
+    struct kmem_cpu_pool *cpu_pool;
 
-    if (array != NULL) {
-        mutex_lock(&cpu_pool->lock);
+    for (size_t i = 0; i < nr_objs; i++) {
+        kmem_prof_remove(cache, objs[i]);
+    }
 
-        /*
-         * Another thread may have built the CPU pool while the lock was
-         * dropped.
-         */
-        if (cpu_pool->array != NULL) {
-            mutex_unlock(&cpu_pool->lock);
-            thread_unpin();
+    if (cache->flags & KMEM_CF_VERIFY) {
+        for (size_t i = 0; i < nr_objs; i++) {
+            kmem_cache_free_verify(cache, objs[i]);
+        }
+    }
 
-            kmem_cache_free(cache->cpu_pool_type->array_cache, array);
+    thread_pin();
+    cpu_pool = kmem_cpu_pool_get(cache);
 
-            thread_pin();
-            cpu_pool = kmem_cpu_pool_get(cache);
-            mutex_lock(&cpu_pool->lock);
-            goto fast_free;
+    mutex_lock(&cpu_pool->lock);
+
+    for (size_t i = 0; i < nr_objs; i++) {
+        if (unlikely(cpu_pool->nr_objs >= cpu_pool->size)) {
+            kmem_cpu_pool_drain(cpu_pool, cache);
         }
 
-        kmem_cpu_pool_build(cpu_pool, cache, array);
-        goto fast_free;
+        kmem_cpu_pool_push(cpu_pool, cache, objs[i]);
     }
 
+    cpu_pool->active = true;
+    mutex_unlock(&cpu_pool->lock);
     thread_unpin();
+}
 
-    mutex_lock(&cache->lock);
-    kmem_cache_free_to_slab(cache, obj);
-    mutex_unlock(&cache->lock);
+static void
+kmem_rcu_batch_run(struct work *work)
+{
+    struct kmem_rcu_batch *batch;
+
+    batch = structof(work, struct kmem_rcu_batch, work);
+    kmem_cache_free_bulk(batch->cache, batch->objs, batch->nr_objs);
+    kmem_cache_free(&kmem_rcu_batch_cache, batch);
+}
+
+/*
+ * Add an object to the current RCU batch of a CPU pool.
+ *
+ * Return true if the object was added. The batch pointer is only
+ * dereferenced if the batch belongs to the current work window, in which
+ * case it can't have been released yet.
+ *
+ * Interrupts and preemption must be disabled.
+ */
+static bool
+kmem_cpu_pool_add_rcu(struct kmem_cpu_pool *cpu_pool, void *obj)
+{
+    struct kmem_rcu_batch *batch;
+
+    batch = cpu_pool->rcu_batch;
+
+    if ((batch == NULL) || (cpu_pool->rcu_batch_wid != rcu_get_work_wid())
+        || (batch->nr_objs == ARRAY_SIZE(batch->objs))) {
+        return false;
+    }
+
+    batch->objs[batch->nr_objs] = obj;
+    batch->nr_objs++;
+    return true;
+}
+
+void
+kmem_cache_free_rcu(struct kmem_cache *cache, void *obj)
+{
+    struct kmem_cpu_pool *cpu_pool;
+    struct kmem_rcu_batch *batch;
+    unsigned long flags;
+    bool added;
+
+    thread_preempt_disable_intr_save(&flags);
+    added = kmem_cpu_pool_add_rcu(kmem_cpu_pool_get(cache), obj);
+    thread_preempt_enable_intr_restore(flags);
+
+    if (added) {
+        return;
+    }
+
+    batch = kmem_cache_alloc(&kmem_rcu_batch_cache);
+
+    if (batch == NULL) {
+        rcu_wait();
+        kmem_cache_free(cache, obj);
+        return;
+    }
+
+    work_init(&batch->work, kmem_rcu_batch_run);
+    batch->cache = cache;
+    batch->objs[0] = obj;
+    batch->nr_objs = 1;
+
+    /*
+     * The batch installed by another thread in the meantime, if any, is
+     * already deferred, and is simply replaced.
+     */
+    thread_preempt_disable_intr_save(&flags);
+    cpu_pool = kmem_cpu_pool_get(cache);
+    cpu_pool->rcu_batch = batch;
+    cpu_pool->rcu_batch_wid = rcu_get_work_wid();
+    rcu_defer(&batch->work);
+    thread_preempt_enable_intr_restore(flags);
+}
+
+static unsigned long
+kmem_cache_nr_objs(struct kmem_cache *cache)
+{
+    struct kmem_cpu_pool *cpu_pool;
+    unsigned long nr_objs;
+
+    nr_objs = 0;
+
+    for (unsigned int i = 0; i < cpu_count(); i++) {
+        cpu_pool = &cache->cpu_pools[i];
+        mutex_lock(&cpu_pool->lock);
+        nr_objs += cpu_pool->nr_refs;
+        mutex_unlock(&cpu_pool->lock);
+    }
+
+    return nr_objs;
 }
 
 void
 kmem_cache_info(struct kmem_cache *cache)
 {
+    unsigned long nr_objs;
     char flags_str[64];
 
     snprintf(flags_str, sizeof(flags_str), "%s%s",
              (cache->flags & KMEM_CF_SLAB_EXTERNAL) ? " SLAB_EXTERNAL" : "",
              (cache->flags & KMEM_CF_VERIFY) ? " VERIFY" : "");
 
+    nr_objs = kmem_cache_nr_objs(cache);
+
     mutex_lock(&cache->lock);
 
     printf("kmem:         flags: 0x%x%s\n"
@@ -1113,12 +1959,20 @@ kmem_cache_info(struct kmem_cache *cache)
            "kmem: nr_free_slabs: %lu\n"
            "kmem:   buftag_dist: %zu\n"
            "kmem:   redzone_pad: %zu\n"
-           "kmem: cpu_pool_size: %d\n", cache->flags, flags_str, cache->obj_size,
+           "kmem: cpu_pool_size: %d (min: %d, max: %d)\n",
+           cache->flags, flags_str, cache->obj_size,
            cache->align, cache->buf_size, cache->bufctl_dist,
            cache->slab_size, cache->color_max, cache->bufs_per_slab,
-           cache->nr_objs, cache->nr_bufs, cache->nr_slabs,
+           nr_objs, cache->nr_bufs, cache->nr_slabs,
            cache->nr_free_slabs, cache->buftag_dist, cache->redzone_pad,
-           cache->cpu_pool_type->array_size);
+           cache->cpu_pool_size, cache->cpu_pool_type->min_size,
+           cache->cpu_pool_type->max_size);
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(cache->nr_node_slabs); i++) {
+        if (cache->nr_node_slabs[i] != 0) {
+            printf("kmem:   node%u_slabs: %lu\n", i, cache->nr_node_slabs[i]);
+        }
+    }
 
     mutex_unlock(&cache->lock);
 }
@@ -1165,10 +2019,174 @@ kmem_shell_info(int argc, char **argv)
     }
 }
 
+#ifdef CONFIG_KMEM_PROFILE
+
+/*
+ * Number of call sites reported by the kmem_profile command.
+ */
+#define KMEM_PROF_NR_TOP_SITES 10
+
+/*
+ * Estimated number of bytes used by objects allocated from a call site.
+ */
+static unsigned long
+kmem_prof_site_live_bytes(const struct kmem_cache *cache,
+                          const struct kmem_prof_site *site)
+{
+    return site->nr_live * KMEM_PROF_SAMPLE_RATE * cache->obj_size;
+}
+
+/*
+ * Estimated number of allocations per second from a call site, since the
+ * last report.
+ */
+static unsigned long
+kmem_prof_site_rate(const struct kmem_prof_site *site, uint64_t elapsed_ms)
+{
+    unsigned long nr_allocs;
+
+    nr_allocs = site->nr_allocs - site->nr_allocs_snapshot;
+    return ((uint64_t)nr_allocs * KMEM_PROF_SAMPLE_RATE * 1000) / elapsed_ms;
+}
+
+static void
+kmem_prof_show_site(const struct kmem_cache *cache,
+                    const struct kmem_prof_site *site, uint64_t elapsed_ms)
+{
+    uintptr_t offset, size;
+    const char *name;
+
+    printf("kmem: %10luk %10lu ", kmem_prof_site_live_bytes(cache, site) >> 10,
+           kmem_prof_site_rate(site, elapsed_ms));
+    name = strace_lookup(site->caller, &offset, &size);
+
+    if (name == NULL) {
+        printf("%#lx\n", (unsigned long)site->caller);
+    } else {
+        printf("%s+%#lx\n", name, (unsigned long)offset);
+    }
+}
+
+/*
+ * Sort the used call sites of a cache in descending order, either by live
+ * bytes or by allocation rate, and return the number of used call sites.
+ */
+static unsigned int
+kmem_prof_sort_sites(const struct kmem_cache *cache,
+                     const struct kmem_prof_site **sites, bool by_rate,
+                     uint64_t elapsed_ms)
+{
+    const struct kmem_prof_site *site;
+    unsigned long key, other;
+    unsigned int nr_sites, j;
+
+    nr_sites = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(cache->prof.sites); i++) {
+        site = &cache->prof.sites[i];
+
+        if (site->caller == 0) {
+            continue;
+        }
+
+        key = by_rate ? kmem_prof_site_rate(site, elapsed_ms)
+                      : kmem_prof_site_live_bytes(cache, site);
+
+        for (j = nr_sites; j > 0; j--) {
+            other = by_rate ? kmem_prof_site_rate(sites[j - 1], elapsed_ms)
+                            : kmem_prof_site_live_bytes(cache, sites[j - 1]);
+
+            if (other >= key) {
+                break;
+            }
+
+            sites[j] = sites[j - 1];
+        }
+
+        sites[j] = site;
+        nr_sites++;
+    }
+
+    return nr_sites;
+}
+
+static void
+kmem_prof_info(struct kmem_cache *cache)
+{
+    const struct kmem_prof_site *sites[KMEM_PROF_NR_SITES];
+    struct kmem_prof *prof;
+    unsigned int nr_sites;
+    uint64_t now, elapsed_ms;
+
+    prof = &cache->prof;
+
+    mutex_lock(&prof->lock);
+
+    now = clock_get_time();
+    elapsed_ms = clock_ticks_to_ms(now - prof->snapshot_time);
+
+    if (elapsed_ms == 0) {
+        elapsed_ms = 1;
+    }
+
+    printf("kmem: profile: %s, sample rate: 1/%u, sampled objects: %lu, "
+           "dropped: %lu\n", cache->name, KMEM_PROF_SAMPLE_RATE,
+           prof->nr_objs, prof->nr_dropped);
+
+    for (unsigned int i = 0; i < 2; i++) {
+        nr_sites = kmem_prof_sort_sites(cache, sites, i != 0, elapsed_ms);
+        printf("kmem: top call sites by %s:\n"
+               "kmem:  live bytes   allocs/s call site\n",
+               (i == 0) ? "live bytes" : "allocation rate");
+
+        for (unsigned int j = 0; j < MIN(nr_sites, KMEM_PROF_NR_TOP_SITES);
+             j++) {
+            kmem_prof_show_site(cache, sites[j], elapsed_ms);
+        }
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(prof->sites); i++) {
+        prof->sites[i].nr_allocs_snapshot = prof->sites[i].nr_allocs;
+    }
+
+    prof->snapshot_time = now;
+
+    mutex_unlock(&prof->lock);
+}
+
+static void
+kmem_shell_profile(int argc, char **argv)
+{
+    struct kmem_cache *cache;
+
+    if (argc != 2) {
+        goto error;
+    }
+
+    cache = kmem_lookup_cache(argv[1]);
+
+    if (cache == NULL) {
+        goto error;
+    }
+
+    kmem_prof_info(cache);
+    return;
+
+error:
+    printf("kmem: profile: invalid arguments\n");
+}
+
+#endif /* CONFIG_KMEM_PROFILE */
+
 static struct shell_cmd kmem_shell_cmds[] = {
     SHELL_CMD_INITIALIZER("kmem_info", kmem_shell_info,
         "kmem_info [<cache_name>]",
         "display information about kernel memory and caches"),
+#ifdef CONFIG_KMEM_PROFILE
+    SHELL_CMD_INITIALIZER("kmem_profile", kmem_shell_profile,
+        "kmem_profile <cache_name>",
+        "display the top allocation call sites of a cache"),
+#endif /* CONFIG_KMEM_PROFILE */
 };
 
 static int __init
@@ -1189,9 +2207,8 @@ INIT_OP_DEFINE(kmem_setup_shell,
 static int __init
 kmem_bootstrap(void)
 {
-    struct kmem_cpu_pool_type *cpu_pool_type;
     char name[KMEM_NAME_SIZE];
-    size_t i, size;
+    size_t i, j, size;
 
     /* Make sure a bufctl can always be stored in a buffer */
     assert(sizeof(union kmem_bufctl) <= KMEM_ALIGN_MIN);
@@ -1199,27 +2216,36 @@ kmem_bootstrap(void)
     list_init(&kmem_cache_list);
     mutex_init(&kmem_cache_list_lock);
 
-    for (i = 0; i < ARRAY_SIZE(kmem_cpu_pool_types); i++) {
-        cpu_pool_type = &kmem_cpu_pool_types[i];
-        cpu_pool_type->array_cache = &kmem_cpu_array_caches[i];
-        sprintf(name, "kmem_cpu_array_%d", cpu_pool_type->array_size);
-        size = sizeof(void *) * cpu_pool_type->array_size;
-        kmem_cache_init(cpu_pool_type->array_cache, name, size,
-                        cpu_pool_type->array_align, NULL, 0);
-    }
-
     /*
      * Prevent off slab data for the slab cache to avoid infinite recursion.
      */
     kmem_cache_init(&kmem_slab_cache, "kmem_slab", sizeof(struct kmem_slab),
                     0, NULL, KMEM_CACHE_NOOFFSLAB);
 
-    size = 1 << KMEM_CACHES_FIRST_ORDER;
+#ifdef CONFIG_KMEM_PROFILE
+    kmem_cache_init(&kmem_prof_obj_cache, "kmem_prof_obj",
+                    sizeof(struct kmem_prof_obj), 0, NULL,
+                    KMEM_CACHE_NOOFFSLAB);
+#endif /* CONFIG_KMEM_PROFILE */
+
+    kmem_cache_init(&kmem_rcu_batch_cache, "kmem_rcu_batch",
+                    sizeof(struct kmem_rcu_batch), 0, NULL, 0);
 
     for (i = 0; i < ARRAY_SIZE(kmem_caches); i++) {
+        size = kmem_cache_sizes[i];
         sprintf(name, "kmem_%zu", size);
         kmem_cache_init(&kmem_caches[i], name, size, 0, NULL, 0);
-        size <<= 1;
+    }
+
+    for (i = 0, j = 0; i < ARRAY_SIZE(kmem_size_table); i++) {
+        size = (i + 1) << KMEM_SIZE_TABLE_SHIFT;
+
+        while (kmem_cache_sizes[j] < size) {
+            j++;
+        }
+
+        assert(P2ALIGNED(kmem_cache_sizes[j], 1 << KMEM_SIZE_TABLE_SHIFT));
+        kmem_size_table[i] = j;
     }
 
     return 0;
@@ -1239,10 +2265,95 @@ INIT_OP_DEFINE(kmem_setup,
                INIT_OP_DEP(kmem_bootstrap, true),
                INIT_OP_DEP(vm_kmem_setup, true));
 
+static void
+kmem_reap(bool force)
+{
+    struct kmem_cache *cache;
+
+    mutex_lock(&kmem_cache_list_lock);
+
+    list_for_each_entry(&kmem_cache_list, cache, node) {
+        kmem_cache_reap(cache, force);
+    }
+
+    mutex_unlock(&kmem_cache_list_lock);
+}
+
+static void
+kmem_reaper_run(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        thread_delay(clock_ticks_from_ms(KMEM_REAP_INTERVAL), false);
+        kmem_reap(false);
+    }
+}
+
+static void
+kmem_shrink(struct vm_page_shrinker *shrinker)
+{
+    (void)shrinker;
+    kmem_reap(true);
+}
+
+static int __init
+kmem_start(void)
+{
+    struct thread_attr attr;
+    struct thread *thread;
+    int error;
+
+    thread_attr_init(&attr, THREAD_KERNEL_PREFIX "kmem_reaper");
+    thread_attr_set_detached(&attr);
+    error = thread_create(&thread, &attr, kmem_reaper_run, NULL);
+
+    if (error) {
+        panic("kmem: unable to create reaper thread");
+    }
+
+    vm_page_register_shrinker(&kmem_shrinker, kmem_shrink);
+
+    return 0;
+}
+
+INIT_OP_DEFINE(kmem_start,
+               INIT_OP_DEP(kmem_setup, true),
+               INIT_OP_DEP(panic_setup, true),
+               INIT_OP_DEP(thread_setup, true));
+
 static inline size_t
 kmem_get_index(unsigned long size)
 {
-    return log2_order(size) - KMEM_CACHES_FIRST_ORDER;
+    size_t index;
+
+    assert(size != 0);
+
+    if (size <= (1 << KMEM_SIZE_TABLE_ORDER)) {
+        return kmem_size_table[(size - 1) >> KMEM_SIZE_TABLE_SHIFT];
+    }
+
+    index = kmem_size_table[ARRAY_SIZE(kmem_size_table) - 1];
+    return index + log2_order(size) - KMEM_SIZE_TABLE_ORDER;
+}
+
+/*
+ * Update the statistics of a general cache.
+ *
+ * Preemption is disabled so that the counters of the local CPU pool can
+ * be updated without atomic instructions. Objects may be released on
+ * another processor, so that only the sums of all counters are meaningful.
+ */
+static void
+kmem_update_stats(struct kmem_cache *cache, long nr_objs, long size)
+{
+    struct kmem_cpu_pool *cpu_pool;
+
+    thread_preempt_disable();
+    cpu_pool = kmem_cpu_pool_get(cache);
+    cpu_pool->nr_mem_objs += nr_objs;
+    cpu_pool->mem_req_size += size;
+    thread_preempt_enable();
 }
 
 static void
@@ -1258,8 +2369,8 @@ kmem_alloc_verify(struct kmem_cache *cache, void *buf, size_t size)
     memset(redzone, KMEM_REDZONE_BYTE, redzone_size);
 }
 
-void *
-kmem_alloc(size_t size)
+static __always_inline void *
+kmem_alloc_common(size_t size, const void *caller)
 {
     size_t index;
     void *buf;
@@ -1274,9 +2385,15 @@ kmem_alloc(size_t size)
         struct kmem_cache *cache;
 
         cache = &kmem_caches[index];
-        buf = kmem_cache_alloc(cache);
+        buf = kmem_cache_alloc_common(cache, caller);
+
+        if (buf == NULL) {
+            return NULL;
+        }
 
-        if ((buf != NULL) && (cache->flags & KMEM_CF_VERIFY)) {
+        kmem_update_stats(cache, 1, size);
+
+        if (cache->flags & KMEM_CF_VERIFY) {
             kmem_alloc_verify(cache, buf, size);
         }
     } else {
@@ -1286,12 +2403,18 @@ kmem_alloc(size_t size)
     return buf;
 }
 
+void *
+kmem_alloc(size_t size)
+{
+    return kmem_alloc_common(size, __builtin_return_address(0));
+}
+
 void *
 kmem_zalloc(size_t size)
 {
     void *ptr;
 
-    ptr = kmem_alloc(size);
+    ptr = kmem_alloc_common(size, __builtin_return_address(0));
 
     if (ptr == NULL) {
         return NULL;
@@ -1340,12 +2463,53 @@ kmem_free(void *ptr, size_t size)
             kmem_free_verify(cache, ptr, size);
         }
 
+        kmem_update_stats(cache, -1, -(long)size);
         kmem_cache_free(cache, ptr);
     } else {
         kmem_pagefree(ptr, size);
     }
 }
 
+/*
+ * Report the internal fragmentation of general caches, i.e. the share of
+ * allocated buffers not covered by the sizes passed to kmem_alloc().
+ *
+ * Counters are read without synchronization, and the results are only
+ * approximate.
+ */
+static void
+kmem_info_fragmentation(void)
+{
+    unsigned long nr_objs, req_size, alloc_size, frag;
+    struct kmem_cpu_pool *cpu_pool;
+    struct kmem_cache *cache;
+
+    printf("kmem: general          objs  requested  allocated  frag\n");
+
+    for (size_t i = 0; i < ARRAY_SIZE(kmem_caches); i++) {
+        cache = &kmem_caches[i];
+        nr_objs = 0;
+        req_size = 0;
+
+        for (unsigned int j = 0; j < cpu_count(); j++) {
+            cpu_pool = &cache->cpu_pools[j];
+            nr_objs += cpu_pool->nr_mem_objs;
+            req_size += cpu_pool->mem_req_size;
+        }
+
+        if (nr_objs == 0) {
+            continue;
+        }
+
+        alloc_size = nr_objs * cache->obj_size;
+        frag = (req_size < alloc_size)
+               ? ((alloc_size - req_size) * 100) / alloc_size
+               : 0;
+        printf("kmem: %-13s %8lu %9luk %9luk %4lu%%\n", cache->name, nr_objs,
+               req_size >> 10, alloc_size >> 10, frag);
+    }
+}
+
 void
 kmem_info(void)
 {
@@ -1353,6 +2517,7 @@ kmem_info(void)
     size_t total, total_physical, total_virtual;
     size_t mem_usage, mem_reclaim;
     struct kmem_cache *cache;
+    unsigned long nr_objs;
 
     total = 0;
     total_physical = 0;
@@ -1362,13 +2527,15 @@ kmem_info(void)
     total_reclaim_virtual = 0;
 
     printf("kmem: cache                  obj slab  bufs   objs   bufs "
-           "   total reclaimable\n"
+           "   total reclaimable  pool\n"
            "kmem: name                  size size /slab  usage  count "
-           "  memory      memory\n");
+           "  memory      memory  size\n");
 
     mutex_lock(&kmem_cache_list_lock);
 
     list_for_each_entry(&kmem_cache_list, cache, node) {
+        nr_objs = kmem_cache_nr_objs(cache);
+
         mutex_lock(&cache->lock);
 
         mem_usage = (cache->nr_slabs * cache->slab_size) >> 10;
@@ -1384,10 +2551,10 @@ kmem_info(void)
             total_reclaim_physical += mem_reclaim;
         }
 
-        printf("kmem: %-19s %6zu %3zuk  %4lu %6lu %6lu %7zuk %10zuk\n",
+        printf("kmem: %-19s %6zu %3zuk  %4lu %6lu %6lu %7zuk %10zuk %5d\n",
                cache->name, cache->obj_size, cache->slab_size >> 10,
-               cache->bufs_per_slab, cache->nr_objs, cache->nr_bufs,
-               mem_usage, mem_reclaim);
+               cache->bufs_per_slab, nr_objs, cache->nr_bufs,
+               mem_usage, mem_reclaim, cache->cpu_pool_size);
 
         mutex_unlock(&cache->lock);
     }
@@ -1398,4 +2565,6 @@ kmem_info(void)
            "reclaim: %zuk (phys: %zuk virt: %zuk)\n",
            total, total_physical, total_virtual,
            total_reclaim, total_reclaim_physical, total_reclaim_virtual);
+
+    kmem_info_fragmentation();
 }
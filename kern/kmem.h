@@ -71,6 +71,38 @@ void * kmem_cache_alloc(struct kmem_cache *cache);
  */
 void kmem_cache_free(struct kmem_cache *cache, void *obj);
 
+/*
+ * Allocate objects from a cache.
+ *
+ * On success, the given array is filled with nr_objs objects. The CPU pool
+ * is locked once for the whole batch, and objects are allocated directly
+ * from slabs when the pool runs out of them.
+ *
+ * Return 0 on success, ENOMEM if not all objects could be allocated, in
+ * which case no object is allocated.
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *cache, void **objs,
+                          size_t nr_objs);
+
+/*
+ * Release objects to their cache.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *cache, void **objs,
+                          size_t nr_objs);
+
+/*
+ * Release an object to its cache once all existing RCU read-side
+ * references are dropped.
+ *
+ * Objects are batched in per-processor arrays attached to the current
+ * RCU window, and whole arrays are released after the grace period. If
+ * no array can be allocated, this function waits for the grace period
+ * and releases the object immediately.
+ *
+ * This function may not be called from a read-side critical section.
+ */
+void kmem_cache_free_rcu(struct kmem_cache *cache, void *obj);
+
 /*
  * Display internal cache information.
  *
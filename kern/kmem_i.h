@@ -19,16 +19,39 @@
 #define KERN_KMEM_I_H
 
 #include <stdalign.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
+#include <kern/hlist_types.h>
 #include <kern/list.h>
 #include <kern/mutex.h>
 #include <machine/cpu.h>
+#include <machine/pmem.h>
+
+union kmem_bufctl;
+struct kmem_rcu_batch;
 
 /*
  * Per-processor cache of pre-constructed objects.
  *
+ * Each CPU pool owns a set of slabs. Objects are allocated from and released
+ * to owned slabs without taking the cache lock, which is only used to obtain
+ * new slabs and return free ones. Objects are released to the free list of
+ * the local CPU pool, whatever the owner of their slab, so that the slab
+ * doesn't need to be looked up on release. When releasing objects from its
+ * free list to their slabs, a CPU pool pushes those from slabs it doesn't
+ * own on the remote free list of the owning CPU pool, without locking. They
+ * are transferred to its free list the next time it's refilled or drained.
+ *
+ * The active member is set on every allocation and release, and cleared
+ * by the reaper, which completely drains pools that remain idle between
+ * two of its passes.
+ *
  * The flags member is a read-only CPU-local copy of the parent cache flags.
+ *
+ * The RCU batch members are only accessed on the local processor, with
+ * interrupts disabled.
  */
 struct kmem_cpu_pool {
     alignas(CPU_L1_SIZE) struct mutex lock;
@@ -36,7 +59,18 @@ struct kmem_cpu_pool {
     int size;
     int transfer_size;
     int nr_objs;
-    void **array;
+    bool active;
+    union kmem_bufctl *free_list;
+    struct list partial_slabs;
+    unsigned long nr_refs;  /* Number of buffers allocated from owned slabs */
+    unsigned long nr_mem_objs;  /* Objects allocated with kmem_alloc() */
+    unsigned long mem_req_size; /* Bytes requested with kmem_alloc() */
+#ifdef CONFIG_KMEM_PROFILE
+    unsigned int prof_countdown;    /* Allocations until the next sample */
+#endif /* CONFIG_KMEM_PROFILE */
+    struct kmem_rcu_batch *rcu_batch;   /* Valid if rcu_batch_wid is current */
+    unsigned int rcu_batch_wid;
+    alignas(CPU_L1_SIZE) union kmem_bufctl *remote_free_list;
 };
 
 /*
@@ -44,12 +78,16 @@ struct kmem_cpu_pool {
  * size. For small buffer sizes, many objects can be cached in a CPU pool.
  * Conversely, for large buffer sizes, this would incur much overhead, so only
  * a few objects are stored in a CPU pool.
+ *
+ * The size of CPU pools starts at the given default value, and is then
+ * adjusted at runtime within the given bounds, depending on the contention
+ * on the cache lock.
  */
 struct kmem_cpu_pool_type {
     size_t buf_size;
-    int array_size;
-    size_t array_align;
-    struct kmem_cache *array_cache;
+    int min_size;
+    int size;
+    int max_size;
 };
 
 /*
@@ -148,8 +186,64 @@ struct kmem_slab {
     unsigned long nr_refs;
     union kmem_bufctl *first_free;
     void *addr;
+    unsigned int cpu;   /* Owning CPU pool, valid if nr_refs != 0 */
+    unsigned int node_index;    /* Memory node of the slab pages */
+};
+
+#ifdef CONFIG_KMEM_PROFILE
+
+/*
+ * Allocation profiling.
+ *
+ * One out of KMEM_PROF_SAMPLE_RATE allocations from a CPU pool is sampled.
+ * Sampled objects are tracked in a hash table until they're released, and
+ * accounted to the call site that allocated them.
+ */
+#define KMEM_PROF_SAMPLE_RATE       32
+#define KMEM_PROF_SITES_ORDER       6
+#define KMEM_PROF_NR_SITES          (1 << KMEM_PROF_SITES_ORDER)
+#define KMEM_PROF_HTABLE_ORDER      6
+#define KMEM_PROF_HTABLE_SIZE       (1 << KMEM_PROF_HTABLE_ORDER)
+
+/*
+ * Call site of sampled allocations.
+ *
+ * A null caller denotes an unused entry. The value of nr_allocs at the
+ * time of the last report is kept to compute allocation rates.
+ */
+struct kmem_prof_site {
+    uintptr_t caller;
+    unsigned long nr_allocs;
+    unsigned long nr_allocs_snapshot;
+    unsigned long nr_live;
+};
+
+/*
+ * Descriptor of a sampled object.
+ */
+struct kmem_prof_obj {
+    struct hlist_node node;
+    void *obj;
+    struct kmem_prof_site *site;
 };
 
+/*
+ * Profiling data of a cache.
+ *
+ * The number of sampled objects may be read without locking, so that
+ * releasing objects is cheap while none is tracked.
+ */
+struct kmem_prof {
+    struct mutex lock;
+    unsigned long nr_objs;
+    unsigned long nr_dropped;   /* Samples lost because of a full table */
+    uint64_t snapshot_time;
+    struct kmem_prof_site sites[KMEM_PROF_NR_SITES];
+    struct hlist objs[KMEM_PROF_HTABLE_SIZE];
+};
+
+#endif /* CONFIG_KMEM_PROFILE */
+
 /*
  * Cache name buffer size.
  */
@@ -167,17 +261,20 @@ struct kmem_slab {
  * Cache of objects.
  *
  * Locking order : cpu_pool -> cache. CPU pools locking is ordered by CPU ID.
+ * Remote free lists are lock-free.
  */
 struct kmem_cache {
     /* CPU pool layer */
     struct kmem_cpu_pool cpu_pools[CONFIG_MAX_CPUS];
     struct kmem_cpu_pool_type *cpu_pool_type;
+    int cpu_pool_size;
+    unsigned long nr_contentions;   /* Since the last reaping pass */
+    unsigned int nr_quiet_reaps;    /* Passes without contention */
 
     /* Slab layer */
     struct mutex lock;
     struct list node;   /* Cache list linkage */
-    struct list partial_slabs;
-    struct list free_slabs;
+    struct list free_slabs[PMEM_MAX_NODES];
     int flags;
     size_t obj_size;    /* User-provided size */
     size_t align;
@@ -187,14 +284,18 @@ struct kmem_cache {
     size_t color;
     size_t color_max;
     unsigned long bufs_per_slab;
-    unsigned long nr_objs;  /* Number of allocated objects */
     unsigned long nr_bufs;  /* Total number of buffers */
     unsigned long nr_slabs;
     unsigned long nr_free_slabs;
+    unsigned long nr_node_slabs[PMEM_MAX_NODES];
     kmem_ctor_fn_t ctor;
     char name[KMEM_NAME_SIZE];
     size_t buftag_dist; /* Distance from buffer to buftag */
     size_t redzone_pad; /* Bytes from end of object to redzone word */
+
+#ifdef CONFIG_KMEM_PROFILE
+    struct kmem_prof prof;
+#endif /* CONFIG_KMEM_PROFILE */
 };
 
 #endif /* KERN_KMEM_I_H */
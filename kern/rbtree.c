@@ -144,9 +144,13 @@ rbtree_node_find_deepest(struct rbtree_node *node)
  *
  * The direction parameter defines the rotation direction and is either
  * RBTREE_LEFT or RBTREE_RIGHT.
+ *
+ * In augmented trees, the rotated subtree keeps the same nodes, so only
+ * the metadata of the two rotated nodes need to be updated, bottom-up.
  */
 static void
-rbtree_rotate(struct rbtree *tree, struct rbtree_node *node, int direction)
+rbtree_rotate(struct rbtree *tree, struct rbtree_node *node, int direction,
+              rbtree_update_fn_t update_fn)
 {
     struct rbtree_node *parent, *rnode;
     int left, right;
@@ -172,11 +176,17 @@ rbtree_rotate(struct rbtree *tree, struct rbtree_node *node, int direction)
     }
 
     rbtree_node_set_parent(node, rnode);
+
+    if (update_fn != NULL) {
+        update_fn(node);
+        update_fn(rnode);
+    }
 }
 
-void
-rbtree_insert_rebalance(struct rbtree *tree, struct rbtree_node *parent,
-                        int index, struct rbtree_node *node)
+static __always_inline void
+rbtree_insert_rebalance_common(struct rbtree *tree, struct rbtree_node *parent,
+                               int index, struct rbtree_node *node,
+                               rbtree_update_fn_t update_fn)
 {
     struct rbtree_node *grand_parent, *uncle;
     int left, right;
@@ -194,6 +204,10 @@ rbtree_insert_rebalance(struct rbtree *tree, struct rbtree_node *parent,
         parent->children[index] = node;
     }
 
+    if (update_fn != NULL) {
+        rbtree_propagate(node, update_fn);
+    }
+
     for (;;) {
         if (parent == NULL) {
             rbtree_node_set_black(node);
@@ -228,7 +242,7 @@ rbtree_insert_rebalance(struct rbtree *tree, struct rbtree_node *parent,
          * Node is the right child of its parent. Rotate left at parent.
          */
         if (parent->children[right] == node) {
-            rbtree_rotate(tree, parent, left);
+            rbtree_rotate(tree, parent, left, update_fn);
             parent = node;
         }
 
@@ -238,13 +252,30 @@ rbtree_insert_rebalance(struct rbtree *tree, struct rbtree_node *parent,
          */
         rbtree_node_set_black(parent);
         rbtree_node_set_red(grand_parent);
-        rbtree_rotate(tree, grand_parent, right);
+        rbtree_rotate(tree, grand_parent, right, update_fn);
         break;
     }
 
     assert(rbtree_node_is_black(tree->root));
 }
 
+void
+rbtree_insert_rebalance(struct rbtree *tree, struct rbtree_node *parent,
+                        int index, struct rbtree_node *node)
+{
+    rbtree_insert_rebalance_common(tree, parent, index, node, NULL);
+}
+
+void
+rbtree_insert_rebalance_augmented(struct rbtree *tree,
+                                  struct rbtree_node *parent, int index,
+                                  struct rbtree_node *node,
+                                  rbtree_update_fn_t update_fn)
+{
+    assert(update_fn != NULL);
+    rbtree_insert_rebalance_common(tree, parent, index, node, update_fn);
+}
+
 void *
 rbtree_replace_slot(struct rbtree *tree, rbtree_slot_t slot,
                     struct rbtree_node *node)
@@ -279,8 +310,9 @@ rbtree_replace_slot(struct rbtree *tree, rbtree_slot_t slot,
     return prev;
 }
 
-void
-rbtree_remove(struct rbtree *tree, struct rbtree_node *node)
+static __always_inline void
+rbtree_remove_common(struct rbtree *tree, struct rbtree_node *node,
+                     rbtree_update_fn_t update_fn)
 {
     struct rbtree_node *child, *parent, *brother;
     int color, left, right;
@@ -359,6 +391,10 @@ rbtree_remove(struct rbtree *tree, struct rbtree_node *node)
      * be NULL, in which case it is considered a black leaf.
      */
 update_color:
+    if ((update_fn != NULL) && (parent != NULL)) {
+        rbtree_propagate(parent, update_fn);
+    }
+
     if (color == RBTREE_COLOR_RED) {
         return;
     }
@@ -385,7 +421,7 @@ update_color:
         if (rbtree_node_is_red(brother)) {
             rbtree_node_set_black(brother);
             rbtree_node_set_red(parent);
-            rbtree_rotate(tree, parent, left);
+            rbtree_rotate(tree, parent, left, update_fn);
             brother = parent->children[right];
         }
 
@@ -411,7 +447,7 @@ update_color:
             || rbtree_node_is_black(brother->children[right])) {
             rbtree_node_set_black(brother->children[left]);
             rbtree_node_set_red(brother);
-            rbtree_rotate(tree, brother, right);
+            rbtree_rotate(tree, brother, right, update_fn);
             brother = parent->children[right];
         }
 
@@ -424,13 +460,36 @@ update_color:
         rbtree_node_set_color(brother, rbtree_node_color(parent));
         rbtree_node_set_black(parent);
         rbtree_node_set_black(brother->children[right]);
-        rbtree_rotate(tree, parent, left);
+        rbtree_rotate(tree, parent, left, update_fn);
         break;
     }
 
     assert((tree->root == NULL) || rbtree_node_is_black(tree->root));
 }
 
+void
+rbtree_remove(struct rbtree *tree, struct rbtree_node *node)
+{
+    rbtree_remove_common(tree, node, NULL);
+}
+
+void
+rbtree_remove_augmented(struct rbtree *tree, struct rbtree_node *node,
+                        rbtree_update_fn_t update_fn)
+{
+    assert(update_fn != NULL);
+    rbtree_remove_common(tree, node, update_fn);
+}
+
+void
+rbtree_propagate(struct rbtree_node *node, rbtree_update_fn_t update_fn)
+{
+    while (node != NULL) {
+        update_fn(node);
+        node = rbtree_node_parent(node);
+    }
+}
+
 struct rbtree_node *
 rbtree_nearest(struct rbtree_node *parent, int index, int direction)
 {
@@ -51,6 +51,13 @@ struct rbtree;
  */
 typedef uintptr_t rbtree_slot_t;
 
+/*
+ * Type for functions updating the metadata of a node in an augmented tree.
+ *
+ * See rbtree_insert_augmented().
+ */
+typedef void (*rbtree_update_fn_t)(struct rbtree_node *node);
+
 /*
  * Static tree initializer.
  */
@@ -305,6 +312,62 @@ void rbtree_remove(struct rbtree *tree, struct rbtree_node *node);
  */
 #define rbtree_next(node) rbtree_walk(node, RBTREE_RIGHT)
 
+/*
+ * Augmented trees.
+ *
+ * The nodes of an augmented tree carry metadata summarizing the subtree
+ * they root, e.g. the maximum value of some property of its nodes, which
+ * allows searches on that property in logarithmic time. The update function
+ * recomputes the metadata of a node from its own properties and the
+ * metadata of its children, which may be NULL.
+ *
+ * Augmented trees are looked up and walked with the regular functions,
+ * but nodes must be inserted and removed with the augmented variants,
+ * always passing the same update function. When a property of a node
+ * changes while it's in the tree, rbtree_propagate() must be called.
+ */
+
+/*
+ * Insert a node in an augmented tree.
+ *
+ * This macro behaves like rbtree_insert(), and also updates the metadata
+ * of the new node and of the nodes affected by the insertion.
+ */
+#define rbtree_insert_augmented(tree, node, cmp_fn, update_fn)     \
+MACRO_BEGIN                                                         \
+    struct rbtree_node *cur___, *prev___;                           \
+    int diff___, index___;                                          \
+                                                                    \
+    prev___ = NULL;                                                 \
+    index___ = -1;                                                  \
+    cur___ = (tree)->root;                                          \
+                                                                    \
+    while (cur___ != NULL) {                                        \
+        diff___ = cmp_fn(node, cur___);                             \
+        assert(diff___ != 0);                                       \
+        prev___ = cur___;                                           \
+        index___ = rbtree_d2i(diff___);                             \
+        cur___ = cur___->children[index___];                        \
+    }                                                               \
+                                                                    \
+    rbtree_insert_rebalance_augmented(tree, prev___, index___,      \
+                                      node, update_fn);             \
+MACRO_END
+
+/*
+ * Remove a node from an augmented tree.
+ *
+ * This function behaves like rbtree_remove(), and also updates the metadata
+ * of the nodes affected by the removal.
+ */
+void rbtree_remove_augmented(struct rbtree *tree, struct rbtree_node *node,
+                             rbtree_update_fn_t update_fn);
+
+/*
+ * Update the metadata of a node and of all its ancestors.
+ */
+void rbtree_propagate(struct rbtree_node *node, rbtree_update_fn_t update_fn);
+
 /*
  * Forge a loop to process all nodes of a tree, removing them when visited.
  *
@@ -152,6 +152,17 @@ rbtree_slot_index(rbtree_slot_t slot)
 void rbtree_insert_rebalance(struct rbtree *tree, struct rbtree_node *parent,
                              int index, struct rbtree_node *node);
 
+/*
+ * Insert a node in an augmented tree, rebalancing it if necessary.
+ *
+ * This function is intended to be used by the rbtree_insert_augmented()
+ * macro only.
+ */
+void rbtree_insert_rebalance_augmented(struct rbtree *tree,
+                                       struct rbtree_node *parent, int index,
+                                       struct rbtree_node *node,
+                                       rbtree_update_fn_t update_fn);
+
 /*
  * Return the previous or next node relative to a location in a tree.
  *
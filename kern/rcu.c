@@ -75,10 +75,17 @@
  * TODO Improve atomic acknowledgment scalability.
  * TODO Handle large amounts of deferred works.
  * TODO Priority boosting of slow readers.
- * TODO CPU registration for dyntick-friendly behavior.
+ *
+ * Processors may unregister, e.g. when idling, so that they don't need to
+ * regularly check the grace period state, as long as they have no deferred
+ * work. The number of acknowledgments expected on a grace period state
+ * change is the number of registered processors. A processor registering
+ * again synchronizes its local state with the global state without
+ * acknowledging it, since it wasn't accounted for.
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdalign.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -146,6 +153,7 @@ struct rcu_cpu_window {
  * Interrupts and preemption must be disabled when accessing local CPU data.
  */
 struct rcu_cpu_data {
+    bool registered;
     enum rcu_gp_state gp_state;
     unsigned int work_wid;
     unsigned int reader_wid;
@@ -196,7 +204,10 @@ struct rcu_window {
  * In addition to the global window ID and the windows themselves, the data
  * include a timer, used to trigger the end of windows, i.e. grace periods.
  * Since the timer function, atomic acknowledgments, and window no-reference
- * function chain each other, there is currently no need for a global lock.
+ * function chain each other, they don't need to be serialized with each
+ * other. The lock serializes grace period state changes with processor
+ * registration, so that the number of expected acknowledgments and the
+ * window ID match the set of registered processors.
  */
 struct rcu_data {
     struct {
@@ -206,6 +217,8 @@ struct rcu_data {
         alignas(CPU_L1_SIZE) unsigned int nr_acks;
     };
 
+    struct spinlock lock;
+    unsigned int nr_registered_cpus;
     unsigned int wid;
     struct rcu_window windows[2];
     struct timer timer;
@@ -264,6 +277,7 @@ rcu_data_get_window(struct rcu_data *data, unsigned int wid)
 static void
 rcu_data_update_gp_state(struct rcu_data *data, enum rcu_gp_state gp_state)
 {
+    spinlock_assert_locked(&data->lock);
     assert(data->nr_acks  == 0);
 
     switch (gp_state) {
@@ -280,7 +294,8 @@ rcu_data_update_gp_state(struct rcu_data *data, enum rcu_gp_state gp_state)
         panic("rcu: invalid grace period state");
     }
 
-    data->nr_acks = cpu_count();
+    assert(data->nr_registered_cpus != 0);
+    data->nr_acks = data->nr_registered_cpus;
     atomic_store(&data->gp_state, gp_state, ATOMIC_RELEASE);
 }
 
@@ -327,9 +342,13 @@ rcu_window_get_start_ts(const struct rcu_window *window)
 static void
 rcu_window_flush(struct sref_counter *counter)
 {
+    unsigned long flags;
+
     (void)counter;
 
+    spinlock_lock_intr_save(&rcu_data.lock, &flags);
     rcu_data_update_gp_state(&rcu_data, RCU_GP_STATE_WORK_FLUSH);
+    spinlock_unlock_intr_restore(&rcu_data.lock, flags);
 }
 
 static void __init
@@ -385,6 +404,7 @@ rcu_data_ack_cpu(struct rcu_data *data)
 {
     struct rcu_window *window;
     unsigned int prev_nr_acks;
+    unsigned long flags;
     uint64_t now;
 
     prev_nr_acks = atomic_fetch_sub(&data->nr_acks, 1, ATOMIC_ACQ_REL);
@@ -396,7 +416,9 @@ rcu_data_ack_cpu(struct rcu_data *data)
 
     switch (data->gp_state) {
     case RCU_GP_STATE_WORK_WINDOW_FLIP:
+        spinlock_lock_intr_save(&data->lock, &flags);
         rcu_data_update_gp_state(data, RCU_GP_STATE_READER_WINDOW_FLIP);
+        spinlock_unlock_intr_restore(&data->lock, flags);
         break;
     case RCU_GP_STATE_READER_WINDOW_FLIP:
         window = rcu_data_get_window(data, data->wid - 1);
@@ -416,6 +438,7 @@ static bool
 rcu_data_flip_windows(struct rcu_data *data)
 {
     struct rcu_window *window;
+    unsigned long flags;
 
     window = rcu_data_get_window(data, data->wid - 1);
 
@@ -425,8 +448,12 @@ rcu_data_flip_windows(struct rcu_data *data)
 
     rcu_window_start(window);
     syscnt_inc(&data->sc_nr_windows);
+
+    spinlock_lock_intr_save(&data->lock, &flags);
     data->wid++;
     rcu_data_update_gp_state(data, RCU_GP_STATE_WORK_WINDOW_FLIP);
+    spinlock_unlock_intr_restore(&data->lock, flags);
+
     return true;
 }
 
@@ -449,6 +476,8 @@ rcu_data_init(struct rcu_data *data)
 {
     data->gp_state = RCU_GP_STATE_WORK_FLUSH;
     data->nr_acks = 0;
+    spinlock_init(&data->lock);
+    data->nr_registered_cpus = 0;
     data->wid = RCU_WINDOW_ID_INIT_VALUE;
 
     for (size_t i = 0; i < ARRAY_SIZE(data->windows); i++) {
@@ -511,6 +540,8 @@ rcu_cpu_data_init(struct rcu_cpu_data *cpu_data, unsigned int cpu)
 
     data = &rcu_data;
 
+    cpu_data->registered = true;
+    data->nr_registered_cpus++;
     cpu_data->gp_state = rcu_data_get_gp_state(data);
     cpu_data->work_wid = rcu_data_get_wid(data);
     cpu_data->reader_wid = cpu_data->work_wid;
@@ -532,6 +563,22 @@ rcu_cpu_data_queue(struct rcu_cpu_data *cpu_data, struct work *work)
     rcu_cpu_window_queue(cpu_window, work);
 }
 
+static bool
+rcu_cpu_data_has_works(struct rcu_cpu_data *cpu_data)
+{
+    struct rcu_cpu_window *cpu_window;
+
+    for (size_t i = 0; i < ARRAY_SIZE(cpu_data->windows); i++) {
+        cpu_window = rcu_cpu_data_get_window_from_index(cpu_data, i);
+
+        if (work_queue_nr_works(&cpu_window->works) != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static void
 rcu_cpu_data_flush(struct rcu_cpu_data *cpu_data)
 {
@@ -694,10 +741,84 @@ rcu_report_context_switch(struct rcu_reader *reader)
 void
 rcu_report_periodic_event(void)
 {
+    struct rcu_cpu_data *cpu_data;
+
     assert(!cpu_intr_enabled());
     assert(!thread_preempt_enabled());
 
-    rcu_cpu_data_check_gp_state(rcu_get_cpu_data());
+    cpu_data = rcu_get_cpu_data();
+
+    if (!cpu_data->registered) {
+        return;
+    }
+
+    rcu_cpu_data_check_gp_state(cpu_data);
+}
+
+void
+rcu_register(void)
+{
+    struct rcu_cpu_data *cpu_data;
+    struct rcu_data *data;
+    unsigned int wid;
+
+    data = &rcu_data;
+    cpu_data = rcu_get_cpu_data();
+    assert(!cpu_data->registered);
+    assert(!rcu_cpu_data_has_works(cpu_data));
+
+    spinlock_lock(&data->lock);
+
+    /*
+     * Processors that are registered at a work window flip haven't
+     * necessarily flipped their reader window ID yet.
+     */
+    wid = rcu_data_get_wid(data);
+    cpu_data->gp_state = rcu_data_get_gp_state(data);
+    cpu_data->work_wid = wid;
+    cpu_data->reader_wid = (cpu_data->gp_state
+                            == RCU_GP_STATE_WORK_WINDOW_FLIP) ? wid - 1 : wid;
+    data->nr_registered_cpus++;
+
+    spinlock_unlock(&data->lock);
+
+    cpu_data->registered = true;
+}
+
+int
+rcu_unregister(void)
+{
+    struct rcu_cpu_data *cpu_data;
+    struct rcu_data *data;
+    int error;
+
+    data = &rcu_data;
+    cpu_data = rcu_get_cpu_data();
+    assert(cpu_data->registered);
+    assert(!rcu_reader_in_cs(thread_rcu_reader(thread_self())));
+
+    if (rcu_cpu_data_has_works(cpu_data)) {
+        return EBUSY;
+    }
+
+    spinlock_lock(&data->lock);
+
+    /*
+     * The number of expected acknowledgments includes this processor
+     * until it has acknowledged the current state.
+     */
+    if (cpu_data->gp_state != rcu_data_get_gp_state(data)) {
+        error = EBUSY;
+    } else {
+        assert(data->nr_registered_cpus > 1);
+        data->nr_registered_cpus--;
+        cpu_data->registered = false;
+        error = 0;
+    }
+
+    spinlock_unlock(&data->lock);
+
+    return error;
 }
 
 void
@@ -710,10 +831,21 @@ rcu_defer(struct work *work)
 
     thread_preempt_disable_intr_save(&flags);
     cpu_data = rcu_get_cpu_data();
+    assert(cpu_data->registered);
     rcu_cpu_data_queue(cpu_data, work);
     thread_preempt_enable_intr_restore(flags);
 }
 
+unsigned int
+rcu_get_work_wid(void)
+{
+    struct rcu_cpu_data *cpu_data;
+
+    cpu_data = rcu_get_cpu_data();
+    assert(cpu_data->registered);
+    return cpu_data->work_wid;
+}
+
 static void
 rcu_waiter_wakeup(struct work *work)
 {
@@ -119,6 +119,21 @@ void rcu_report_context_switch(struct rcu_reader *reader);
  */
 void rcu_report_periodic_event(void);
 
+/*
+ * Manage registration of the current processor.
+ *
+ * Registration is required for processors to take part in grace periods.
+ * All processors are initially registered. A processor may unregister
+ * only if it has acknowledged the current grace period state and has no
+ * deferred work, otherwise EBUSY is returned. While unregistered, a
+ * processor doesn't need to report periodic events, and it may not run
+ * read-side critical sections or defer works.
+ *
+ * Interrupts and preemption must be disabled when calling these functions.
+ */
+void rcu_register(void);
+int rcu_unregister(void);
+
 /*
  * Defer a work until all existing read-side references are dropped,
  * without blocking.
@@ -128,6 +143,16 @@ void rcu_report_periodic_event(void);
  */
 void rcu_defer(struct work *work);
 
+/*
+ * Return the ID of the local work window.
+ *
+ * All works deferred on the local processor while this ID doesn't change
+ * are scheduled when the same grace period ends.
+ *
+ * Interrupts and preemption must be disabled when calling this function.
+ */
+unsigned int rcu_get_work_wid(void);
+
 /*
  * Wait for all existing read-side references to be dropped.
  *
@@ -32,7 +32,6 @@
 #include <kern/rcu.h>
 #include <kern/rdxtree.h>
 #include <kern/rdxtree_i.h>
-#include <kern/work.h>
 
 /*
  * Mask applied on an entry to obtain its address.
@@ -91,16 +90,8 @@ typedef unsigned long long rdxtree_bm_t;
  * pointers so that they can be accessed from slots without conversion.
  */
 struct rdxtree_node {
-    union {
-        struct {
-            struct rdxtree_node *parent;
-            unsigned short index;
-        };
-
-        /* Deferred destruction when unlinked */
-        struct work work;
-    };
-
+    struct rdxtree_node *parent;
+    unsigned short index;
     unsigned short height;
     unsigned short nr_entries;
     rdxtree_bm_t alloc_bm;
@@ -156,17 +147,11 @@ rdxtree_node_create(struct rdxtree_node **nodep, unsigned short height)
         return ENOMEM;
     }
 
-    rdxtree_assert_alignment(node);
-    node->parent = NULL;
-    node->height = height;
-    *nodep = node;
-    return 0;
-}
-
-static void
-rdxtree_node_destroy(struct rdxtree_node *node)
-{
-    /* See rdxtree_shrink() */
+    /*
+     * Nodes destroyed while shrinking the tree are released with their
+     * first entry, which must remain valid for concurrent lookups until
+     * the end of the grace period. See rdxtree_shrink().
+     */
     if (node->nr_entries != 0) {
         assert(node->nr_entries == 1);
         assert(node->entries[0] != NULL);
@@ -175,25 +160,18 @@ rdxtree_node_destroy(struct rdxtree_node *node)
         node->alloc_bm = RDXTREE_BM_FULL;
     }
 
-    kmem_cache_free(&rdxtree_node_cache, node);
-}
-
-static void
-rdxtree_node_destroy_deferred(struct work *work)
-{
-    struct rdxtree_node *node;
-
-    node = structof(work, struct rdxtree_node, work);
-    rdxtree_node_destroy(node);
+    rdxtree_assert_alignment(node);
+    node->parent = NULL;
+    node->height = height;
+    *nodep = node;
+    return 0;
 }
 
 static void
 rdxtree_node_schedule_destruction(struct rdxtree_node *node)
 {
     assert(node->parent == NULL);
-
-    work_init(&node->work, rdxtree_node_destroy_deferred);
-    rcu_defer(&node->work);
+    kmem_cache_free_rcu(&rdxtree_node_cache, node);
 }
 
 static inline void
@@ -39,10 +39,15 @@ struct sleepq_bucket {
     struct hlist sleepqs;
 };
 
+/*
+ * The chain flag is set on the most recent waiter of a batch awaken on
+ * broadcast, which wakes up the next batch, if any.
+ */
 struct sleepq_waiter {
     struct list node;
     struct thread *thread;
     bool pending_wakeup;
+    bool chain;
 };
 
 /*
@@ -61,6 +66,11 @@ struct sleepq {
     struct sleepq *next_free;
 };
 
+/*
+ * Maximum number of threads awaken at once on broadcast.
+ */
+#define SLEEPQ_WAKEUP_BATCH_SIZE 16
+
 #define SLEEPQ_HTABLE_SIZE      128
 #define SLEEPQ_COND_HTABLE_SIZE 64
 
@@ -87,6 +97,7 @@ sleepq_waiter_init(struct sleepq_waiter *waiter, struct thread *thread)
 {
     waiter->thread = thread;
     waiter->pending_wakeup = false;
+    waiter->chain = false;
 }
 
 static bool
@@ -431,14 +442,66 @@ sleepq_remove_waiter(struct sleepq *sleepq, struct sleepq_waiter *waiter)
     list_remove(&waiter->node);
 }
 
+/*
+ * Return the waiter following the given one in a broadcast, i.e. the next
+ * most recent waiter, or NULL if it isn't pending for wake-up.
+ *
+ * Waiters already pending for wake-up belong to a more recent signal or
+ * broadcast, and terminate the batches of the given one.
+ */
 static struct sleepq_waiter *
-sleepq_get_last_waiter(struct sleepq *sleepq)
+sleepq_get_next_broadcast_waiter(struct sleepq *sleepq,
+                                 struct sleepq_waiter *waiter)
 {
-    if (list_empty(&sleepq->waiters)) {
+    struct list *node;
+
+    node = list_prev(&waiter->node);
+
+    if (list_end(&sleepq->waiters, node)) {
         return NULL;
     }
 
-    return list_last_entry(&sleepq->waiters, struct sleepq_waiter, node);
+    waiter = list_entry(node, struct sleepq_waiter, node);
+
+    if ((waiter == sleepq->oldest_waiter)
+        || sleepq_waiter_pending_wakeup(waiter)) {
+        return NULL;
+    }
+
+    return waiter;
+}
+
+/*
+ * Wake up a batch of waiters, starting with the given one, from the oldest
+ * to the most recent, so that remote run queues are interrupted as few
+ * times as possible.
+ */
+static void
+sleepq_wakeup_batch(struct sleepq *sleepq, struct sleepq_waiter *waiter)
+{
+    struct thread *threads[SLEEPQ_WAKEUP_BATCH_SIZE];
+    unsigned int nr_threads;
+
+    nr_threads = 0;
+
+    for (;;) {
+        sleepq_waiter_set_pending_wakeup(waiter);
+        threads[nr_threads] = waiter->thread;
+        nr_threads++;
+
+        if (nr_threads == ARRAY_SIZE(threads)) {
+            waiter->chain = true;
+            break;
+        }
+
+        waiter = sleepq_get_next_broadcast_waiter(sleepq, waiter);
+
+        if (waiter == NULL) {
+            break;
+        }
+    }
+
+    thread_wakeup_batch(threads, nr_threads);
 }
 
 bool
@@ -477,17 +540,19 @@ sleepq_wait_common(struct sleepq *sleepq, const char *wchan,
         }
     } while (!sleepq_waiter_pending_wakeup(&waiter));
 
-    sleepq_remove_waiter(sleepq, &waiter);
-
     /*
-     * Chain wake-ups here to prevent broadacasting from walking a list
-     * with preemption disabled. Note that this doesn't guard against
+     * Chain batches of wake-ups here to prevent broadcasting from walking
+     * a list with preemption disabled. Note that this doesn't guard against
      * the thundering herd effect for condition variables.
      */
-    next = sleepq_get_last_waiter(sleepq);
+    next = waiter.chain
+           ? sleepq_get_next_broadcast_waiter(sleepq, &waiter)
+           : NULL;
 
-    if (next) {
-        sleepq_waiter_wakeup(next);
+    sleepq_remove_waiter(sleepq, &waiter);
+
+    if (next != NULL) {
+        sleepq_wakeup_batch(sleepq, next);
     }
 
     return error;
@@ -536,6 +601,5 @@ sleepq_broadcast(struct sleepq *sleepq)
     }
 
     sleepq->oldest_waiter = NULL;
-    sleepq_waiter_set_pending_wakeup(waiter);
-    sleepq_waiter_wakeup(waiter);
+    sleepq_wakeup_batch(sleepq, waiter);
 }
@@ -93,6 +93,26 @@ syscnt_register(struct syscnt *syscnt, const char *name)
     mutex_unlock(&syscnt_lock);
 }
 
+struct syscnt *
+syscnt_lookup(const char *name)
+{
+    struct syscnt *syscnt;
+
+    mutex_lock(&syscnt_lock);
+
+    list_for_each_entry(&syscnt_list, syscnt, node) {
+        if (strcmp(syscnt->name, name) == 0) {
+            goto out;
+        }
+    }
+
+    syscnt = NULL;
+
+out:
+    mutex_unlock(&syscnt_lock);
+    return syscnt;
+}
+
 void
 syscnt_info(const char *prefix)
 {
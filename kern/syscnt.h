@@ -50,6 +50,16 @@ struct syscnt;
  */
 void syscnt_register(struct syscnt *syscnt, const char *name);
 
+/*
+ * Look up a counter by name.
+ *
+ * This allows reading counters private to other modules, e.g. to check
+ * their accounting from test modules.
+ *
+ * Return NULL if no such counter is registered.
+ */
+struct syscnt * syscnt_lookup(const char *name);
+
 #ifdef ATOMIC_HAVE_64B_OPS
 
 static inline void
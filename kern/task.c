@@ -255,7 +255,7 @@ task_info(struct task *task)
      */
     list_for_each_entry(&task->threads, thread, task_node) {
         printf(TASK_INFO_ADDR_FMT " %c %8s:" TASK_INFO_ADDR_FMT
-               " %.2s:%02hu %02u %s\n",
+               " %.2s:%02hu %02u %4zu/%4zu %s\n",
                (unsigned long)thread,
                thread_state_to_chr(thread),
                thread_wchan_desc(thread),
@@ -263,6 +263,8 @@ task_info(struct task *task)
                thread_sched_class_to_str(thread_user_sched_class(thread)),
                thread_user_priority(thread),
                thread_real_global_priority(thread),
+               thread_stack_usage(thread),
+               thread_stack_size(thread),
                thread->name);
     }
 
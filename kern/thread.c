@@ -54,20 +54,35 @@
  *
  * A few terms are used by both papers with slightly different meanings. Here
  * are the definitions used in this implementation :
- *  - The time unit is the system timer period (1 / tick frequency)
+ *  - The time unit is a fixed fraction of the system timer period
+ *    (1 / (tick frequency * THREAD_FS_UNITS_PER_TICK))
  *  - Work is the amount of execution time units consumed
  *  - Weight is the amount of execution time units allocated
  *  - A round is the shortest period during which all threads in a run queue
  *    consume their allocated time (i.e. their work reaches their weight)
  *
- * TODO Sub-tick accounting.
+ * Execution time is measured with the processor time stamp counter on every
+ * context switch and periodic event, instead of charging a whole tick to
+ * the thread that happens to be running when the timer interrupt occurs.
+ * Threads that sleep and wake up many times per tick are therefore charged
+ * for what they actually consume. The part of the execution time that is
+ * less than a time unit is kept per thread, and accounted later, so that
+ * no execution time is lost.
  *
- * TODO Setting affinity after thread creation.
+ * Load balancing takes the processor topology into account. Processors
+ * are grouped in scheduling domains, from processors sharing a core, to
+ * processors sharing a package, to the whole system, and each domain has
+ * its own highest round. Balancing is applied bottom-up, so that threads
+ * are preferably pulled from nearby processors, and large domains, the
+ * highest round of which is shared by many processors, are balanced less
+ * often.
  *
- * TODO Take into account the underlying CPU topology (and adjust load
- * balancing to access the global highest round less frequently on large
- * processor groups, perhaps by applying the load balancing algorithm in a
- * bottom-up fashion with one highest round per processor group).
+ * When the affinity of a thread is changed so that it may not run on its
+ * current processor any more, it's removed from its run queue and woken up
+ * again on an allowed processor. A thread running at that time is first
+ * preempted, and removed from its run queue once it has been descheduled,
+ * so that it's never moved while it's still running. In that case, it's
+ * the balancer thread of its previous processor that wakes it up.
  *
  * TODO For now, interactivity can not be experimented. The current strategy
  * is to always add threads in front of their group queue and track rounds
@@ -97,9 +112,11 @@
 #include <kern/init.h>
 #include <kern/kmem.h>
 #include <kern/list.h>
+#include <kern/log2.h>
 #include <kern/macros.h>
 #include <kern/panic.h>
 #include <kern/percpu.h>
+#include <kern/rbtree.h>
 #include <kern/rcu.h>
 #include <kern/shell.h>
 #include <kern/sleepq.h>
@@ -117,6 +134,7 @@
 #include <machine/tcb.h>
 #include <vm/vm_kmem.h>
 #include <vm/vm_map.h>
+#include <vm/vm_page.h>
 
 /*
  * Preemption level of a suspended thread.
@@ -141,9 +159,10 @@
  * The idle class is reserved for the per-CPU idle threads.
  */
 #define THREAD_SCHED_CLASS_RT   0
-#define THREAD_SCHED_CLASS_FS   1
-#define THREAD_SCHED_CLASS_IDLE 2
-#define THREAD_NR_SCHED_CLASSES 3
+#define THREAD_SCHED_CLASS_DL   1
+#define THREAD_SCHED_CLASS_FS   2
+#define THREAD_SCHED_CLASS_IDLE 3
+#define THREAD_NR_SCHED_CLASSES 4
 
 /*
  * Global priority bases for each scheduling class.
@@ -152,10 +171,11 @@
  * has the higher priority, and should only matter for priority
  * inheritance.
  *
- * In the current configuration, all fair-scheduling threads have the
- * same global priority.
+ * In the current configuration, all deadline threads have the same global
+ * priority, and so do all fair-scheduling threads.
  */
-#define THREAD_SCHED_GLOBAL_PRIO_RT     2
+#define THREAD_SCHED_GLOBAL_PRIO_RT     3
+#define THREAD_SCHED_GLOBAL_PRIO_DL     2
 #define THREAD_SCHED_GLOBAL_PRIO_FS     1
 #define THREAD_SCHED_GLOBAL_PRIO_IDLE   0
 
@@ -175,6 +195,69 @@
  */
 #define THREAD_IDLE_BALANCE_TICKS (CLOCK_FREQ / 2)
 
+/*
+ * Delay (in ticks) before attempting newly-idle balancing again after a
+ * failed attempt.
+ */
+#define THREAD_IDLE_PULL_BACKOFF_TICKS 1
+
+/*
+ * Number of buckets of scheduling latency histograms.
+ *
+ * Bucket 0 counts latencies below one microsecond, and bucket i latencies
+ * between 2^(i - 1) and 2^i microseconds, except for the last bucket,
+ * which also counts all larger latencies.
+ */
+#define THREAD_STATS_NR_BUCKETS 20
+
+/*
+ * Scheduling domain levels.
+ *
+ * Levels are sorted from the smallest to the largest domains.
+ */
+#define THREAD_DOMAIN_SMT       0
+#define THREAD_DOMAIN_PACKAGE   1
+#define THREAD_DOMAIN_SYSTEM    2
+#define THREAD_NR_DOMAINS       3
+
+/*
+ * Number of balancing attempts between two attempts at a given domain level,
+ * unless the run queue is idle.
+ *
+ * Migrating a thread between distant processors is more expensive, since
+ * its working set must be fetched again from farther levels of the memory
+ * hierarchy.
+ */
+#define THREAD_SMT_BALANCE_INTERVAL     1
+#define THREAD_PACKAGE_BALANCE_INTERVAL 2
+#define THREAD_SYSTEM_BALANCE_INTERVAL  4
+
+/*
+ * Highest round of a group of run queues.
+ *
+ * There can be moderate bouncing on this word so give it its own cache line.
+ */
+struct thread_fs_round {
+    alignas(CPU_L1_SIZE) unsigned long value;
+};
+
+/*
+ * Scheduling domain, as seen from a run queue.
+ *
+ * A domain is made of the processors sharing a topology level with the
+ * processor owning the run queue. Domains that wouldn't add any processor
+ * to their child domain are ignored, except for the system domain.
+ *
+ * The highest round of the system domain is the global highest round.
+ * For smaller domains, it is stored in the run queue of the first processor
+ * of the domain.
+ */
+struct thread_sched_domain {
+    struct cpumap cpumap;
+    unsigned long *highest_round;
+    unsigned int balance_interval;
+};
+
 /*
  * Run queue properties for real-time threads.
  */
@@ -183,6 +266,31 @@ struct thread_rt_runq {
     struct list threads[THREAD_SCHED_RT_PRIO_MAX + 1];
 };
 
+/*
+ * Fixed-point shift of deadline bandwidths, where 1 << THREAD_DL_BW_SHIFT
+ * is a whole processor.
+ */
+#define THREAD_DL_BW_SHIFT 20
+
+/*
+ * Maximum bandwidth which may be reserved by deadline threads on a
+ * processor, so that lower classes aren't completely starved.
+ */
+#define THREAD_DL_BW_MAX ((95UL << THREAD_DL_BW_SHIFT) / 100)
+
+/*
+ * Run queue properties for deadline threads.
+ *
+ * Threads are sorted by absolute deadline. Throttled threads have exhausted
+ * their runtime and wait for replenishment at their deadline. They remain
+ * in the run queue, i.e. they're counted in its number of threads.
+ */
+struct thread_dl_runq {
+    struct rbtree threads;
+    struct list throttled;
+    unsigned int nr_throttled;
+};
+
 /*
  * Initial value of the highest round.
  *
@@ -190,10 +298,34 @@ struct thread_rt_runq {
  */
 #define THREAD_FS_INITIAL_ROUND ((unsigned long)-10)
 
+/*
+ * Maximum number of threads on the run queue of a waker for it to be
+ * selected for the wakee, including the waker itself.
+ */
+#define THREAD_FS_WAKE_AFFINE_MAX_THREADS 1
+
+/*
+ * Maximum number of threads grouped by run queue when awaken as a batch.
+ */
+#define THREAD_WAKEUP_BATCH_SIZE 16
+
+/*
+ * States of the threads of a batch being awaken.
+ */
+#define THREAD_WAKEUP_BATCH_GROUPED 0   /* Added with its group */
+#define THREAD_WAKEUP_BATCH_SINGLE  1   /* Awaken alone */
+#define THREAD_WAKEUP_BATCH_PLACE   2   /* Running, added alone */
+#define THREAD_WAKEUP_BATCH_DONE    3
+
+/*
+ * Number of fair-scheduling time units per tick.
+ */
+#define THREAD_FS_UNITS_PER_TICK 64
+
 /*
  * Round slice base unit for fair-scheduling threads.
  */
-#define THREAD_FS_ROUND_SLICE_BASE (CLOCK_FREQ / 10)
+#define THREAD_FS_ROUND_SLICE_BASE ((CLOCK_FREQ / 10) * THREAD_FS_UNITS_PER_TICK)
 
 /*
  * Group of threads sharing the same weight.
@@ -238,6 +370,12 @@ struct thread_runq {
     /* Real-time related members */
     struct thread_rt_runq rt_runq;
 
+    /* Deadline related members */
+    struct thread_dl_runq dl_runq;
+
+    /* Bandwidth reserved by deadline threads, protected by thread_dl_lock */
+    unsigned long dl_bw;
+
     /*
      * Fair-scheduling related members.
      *
@@ -255,11 +393,52 @@ struct thread_runq {
     struct thread *balancer;
     struct thread *idler;
 
+    /* Time stamp counter value when execution time was last accounted */
+    uint64_t last_tsc;
+
+    /* Scheduling domains, from the smallest to the largest */
+    struct thread_sched_domain domains[THREAD_NR_DOMAINS];
+    unsigned int nr_domains;
+    unsigned int nr_balances;
+
+    /* Highest rounds of the domains this run queue is the first of */
+    struct thread_fs_round fs_domain_rounds[THREAD_NR_DOMAINS - 1];
+
     /* Ticks before the next balancing attempt when a run queue is idle */
     unsigned int idle_balance_ticks;
 
+    /* Time before which newly-idle balancing isn't attempted */
+    uint64_t idle_pull_time;
+
+    /* Threads to be migrated by the balancer because of their affinity */
+    struct list migrations;
+
+    /*
+     * Lock-free list of threads awaken by remote processors, added to this
+     * run queue by its own processor. The list has its own cache line so
+     * that remote wakers don't steal the one holding the lock.
+     */
+    alignas(CPU_L1_SIZE) struct thread *wakelist;
+
+    /*
+     * Histograms of the wake-up latencies, and of all the wait times of
+     * threads dispatched on this run queue.
+     */
+    unsigned long latency_hist[THREAD_STATS_NR_BUCKETS];
+    unsigned long wait_hist[THREAD_STATS_NR_BUCKETS];
+
     struct syscnt sc_schedule_intrs;
     struct syscnt sc_boosts;
+    struct syscnt sc_wakeups_affine;
+    struct syscnt sc_wakeups_non_affine;
+    struct syscnt sc_idle_pulls;
+    struct syscnt sc_wakelist_wakeups;
+    struct syscnt sc_dl_throttles;
+    struct syscnt sc_voluntary_switches;
+    struct syscnt sc_involuntary_switches;
+    struct syscnt sc_wakeups;
+    struct syscnt sc_wakeup_latency;
+    struct syscnt sc_wait;
 };
 
 /*
@@ -275,6 +454,8 @@ struct thread_sched_ops {
     void (*update_priority)(struct thread *thread, unsigned short priority);
     unsigned int (*get_global_priority)(unsigned short priority);
     void (*set_next)(struct thread_runq *runq, struct thread *thread);
+    void (*account)(struct thread_runq *runq, struct thread *thread,
+                    uint64_t cycles);
     void (*tick)(struct thread_runq *runq, struct thread *thread);
 };
 
@@ -288,19 +469,85 @@ static struct thread thread_booters[CONFIG_MAX_CPUS] __initdata;
 
 static struct kmem_cache thread_cache;
 
-#ifndef CONFIG_THREAD_STACK_GUARD
-static struct kmem_cache thread_stack_cache;
+#ifdef CONFIG_THREAD_STACK_GUARD
+
+/*
+ * Number of guarded stacks cached per processor.
+ */
+#define THREAD_STACK_CACHE_SIZE 8
+
+/*
+ * Per-processor cache of guarded stacks.
+ *
+ * Unmapping the guard pages of a new stack requires TLB shootdowns on all
+ * processors. Released stacks are cached with their guard pages still
+ * unmapped, so that they can be reused without any TLB invalidation. The
+ * lock is only contended when caches are drained by the vm_page shrinker.
+ */
+struct thread_stack_cache {
+    struct spinlock lock;
+    unsigned int nr_stacks;
+    void *stacks[THREAD_STACK_CACHE_SIZE];
+};
+
+static struct thread_stack_cache thread_stack_cache __percpu;
+
+static struct vm_page_shrinker thread_stack_shrinker;
+
+#else /* CONFIG_THREAD_STACK_GUARD */
+
+/*
+ * Number of stack caches, for sizes ranging from THREAD_STACK_MIN_SIZE
+ * to TCB_STACK_SIZE.
+ */
+#define THREAD_NR_STACK_CACHES 3
+
+static_assert((THREAD_STACK_MIN_SIZE << (THREAD_NR_STACK_CACHES - 1))
+              == TCB_STACK_SIZE, "invalid number of stack caches");
+
+static struct kmem_cache thread_stack_caches[THREAD_NR_STACK_CACHES];
+
 #endif /* CONFIG_THREAD_STACK_GUARD */
 
+/*
+ * Pattern used to fill stacks for high watermark measurements.
+ */
+#define THREAD_STACK_PATTERN 0x5a
+
+/*
+ * Stack sizes of the idler and balancer threads.
+ *
+ * These threads only run scheduler code, and interrupt handlers.
+ */
+#define THREAD_IDLER_STACK_SIZE     2048
+#define THREAD_BALANCER_STACK_SIZE  2048
+
+/*
+ * Memory used by thread stacks, and memory saved compared to stacks of
+ * the default size.
+ */
+static struct syscnt thread_sc_stack_bytes;
+static struct syscnt thread_sc_stack_saved_bytes;
+
 static const unsigned char thread_policy_table[THREAD_NR_SCHED_POLICIES] = {
     [THREAD_SCHED_POLICY_FIFO] = THREAD_SCHED_CLASS_RT,
     [THREAD_SCHED_POLICY_RR] = THREAD_SCHED_CLASS_RT,
     [THREAD_SCHED_POLICY_FS] = THREAD_SCHED_CLASS_FS,
+    [THREAD_SCHED_POLICY_DEADLINE] = THREAD_SCHED_CLASS_DL,
     [THREAD_SCHED_POLICY_IDLE] = THREAD_SCHED_CLASS_IDLE,
 };
 
 static const struct thread_sched_ops thread_sched_ops[THREAD_NR_SCHED_CLASSES];
 
+static bool thread_sched_fs_balance_idle(struct thread_runq *runq);
+
+/*
+ * Lock protecting the bandwidth reserved on run queues by deadline threads.
+ *
+ * It is always acquired with a run queue locked, after that run queue.
+ */
+static struct spinlock thread_dl_lock;
+
 /*
  * Map of run queues for which a processor is running.
  */
@@ -323,12 +570,20 @@ static struct cpumap thread_idle_runqs;
  *
  * There can be moderate bouncing on this word so give it its own cache line.
  */
-static struct {
-    alignas(CPU_L1_SIZE) volatile unsigned long value;
-} thread_fs_highest_round_struct;
+static struct thread_fs_round thread_fs_highest_round_struct;
 
 #define thread_fs_highest_round (thread_fs_highest_round_struct.value)
 
+/*
+ * Number of time stamp counter cycles per fair-scheduling time unit.
+ */
+static unsigned int thread_fs_unit_cycles __read_mostly;
+
+/*
+ * Number of time stamp counter cycles per microsecond.
+ */
+static unsigned int thread_stats_us_cycles __read_mostly;
+
 /*
  * Number of TSD keys actually allocated.
  */
@@ -410,6 +665,18 @@ thread_runq_init_rt(struct thread_runq *runq)
     }
 }
 
+static void __init
+thread_runq_init_dl(struct thread_runq *runq)
+{
+    struct thread_dl_runq *dl_runq;
+
+    dl_runq = &runq->dl_runq;
+    rbtree_init(&dl_runq->threads);
+    list_init(&dl_runq->throttled);
+    dl_runq->nr_throttled = 0;
+    runq->dl_bw = 0;
+}
+
 static void __init
 thread_fs_group_init(struct thread_fs_group *group)
 {
@@ -449,20 +716,55 @@ thread_runq_init(struct thread_runq *runq, unsigned int cpu,
                  struct thread *booter)
 {
     char name[SYSCNT_NAME_SIZE];
+    size_t i;
 
     spinlock_init(&runq->lock);
     runq->cpu = cpu;
     runq->nr_threads = 0;
     runq->current = booter;
     thread_runq_init_rt(runq);
+    thread_runq_init_dl(runq);
     thread_runq_init_fs(runq);
     runq->balancer = NULL;
     runq->idler = NULL;
+    runq->last_tsc = cpu_get_tsc();
+    runq->nr_domains = 0;
+    runq->nr_balances = 0;
+
+    for (i = 0; i < ARRAY_SIZE(runq->fs_domain_rounds); i++) {
+        runq->fs_domain_rounds[i].value = THREAD_FS_INITIAL_ROUND;
+    }
+
     runq->idle_balance_ticks = (unsigned int)-1;
+    runq->idle_pull_time = 0;
+    list_init(&runq->migrations);
+    runq->wakelist = NULL;
+    memset(runq->latency_hist, 0, sizeof(runq->latency_hist));
+    memset(runq->wait_hist, 0, sizeof(runq->wait_hist));
     snprintf(name, sizeof(name), "thread_schedule_intrs/%u", cpu);
     syscnt_register(&runq->sc_schedule_intrs, name);
     snprintf(name, sizeof(name), "thread_boosts/%u", cpu);
     syscnt_register(&runq->sc_boosts, name);
+    snprintf(name, sizeof(name), "thread_wakeups_affine/%u", cpu);
+    syscnt_register(&runq->sc_wakeups_affine, name);
+    snprintf(name, sizeof(name), "thread_wakeups_non_affine/%u", cpu);
+    syscnt_register(&runq->sc_wakeups_non_affine, name);
+    snprintf(name, sizeof(name), "thread_idle_pulls/%u", cpu);
+    syscnt_register(&runq->sc_idle_pulls, name);
+    snprintf(name, sizeof(name), "thread_wakelist_wakeups/%u", cpu);
+    syscnt_register(&runq->sc_wakelist_wakeups, name);
+    snprintf(name, sizeof(name), "thread_dl_throttles/%u", cpu);
+    syscnt_register(&runq->sc_dl_throttles, name);
+    snprintf(name, sizeof(name), "thread_voluntary_switches/%u", cpu);
+    syscnt_register(&runq->sc_voluntary_switches, name);
+    snprintf(name, sizeof(name), "thread_involuntary_switches/%u", cpu);
+    syscnt_register(&runq->sc_involuntary_switches, name);
+    snprintf(name, sizeof(name), "thread_wakeups/%u", cpu);
+    syscnt_register(&runq->sc_wakeups, name);
+    snprintf(name, sizeof(name), "thread_wakeup_latency/%u", cpu);
+    syscnt_register(&runq->sc_wakeup_latency, name);
+    snprintf(name, sizeof(name), "thread_wait/%u", cpu);
+    syscnt_register(&runq->sc_wait, name);
 }
 
 static inline struct thread_runq *
@@ -478,6 +780,108 @@ thread_runq_cpu(struct thread_runq *runq)
     return runq->cpu;
 }
 
+static bool
+thread_domain_shared(unsigned int level, unsigned int cpu1, unsigned int cpu2)
+{
+    switch (level) {
+    case THREAD_DOMAIN_SMT:
+        return cpu_core_id(cpu1) == cpu_core_id(cpu2);
+    case THREAD_DOMAIN_PACKAGE:
+        return cpu_package_id(cpu1) == cpu_package_id(cpu2);
+    case THREAD_DOMAIN_SYSTEM:
+        return true;
+    default:
+        panic("thread: invalid domain level");
+    }
+}
+
+static void __init
+thread_domain_init(struct thread_sched_domain *domain, unsigned int level,
+                   unsigned int cpu)
+{
+    static const unsigned int balance_intervals[THREAD_NR_DOMAINS] = {
+        [THREAD_DOMAIN_SMT] = THREAD_SMT_BALANCE_INTERVAL,
+        [THREAD_DOMAIN_PACKAGE] = THREAD_PACKAGE_BALANCE_INTERVAL,
+        [THREAD_DOMAIN_SYSTEM] = THREAD_SYSTEM_BALANCE_INTERVAL,
+    };
+
+    struct thread_runq *first_runq;
+    int i;
+
+    cpumap_zero(&domain->cpumap);
+
+    cpumap_for_each(&thread_active_runqs, i) {
+        if (thread_domain_shared(level, cpu, i)) {
+            cpumap_set(&domain->cpumap, i);
+        }
+    }
+
+    if (level == THREAD_DOMAIN_SYSTEM) {
+        domain->highest_round = &thread_fs_highest_round;
+    } else {
+        i = cpumap_find_first(&domain->cpumap);
+        assert(i >= 0);
+        first_runq = percpu_ptr(thread_runq, i);
+        domain->highest_round = &first_runq->fs_domain_rounds[level].value;
+    }
+
+    domain->balance_interval = balance_intervals[level];
+}
+
+static unsigned int __init
+thread_domain_nr_cpus(const struct thread_sched_domain *domain)
+{
+    unsigned int nr_cpus;
+    int i;
+
+    nr_cpus = 0;
+
+    cpumap_for_each(&domain->cpumap, i) {
+        nr_cpus++;
+    }
+
+    return nr_cpus;
+}
+
+/*
+ * Build the scheduling domains of a run queue.
+ *
+ * This function must be called on each processor once all processors have
+ * been started, so that their topology is known.
+ */
+static void __init
+thread_runq_setup_domains(struct thread_runq *runq)
+{
+    struct thread_sched_domain *domain;
+    unsigned int level, nr_cpus, prev_nr_cpus;
+
+    prev_nr_cpus = 1;
+
+    for (level = 0; level < THREAD_NR_DOMAINS; level++) {
+        domain = &runq->domains[runq->nr_domains];
+        thread_domain_init(domain, level, thread_runq_cpu(runq));
+        nr_cpus = thread_domain_nr_cpus(domain);
+
+        if (nr_cpus != prev_nr_cpus) {
+            runq->nr_domains++;
+            prev_nr_cpus = nr_cpus;
+        } else if (level == THREAD_DOMAIN_SYSTEM) {
+            /*
+             * The largest domain spans all processors, make it use the
+             * global highest round.
+             */
+            if (runq->nr_domains == 0) {
+                runq->nr_domains++;
+            } else {
+                runq->domains[runq->nr_domains - 1].highest_round
+                    = domain->highest_round;
+            }
+        }
+    }
+
+    assert(runq->nr_domains != 0);
+}
+
 static void
 thread_runq_add(struct thread_runq *runq, struct thread *thread)
 {
@@ -577,8 +981,39 @@ thread_runq_set_next(struct thread_runq *runq, struct thread *thread)
     atomic_store(&runq->current, thread, ATOMIC_RELAXED);
 }
 
+/*
+ * Charge the execution time elapsed since the last accounting to the
+ * current thread of a run queue.
+ */
 static void
-thread_runq_wakeup(struct thread_runq *runq, struct thread *thread)
+thread_runq_account(struct thread_runq *runq, struct thread *thread)
+{
+    const struct thread_sched_ops *ops;
+    uint64_t now, cycles;
+
+    assert(!cpu_intr_enabled());
+    spinlock_assert_locked(&runq->lock);
+    assert(thread == runq->current);
+
+    now = cpu_get_tsc();
+    cycles = now - runq->last_tsc;
+    runq->last_tsc = now;
+
+    ops = thread_get_real_sched_ops(thread);
+
+    if (ops->account != NULL) {
+        ops->account(runq, thread, cycles);
+    }
+}
+
+/*
+ * Add a thread being awaken to a run queue.
+ *
+ * Return true if the processor of the run queue must be interrupted so
+ * that it reschedules.
+ */
+static bool
+thread_runq_wakeup_common(struct thread_runq *runq, struct thread *thread)
 {
     assert(!cpu_intr_enabled());
     spinlock_assert_locked(&runq->lock);
@@ -586,102 +1021,344 @@ thread_runq_wakeup(struct thread_runq *runq, struct thread *thread)
 
     thread_runq_add(runq, thread);
 
-    if ((runq != thread_runq_local())
-        && thread_test_flag(runq->current, THREAD_YIELD)) {
+    return (runq != thread_runq_local())
+           && thread_test_flag(runq->current, THREAD_YIELD);
+}
+
+static void
+thread_runq_wakeup(struct thread_runq *runq, struct thread *thread)
+{
+    if (thread_runq_wakeup_common(runq, thread)) {
         cpu_send_thread_schedule(thread_runq_cpu(runq));
     }
 }
 
-static void
-thread_runq_wakeup_balancer(struct thread_runq *runq)
+static unsigned int
+thread_stats_get_bucket(uint64_t cycles)
 {
-    if (runq->balancer->state == THREAD_RUNNING) {
-        return;
+    unsigned int bucket;
+    uint64_t us;
+
+    us = cycles / thread_stats_us_cycles;
+
+    if (us == 0) {
+        return 0;
     }
 
-    thread_clear_wchan(runq->balancer);
-    runq->balancer->state = THREAD_RUNNING;
-    thread_runq_wakeup(runq, runq->balancer);
+    bucket = 64 - __builtin_clzll(us);
+    return MIN(bucket, THREAD_STATS_NR_BUCKETS - 1);
 }
 
+/*
+ * Record that a thread is awaken, so that its wake-up latency is
+ * accounted when it's dispatched.
+ */
 static void
-thread_runq_schedule_prepare(struct thread *thread)
+thread_stats_wakeup(struct thread *thread)
 {
-    pmap_load(thread->task->map->pmap);
+    struct thread_stats *stats;
+
+    stats = &thread->stats;
+    stats->wait_start = cpu_get_tsc();
+    stats->woken = true;
+    stats->nr_wakeups++;
 }
 
-static struct thread_runq *
-thread_runq_schedule(struct thread_runq *runq)
+/*
+ * Account a context switch on a run queue.
+ *
+ * The time of the switch is the last accounting time of the run queue.
+ * Since wake-ups may be recorded on other processors, time stamp counters
+ * are assumed to be synchronized, and negative wait times are ignored.
+ */
+static void
+thread_runq_stats_switch(struct thread_runq *runq, struct thread *prev,
+                         struct thread *next)
 {
-    struct thread *prev, *next;
+    struct thread_stats *stats;
+    uint64_t now, wait;
 
-    prev = thread_self();
-
-    assert((__builtin_frame_address(0) >= prev->stack)
-           && (__builtin_frame_address(0) < (prev->stack + TCB_STACK_SIZE)));
-    assert(prev->preempt_level == THREAD_SUSPEND_PREEMPT_LEVEL);
-    assert(!cpu_intr_enabled());
-    spinlock_assert_locked(&runq->lock);
-
-    thread_clear_flag(prev, THREAD_YIELD);
-    thread_runq_put_prev(runq, prev);
+    now = runq->last_tsc;
 
-    if (prev->state != THREAD_RUNNING) {
-        thread_runq_remove(runq, prev);
+    if (prev != runq->idler) {
+        stats = &prev->stats;
 
-        if ((runq->nr_threads == 0) && (prev != runq->balancer)) {
-            thread_runq_wakeup_balancer(runq);
+        if (prev->state == THREAD_RUNNING) {
+            stats->nr_involuntary_switches++;
+            stats->wait_start = now;
+            stats->woken = false;
+            syscnt_inc(&runq->sc_involuntary_switches);
+        } else {
+            stats->nr_voluntary_switches++;
+            syscnt_inc(&runq->sc_voluntary_switches);
         }
     }
 
-    next = thread_runq_get_next(runq);
-    assert((next != runq->idler) || (runq->nr_threads == 0));
-    assert(next->preempt_level == THREAD_SUSPEND_PREEMPT_LEVEL);
+    stats = &next->stats;
 
-    if (likely(prev != next)) {
-        rcu_report_context_switch(thread_rcu_reader(prev));
-        spinlock_transfer_owner(&runq->lock, next);
+    if (stats->wait_start == 0) {
+        return;
+    }
 
-        /*
-         * That's where the true context switch occurs. The next thread must
-         * unlock the run queue and reenable preemption. Note that unlocking
-         * and locking the run queue again is equivalent to a full memory
-         * barrier.
-         */
-        tcb_switch(&prev->tcb, &next->tcb);
+    wait = ((int64_t)(now - stats->wait_start) > 0)
+           ? (now - stats->wait_start)
+           : 0;
+    stats->wait_start = 0;
+    stats->wait_cycles += wait;
+    runq->wait_hist[thread_stats_get_bucket(wait)]++;
+    syscnt_add(&runq->sc_wait, wait);
 
-        /*
-         * The thread is dispatched on a processor once again.
-         *
-         * Keep in mind the system state may have changed a lot since this
-         * function was called. In particular :
-         *  - The next thread may have been destroyed, and must not be
-         *    referenced any more.
-         *  - The current thread may have been migrated to another processor.
-         */
-        barrier();
-        next = NULL;
-        runq = thread_runq_local();
+    if (!stats->woken) {
+        return;
+    }
 
-        thread_runq_schedule_prepare(prev);
-    } else {
-        next = NULL;
+    stats->latency_cycles += wait;
+
+    if (wait > stats->max_latency) {
+        stats->max_latency = wait;
     }
 
-    assert(prev->preempt_level == THREAD_SUSPEND_PREEMPT_LEVEL);
-    assert(!cpu_intr_enabled());
-    spinlock_assert_locked(&runq->lock);
-    return runq;
+    runq->latency_hist[thread_stats_get_bucket(wait)]++;
+    syscnt_inc(&runq->sc_wakeups);
+    syscnt_add(&runq->sc_wakeup_latency, wait);
 }
 
 static void
-thread_runq_double_lock(struct thread_runq *a, struct thread_runq *b)
+thread_runq_wakeup_balancer(struct thread_runq *runq)
 {
-    assert(!cpu_intr_enabled());
-    assert(!thread_preempt_enabled());
-    assert(a != b);
-
-    if (a->cpu < b->cpu) {
+    if (runq->balancer->state == THREAD_RUNNING) {
+        return;
+    }
+
+    thread_clear_wchan(runq->balancer);
+    runq->balancer->state = THREAD_RUNNING;
+    thread_stats_wakeup(runq->balancer);
+    thread_runq_wakeup(runq, runq->balancer);
+}
+
+/*
+ * Return true if a thread must leave its run queue because its affinity
+ * doesn't include the processor of that run queue, or because it's a
+ * deadline thread which bandwidth is reserved on another processor.
+ */
+static bool
+thread_runq_must_migrate(struct thread_runq *runq, struct thread *thread)
+{
+    unsigned int cpu;
+
+    if (thread->pin_level != 0) {
+        return false;
+    }
+
+    cpu = thread_runq_cpu(runq);
+
+    if ((thread_real_sched_class(thread) == THREAD_SCHED_CLASS_DL)
+        && (thread->dl_data.bw != 0)) {
+        return (cpu != thread->dl_data.cpu);
+    }
+
+    return !cpumap_test(&thread->cpumap, cpu);
+}
+
+/*
+ * Remove a thread from its run queue and queue it for migration.
+ *
+ * The thread must not be running, except if it's the current thread being
+ * descheduled.
+ */
+static void
+thread_runq_push_migration(struct thread_runq *runq, struct thread *thread)
+{
+    assert(thread != runq->balancer);
+
+    thread_runq_remove(runq, thread);
+    list_insert_tail(&runq->migrations, &thread->migration_node);
+}
+
+/*
+ * Wake up threads queued for migration on allowed processors.
+ *
+ * The run queue must be locked, and interrupts and preemption disabled when
+ * calling this function. Preemption must remain disabled when the lock is
+ * released, since the lock is temporarily released for each thread.
+ */
+static void
+thread_runq_migrate(struct thread_runq *runq)
+{
+    struct thread_runq *remote_runq;
+    struct thread *thread;
+
+    while (!list_empty(&runq->migrations)) {
+        thread = list_first_entry(&runq->migrations, struct thread,
+                                  migration_node);
+        list_remove(&thread->migration_node);
+        spinlock_unlock(&runq->lock);
+
+        assert(thread->state == THREAD_RUNNING);
+        assert(!thread->in_runq);
+
+        remote_runq = thread_get_real_sched_ops(thread)->select_runq(thread);
+        thread_runq_wakeup(remote_runq, thread);
+        spinlock_unlock(&remote_runq->lock);
+
+        spinlock_lock(&runq->lock);
+    }
+}
+
+/*
+ * Push a thread being awaken on the wake list of a remote run queue.
+ *
+ * Return true if the list was empty, in which case the processor of the
+ * run queue must be interrupted so that it drains the list.
+ */
+static bool
+thread_runq_push_wakelist(struct thread_runq *runq, struct thread *thread)
+{
+    struct thread *head, *prev;
+
+    assert(thread->state == THREAD_RUNNING);
+    assert(!thread->in_runq);
+
+    head = atomic_load(&runq->wakelist, ATOMIC_RELAXED);
+
+    for (;;) {
+        thread->wakelist_next = head;
+        prev = atomic_cas(&runq->wakelist, head, thread, ATOMIC_RELEASE);
+
+        if (prev == head) {
+            break;
+        }
+
+        head = prev;
+    }
+
+    return (head == NULL);
+}
+
+/*
+ * Add the threads of the wake list of the local run queue.
+ *
+ * Threads which affinity changed while they were on the list are queued
+ * for migration instead.
+ */
+static void
+thread_runq_drain_wakelist(struct thread_runq *runq)
+{
+    struct thread *thread, *next;
+
+    assert(!cpu_intr_enabled());
+    assert(runq == thread_runq_local());
+
+    thread = atomic_swap(&runq->wakelist, NULL, ATOMIC_ACQUIRE);
+
+    if (thread == NULL) {
+        return;
+    }
+
+    spinlock_lock(&runq->lock);
+
+    do {
+        next = thread->wakelist_next;
+
+        if (thread_runq_must_migrate(runq, thread)) {
+            list_insert_tail(&runq->migrations, &thread->migration_node);
+            thread_runq_wakeup_balancer(runq);
+        } else {
+            thread_runq_wakeup(runq, thread);
+        }
+
+        syscnt_inc(&runq->sc_wakelist_wakeups);
+        thread = next;
+    } while (thread != NULL);
+
+    spinlock_unlock(&runq->lock);
+}
+
+static void
+thread_runq_schedule_prepare(struct thread *thread)
+{
+    pmap_load(thread->task->map->pmap);
+}
+
+static struct thread_runq *
+thread_runq_schedule(struct thread_runq *runq)
+{
+    struct thread *prev, *next;
+
+    prev = thread_self();
+
+    assert((__builtin_frame_address(0) >= prev->stack)
+           && (__builtin_frame_address(0) < (prev->stack + prev->stack_size)));
+    assert(prev->preempt_level == THREAD_SUSPEND_PREEMPT_LEVEL);
+    assert(!cpu_intr_enabled());
+    spinlock_assert_locked(&runq->lock);
+
+    thread_clear_flag(prev, THREAD_YIELD);
+    thread_runq_account(runq, prev);
+    thread_runq_put_prev(runq, prev);
+
+    if (prev->state != THREAD_RUNNING) {
+        thread_runq_remove(runq, prev);
+
+        if ((runq->nr_threads == 0) && (prev != runq->balancer)
+            && !thread_sched_fs_balance_idle(runq)) {
+            thread_runq_wakeup_balancer(runq);
+        }
+    } else if (unlikely(thread_runq_must_migrate(runq, prev))) {
+        thread_runq_push_migration(runq, prev);
+        thread_runq_wakeup_balancer(runq);
+    }
+
+    next = thread_runq_get_next(runq);
+    assert((next != runq->idler)
+           || (runq->nr_threads == runq->dl_runq.nr_throttled));
+    assert(next->preempt_level == THREAD_SUSPEND_PREEMPT_LEVEL);
+
+    if (likely(prev != next)) {
+        thread_runq_stats_switch(runq, prev, next);
+        rcu_report_context_switch(thread_rcu_reader(prev));
+        spinlock_transfer_owner(&runq->lock, next);
+
+        /*
+         * That's where the true context switch occurs. The next thread must
+         * unlock the run queue and reenable preemption. Note that unlocking
+         * and locking the run queue again is equivalent to a full memory
+         * barrier.
+         */
+        tcb_switch(&prev->tcb, &next->tcb);
+
+        /*
+         * The thread is dispatched on a processor once again.
+         *
+         * Keep in mind the system state may have changed a lot since this
+         * function was called. In particular :
+         *  - The next thread may have been destroyed, and must not be
+         *    referenced any more.
+         *  - The current thread may have been migrated to another processor.
+         */
+        barrier();
+        next = NULL;
+        runq = thread_runq_local();
+
+        thread_runq_schedule_prepare(prev);
+    } else {
+        next = NULL;
+    }
+
+    assert(prev->preempt_level == THREAD_SUSPEND_PREEMPT_LEVEL);
+    assert(!cpu_intr_enabled());
+    spinlock_assert_locked(&runq->lock);
+    return runq;
+}
+
+static void
+thread_runq_double_lock(struct thread_runq *a, struct thread_runq *b)
+{
+    assert(!cpu_intr_enabled());
+    assert(!thread_preempt_enabled());
+    assert(a != b);
+
+    if (a->cpu < b->cpu) {
         spinlock_lock(&a->lock);
         spinlock_lock(&b->lock);
     } else {
@@ -691,9 +1368,8 @@ thread_runq_double_lock(struct thread_runq *a, struct thread_runq *b)
 }
 
 static struct thread_runq *
-thread_sched_rt_select_runq(struct thread *thread)
+thread_sched_rt_get_runq(const struct thread *thread)
 {
-    struct thread_runq *runq;
     int i;
 
     /*
@@ -704,7 +1380,15 @@ thread_sched_rt_select_runq(struct thread *thread)
     assert(i >= 0);
     assert(cpumap_test(&thread_active_runqs, i));
 
-    runq = percpu_ptr(thread_runq, i);
+    return percpu_ptr(thread_runq, i);
+}
+
+static struct thread_runq *
+thread_sched_rt_select_runq(struct thread *thread)
+{
+    struct thread_runq *runq;
+
+    runq = thread_sched_rt_get_runq(thread);
     spinlock_lock(&runq->lock);
     return runq;
 }
@@ -812,74 +1496,476 @@ thread_sched_rt_tick(struct thread_runq *runq, struct thread *thread)
     thread_set_flag(thread, THREAD_YIELD);
 }
 
-static inline unsigned short
-thread_sched_fs_prio2weight(unsigned short priority)
+/*
+ * Deadline threads are partitioned, and may only run on the processor on
+ * which their bandwidth is reserved.
+ *
+ * Threads without reserved bandwidth may only be in the deadline class
+ * because they inherited the priority of a deadline thread. Such threads
+ * are given the earliest possible deadline, and aren't subject to runtime
+ * enforcement, so that they release the resource they hold quickly.
+ */
+static struct thread_runq *
+thread_sched_dl_get_runq(const struct thread *thread)
 {
-    return ((priority + 1) * THREAD_FS_ROUND_SLICE_BASE);
+    if (thread->dl_data.bw == 0) {
+        return thread_sched_rt_get_runq(thread);
+    }
+
+    return percpu_ptr(thread_runq, thread->dl_data.cpu);
 }
 
 static struct thread_runq *
-thread_sched_fs_select_runq(struct thread *thread)
+thread_sched_dl_select_runq(struct thread *thread)
 {
-    struct thread_runq *runq, *tmp;
-    long delta;
-    int i;
+    struct thread_runq *runq;
 
-    cpumap_for_each(&thread_idle_runqs, i) {
-        if (!cpumap_test(&thread->cpumap, i)) {
-            continue;
-        }
+    runq = thread_sched_dl_get_runq(thread);
+    spinlock_lock(&runq->lock);
+    return runq;
+}
 
-        runq = percpu_ptr(thread_runq, i);
+static inline int
+thread_sched_dl_cmp_insert(struct rbtree_node *a, struct rbtree_node *b)
+{
+    struct thread *thread_a, *thread_b;
+    int64_t delta;
 
-        spinlock_lock(&runq->lock);
+    thread_a = rbtree_entry(a, struct thread, dl_data.node);
+    thread_b = rbtree_entry(b, struct thread, dl_data.node);
+    delta = (int64_t)(thread_a->dl_data.deadline - thread_b->dl_data.deadline);
 
-        /* The run queue really is idle, return it */
-        if (runq->current == runq->idler) {
-            goto out;
-        }
+    if (delta != 0) {
+        return (delta < 0) ? -1 : 1;
+    }
 
-        spinlock_unlock(&runq->lock);
+    return ((uintptr_t)thread_a < (uintptr_t)thread_b) ? -1 : 1;
+}
+
+/*
+ * Return true if the runtime of a waking thread must be replenished and
+ * its deadline reset, according to the constant bandwidth server rules,
+ * i.e. if its deadline has passed, or if using its remaining runtime
+ * before its deadline would exceed its bandwidth.
+ */
+static bool
+thread_sched_dl_must_reset(const struct thread_dl_data *dl_data, uint64_t now)
+{
+    uint64_t delta;
+
+    if ((int64_t)(dl_data->deadline - now) <= 0) {
+        return true;
     }
 
-    runq = NULL;
+    if (dl_data->runtime_left <= 0) {
+        return false;
+    }
 
-    cpumap_for_each(&thread_active_runqs, i) {
-        if (!cpumap_test(&thread->cpumap, i)) {
-            continue;
-        }
+    delta = dl_data->deadline - now;
+    return (((uint64_t)dl_data->runtime_left << THREAD_DL_BW_SHIFT)
+            > (dl_data->bw * delta));
+}
 
-        tmp = percpu_ptr(thread_runq, i);
+static void
+thread_sched_dl_reset(struct thread_dl_data *dl_data, uint64_t now)
+{
+    dl_data->deadline = now + dl_data->rel_deadline;
+    dl_data->runtime_left = dl_data->runtime;
+}
 
-        spinlock_lock(&tmp->lock);
+/*
+ * Replenish the runtime of a thread once its deadline is reached.
+ *
+ * The deadline is postponed by as many periods as necessary to pay for
+ * any overrun, unless it would still be in the past.
+ */
+static void
+thread_sched_dl_replenish(struct thread_dl_data *dl_data, uint64_t now)
+{
+    while (dl_data->runtime_left <= 0) {
+        dl_data->deadline += dl_data->period;
+        dl_data->runtime_left += dl_data->runtime;
+    }
 
-        if (runq == NULL) {
-            runq = tmp;
-            continue;
-        }
+    if ((int64_t)(dl_data->deadline - now) <= 0) {
+        thread_sched_dl_reset(dl_data, now);
+    }
+}
 
-        /* A run queue may have become idle */
-        if (tmp->current == tmp->idler) {
-            spinlock_unlock(&runq->lock);
-            runq = tmp;
-            goto out;
-        }
+static void
+thread_sched_dl_enqueue(struct thread_runq *runq, struct thread *thread)
+{
+    struct thread *current;
 
-        /*
-         * The run queue isn't idle, but there are no fair-scheduling thread,
-         * which means there are real-time threads.
-         */
-        if (tmp->fs_weight == 0) {
-            spinlock_unlock(&tmp->lock);
-            continue;
-        }
+    rbtree_insert(&runq->dl_runq.threads, &thread->dl_data.node,
+                  thread_sched_dl_cmp_insert);
 
-        delta = (long)(tmp->fs_round - runq->fs_round);
+    current = runq->current;
 
-        /* Look for the least loaded of the run queues in the highest round */
-        if ((delta > 0)
-            || ((delta == 0) && (tmp->fs_weight < runq->fs_weight))) {
-            spinlock_unlock(&runq->lock);
+    if ((thread_real_sched_class(current) > THREAD_SCHED_CLASS_DL)
+        || ((thread_real_sched_class(current) == THREAD_SCHED_CLASS_DL)
+            && ((int64_t)(thread->dl_data.deadline
+                          - current->dl_data.deadline) < 0))) {
+        thread_set_flag(current, THREAD_YIELD);
+    }
+}
+
+static void
+thread_sched_dl_throttle(struct thread_runq *runq, struct thread *thread)
+{
+    struct thread_dl_runq *dl_runq;
+
+    dl_runq = &runq->dl_runq;
+    list_insert_tail(&dl_runq->throttled, &thread->dl_data.throttled_node);
+    dl_runq->nr_throttled++;
+    thread->dl_data.throttled = true;
+    syscnt_inc(&runq->sc_dl_throttles);
+}
+
+static void
+thread_sched_dl_requeue(struct thread_runq *runq, struct thread *thread,
+                        uint64_t now)
+{
+    struct thread_dl_data *dl_data;
+
+    dl_data = &thread->dl_data;
+
+    if (dl_data->runtime_left <= 0) {
+        if ((int64_t)(dl_data->deadline - now) > 0) {
+            thread_sched_dl_throttle(runq, thread);
+            return;
+        }
+
+        thread_sched_dl_replenish(dl_data, now);
+    }
+
+    thread_sched_dl_enqueue(runq, thread);
+}
+
+static void
+thread_sched_dl_add(struct thread_runq *runq, struct thread *thread)
+{
+    uint64_t now;
+
+    now = cpu_get_tsc();
+
+    if (thread->dl_data.bw == 0) {
+        thread->dl_data.deadline = now;
+        thread->dl_data.runtime_left = INT64_MAX;
+    } else if (thread_sched_dl_must_reset(&thread->dl_data, now)) {
+        thread_sched_dl_reset(&thread->dl_data, now);
+    }
+
+    thread_sched_dl_requeue(runq, thread, now);
+}
+
+static void
+thread_sched_dl_remove(struct thread_runq *runq, struct thread *thread)
+{
+    struct thread_dl_data *dl_data;
+
+    dl_data = &thread->dl_data;
+
+    if (dl_data->throttled) {
+        list_remove(&dl_data->throttled_node);
+        runq->dl_runq.nr_throttled--;
+        dl_data->throttled = false;
+    } else {
+        rbtree_remove(&runq->dl_runq.threads, &dl_data->node);
+    }
+}
+
+static void
+thread_sched_dl_put_prev(struct thread_runq *runq, struct thread *thread)
+{
+    thread_sched_dl_requeue(runq, thread, cpu_get_tsc());
+}
+
+static struct thread *
+thread_sched_dl_get_next(struct thread_runq *runq)
+{
+    struct rbtree_node *node;
+    struct thread *thread;
+
+    node = rbtree_first(&runq->dl_runq.threads);
+
+    if (node == NULL) {
+        return NULL;
+    }
+
+    thread = rbtree_entry(node, struct thread, dl_data.node);
+    rbtree_remove(&runq->dl_runq.threads, node);
+    return thread;
+}
+
+static unsigned int
+thread_sched_dl_get_global_priority(unsigned short priority)
+{
+    (void)priority;
+    return THREAD_SCHED_GLOBAL_PRIO_DL;
+}
+
+static void
+thread_sched_dl_set_next(struct thread_runq *runq, struct thread *thread)
+{
+    thread_sched_dl_remove(runq, thread);
+}
+
+static void
+thread_sched_dl_account(struct thread_runq *runq, struct thread *thread,
+                        uint64_t cycles)
+{
+    (void)runq;
+
+    thread->dl_data.runtime_left -= (int64_t)cycles;
+}
+
+static void
+thread_sched_dl_tick(struct thread_runq *runq, struct thread *thread)
+{
+    (void)runq;
+
+    if (thread->dl_data.runtime_left <= 0) {
+        thread_set_flag(thread, THREAD_YIELD);
+    }
+}
+
+/*
+ * Replenish throttled threads which deadline has been reached.
+ *
+ * This function is called on each tick, so that runtime enforcement and
+ * replenishment have tick granularity.
+ */
+static void
+thread_sched_dl_replenish_throttled(struct thread_runq *runq)
+{
+    struct thread_dl_runq *dl_runq;
+    struct thread *thread, *tmp;
+    uint64_t now;
+
+    dl_runq = &runq->dl_runq;
+
+    if (dl_runq->nr_throttled == 0) {
+        return;
+    }
+
+    now = cpu_get_tsc();
+
+    list_for_each_entry_safe(&dl_runq->throttled, thread, tmp,
+                             dl_data.throttled_node) {
+        if ((int64_t)(thread->dl_data.deadline - now) > 0) {
+            continue;
+        }
+
+        thread_sched_dl_remove(runq, thread);
+        thread_sched_dl_replenish(&thread->dl_data, now);
+        thread_sched_dl_enqueue(runq, thread);
+    }
+}
+
+/*
+ * Reserve bandwidth for a deadline thread.
+ *
+ * The processor on which bandwidth is already reserved, if any, is tried
+ * first, so that changing parameters doesn't needlessly migrate the thread.
+ * On success, the previous reservation is released.
+ */
+static int
+thread_dl_reserve(struct thread *thread, unsigned long bw)
+{
+    struct thread_dl_data *dl_data;
+    struct thread_runq *runq;
+    unsigned long avail;
+    int i;
+
+    dl_data = &thread->dl_data;
+
+    spinlock_lock(&thread_dl_lock);
+
+    if (dl_data->bw != 0) {
+        runq = percpu_ptr(thread_runq, dl_data->cpu);
+
+        if (cpumap_test(&thread->cpumap, dl_data->cpu)
+            && ((runq->dl_bw - dl_data->bw + bw) <= THREAD_DL_BW_MAX)) {
+            runq->dl_bw += bw - dl_data->bw;
+            goto out;
+        }
+    }
+
+    cpumap_for_each(&thread_active_runqs, i) {
+        if (!cpumap_test(&thread->cpumap, i)) {
+            continue;
+        }
+
+        runq = percpu_ptr(thread_runq, i);
+        avail = THREAD_DL_BW_MAX - runq->dl_bw;
+
+        if (bw <= avail) {
+            if (dl_data->bw != 0) {
+                percpu_ptr(thread_runq, dl_data->cpu)->dl_bw -= dl_data->bw;
+            }
+
+            runq->dl_bw += bw;
+            dl_data->cpu = i;
+            goto out;
+        }
+    }
+
+    spinlock_unlock(&thread_dl_lock);
+    return EBUSY;
+
+out:
+    dl_data->bw = bw;
+    spinlock_unlock(&thread_dl_lock);
+    return 0;
+}
+
+static void
+thread_dl_release(struct thread *thread)
+{
+    struct thread_dl_data *dl_data;
+
+    dl_data = &thread->dl_data;
+
+    if (dl_data->bw == 0) {
+        return;
+    }
+
+    spinlock_lock(&thread_dl_lock);
+    percpu_ptr(thread_runq, dl_data->cpu)->dl_bw -= dl_data->bw;
+    dl_data->bw = 0;
+    spinlock_unlock(&thread_dl_lock);
+}
+
+static inline unsigned int
+thread_sched_fs_prio2weight(unsigned short priority)
+{
+    return ((priority + 1) * THREAD_FS_ROUND_SLICE_BASE);
+}
+
+/*
+ * Try to select a run queue sharing a cache with the previous processor
+ * of a thread being awaken, or with the waker.
+ *
+ * The previous run queue of the thread is selected if idle, since its
+ * cache is likely to contain the working set of the thread. Otherwise,
+ * the local run queue is selected if it shares the same package, and
+ * runs no other thread than the waker, since the waker is then likely to
+ * sleep soon, as is common in producer/consumer pipelines, and its cache
+ * contains the data it produced. The selected run queue is returned locked.
+ */
+static struct thread_runq *
+thread_sched_fs_select_affine_runq(struct thread *thread)
+{
+    struct thread_runq *runq, *prev_runq;
+    unsigned int cpu;
+
+    prev_runq = atomic_load(&thread->runq, ATOMIC_RELAXED);
+
+    if ((prev_runq != NULL)
+        && cpumap_test(&thread->cpumap, thread_runq_cpu(prev_runq))) {
+        spinlock_lock(&prev_runq->lock);
+
+        if (prev_runq->current == prev_runq->idler) {
+            return prev_runq;
+        }
+
+        spinlock_unlock(&prev_runq->lock);
+    }
+
+    runq = thread_runq_local();
+    cpu = thread_runq_cpu(runq);
+
+    if (!cpumap_test(&thread->cpumap, cpu)
+        || ((prev_runq != NULL)
+            && !thread_domain_shared(THREAD_DOMAIN_PACKAGE, cpu,
+                                     thread_runq_cpu(prev_runq)))) {
+        return NULL;
+    }
+
+    spinlock_lock(&runq->lock);
+
+    if ((runq->nr_threads <= THREAD_FS_WAKE_AFFINE_MAX_THREADS)
+        && (thread_real_sched_class(runq->current)
+            >= THREAD_SCHED_CLASS_FS)) {
+        return runq;
+    }
+
+    spinlock_unlock(&runq->lock);
+    return NULL;
+}
+
+static struct thread_runq *
+thread_sched_fs_select_runq(struct thread *thread)
+{
+    struct thread_runq *runq, *tmp;
+    long delta;
+    int i;
+
+    runq = thread_sched_fs_select_affine_runq(thread);
+
+    if (runq != NULL) {
+        syscnt_inc(&thread_runq_local()->sc_wakeups_affine);
+        return runq;
+    }
+
+    syscnt_inc(&thread_runq_local()->sc_wakeups_non_affine);
+
+    cpumap_for_each(&thread_idle_runqs, i) {
+        if (!cpumap_test(&thread->cpumap, i)) {
+            continue;
+        }
+
+        runq = percpu_ptr(thread_runq, i);
+
+        spinlock_lock(&runq->lock);
+
+        /* The run queue really is idle, return it */
+        if (runq->current == runq->idler) {
+            goto out;
+        }
+
+        spinlock_unlock(&runq->lock);
+    }
+
+    runq = NULL;
+
+    cpumap_for_each(&thread_active_runqs, i) {
+        if (!cpumap_test(&thread->cpumap, i)) {
+            continue;
+        }
+
+        tmp = percpu_ptr(thread_runq, i);
+
+        spinlock_lock(&tmp->lock);
+
+        if (runq == NULL) {
+            runq = tmp;
+            continue;
+        }
+
+        /* A run queue may have become idle */
+        if (tmp->current == tmp->idler) {
+            spinlock_unlock(&runq->lock);
+            runq = tmp;
+            goto out;
+        }
+
+        /*
+         * The run queue isn't idle, but there are no fair-scheduling thread,
+         * which means there are real-time threads.
+         */
+        if (tmp->fs_weight == 0) {
+            spinlock_unlock(&tmp->lock);
+            continue;
+        }
+
+        delta = (long)(tmp->fs_round - runq->fs_round);
+
+        /* Look for the least loaded of the run queues in the highest round */
+        if ((delta > 0)
+            || ((delta == 0) && (tmp->fs_weight < runq->fs_weight))) {
+            spinlock_unlock(&runq->lock);
             runq = tmp;
             continue;
         }
@@ -1000,18 +2086,71 @@ thread_sched_fs_restart(struct thread_runq *runq)
     }
 }
 
+/*
+ * Propagate the round of a run queue to the highest round of its domains.
+ *
+ * Since the highest round of a domain is normally never lower than the
+ * highest round of its child domains, propagation stops at the first
+ * domain that is already in the same or a later round. This keeps accesses
+ * to the highest round of large domains infrequent.
+ *
+ * The highest round of a domain is shared by all the run queues of the
+ * domain, and is only ever moved forward, using compare-and-swap so that
+ * concurrent updates can't move it backward.
+ */
+static void
+thread_sched_fs_update_highest_round(struct thread_runq *runq)
+{
+    struct thread_sched_domain *domain;
+    unsigned long round, prev;
+
+    for (unsigned int i = 0; i < runq->nr_domains; i++) {
+        domain = &runq->domains[i];
+        round = atomic_load(domain->highest_round, ATOMIC_RELAXED);
+
+        for (;;) {
+            if ((long)(runq->fs_round - round) <= 0) {
+                return;
+            }
+
+            prev = atomic_cas(domain->highest_round, round, runq->fs_round,
+                              ATOMIC_RELAXED);
+
+            if (prev == round) {
+                break;
+            }
+
+            round = prev;
+        }
+    }
+}
+
 static void
 thread_sched_fs_add(struct thread_runq *runq, struct thread *thread)
 {
     unsigned int total_weight;
 
     if (runq->fs_weight == 0) {
-        runq->fs_round = thread_fs_highest_round;
+        runq->fs_round = atomic_load(&thread_fs_highest_round, ATOMIC_RELAXED);
+
+        /* Don't leave the run queue ahead of its domains */
+        thread_sched_fs_update_highest_round(runq);
     }
 
     total_weight = runq->fs_weight + thread->fs_data.weight;
 
-    /* TODO Limit the maximum number of threads to prevent this situation */
+    /*
+     * TODO Limit the maximum number of threads to prevent this situation.
+     *
+     * Weights are expressed in time units, i.e. scaled by
+     * THREAD_FS_UNITS_PER_TICK, which divides the number of threads a run
+     * queue can hold before overflowing by the same factor. The weight of
+     * a thread is at most (THREAD_SCHED_FS_PRIO_MAX + 1) *
+     * THREAD_FS_ROUND_SLICE_BASE, i.e. 51200 with the default clock
+     * frequency, and 256000 with the highest one, so that overflow may
+     * occur with as few as 83887 and 16778 threads respectively, all at
+     * the highest priority.
+     */
     if (total_weight < runq->fs_weight) {
         panic("thread: weight overflow");
     }
@@ -1181,6 +2320,7 @@ thread_sched_fs_reset_priority(struct thread *thread, unsigned short priority)
     thread->fs_data.round = 0;
     thread->fs_data.weight = thread_sched_fs_prio2weight(priority);
     thread->fs_data.work = 0;
+    thread->fs_data.cycles = 0;
 }
 
 static void
@@ -1210,24 +2350,50 @@ thread_sched_fs_set_next(struct thread_runq *runq, struct thread *thread)
 }
 
 static void
-thread_sched_fs_tick(struct thread_runq *runq, struct thread *thread)
+thread_sched_fs_account(struct thread_runq *runq, struct thread *thread,
+                        uint64_t cycles)
 {
     struct thread_fs_runq *fs_runq;
     struct thread_fs_group *group;
+    unsigned int work;
 
-    fs_runq = runq->fs_runq_active;
-    fs_runq->work++;
+    assert(thread_fs_unit_cycles != 0);
+    assert(thread->fs_data.fs_runq == runq->fs_runq_active);
+
+    cycles += thread->fs_data.cycles;
+    thread->fs_data.cycles = cycles % thread_fs_unit_cycles;
+    cycles /= thread_fs_unit_cycles;
+
+    /*
+     * A thread can't consume more than its weight in a round. This can only
+     * be exceeded when preemption remains disabled for very long, in which
+     * case the excess is discarded.
+     */
+    work = thread->fs_data.weight - thread->fs_data.work;
+
+    if (cycles < work) {
+        work = cycles;
+    }
+
+    fs_runq = runq->fs_runq_active;
+    fs_runq->work += work;
     group = &fs_runq->group_array[thread_real_priority(thread)];
-    group->work++;
+    group->work += work;
+    thread->fs_data.work += work;
+}
+
+static void
+thread_sched_fs_tick(struct thread_runq *runq, struct thread *thread)
+{
+    (void)runq;
+
     thread_set_flag(thread, THREAD_YIELD);
-    thread->fs_data.work++;
 }
 
 static void
 thread_sched_fs_start_next_round(struct thread_runq *runq)
 {
     struct thread_fs_runq *tmp;
-    long delta;
 
     tmp = runq->fs_runq_expired;
     runq->fs_runq_expired = runq->fs_runq_active;
@@ -1235,12 +2401,7 @@ thread_sched_fs_start_next_round(struct thread_runq *runq)
 
     if (runq->fs_runq_active->nr_threads != 0) {
         runq->fs_round++;
-        delta = (long)(runq->fs_round - thread_fs_highest_round);
-
-        if (delta > 0) {
-            thread_fs_highest_round = runq->fs_round;
-        }
-
+        thread_sched_fs_update_highest_round(runq);
         thread_sched_fs_restart(runq);
     }
 }
@@ -1276,11 +2437,25 @@ thread_sched_fs_balance_eligible(struct thread_runq *runq,
     return 1;
 }
 
+/*
+ * Return true if the run queue of the given processor should be considered
+ * when balancing a domain, i.e. if it's not in the child domain, which has
+ * already been balanced.
+ */
+static bool
+thread_sched_fs_balance_candidate(const struct thread_sched_domain *child,
+                                  int cpu)
+{
+    return (child == NULL) || !cpumap_test(&child->cpumap, cpu);
+}
+
 /*
  * Try to find the most suitable run queue from which to pull threads.
  */
 static struct thread_runq *
 thread_sched_fs_balance_scan(struct thread_runq *runq,
+                             const struct thread_sched_domain *domain,
+                             const struct thread_sched_domain *child,
                              unsigned long highest_round)
 {
     struct thread_runq *remote_runq, *tmp;
@@ -1291,7 +2466,11 @@ thread_sched_fs_balance_scan(struct thread_runq *runq,
 
     thread_preempt_disable_intr_save(&flags);
 
-    cpumap_for_each(&thread_active_runqs, i) {
+    cpumap_for_each(&domain->cpumap, i) {
+        if (!thread_sched_fs_balance_candidate(child, i)) {
+            continue;
+        }
+
         tmp = percpu_ptr(thread_runq, i);
 
         if (tmp == runq) {
@@ -1425,35 +2604,115 @@ out:
 }
 
 /*
- * Inter-processor load balancing for fair-scheduling threads.
+ * Newly-idle balancing.
  *
- * Preemption must be disabled, and the local run queue must be locked when
- * calling this function. If balancing actually occurs, the lock will be
- * released and preemption enabled when needed.
+ * This function is called by the scheduler when the local run queue
+ * becomes empty, in an attempt to pull threads immediately instead of
+ * waiting for the balancer thread. Domains are scanned bottom-up for the
+ * most loaded eligible run queue. Since the local run queue lock can't be
+ * released at this point, remote run queues are only try-locked. After a
+ * failure, attempts are suspended for a short while, so that this path
+ * costs little on an idle system.
+ *
+ * Return true if threads could be pulled.
  */
-static void
-thread_sched_fs_balance(struct thread_runq *runq, unsigned long *flags)
+static bool
+thread_sched_fs_balance_idle(struct thread_runq *runq)
 {
-    struct thread_runq *remote_runq;
+    const struct thread_sched_domain *domain, *child;
+    struct thread_runq *remote_runq, *tmp;
     unsigned long highest_round;
-    unsigned int nr_migrations;
-    int i;
+    unsigned int nr_pulls;
+    uint64_t now;
+    int error, i;
 
-    /*
-     * Grab the highest round now and only use the copy so the value is stable
-     * during the balancing operation.
-     */
-    highest_round = thread_fs_highest_round;
+    assert(!cpu_intr_enabled());
+    spinlock_assert_locked(&runq->lock);
 
-    if ((runq->fs_round != highest_round)
-        && (runq->fs_runq_expired->nr_threads != 0)) {
-        goto no_migration;
+    now = clock_get_time();
+
+    if (!clock_time_occurred(runq->idle_pull_time, now)) {
+        return false;
     }
 
-    spinlock_unlock_intr_restore(&runq->lock, *flags);
-    thread_preempt_enable();
+    child = NULL;
+
+    for (unsigned int j = 0; j < runq->nr_domains; j++) {
+        domain = &runq->domains[j];
+        highest_round = atomic_load(domain->highest_round, ATOMIC_RELAXED);
+        remote_runq = NULL;
+
+        cpumap_for_each(&domain->cpumap, i) {
+            if (!thread_sched_fs_balance_candidate(child, i)) {
+                continue;
+            }
+
+            tmp = percpu_ptr(thread_runq, i);
+
+            if (tmp == runq) {
+                continue;
+            }
+
+            error = spinlock_trylock(&tmp->lock);
+
+            if (error) {
+                continue;
+            }
+
+            if (!thread_sched_fs_balance_eligible(tmp, highest_round)
+                || ((remote_runq != NULL)
+                    && (tmp->fs_weight <= remote_runq->fs_weight))) {
+                spinlock_unlock(&tmp->lock);
+                continue;
+            }
+
+            if (remote_runq != NULL) {
+                spinlock_unlock(&remote_runq->lock);
+            }
+
+            remote_runq = tmp;
+        }
 
-    remote_runq = thread_sched_fs_balance_scan(runq, highest_round);
+        if (remote_runq != NULL) {
+            nr_pulls = thread_sched_fs_balance_migrate(runq, remote_runq,
+                                                       highest_round);
+            spinlock_unlock(&remote_runq->lock);
+
+            if (nr_pulls != 0) {
+                runq->idle_pull_time = now;
+                syscnt_inc(&runq->sc_idle_pulls);
+                return true;
+            }
+        }
+
+        child = domain;
+    }
+
+    runq->idle_pull_time = now + THREAD_IDLE_PULL_BACKOFF_TICKS;
+    return false;
+}
+
+/*
+ * Balance the run queues of a domain which aren't part of the given child
+ * domain.
+ *
+ * Preemption must be enabled, and the local run queue must be unlocked when
+ * calling this function. If balancing actually occurs, the local run queue
+ * is locked and preemption disabled on return.
+ */
+static unsigned int
+thread_sched_fs_balance_domain(struct thread_runq *runq,
+                               const struct thread_sched_domain *domain,
+                               const struct thread_sched_domain *child,
+                               unsigned long highest_round,
+                               unsigned long *flags)
+{
+    struct thread_runq *remote_runq;
+    unsigned int nr_migrations;
+    int i;
+
+    remote_runq = thread_sched_fs_balance_scan(runq, domain, child,
+                                               highest_round);
 
     if (remote_runq != NULL) {
         thread_preempt_disable_intr_save(flags);
@@ -1463,7 +2722,7 @@ thread_sched_fs_balance(struct thread_runq *runq, unsigned long *flags)
         spinlock_unlock(&remote_runq->lock);
 
         if (nr_migrations != 0) {
-            return;
+            return nr_migrations;
         }
 
         spinlock_unlock_intr_restore(&runq->lock, *flags);
@@ -1476,7 +2735,11 @@ thread_sched_fs_balance(struct thread_runq *runq, unsigned long *flags)
      * be successfully pulled.
      */
 
-    cpumap_for_each(&thread_active_runqs, i) {
+    cpumap_for_each(&domain->cpumap, i) {
+        if (!thread_sched_fs_balance_candidate(child, i)) {
+            continue;
+        }
+
         remote_runq = percpu_ptr(thread_runq, i);
 
         if (remote_runq == runq) {
@@ -1490,26 +2753,103 @@ thread_sched_fs_balance(struct thread_runq *runq, unsigned long *flags)
         spinlock_unlock(&remote_runq->lock);
 
         if (nr_migrations != 0) {
-            return;
+            return nr_migrations;
         }
 
         spinlock_unlock_intr_restore(&runq->lock, *flags);
         thread_preempt_enable();
     }
 
-    thread_preempt_disable();
-    spinlock_lock_intr_save(&runq->lock, flags);
+    return 0;
+}
+
+/*
+ * Inter-processor load balancing for fair-scheduling threads.
+ *
+ * Domains are balanced bottom-up, and balancing stops as soon as threads
+ * could be pulled. Unless the local run queue has no fair-scheduling
+ * thread at all, large domains are only balanced once every few attempts.
+ *
+ * Preemption must be disabled, and the local run queue must be locked when
+ * calling this function. If balancing actually occurs, the lock will be
+ * released and preemption enabled when needed.
+ */
+static void
+thread_sched_fs_balance(struct thread_runq *runq, unsigned long *flags)
+{
+    const struct thread_sched_domain *domain, *child;
+    unsigned long highest_round;
+    unsigned int nr_migrations;
+    bool idle, skip, skipped;
+
+    idle = (runq->fs_weight == 0);
+    skip = !idle;
+    runq->nr_balances++;
+
+retry:
+    skipped = false;
+    child = NULL;
+
+    for (unsigned int i = 0; i < runq->nr_domains; i++) {
+        domain = &runq->domains[i];
+
+        /*
+         * Larger domains are balanced less often, unless the round is
+         * about to end, in which case they may contain threads that are
+         * still eligible for migration in the current round.
+         */
+        if (skip
+            && (runq->fs_runq_active->nr_threads != 0)
+            && ((runq->nr_balances % domain->balance_interval) != 0)) {
+            skipped = true;
+            continue;
+        }
+
+        /*
+         * Grab the highest round now and only use the copy so the value is
+         * stable during the balancing operation.
+         */
+        highest_round = atomic_load(domain->highest_round, ATOMIC_RELAXED);
+
+        /*
+         * Since the highest round of larger domains is never lower, there
+         * is no need to go further.
+         */
+        if ((runq->fs_round != highest_round)
+            && (runq->fs_runq_expired->nr_threads != 0)) {
+            break;
+        }
+
+        spinlock_unlock_intr_restore(&runq->lock, *flags);
+        thread_preempt_enable();
+
+        nr_migrations = thread_sched_fs_balance_domain(runq, domain, child,
+                                                       highest_round, flags);
+
+        if (nr_migrations != 0) {
+            return;
+        }
 
-no_migration:
+        thread_preempt_disable();
+        spinlock_lock_intr_save(&runq->lock, flags);
+        child = domain;
+    }
 
     /*
      * No thread could be migrated. Check the active run queue, as another
      * processor might have added threads while the balancer was running.
-     * If the run queue is still empty, switch to the next round. The run
-     * queue lock must remain held until the next scheduling decision to
-     * prevent a remote balancer thread from stealing active threads.
+     * If the run queue is still empty, switch to the next round, after
+     * checking the domains skipped because the run queue emptied during
+     * balancing. The run queue lock must remain held until the next
+     * scheduling decision to prevent a remote balancer thread from stealing
+     * active threads.
      */
     if (runq->fs_runq_active->nr_threads == 0) {
+        if (skipped) {
+            skip = false;
+            goto retry;
+        }
+
         thread_sched_fs_start_next_round(runq);
     }
 }
@@ -1570,8 +2910,22 @@ static const struct thread_sched_ops thread_sched_ops[THREAD_NR_SCHED_CLASSES]
         .update_priority = NULL,
         .get_global_priority = thread_sched_rt_get_global_priority,
         .set_next = thread_sched_rt_set_next,
+        .account = NULL,
         .tick = thread_sched_rt_tick,
     },
+    [THREAD_SCHED_CLASS_DL] = {
+        .select_runq = thread_sched_dl_select_runq,
+        .add = thread_sched_dl_add,
+        .remove = thread_sched_dl_remove,
+        .put_prev = thread_sched_dl_put_prev,
+        .get_next = thread_sched_dl_get_next,
+        .reset_priority = NULL,
+        .update_priority = NULL,
+        .get_global_priority = thread_sched_dl_get_global_priority,
+        .set_next = thread_sched_dl_set_next,
+        .account = thread_sched_dl_account,
+        .tick = thread_sched_dl_tick,
+    },
     [THREAD_SCHED_CLASS_FS] = {
         .select_runq = thread_sched_fs_select_runq,
         .add = thread_sched_fs_add,
@@ -1582,6 +2936,7 @@ static const struct thread_sched_ops thread_sched_ops[THREAD_NR_SCHED_CLASSES]
         .update_priority = thread_sched_fs_update_priority,
         .get_global_priority = thread_sched_fs_get_global_priority,
         .set_next = thread_sched_fs_set_next,
+        .account = thread_sched_fs_account,
         .tick = thread_sched_fs_tick,
     },
     [THREAD_SCHED_CLASS_IDLE] = {
@@ -1594,6 +2949,7 @@ static const struct thread_sched_ops thread_sched_ops[THREAD_NR_SCHED_CLASSES]
         .update_priority = NULL,
         .get_global_priority = thread_sched_idle_get_global_priority,
         .set_next = NULL,
+        .account = NULL,
         .tick = NULL,
     },
 };
@@ -1727,6 +3083,7 @@ INIT_OP_DEFINE(thread_setup_booter,
 static int __init
 thread_bootstrap(void)
 {
+    spinlock_init(&thread_dl_lock);
     cpumap_zero(&thread_active_runqs);
     cpumap_zero(&thread_idle_runqs);
 
@@ -1789,7 +3146,7 @@ thread_destroy_tsd(struct thread *thread)
 }
 
 static int
-thread_init(struct thread *thread, void *stack,
+thread_init(struct thread *thread, void *stack, size_t stack_size,
             const struct thread_attr *attr,
             void (*fn)(void *), void *arg)
 {
@@ -1831,6 +3188,9 @@ thread_init(struct thread *thread, void *stack,
     thread->intr_level = 0;
     rcu_reader_init(&thread->rcu_reader);
     cpumap_copy(&thread->cpumap, cpumap);
+    thread->dl_data.bw = 0;
+    thread->dl_data.throttled = false;
+    memset(&thread->stats, 0, sizeof(thread->stats));
     thread_set_user_sched_policy(thread, attr->policy);
     thread_set_user_sched_class(thread, thread_policy_to_class(attr->policy));
     thread_set_user_priority(thread, attr->priority);
@@ -1841,18 +3201,22 @@ thread_init(struct thread *thread, void *stack,
     thread->terminating = false;
     thread->task = task;
     thread->stack = stack;
+    thread->stack_size = stack_size;
     strlcpy(thread->name, attr->name, sizeof(thread->name));
 
     if (attr->flags & THREAD_ATTR_DETACHED) {
         thread->flags |= THREAD_DETACHED;
     }
 
-    error = tcb_build(&thread->tcb, stack, fn, arg);
+    memset(stack, THREAD_STACK_PATTERN, stack_size);
+    error = tcb_build(&thread->tcb, stack, stack_size, fn, arg);
 
     if (error) {
         goto error_tcb;
     }
 
+    syscnt_add(&thread_sc_stack_bytes, stack_size);
+    syscnt_add(&thread_sc_stack_saved_bytes, TCB_STACK_SIZE - stack_size);
     task_add_thread(task, thread);
 
     return 0;
@@ -1897,7 +3261,7 @@ thread_unlock_runq(struct thread_runq *runq, unsigned long flags)
 #include <vm/vm_page.h>
 
 static void *
-thread_alloc_stack(void)
+thread_create_stack(void)
 {
     struct vm_page *first_page, *last_page;
     phys_addr_t first_pa, last_pa;
@@ -1942,7 +3306,7 @@ thread_alloc_stack(void)
 }
 
 static void
-thread_free_stack(void *stack)
+thread_destroy_stack(void *stack)
 {
     size_t stack_size;
     void *va;
@@ -1952,22 +3316,171 @@ thread_free_stack(void *stack)
     vm_kmem_free(va, (PAGE_SIZE * 2) + stack_size);
 }
 
+static size_t
+thread_stack_round(size_t size)
+{
+    (void)size;
+    return TCB_STACK_SIZE;
+}
+
+static void *
+thread_alloc_stack(size_t size)
+{
+    struct thread_stack_cache *cache;
+    void *stack;
+
+    assert(size == TCB_STACK_SIZE);
+
+    thread_preempt_disable();
+    cache = cpu_local_ptr(thread_stack_cache);
+    spinlock_lock(&cache->lock);
+
+    if (cache->nr_stacks == 0) {
+        stack = NULL;
+    } else {
+        cache->nr_stacks--;
+        stack = cache->stacks[cache->nr_stacks];
+    }
+
+    spinlock_unlock(&cache->lock);
+    thread_preempt_enable();
+
+    if (stack != NULL) {
+        return stack;
+    }
+
+    return thread_create_stack();
+}
+
+static void
+thread_free_stack(void *stack, size_t size)
+{
+    struct thread_stack_cache *cache;
+
+    assert(size == TCB_STACK_SIZE);
+
+    thread_preempt_disable();
+    cache = cpu_local_ptr(thread_stack_cache);
+    spinlock_lock(&cache->lock);
+
+    if (cache->nr_stacks < ARRAY_SIZE(cache->stacks)) {
+        cache->stacks[cache->nr_stacks] = stack;
+        cache->nr_stacks++;
+        stack = NULL;
+    }
+
+    spinlock_unlock(&cache->lock);
+    thread_preempt_enable();
+
+    if (stack != NULL) {
+        thread_destroy_stack(stack);
+    }
+}
+
+static void
+thread_shrink_stack_caches(struct vm_page_shrinker *shrinker)
+{
+    void *stacks[THREAD_STACK_CACHE_SIZE];
+    struct thread_stack_cache *cache;
+    unsigned int nr_stacks;
+
+    (void)shrinker;
+
+    for (unsigned int cpu = 0; cpu < cpu_count(); cpu++) {
+        cache = percpu_ptr(thread_stack_cache, cpu);
+
+        spinlock_lock(&cache->lock);
+        nr_stacks = cache->nr_stacks;
+        memcpy(stacks, cache->stacks, nr_stacks * sizeof(stacks[0]));
+        cache->nr_stacks = 0;
+        spinlock_unlock(&cache->lock);
+
+        for (unsigned int i = 0; i < nr_stacks; i++) {
+            thread_destroy_stack(stacks[i]);
+        }
+    }
+}
+
+static void __init
+thread_setup_stack_caches(void)
+{
+    struct thread_stack_cache *cache;
+
+    for (unsigned int cpu = 0; cpu < cpu_count(); cpu++) {
+        cache = percpu_ptr(thread_stack_cache, cpu);
+        spinlock_init(&cache->lock);
+        cache->nr_stacks = 0;
+    }
+
+    vm_page_register_shrinker(&thread_stack_shrinker,
+                              thread_shrink_stack_caches);
+}
+
 #else /* CONFIG_THREAD_STACK_GUARD */
 
+static size_t
+thread_stack_round(size_t size)
+{
+    if (size < THREAD_STACK_MIN_SIZE) {
+        return THREAD_STACK_MIN_SIZE;
+    }
+
+    return 1UL << log2_order(size);
+}
+
+static struct kmem_cache *
+thread_stack_cache_get(size_t size)
+{
+    size_t index;
+
+    index = log2_order(size) - log2_order(THREAD_STACK_MIN_SIZE);
+    assert(index < ARRAY_SIZE(thread_stack_caches));
+    return &thread_stack_caches[index];
+}
+
 static void *
-thread_alloc_stack(void)
+thread_alloc_stack(size_t size)
 {
-    return kmem_cache_alloc(&thread_stack_cache);
+    return kmem_cache_alloc(thread_stack_cache_get(size));
 }
 
 static void
-thread_free_stack(void *stack)
+thread_free_stack(void *stack, size_t size)
+{
+    kmem_cache_free(thread_stack_cache_get(size), stack);
+}
+
+static void __init
+thread_setup_stack_caches(void)
 {
-    kmem_cache_free(&thread_stack_cache, stack);
+    char name[KMEM_NAME_SIZE];
+    size_t size;
+
+    for (size_t i = 0; i < ARRAY_SIZE(thread_stack_caches); i++) {
+        size = THREAD_STACK_MIN_SIZE << i;
+        snprintf(name, sizeof(name), "thread_stack_%zu", size);
+        kmem_cache_init(&thread_stack_caches[i], name, size,
+                        CPU_DATA_ALIGN, NULL, 0);
+    }
 }
 
 #endif /* CONFIG_THREAD_STACK_GUARD */
 
+size_t
+thread_stack_usage(const struct thread *thread)
+{
+    const unsigned char *ptr, *end;
+
+    ptr = thread->stack;
+    end = ptr + thread->stack_size;
+
+    while ((ptr < end) && (*ptr == THREAD_STACK_PATTERN)) {
+        ptr++;
+    }
+
+    return end - ptr;
+}
+
 static void
 thread_destroy(struct thread *thread)
 {
@@ -1980,7 +3493,10 @@ thread_destroy(struct thread *thread)
     thread_destroy_tsd(thread);
     turnstile_destroy(thread->priv_turnstile);
     sleepq_destroy(thread->priv_sleepq);
-    thread_free_stack(thread->stack);
+    syscnt_add(&thread_sc_stack_bytes, -(int64_t)thread->stack_size);
+    syscnt_add(&thread_sc_stack_saved_bytes,
+               -(int64_t)(TCB_STACK_SIZE - thread->stack_size));
+    thread_free_stack(thread->stack, thread->stack_size);
     tcb_cleanup(&thread->tcb);
     kmem_cache_free(&thread_cache, thread);
 }
@@ -2043,6 +3559,43 @@ thread_balance_idle_tick(struct thread_runq *runq)
     }
 }
 
+static uint64_t
+thread_balance_idle_time(struct thread_runq *runq, uint64_t now,
+                         uint64_t limit)
+{
+    uint64_t time;
+
+    if (runq->balancer == NULL) {
+        return limit;
+    }
+
+    time = now + runq->idle_balance_ticks;
+    return clock_time_expired(time, limit) ? time : limit;
+}
+
+/*
+ * Account ticks elapsed while the processor was idle without reporting
+ * periodic events.
+ *
+ * The last tick is left to the next periodic event, which wakes up the
+ * balancer thread if the run queue is still empty.
+ */
+static void
+thread_balance_idle_ticks(struct thread_runq *runq, uint64_t ticks)
+{
+    assert(runq->idle_balance_ticks != 0);
+
+    if (runq->balancer == NULL) {
+        return;
+    }
+
+    if (ticks >= runq->idle_balance_ticks) {
+        ticks = runq->idle_balance_ticks - 1;
+    }
+
+    runq->idle_balance_ticks -= ticks;
+}
+
 static void
 thread_balance(void *arg)
 {
@@ -2058,6 +3611,12 @@ thread_balance(void *arg)
     spinlock_lock_intr_save(&runq->lock, &flags);
 
     for (;;) {
+        /*
+         * Threads are queued for migration with the run queue locked, so
+         * checking here, right before sleeping, guarantees none is missed.
+         */
+        thread_runq_migrate(runq);
+
         runq->idle_balance_ticks = THREAD_IDLE_BALANCE_TICKS;
         thread_set_wchan(self, runq, "runq");
         self->state = THREAD_SLEEPING;
@@ -2096,6 +3655,7 @@ thread_setup_balancer(struct thread_runq *runq)
     thread_attr_set_cpumap(&attr, cpumap);
     thread_attr_set_policy(&attr, THREAD_SCHED_POLICY_FIFO);
     thread_attr_set_priority(&attr, THREAD_SCHED_RT_PRIO_MIN);
+    thread_attr_set_stack_size(&attr, THREAD_BALANCER_STACK_SIZE);
     error = thread_create(&balancer, &attr, thread_balance, runq);
     cpumap_destroy(cpumap);
 
@@ -2126,6 +3686,15 @@ thread_idle(void *arg)
                 break;
             }
 
+            /*
+             * Throttled deadline threads are replenished on ticks. They
+             * can't be throttled while the idle thread runs, so checking
+             * without locking is safe.
+             */
+            if (thread_runq_local()->dl_runq.nr_throttled == 0) {
+                clock_idle_enter();
+            }
+
             cpu_idle();
         }
 
@@ -2140,6 +3709,7 @@ thread_setup_idler(struct thread_runq *runq)
     struct thread_attr attr;
     struct thread *idler;
     struct cpumap *cpumap;
+    size_t stack_size;
     void *stack;
     int error;
 
@@ -2157,7 +3727,8 @@ thread_setup_idler(struct thread_runq *runq)
         panic("thread: unable to allocate idler thread");
     }
 
-    stack = thread_alloc_stack();
+    stack_size = thread_stack_round(THREAD_IDLER_STACK_SIZE);
+    stack = thread_alloc_stack(stack_size);
 
     if (stack == NULL) {
         panic("thread: unable to allocate idler thread stack");
@@ -2168,7 +3739,7 @@ thread_setup_idler(struct thread_runq *runq)
     thread_attr_init(&attr, name);
     thread_attr_set_cpumap(&attr, cpumap);
     thread_attr_set_policy(&attr, THREAD_SCHED_POLICY_IDLE);
-    error = thread_init(idler, stack, &attr, thread_idle, NULL);
+    error = thread_init(idler, stack, stack_size, &attr, thread_idle, NULL);
 
     if (error) {
         panic("thread: unable to initialize idler thread");
@@ -2247,29 +3818,145 @@ error:
     printf("thread: trace: %s\n", strerror(error));
 }
 
-static struct shell_cmd thread_shell_cmds[] = {
-    SHELL_CMD_INITIALIZER("thread_trace", thread_shell_trace,
-                          "thread_trace <task_name> <thread_name>",
-                          "display the stack trace of a given thread"),
-};
-
-static int __init
-thread_setup_shell(void)
+static uint64_t
+thread_stats_cycles_to_us(uint64_t cycles)
 {
-    SHELL_REGISTER_CMDS(thread_shell_cmds);
-    return 0;
+    return cycles / thread_stats_us_cycles;
 }
 
-INIT_OP_DEFINE(thread_setup_shell,
-               INIT_OP_DEP(printf_setup, true),
-               INIT_OP_DEP(shell_setup, true),
-               INIT_OP_DEP(task_setup, true),
-               INIT_OP_DEP(thread_setup, true));
-
-#endif /* CONFIG_SHELL */
-
-static void __init
-thread_setup_common(unsigned int cpu)
+static void
+thread_shell_sched_stats_runq(struct thread_runq *runq)
+{
+    unsigned long latency_hist[THREAD_STATS_NR_BUCKETS];
+    unsigned long wait_hist[THREAD_STATS_NR_BUCKETS];
+    unsigned long long nr_wakeups, latency;
+    unsigned long flags;
+    unsigned int i;
+
+    spinlock_lock_intr_save(&runq->lock, &flags);
+    memcpy(latency_hist, runq->latency_hist, sizeof(latency_hist));
+    memcpy(wait_hist, runq->wait_hist, sizeof(wait_hist));
+    spinlock_unlock_intr_restore(&runq->lock, flags);
+
+    nr_wakeups = syscnt_read(&runq->sc_wakeups);
+    latency = thread_stats_cycles_to_us(syscnt_read(&runq->sc_wakeup_latency));
+
+    printf("thread: cpu%u: switches: voluntary: %llu, involuntary: %llu\n"
+           "thread: cpu%u: wakeups: %llu, average latency: %lluus\n"
+           "        range (us)    latency       wait\n",
+           thread_runq_cpu(runq),
+           (unsigned long long)syscnt_read(&runq->sc_voluntary_switches),
+           (unsigned long long)syscnt_read(&runq->sc_involuntary_switches),
+           thread_runq_cpu(runq), nr_wakeups,
+           (nr_wakeups == 0) ? 0 : (latency / nr_wakeups));
+
+    printf("%8s %-8s %10lu %10lu\n", "0", "1",
+           latency_hist[0], wait_hist[0]);
+
+    for (i = 1; i < (THREAD_STATS_NR_BUCKETS - 1); i++) {
+        printf("%8lu %-8lu %10lu %10lu\n", 1UL << (i - 1), 1UL << i,
+               latency_hist[i], wait_hist[i]);
+    }
+
+    printf("%8lu %-8s %10lu %10lu\n", 1UL << (i - 1), "-",
+           latency_hist[i], wait_hist[i]);
+}
+
+static void
+thread_shell_sched_stats_thread(const char *task_name,
+                                const char *thread_name)
+{
+    unsigned long long latency;
+    struct thread_stats stats;
+    struct thread_runq *runq;
+    struct thread *thread;
+    unsigned long flags;
+    struct task *task;
+
+    task = task_lookup(task_name);
+
+    if (task == NULL) {
+        goto error;
+    }
+
+    thread = task_lookup_thread(task, thread_name);
+    task_unref(task);
+
+    if (thread == NULL) {
+        goto error;
+    }
+
+    runq = thread_lock_runq(thread, &flags);
+    stats = thread->stats;
+    thread_unlock_runq(runq, flags);
+
+    thread_unref(thread);
+
+    latency = thread_stats_cycles_to_us(stats.latency_cycles);
+
+    if (stats.nr_wakeups != 0) {
+        latency /= stats.nr_wakeups;
+    }
+
+    printf("thread: %s: switches: voluntary: %lu, involuntary: %lu\n"
+           "thread: %s: wakeups: %lu, average latency: %lluus, "
+           "max latency: %lluus, total wait: %lluus\n",
+           thread_name,
+           stats.nr_voluntary_switches, stats.nr_involuntary_switches,
+           thread_name, stats.nr_wakeups, latency,
+           (unsigned long long)thread_stats_cycles_to_us(stats.max_latency),
+           (unsigned long long)thread_stats_cycles_to_us(stats.wait_cycles));
+    return;
+
+error:
+    printf("thread: sched_stats: %s\n", strerror(ESRCH));
+}
+
+static void
+thread_shell_sched_stats(int argc, char *argv[])
+{
+    int cpu;
+
+    if (argc == 3) {
+        thread_shell_sched_stats_thread(argv[1], argv[2]);
+        return;
+    } else if (argc != 1) {
+        printf("thread: sched_stats: %s\n", strerror(EINVAL));
+        return;
+    }
+
+    cpumap_for_each(&thread_active_runqs, cpu) {
+        thread_shell_sched_stats_runq(percpu_ptr(thread_runq, cpu));
+    }
+}
+
+static struct shell_cmd thread_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER("thread_trace", thread_shell_trace,
+                          "thread_trace <task_name> <thread_name>",
+                          "display the stack trace of a given thread"),
+    SHELL_CMD_INITIALIZER("thread_sched_stats", thread_shell_sched_stats,
+                          "thread_sched_stats [<task_name> <thread_name>]",
+                          "display scheduling statistics of all processors,"
+                          " or of a given thread"),
+};
+
+static int __init
+thread_setup_shell(void)
+{
+    SHELL_REGISTER_CMDS(thread_shell_cmds);
+    return 0;
+}
+
+INIT_OP_DEFINE(thread_setup_shell,
+               INIT_OP_DEP(printf_setup, true),
+               INIT_OP_DEP(shell_setup, true),
+               INIT_OP_DEP(task_setup, true),
+               INIT_OP_DEP(thread_setup, true));
+
+#endif /* CONFIG_SHELL */
+
+static void __init
+thread_setup_common(unsigned int cpu)
 {
     assert(cpu != 0);
     cpumap_set(&thread_active_runqs, cpu);
@@ -2280,18 +3967,22 @@ thread_setup_common(unsigned int cpu)
 static int __init
 thread_setup(void)
 {
+    uint64_t unit_cycles;
     int cpu;
 
+    unit_cycles = cpu_get_freq() / (CLOCK_FREQ * THREAD_FS_UNITS_PER_TICK);
+    thread_fs_unit_cycles = (unit_cycles == 0) ? 1 : unit_cycles;
+    thread_stats_us_cycles = DIV_CEIL(cpu_get_freq(), 1000000);
+
     for (cpu = 1; (unsigned int)cpu < cpu_count(); cpu++) {
         thread_setup_common(cpu);
     }
 
     kmem_cache_init(&thread_cache, "thread", sizeof(struct thread),
                     CPU_L1_SIZE, NULL, 0);
-#ifndef CONFIG_THREAD_STACK_GUARD
-    kmem_cache_init(&thread_stack_cache, "thread_stack", TCB_STACK_SIZE,
-                    CPU_DATA_ALIGN, NULL, 0);
-#endif /* CONFIG_THREAD_STACK_GUARD */
+    thread_setup_stack_caches();
+    syscnt_register(&thread_sc_stack_bytes, "thread_stack_bytes");
+    syscnt_register(&thread_sc_stack_saved_bytes, "thread_stack_saved_bytes");
 
     cpumap_for_each(&thread_active_runqs, cpu) {
         thread_setup_runq(percpu_ptr(thread_runq, cpu));
@@ -2310,6 +4001,7 @@ thread_setup(void)
 #endif /* CONFIG_THREAD_STACK_GUARD */
 
 INIT_OP_DEFINE(thread_setup,
+               INIT_OP_DEP(cpu_setup, true),
                INIT_OP_DEP(cpumap_setup, true),
                INIT_OP_DEP(kmem_setup, true),
                INIT_OP_DEP(pmap_setup, true),
@@ -2326,168 +4018,478 @@ thread_ap_setup(void)
     tcb_set_current(&thread_booters[cpu_id()].tcb);
 }
 
-int
-thread_create(struct thread **threadp, const struct thread_attr *attr,
-              void (*fn)(void *), void *arg)
+int
+thread_create(struct thread **threadp, const struct thread_attr *attr,
+              void (*fn)(void *), void *arg)
+
+{
+    struct thread *thread;
+    size_t stack_size;
+    void *stack;
+    int error;
+
+    if (attr->policy == THREAD_SCHED_POLICY_DEADLINE) {
+        return EINVAL;
+    }
+
+    if (attr->cpumap != NULL) {
+        error = cpumap_check(attr->cpumap);
+
+        if (error) {
+            return error;
+        }
+    }
+
+    thread = kmem_cache_alloc(&thread_cache);
+
+    if (thread == NULL) {
+        error = ENOMEM;
+        goto error_thread;
+    }
+
+    stack_size = thread_stack_round(attr->stack_size);
+    stack = thread_alloc_stack(stack_size);
+
+    if (stack == NULL) {
+        error = ENOMEM;
+        goto error_stack;
+    }
+
+    error = thread_init(thread, stack, stack_size, attr, fn, arg);
+
+    if (error) {
+        goto error_init;
+    }
+
+    /*
+     * The new thread address must be written before the thread is started
+     * in case it's passed to it.
+     */
+    *threadp = thread;
+
+    thread_wakeup(thread);
+
+    return 0;
+
+error_init:
+    thread_free_stack(stack, stack_size);
+error_stack:
+    kmem_cache_free(&thread_cache, thread);
+error_thread:
+    return error;
+}
+
+static void
+thread_reap(struct work *work)
+{
+    struct thread_zombie *zombie;
+
+    zombie = structof(work, struct thread_zombie, work);
+    thread_join_common(zombie->thread);
+}
+
+void
+thread_exit(void)
+{
+    struct thread_zombie zombie;
+    struct thread_runq *runq;
+    struct thread *thread;
+    unsigned long flags;
+
+    thread = thread_self();
+
+    if (thread_test_flag(thread, THREAD_DETACHED)) {
+        zombie.thread = thread;
+
+        work_init(&zombie.work, thread_reap);
+        work_schedule(&zombie.work, 0);
+    }
+
+    /*
+     * Disable preemption before dropping the reference, as this may
+     * trigger the active state poll of the join operation. Doing so
+     * keeps the duration of that active wait minimum.
+     */
+    thread_preempt_disable();
+
+    thread_unref(thread);
+
+    runq = thread_runq_local();
+    spinlock_lock_intr_save(&runq->lock, &flags);
+
+    thread_dl_release(thread);
+    thread->state = THREAD_DEAD;
+
+    thread_runq_schedule(runq);
+    panic("thread: dead thread walking");
+}
+
+void
+thread_join(struct thread *thread)
+{
+    assert(!thread_test_flag(thread, THREAD_DETACHED));
+    thread_join_common(thread);
+}
+
+/*
+ * Set a sleeping thread in the running state.
+ *
+ * The run queue of the thread must be locked, unless the thread was never
+ * dispatched. Return EINVAL if the thread is already running.
+ */
+static int
+thread_wakeup_prepare_locked(struct thread *thread)
+{
+    if (thread->state == THREAD_RUNNING) {
+        return EINVAL;
+    }
+
+    thread_clear_wchan(thread);
+    thread->state = THREAD_RUNNING;
+    return 0;
+}
+
+/*
+ * Set a sleeping thread in the running state.
+ *
+ * Return EINVAL if the thread is NULL, the calling thread, or already
+ * running.
+ */
+static int
+thread_wakeup_prepare(struct thread *thread)
+{
+    struct thread_runq *runq;
+    unsigned long flags;
+    int error;
+
+    if ((thread == NULL) || (thread == thread_self())) {
+        return EINVAL;
+    }
+
+    /*
+     * There is at most one reference on threads that were never dispatched,
+     * in which case there is no need to lock anything.
+     */
+    if (thread->runq == NULL) {
+        assert(thread->state != THREAD_RUNNING);
+        error = thread_wakeup_prepare_locked(thread);
+    } else {
+        runq = thread_lock_runq(thread, &flags);
+        error = thread_wakeup_prepare_locked(thread);
+        thread_unlock_runq(runq, flags);
+    }
+
+    return error;
+}
+
+/*
+ * Select the run queue of a thread being awaken.
+ *
+ * Interrupts and preemption must be disabled when calling this function.
+ * The run queue is returned locked.
+ */
+static struct thread_runq *
+thread_wakeup_select_runq(struct thread *thread)
+{
+    struct thread_runq *runq;
+
+    if (thread->pin_level == 0) {
+        runq = thread_get_real_sched_ops(thread)->select_runq(thread);
+    } else {
+        /*
+         * This access doesn't need to be atomic, as the current thread is
+         * the only one which may update the member.
+         */
+        runq = thread->runq;
+        spinlock_lock(&runq->lock);
+    }
+
+    return runq;
+}
+
+/*
+ * Return the remote run queue on the wake list of which a thread being
+ * awaken should be pushed, or NULL if the thread must be added to a run
+ * queue synchronously.
+ *
+ * Pinned threads may only run on their current run queue. Fair-scheduling
+ * threads are pushed on their previous run queue if it's idle and has no
+ * pending wake-up, which is the preferred choice of wake-affine selection,
+ * determined here without locking. All other threads, including those
+ * which were never dispatched, go through the select_runq operation.
+ *
+ * Interrupts and preemption must be disabled when calling this function.
+ */
+static struct thread_runq *
+thread_wakeup_get_wakelist_runq(struct thread *thread)
+{
+    struct thread_runq *runq;
+    unsigned int cpu;
+
+    runq = atomic_load(&thread->runq, ATOMIC_RELAXED);
+
+    if ((runq == NULL) || (runq == thread_runq_local())) {
+        return NULL;
+    }
+
+    if (thread->pin_level != 0) {
+        return runq;
+    }
+
+    cpu = thread_runq_cpu(runq);
+
+    if ((thread_real_sched_class(thread) != THREAD_SCHED_CLASS_FS)
+        || !cpumap_test(&thread->cpumap, cpu)
+        || !cpumap_test(&thread_idle_runqs, cpu)
+        || (atomic_load(&runq->wakelist, ATOMIC_RELAXED) != NULL)) {
+        return NULL;
+    }
+
+    return runq;
+}
+
+/*
+ * Add a thread set in the running state to a run queue, or push it on the
+ * wake list of a remote run queue.
+ *
+ * Return the processor to interrupt so that it reschedules, or -1 if there
+ * is none.
+ *
+ * Interrupts and preemption must be disabled when calling this function.
+ */
+static int
+thread_wakeup_place(struct thread *thread)
+{
+    struct thread_runq *runq;
+    int cpu;
+
+    runq = thread_wakeup_get_wakelist_runq(thread);
+
+    if (runq != NULL) {
+        return thread_runq_push_wakelist(runq, thread)
+               ? (int)thread_runq_cpu(runq)
+               : -1;
+    }
+
+    runq = thread_wakeup_select_runq(thread);
+    cpu = thread_runq_wakeup_common(runq, thread)
+          ? (int)thread_runq_cpu(runq)
+          : -1;
+    spinlock_unlock(&runq->lock);
+    return cpu;
+}
+
+static int
+thread_wakeup_common(struct thread *thread, int error)
+{
+    unsigned long flags;
+    int ret, cpu;
+
+    ret = thread_wakeup_prepare(thread);
+
+    if (ret) {
+        return ret;
+    }
+
+    thread_preempt_disable_intr_save(&flags);
+
+    thread->wakeup_error = error;
+    thread_stats_wakeup(thread);
+    cpu = thread_wakeup_place(thread);
+
+    if (cpu >= 0) {
+        cpu_send_thread_schedule(cpu);
+    }
+
+    thread_preempt_enable_intr_restore(flags);
+
+    return 0;
+}
+
+int
+thread_wakeup(struct thread *thread)
+{
+    return thread_wakeup_common(thread, 0);
+}
+
+/*
+ * Return the run queue to which a thread awaken as part of a batch is
+ * added, if it can be determined without locking, or NULL if the thread
+ * must be awaken alone.
+ *
+ * Pinned threads may only run on their current run queue, and real-time
+ * and deadline threads run on a fixed processor. Fair-scheduling threads
+ * are added back to their previous run queue, where their working set is
+ * likely to be cached, without comparing the load of run queues, which
+ * couldn't account for the other threads of the batch. Imbalances are
+ * left to the balancer threads.
+ *
+ * Interrupts and preemption must be disabled when calling this function.
+ */
+static struct thread_runq *
+thread_wakeup_batch_get_runq(struct thread *thread)
+{
+    struct thread_runq *runq;
+
+    if ((thread == NULL) || (thread == thread_self())) {
+        return NULL;
+    }
 
-{
-    struct thread *thread;
-    void *stack;
-    int error;
+    runq = atomic_load(&thread->runq, ATOMIC_RELAXED);
 
-    if (attr->cpumap != NULL) {
-        error = cpumap_check(attr->cpumap);
+    if (thread->pin_level != 0) {
+        return runq;
+    }
 
-        if (error) {
-            return error;
+    switch (thread_real_sched_class(thread)) {
+    case THREAD_SCHED_CLASS_RT:
+        return thread_sched_rt_get_runq(thread);
+    case THREAD_SCHED_CLASS_DL:
+        return thread_sched_dl_get_runq(thread);
+    case THREAD_SCHED_CLASS_FS:
+        if ((runq == NULL)
+            || !cpumap_test(&thread->cpumap, thread_runq_cpu(runq))) {
+            return NULL;
         }
+
+        return runq;
+    default:
+        return NULL;
     }
+}
 
-    thread = kmem_cache_alloc(&thread_cache);
+/*
+ * Add a thread awaken as part of a batch to the locked run queue of its
+ * group.
+ *
+ * Since the run queue of the group is normally the run queue on which the
+ * thread went to sleep, setting the thread in the running state is done
+ * under the same lock.
+ *
+ * Return the new state of the batch entry of the thread.
+ */
+static unsigned int
+thread_wakeup_batch_add(struct thread_runq *runq, struct thread *thread,
+                        struct cpumap *cpus)
+{
+    struct thread_runq *prev_runq;
 
-    if (thread == NULL) {
-        error = ENOMEM;
-        goto error_thread;
-    }
+    spinlock_assert_locked(&runq->lock);
 
-    stack = thread_alloc_stack();
+    prev_runq = atomic_load(&thread->runq, ATOMIC_RELAXED);
 
-    if (stack == NULL) {
-        error = ENOMEM;
-        goto error_stack;
+    if ((prev_runq != NULL) && (prev_runq != runq)) {
+        return THREAD_WAKEUP_BATCH_SINGLE;
     }
 
-    error = thread_init(thread, stack, attr, fn, arg);
-
-    if (error) {
-        goto error_init;
+    if (thread_wakeup_prepare_locked(thread)) {
+        return THREAD_WAKEUP_BATCH_DONE;
     }
 
-    /*
-     * The new thread address must be written before the thread is started
-     * in case it's passed to it.
-     */
-    *threadp = thread;
+    thread->wakeup_error = 0;
+    thread_stats_wakeup(thread);
 
-    thread_wakeup(thread);
+    /* The affinity of the thread may have changed since it was grouped */
+    if (thread_runq_must_migrate(runq, thread)) {
+        return THREAD_WAKEUP_BATCH_PLACE;
+    }
 
-    return 0;
+    if (thread_runq_wakeup_common(runq, thread)) {
+        cpumap_set(cpus, thread_runq_cpu(runq));
+    }
 
-error_init:
-    thread_free_stack(stack);
-error_stack:
-    kmem_cache_free(&thread_cache, thread);
-error_thread:
-    return error;
+    return THREAD_WAKEUP_BATCH_DONE;
 }
 
+/*
+ * Wake up at most THREAD_WAKEUP_BATCH_SIZE threads.
+ *
+ * Threads are grouped by destination run queue, and each group is added
+ * to its run queue with a single lock acquisition. Threads which run queue
+ * can't be determined without locking are awaken alone.
+ */
 static void
-thread_reap(struct work *work)
+thread_wakeup_batch_chunk(struct thread **threads, unsigned int nr_threads,
+                          struct cpumap *cpus)
 {
-    struct thread_zombie *zombie;
+    struct thread_runq *runqs[THREAD_WAKEUP_BATCH_SIZE], *runq;
+    unsigned char states[THREAD_WAKEUP_BATCH_SIZE];
+    struct thread *thread;
+    int cpu;
 
-    zombie = structof(work, struct thread_zombie, work);
-    thread_join_common(zombie->thread);
-}
+    assert(nr_threads <= ARRAY_SIZE(runqs));
 
-void
-thread_exit(void)
-{
-    struct thread_zombie zombie;
-    struct thread_runq *runq;
-    struct thread *thread;
-    unsigned long flags;
+    for (unsigned int i = 0; i < nr_threads; i++) {
+        runqs[i] = thread_wakeup_batch_get_runq(threads[i]);
+        states[i] = (runqs[i] == NULL)
+                    ? THREAD_WAKEUP_BATCH_SINGLE
+                    : THREAD_WAKEUP_BATCH_GROUPED;
+    }
 
-    thread = thread_self();
+    for (unsigned int i = 0; i < nr_threads; i++) {
+        if (states[i] != THREAD_WAKEUP_BATCH_GROUPED) {
+            continue;
+        }
 
-    if (thread_test_flag(thread, THREAD_DETACHED)) {
-        zombie.thread = thread;
+        runq = runqs[i];
+        spinlock_lock(&runq->lock);
 
-        work_init(&zombie.work, thread_reap);
-        work_schedule(&zombie.work, 0);
+        for (unsigned int j = i; j < nr_threads; j++) {
+            if ((states[j] == THREAD_WAKEUP_BATCH_GROUPED)
+                && (runqs[j] == runq)) {
+                states[j] = thread_wakeup_batch_add(runq, threads[j], cpus);
+            }
+        }
+
+        spinlock_unlock(&runq->lock);
     }
 
-    /*
-     * Disable preemption before dropping the reference, as this may
-     * trigger the active state poll of the join operation. Doing so
-     * keeps the duration of that active wait minimum.
-     */
-    thread_preempt_disable();
+    for (unsigned int i = 0; i < nr_threads; i++) {
+        thread = threads[i];
 
-    thread_unref(thread);
+        if (states[i] == THREAD_WAKEUP_BATCH_SINGLE) {
+            if (thread_wakeup_prepare(thread)) {
+                continue;
+            }
 
-    runq = thread_runq_local();
-    spinlock_lock_intr_save(&runq->lock, &flags);
+            thread->wakeup_error = 0;
+            thread_stats_wakeup(thread);
+        } else if (states[i] != THREAD_WAKEUP_BATCH_PLACE) {
+            continue;
+        }
 
-    thread->state = THREAD_DEAD;
+        cpu = thread_wakeup_place(thread);
 
-    thread_runq_schedule(runq);
-    panic("thread: dead thread walking");
+        if (cpu >= 0) {
+            cpumap_set(cpus, cpu);
+        }
+    }
 }
 
 void
-thread_join(struct thread *thread)
-{
-    assert(!thread_test_flag(thread, THREAD_DETACHED));
-    thread_join_common(thread);
-}
-
-static int
-thread_wakeup_common(struct thread *thread, int error)
+thread_wakeup_batch(struct thread **threads, unsigned int nr_threads)
 {
-    struct thread_runq *runq;
+    struct cpumap cpus;
     unsigned long flags;
+    unsigned int size;
+    int cpu;
 
-    if ((thread == NULL) || (thread == thread_self())) {
-        return EINVAL;
-    }
-
-    /*
-     * There is at most one reference on threads that were never dispatched,
-     * in which case there is no need to lock anything.
-     */
-    if (thread->runq == NULL) {
-        assert(thread->state != THREAD_RUNNING);
-        thread_clear_wchan(thread);
-        thread->state = THREAD_RUNNING;
-    } else {
-        runq = thread_lock_runq(thread, &flags);
+    cpumap_zero(&cpus);
 
-        if (thread->state == THREAD_RUNNING) {
-            thread_unlock_runq(runq, flags);
-            return EINVAL;
-        }
+    thread_preempt_disable_intr_save(&flags);
 
-        thread_clear_wchan(thread);
-        thread->state = THREAD_RUNNING;
-        thread_unlock_runq(runq, flags);
+    while (nr_threads != 0) {
+        size = MIN(nr_threads, THREAD_WAKEUP_BATCH_SIZE);
+        thread_wakeup_batch_chunk(threads, size, &cpus);
+        threads += size;
+        nr_threads -= size;
     }
 
-    thread_preempt_disable_intr_save(&flags);
-
-    if (thread->pin_level == 0) {
-        runq = thread_get_real_sched_ops(thread)->select_runq(thread);
-    } else {
-        /*
-         * This access doesn't need to be atomic, as the current thread is
-         * the only one which may update the member.
-         */
-        runq = thread->runq;
-        spinlock_lock(&runq->lock);
+    cpumap_for_each(&cpus, cpu) {
+        cpu_send_thread_schedule(cpu);
     }
 
-    thread->wakeup_error = error;
-    thread_runq_wakeup(runq, thread);
-    spinlock_unlock(&runq->lock);
     thread_preempt_enable_intr_restore(flags);
-
-    return 0;
-}
-
-int
-thread_wakeup(struct thread *thread)
-{
-    return thread_wakeup_common(thread, 0);
 }
 
 struct thread_timeout_waiter {
@@ -2612,6 +4614,7 @@ thread_run_scheduler(void)
     thread_boot_barrier();
 
     runq = thread_runq_local();
+    thread_runq_setup_domains(runq);
     thread = thread_self();
     assert(thread == runq->current);
     assert(thread->preempt_level == (THREAD_SUSPEND_PREEMPT_LEVEL - 1));
@@ -2620,6 +4623,7 @@ thread_run_scheduler(void)
 
     spinlock_lock(&runq->lock);
     thread = thread_runq_get_next(thread_runq_local());
+    runq->last_tsc = cpu_get_tsc();
     spinlock_transfer_owner(&runq->lock, thread);
 
     tcb_load(&thread->tcb);
@@ -2667,6 +4671,7 @@ thread_schedule_intr(void)
 
     runq = thread_runq_local();
     syscnt_inc(&runq->sc_schedule_intrs);
+    thread_runq_drain_wakelist(runq);
 }
 
 void
@@ -2687,12 +4692,49 @@ thread_report_periodic_event(void)
         thread_balance_idle_tick(runq);
     }
 
+    thread_runq_account(runq, thread);
+
     ops = thread_get_real_sched_ops(thread);
 
     if (ops->tick != NULL) {
         ops->tick(runq, thread);
     }
 
+    thread_sched_dl_replenish_throttled(runq);
+
+    spinlock_unlock(&runq->lock);
+}
+
+uint64_t
+thread_idle_enter(uint64_t now, uint64_t limit)
+{
+    struct thread_runq *runq;
+    uint64_t time;
+
+    assert(!cpu_intr_enabled());
+    assert(!thread_preempt_enabled());
+
+    runq = thread_runq_local();
+
+    spinlock_lock(&runq->lock);
+    time = thread_balance_idle_time(runq, now, limit);
+    spinlock_unlock(&runq->lock);
+
+    return time;
+}
+
+void
+thread_idle_leave(uint64_t ticks)
+{
+    struct thread_runq *runq;
+
+    assert(!cpu_intr_enabled());
+    assert(!thread_preempt_enabled());
+
+    runq = thread_runq_local();
+
+    spinlock_lock(&runq->lock);
+    thread_balance_idle_ticks(runq, ticks);
     spinlock_unlock(&runq->lock);
 }
 
@@ -2717,6 +4759,8 @@ thread_sched_class_to_str(unsigned char sched_class)
     switch (sched_class) {
     case THREAD_SCHED_CLASS_RT:
         return "rt";
+    case THREAD_SCHED_CLASS_DL:
+        return "dl";
     case THREAD_SCHED_CLASS_FS:
         return "fs";
     case THREAD_SCHED_CLASS_IDLE:
@@ -2726,22 +4770,83 @@ thread_sched_class_to_str(unsigned char sched_class)
     }
 }
 
-void
-thread_setscheduler(struct thread *thread, unsigned char policy,
-                    unsigned short priority)
+/*
+ * Migrate a queued thread if it may not run on its run queue any more.
+ *
+ * The run queue must be locked, and interrupts and preemption disabled
+ * when calling this function. The lock may be temporarily released.
+ */
+static void
+thread_runq_check_migration(struct thread_runq *runq, struct thread *thread)
+{
+    if (!thread->in_runq || !thread_runq_must_migrate(runq, thread)) {
+        return;
+    }
+
+    if (thread == runq->current) {
+        /*
+         * The thread is running, force it through the scheduler, which
+         * removes it from its run queue once it's descheduled.
+         */
+        thread_set_flag(thread, THREAD_YIELD);
+
+        if (runq != thread_runq_local()) {
+            cpu_send_thread_schedule(thread_runq_cpu(runq));
+        }
+    } else {
+        thread_runq_push_migration(runq, thread);
+        thread_runq_migrate(runq);
+    }
+}
+
+static uint64_t
+thread_dl_us_to_cycles(uint64_t us)
+{
+    return (us * cpu_get_freq()) / 1000000;
+}
+
+static void
+thread_dl_set_params(struct thread *thread,
+                     const struct thread_deadline_params *params)
+{
+    struct thread_dl_data *dl_data;
+
+    dl_data = &thread->dl_data;
+    dl_data->runtime = thread_dl_us_to_cycles(params->runtime);
+    dl_data->rel_deadline = thread_dl_us_to_cycles(params->deadline);
+    dl_data->period = thread_dl_us_to_cycles(params->period);
+
+    /* Make the next insertion start a new period */
+    dl_data->deadline = cpu_get_tsc();
+    dl_data->runtime_left = 0;
+}
+
+static int
+thread_setscheduler_common(struct thread *thread, unsigned char policy,
+                           unsigned short priority,
+                           const struct thread_deadline_params *params)
 {
     struct thread_runq *runq;
     struct turnstile_td *td;
-    unsigned long flags;
+    unsigned long flags, bw;
     bool requeue, current, update;
+    int error;
 
     td = thread_turnstile_td(thread);
+    error = 0;
 
     turnstile_td_lock(td);
     runq = thread_lock_runq(thread, &flags);
 
-    if ((thread_user_sched_policy(thread) == policy)
-        && (thread_user_priority(thread) == priority)) {
+    if (policy == THREAD_SCHED_POLICY_DEADLINE) {
+        bw = (params->runtime << THREAD_DL_BW_SHIFT) / params->period;
+        error = thread_dl_reserve(thread, bw);
+
+        if (error) {
+            goto out;
+        }
+    } else if ((thread_user_sched_policy(thread) == policy)
+               && (thread_user_priority(thread) == priority)) {
         goto out;
     }
 
@@ -2753,6 +4858,7 @@ thread_setscheduler(struct thread *thread, unsigned char policy,
         if (thread != runq->current) {
             current = false;
         } else {
+            thread_runq_account(runq, thread);
             thread_runq_put_prev(runq, thread);
             current = true;
         }
@@ -2760,6 +4866,12 @@ thread_setscheduler(struct thread *thread, unsigned char policy,
         thread_runq_remove(runq, thread);
     }
 
+    if (policy == THREAD_SCHED_POLICY_DEADLINE) {
+        thread_dl_set_params(thread, params);
+    } else {
+        thread_dl_release(thread);
+    }
+
     if (thread_user_sched_policy(thread) == policy) {
         thread_update_user_priority(thread, priority);
         update = true;
@@ -2793,11 +4905,72 @@ thread_setscheduler(struct thread *thread, unsigned char policy,
         }
     }
 
+    thread_runq_check_migration(runq, thread);
+
 out:
     thread_unlock_runq(runq, flags);
     turnstile_td_unlock(td);
 
-    turnstile_td_propagate_priority(td);
+    if (!error) {
+        turnstile_td_propagate_priority(td);
+    }
+
+    return error;
+}
+
+void
+thread_setscheduler(struct thread *thread, unsigned char policy,
+                    unsigned short priority)
+{
+    assert(policy != THREAD_SCHED_POLICY_DEADLINE);
+    thread_setscheduler_common(thread, policy, priority, NULL);
+}
+
+int
+thread_setscheduler_deadline(struct thread *thread,
+                             const struct thread_deadline_params *params)
+{
+    if ((params->period < THREAD_SCHED_DL_PERIOD_MIN)
+        || (params->period > THREAD_SCHED_DL_PERIOD_MAX)
+        || (params->runtime == 0)
+        || (params->runtime > params->deadline)
+        || (params->deadline > params->period)) {
+        return EINVAL;
+    }
+
+    return thread_setscheduler_common(thread, THREAD_SCHED_POLICY_DEADLINE,
+                                      0, params);
+}
+
+int
+thread_setaffinity(struct thread *thread, const struct cpumap *cpumap)
+{
+    struct thread_runq *runq;
+    unsigned long flags;
+    int error;
+
+    error = cpumap_check(cpumap);
+
+    if (error) {
+        return error;
+    }
+
+    thread_preempt_disable();
+    runq = thread_lock_runq(thread, &flags);
+
+    if ((thread->dl_data.bw != 0)
+        && !cpumap_test(cpumap, thread->dl_data.cpu)) {
+        error = EBUSY;
+        goto out;
+    }
+
+    cpumap_copy(&thread->cpumap, cpumap);
+    thread_runq_check_migration(runq, thread);
+
+out:
+    thread_unlock_runq(runq, flags);
+    thread_preempt_enable();
+    return error;
 }
 
 void
@@ -2834,6 +5007,7 @@ thread_pi_setscheduler(struct thread *thread, unsigned char policy,
         if (thread != runq->current) {
             current = false;
         } else {
+            thread_runq_account(runq, thread);
             thread_runq_put_prev(runq, thread);
             current = true;
         }
@@ -77,13 +77,15 @@ struct thread_sched_data {
 /*
  * Scheduling policies.
  *
+ * The deadline policy may only be set with thread_setscheduler_deadline().
  * The idle policy is reserved for the per-CPU idle threads.
  */
-#define THREAD_SCHED_POLICY_FIFO    0
-#define THREAD_SCHED_POLICY_RR      1
-#define THREAD_SCHED_POLICY_FS      2
-#define THREAD_SCHED_POLICY_IDLE    3
-#define THREAD_NR_SCHED_POLICIES    4
+#define THREAD_SCHED_POLICY_FIFO        0
+#define THREAD_SCHED_POLICY_RR          1
+#define THREAD_SCHED_POLICY_FS          2
+#define THREAD_SCHED_POLICY_DEADLINE    3
+#define THREAD_SCHED_POLICY_IDLE        4
+#define THREAD_NR_SCHED_POLICIES        5
 
 /*
  * Real-time priority properties.
@@ -98,6 +100,31 @@ struct thread_sched_data {
 #define THREAD_SCHED_FS_PRIO_DEFAULT    20
 #define THREAD_SCHED_FS_PRIO_MAX        39
 
+/*
+ * Deadline scheduling parameters, in microseconds.
+ *
+ * Once admitted, a deadline thread is guaranteed to be given runtime
+ * microseconds of processor time, within deadline microseconds from the
+ * start of each period. The relative deadline must be between the runtime
+ * and the period, and the period between the limits below.
+ */
+struct thread_deadline_params {
+    uint64_t runtime;
+    uint64_t deadline;
+    uint64_t period;
+};
+
+#define THREAD_SCHED_DL_PERIOD_MIN      100
+#define THREAD_SCHED_DL_PERIOD_MAX      1000000
+
+/*
+ * Minimum size of a thread stack.
+ *
+ * Stacks smaller than TCB_STACK_SIZE are allocated from caches of
+ * power-of-two sizes, starting at this size.
+ */
+#define THREAD_STACK_MIN_SIZE 1024
+
 /*
  * Thread creation attributes.
  */
@@ -106,6 +133,7 @@ struct thread_attr {
     unsigned long flags;
     struct cpumap *cpumap;
     struct task *task;
+    size_t stack_size;
     unsigned char policy;
     unsigned short priority;
 };
@@ -117,6 +145,7 @@ struct thread_attr {
  *  - thread is joinable
  *  - no processor affinity
  *  - task is inherited from parent thread
+ *  - stack size is TCB_STACK_SIZE
  *  - policy is fair-scheduling
  *  - priority is fair-scheduling default
  *
@@ -130,6 +159,7 @@ thread_attr_init(struct thread_attr *attr, const char *name)
     attr->flags = 0;
     attr->cpumap = NULL;
     attr->task = NULL;
+    attr->stack_size = TCB_STACK_SIZE;
     attr->policy = THREAD_SCHED_POLICY_FS;
     attr->priority = THREAD_SCHED_FS_PRIO_DEFAULT;
 }
@@ -152,6 +182,20 @@ thread_attr_set_task(struct thread_attr *attr, struct task *task)
     attr->task = task;
 }
 
+/*
+ * Set the stack size of a thread.
+ *
+ * The size is rounded up to a power-of-two, and must not be greater than
+ * TCB_STACK_SIZE. When guard pages are enabled, all stacks have the
+ * default size.
+ */
+static inline void
+thread_attr_set_stack_size(struct thread_attr *attr, size_t stack_size)
+{
+    assert(stack_size <= TCB_STACK_SIZE);
+    attr->stack_size = stack_size;
+}
+
 static inline void
 thread_attr_set_policy(struct thread_attr *attr, unsigned char policy)
 {
@@ -181,7 +225,8 @@ void thread_ap_setup(void);
  *
  * Creation attributes must be passed, but some of them may be NULL, in which
  * case the value is inherited from the caller. The name attribute must not be
- * NULL.
+ * NULL. Threads can't be created with the deadline policy, in which case
+ * EINVAL is returned.
  */
 int thread_create(struct thread **threadp, const struct thread_attr *attr,
                   void (*fn)(void *), void *arg);
@@ -229,10 +274,33 @@ int thread_timedsleep(struct spinlock *interlock, const void *wchan_addr,
  * If the target thread is NULL, the calling thread, or already in the
  * running state, no action is performed and EINVAL is returned.
  *
+ * The thread may be handed to a remote processor which adds it to its
+ * own run queue, in which case the thread doesn't immediately appear as
+ * queued once this function returns.
+ *
  * TODO Describe memory ordering with regard to thread_sleep().
  */
 int thread_wakeup(struct thread *thread);
 
+/*
+ * Schedule several threads for execution.
+ *
+ * This function is equivalent to calling thread_wakeup() on each of the
+ * given threads, except that threads are grouped by run queue, each run
+ * queue being locked once per group, and rescheduling interrupts are
+ * coalesced so that at most one is sent to each processor. Threads that
+ * are NULL, the calling thread, or already in the running state are
+ * ignored.
+ *
+ * In order to be grouped, fair-scheduling threads are added back to their
+ * previous run queue if allowed, instead of the run queue that thread_wakeup()
+ * would select.
+ *
+ * Interrupts and preemption are disabled while threads are processed,
+ * and callers should bound the number of threads accordingly.
+ */
+void thread_wakeup_batch(struct thread **threads, unsigned int nr_threads);
+
 /*
  * Suspend execution of the calling thread.
  */
@@ -258,6 +326,8 @@ void thread_yield(void);
 
 /*
  * Report a scheduling interrupt from a remote processor.
+ *
+ * Threads awaken by remote processors are added to the local run queue.
  */
 void thread_schedule_intr(void);
 
@@ -268,12 +338,59 @@ void thread_schedule_intr(void);
  */
 void thread_report_periodic_event(void);
 
+/*
+ * Report that the local processor stops, or restarts, reporting periodic
+ * events because it's idle.
+ *
+ * On entry, the time at which idle load balancing is next due on the local
+ * processor is returned, or the given limit if it's earlier. On exit, the
+ * given number of ticks elapsed while idle are accounted as if periodic
+ * events had been reported.
+ *
+ * Interrupts and preemption must be disabled when calling these functions.
+ */
+uint64_t thread_idle_enter(uint64_t now, uint64_t limit);
+void thread_idle_leave(uint64_t ticks);
+
 /*
  * Set thread scheduling parameters.
+ *
+ * The policy must not be the deadline policy. If the thread was a deadline
+ * thread, its reserved bandwidth is released.
  */
 void thread_setscheduler(struct thread *thread, unsigned char policy,
                          unsigned short priority);
 
+/*
+ * Make a thread use the deadline policy with the given parameters.
+ *
+ * This function performs admission control. Deadline threads are
+ * partitioned, i.e. each of them reserves bandwidth on, and runs on,
+ * a single processor, selected among those allowed by its affinity.
+ * The thread is migrated to that processor if needed.
+ *
+ * Return EINVAL if the parameters are invalid, or EBUSY if none of the
+ * allowed processors has enough bandwidth available, in which case the
+ * scheduling parameters of the thread are left unchanged.
+ */
+int thread_setscheduler_deadline(struct thread *thread,
+                                 const struct thread_deadline_params *params);
+
+/*
+ * Set the processors on which a thread is allowed to run.
+ *
+ * If the thread is queued or running on a processor that isn't part of
+ * the new affinity, it's migrated to an allowed processor. If the thread
+ * is pinned, migration is delayed until it's unpinned and goes through the
+ * scheduler. The new affinity is otherwise applied immediately, including
+ * by load balancing.
+ *
+ * Return EINVAL if the given CPU map doesn't contain any valid processor,
+ * or EBUSY if the thread is a deadline thread and the new affinity doesn't
+ * include the processor on which its bandwidth is reserved.
+ */
+int thread_setaffinity(struct thread *thread, const struct cpumap *cpumap);
+
 /*
  * Variant used for priority inheritance.
  *
@@ -317,6 +434,22 @@ thread_wchan_desc(const struct thread *thread)
     return thread->wchan_desc;
 }
 
+static inline size_t
+thread_stack_size(const struct thread *thread)
+{
+    return thread->stack_size;
+}
+
+/*
+ * Return the maximum number of bytes used on the stack of a thread.
+ *
+ * Stacks are filled with a pattern when threads are created, and the
+ * high watermark is found by looking for the deepest byte which doesn't
+ * match the pattern. The result may be underestimated if the thread
+ * writes bytes matching the pattern.
+ */
+size_t thread_stack_usage(const struct thread *thread);
+
 /*
  * Return a character representation of the state of a thread.
  */
@@ -20,10 +20,13 @@
 
 #include <stdalign.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include <kern/atomic.h>
 #include <kern/cpumap.h>
 #include <kern/list_types.h>
+#include <kern/rbtree.h>
 #include <kern/rcu_types.h>
 #include <kern/spinlock_types.h>
 #include <kern/turnstile_types.h>
@@ -64,14 +67,60 @@ struct thread_rt_data {
 
 /*
  * Scheduling data for a fair-scheduling thread.
+ *
+ * The cycles member is the part of the execution time, in time stamp
+ * counter cycles, not yet accounted as work.
  */
 struct thread_fs_data {
     struct list group_node;
     struct list runq_node;
     struct thread_fs_runq *fs_runq;
     unsigned long round;
-    unsigned short weight;
-    unsigned short work;
+    unsigned int weight;
+    unsigned int work;
+    unsigned int cycles;
+};
+
+/*
+ * Scheduling data for a deadline thread.
+ *
+ * Unlike the data of other classes, these members are preserved when the
+ * class of the thread changes, e.g. when its priority is boosted, since
+ * they include the bandwidth reserved for the thread. Times are in time
+ * stamp counter cycles, and the absolute deadline is a time stamp counter
+ * value. The bandwidth is a fixed-point fraction of a processor.
+ */
+struct thread_dl_data {
+    struct rbtree_node node;
+    struct list throttled_node;
+    uint64_t runtime;
+    uint64_t rel_deadline;
+    uint64_t period;
+    uint64_t deadline;
+    int64_t runtime_left;
+    unsigned long bw;
+    unsigned int cpu;
+    bool throttled;
+};
+
+/*
+ * Scheduling statistics of a thread.
+ *
+ * The wait start member is the time stamp counter value when the thread
+ * last became runnable without running, or 0 if it's running or sleeping.
+ * The woken member is true if it became runnable because it was awaken,
+ * in which case the wait is accounted as wake-up latency. Times are in
+ * time stamp counter cycles.
+ */
+struct thread_stats {
+    uint64_t wait_start;
+    uint64_t wait_cycles;
+    uint64_t latency_cycles;
+    uint64_t max_latency;
+    unsigned long nr_wakeups;
+    unsigned long nr_voluntary_switches;
+    unsigned long nr_involuntary_switches;
+    bool woken;
 };
 
 /*
@@ -141,6 +190,12 @@ struct thread {
     /* Processors on which this thread is allowed to run */
     struct cpumap cpumap;   /* (r) */
 
+    /* Node in the list of threads leaving their run queue */
+    struct list migration_node; /* (r) */
+
+    /* Next thread in the wake list of a run queue */
+    struct thread *wakelist_next;   /* (a) */
+
     struct thread_sched_data user_sched_data;   /* (r,t) */
     struct thread_sched_data real_sched_data;   /* (r,t) */
 
@@ -158,6 +213,10 @@ struct thread {
         struct thread_fs_data fs_data;  /* (r) */
     };
 
+    struct thread_dl_data dl_data;  /* (r) */
+
+    struct thread_stats stats;      /* (r) */
+
     /*
      * Thread-specific data.
      *
@@ -184,6 +243,7 @@ struct thread {
     struct task *task;              /* (T) */
     struct list task_node;          /* (T) */
     void *stack;                    /* (-) */
+    size_t stack_size;              /* (-) */
     char name[THREAD_NAME_SIZE];    /* ( ) */
 };
 
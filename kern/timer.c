@@ -70,6 +70,12 @@
 
 #define TIMER_HTABLE_MASK (TIMER_HTABLE_SIZE - 1)
 
+/*
+ * Maximum number of buckets scanned when looking up the next expiration
+ * on idle entry, which is done with interrupts disabled.
+ */
+#define TIMER_IDLE_MAX_SCAN 64
+
 struct timer_bucket {
     struct hlist timers;
 };
@@ -78,12 +84,21 @@ struct timer_bucket {
  * The hash table bucket matching the last time member has already been
  * processed, and the next periodic event resumes from the next bucket.
  *
+ * While the processor is idle and doesn't report periodic events, the
+ * next time member is the time at which it expects to be interrupted.
+ *
+ * No timer expires before the earliest time member. It's lowered when
+ * adding timers, and raised by idle entry lookups, which resume from it.
+ *
  * Locking order: interrupts -> timer_cpu_data.
  */
 struct timer_cpu_data {
     unsigned int cpu;
     struct spinlock lock;
     uint64_t last_time;
+    bool idle;
+    uint64_t next_time;
+    uint64_t earliest_time;
     struct timer_bucket htable[TIMER_HTABLE_SIZE];
 };
 
@@ -352,6 +367,8 @@ timer_cpu_data_init(struct timer_cpu_data *cpu_data, unsigned int cpu)
 
     /* See periodic event handling */
     cpu_data->last_time = clock_get_time() - 1;
+    cpu_data->idle = false;
+    cpu_data->earliest_time = cpu_data->last_time + 1;
 
     for (size_t i = 0; i < ARRAY_SIZE(cpu_data->htable); i++) {
         timer_bucket_init(&cpu_data->htable[i]);
@@ -377,6 +394,10 @@ timer_cpu_data_add(struct timer_cpu_data *cpu_data, struct timer *timer)
 
     bucket = timer_cpu_data_get_bucket(cpu_data, timer->ticks);
     timer_bucket_add(bucket, timer);
+
+    if (timer_occurred(timer, cpu_data->earliest_time)) {
+        cpu_data->earliest_time = timer->ticks;
+    }
 }
 
 static void
@@ -487,6 +508,16 @@ timer_schedule(struct timer *timer, uint64_t ticks)
     timer_cpu_data_add(cpu_data, timer);
     timer_set_scheduled(timer, cpu_data->cpu);
 
+    /*
+     * If the processor is idle, interrupt it so that it takes the new
+     * timer into account.
+     */
+    if (cpu_data->idle && timer_occurred(timer, cpu_data->next_time)
+        && (cpu_data->cpu != cpu_id())) {
+        cpu_data->idle = false;
+        cpu_send_thread_schedule(cpu_data->cpu);
+    }
+
 out:
     timer_unlock_cpu_data(cpu_data, cpu_flags);
 }
@@ -564,3 +595,66 @@ timer_report_periodic_event(void)
         timer_process(timer);
     }
 }
+
+uint64_t
+timer_idle_enter(uint64_t limit)
+{
+    struct timer_cpu_data *cpu_data;
+    struct timer_bucket *bucket;
+    struct timer *timer;
+    uint64_t ticks, end;
+
+    assert(!cpu_intr_enabled());
+    assert(!thread_preempt_enabled());
+
+    cpu_data = cpu_local_ptr(timer_cpu_data);
+
+    spinlock_lock(&cpu_data->lock);
+
+    ticks = cpu_data->last_time + 1;
+
+    /* Skip the buckets known to contain no timer expiring before */
+    if (clock_time_expired(ticks, cpu_data->earliest_time)) {
+        ticks = cpu_data->earliest_time;
+    }
+
+    end = ticks + TIMER_IDLE_MAX_SCAN;
+
+    if (clock_time_expired(limit, end)) {
+        end = limit;
+    }
+
+    for (; clock_time_expired(ticks, end); ticks++) {
+        bucket = timer_cpu_data_get_bucket(cpu_data, ticks);
+
+        hlist_for_each_entry(&bucket->timers, timer, node) {
+            if (timer_occurred(timer, ticks)) {
+                goto out;
+            }
+        }
+    }
+
+out:
+    cpu_data->idle = true;
+    cpu_data->next_time = ticks;
+    cpu_data->earliest_time = ticks;
+
+    spinlock_unlock(&cpu_data->lock);
+
+    return ticks;
+}
+
+void
+timer_idle_leave(void)
+{
+    struct timer_cpu_data *cpu_data;
+
+    assert(!cpu_intr_enabled());
+    assert(!thread_preempt_enabled());
+
+    cpu_data = cpu_local_ptr(timer_cpu_data);
+
+    spinlock_lock(&cpu_data->lock);
+    cpu_data->idle = false;
+    spinlock_unlock(&cpu_data->lock);
+}
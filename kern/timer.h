@@ -96,6 +96,22 @@ void timer_cancel(struct timer *timer);
  */
 void timer_report_periodic_event(void);
 
+/*
+ * Report that the local processor stops, or restarts, reporting periodic
+ * events because it's idle.
+ *
+ * On entry, the time of the earliest timer of the local processor is
+ * returned, or the given limit if it's earlier. Since the lookup is
+ * bounded, an earlier time may be returned, from which the lookup resumes
+ * on the next idle entry. Until the processor restarts reporting periodic
+ * events, scheduling a timer on it so that it expires earlier interrupts
+ * the processor.
+ *
+ * Interrupts and preemption must be disabled when calling these functions.
+ */
+uint64_t timer_idle_enter(uint64_t limit);
+void timer_idle_leave(void);
+
 /*
  * This init operation provides :
  *  - timer initialization and scheduling
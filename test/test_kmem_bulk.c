@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * This test module measures the per-object cost of bulk allocation and
+ * release, compared to allocating and releasing objects one at a time.
+ *
+ * For each batch size, the test thread repeatedly allocates a batch of
+ * objects and releases it, first with the bulk interface, then with one
+ * call per object. The average number of cycles per object is reported
+ * for both methods.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kern/error.h>
+#include <kern/init.h>
+#include <kern/kmem.h>
+#include <kern/log.h>
+#include <kern/macros.h>
+#include <kern/panic.h>
+#include <kern/thread.h>
+#include <machine/cpu.h>
+#include <test/test.h>
+
+#define TEST_OBJ_SIZE 64
+
+#define TEST_MAX_BATCH_SIZE 64
+
+#define TEST_NR_ROUNDS 10000
+
+static const unsigned int test_batch_sizes[] = { 1, 8, 64 };
+
+static struct kmem_cache test_cache;
+
+static void *test_objs[TEST_MAX_BATCH_SIZE];
+
+static uint64_t
+test_run_bulk(unsigned int batch_size)
+{
+    uint64_t start;
+    int error;
+
+    start = cpu_get_tsc();
+
+    for (unsigned int i = 0; i < TEST_NR_ROUNDS; i++) {
+        error = kmem_cache_alloc_bulk(&test_cache, test_objs, batch_size);
+        error_check(error, "kmem_cache_alloc_bulk");
+        kmem_cache_free_bulk(&test_cache, test_objs, batch_size);
+    }
+
+    return cpu_get_tsc() - start;
+}
+
+static uint64_t
+test_run_single(unsigned int batch_size)
+{
+    uint64_t start;
+
+    start = cpu_get_tsc();
+
+    for (unsigned int i = 0; i < TEST_NR_ROUNDS; i++) {
+        for (unsigned int j = 0; j < batch_size; j++) {
+            test_objs[j] = kmem_cache_alloc(&test_cache);
+
+            if (test_objs[j] == NULL) {
+                panic("test: unable to allocate object");
+            }
+        }
+
+        for (unsigned int j = 0; j < batch_size; j++) {
+            kmem_cache_free(&test_cache, test_objs[j]);
+        }
+    }
+
+    return cpu_get_tsc() - start;
+}
+
+static void
+test_run(void *arg)
+{
+    unsigned int batch_size;
+    uint64_t bulk, single;
+
+    (void)arg;
+
+    /* Warm up the CPU pool */
+    test_run_single(TEST_MAX_BATCH_SIZE);
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(test_batch_sizes); i++) {
+        batch_size = test_batch_sizes[i];
+        assert(batch_size <= ARRAY_SIZE(test_objs));
+
+        bulk = test_run_bulk(batch_size);
+        single = test_run_single(batch_size);
+
+        log_info("test: batch: %2u, bulk: %llu cycles/obj, "
+                 "single: %llu cycles/obj", batch_size,
+                 (unsigned long long)(bulk / (TEST_NR_ROUNDS * batch_size)),
+                 (unsigned long long)(single / (TEST_NR_ROUNDS * batch_size)));
+    }
+
+    log_info("test: done");
+}
+
+void __init
+test_setup(void)
+{
+    struct thread_attr attr;
+    struct thread *thread;
+    int error;
+
+    kmem_cache_init(&test_cache, "test_kmem_bulk", TEST_OBJ_SIZE, 0, NULL, 0);
+
+    thread_attr_init(&attr, THREAD_KERNEL_PREFIX "test_run");
+    thread_attr_set_detached(&attr);
+    error = thread_create(&thread, &attr, test_run, NULL);
+    error_check(error, "thread_create");
+}
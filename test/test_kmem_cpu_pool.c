@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * This test module measures the cost of allocating and releasing objects
+ * from a cache concurrently on all processors.
+ *
+ * One thread is bound to each processor. In the local pattern, each thread
+ * allocates a batch of objects and releases them. In the remote pattern,
+ * each thread allocates a batch of objects, and after all threads have
+ * synchronized, releases the batch allocated by the thread running on the
+ * previous processor, a typical producer-consumer scenario. The average
+ * number of cycles per allocation and per release is reported for both
+ * patterns.
+ *
+ * Since this module only uses the public interface of the allocator, it can
+ * be used to compare different implementations of the CPU pool layer, e.g.
+ * per-CPU arrays of objects against per-CPU free lists.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kern/condition.h>
+#include <kern/cpumap.h>
+#include <kern/error.h>
+#include <kern/init.h>
+#include <kern/kmem.h>
+#include <kern/log.h>
+#include <kern/macros.h>
+#include <kern/mutex.h>
+#include <kern/panic.h>
+#include <kern/thread.h>
+#include <machine/cpu.h>
+#include <test/test.h>
+
+#define TEST_OBJ_SIZE 64
+
+#define TEST_BATCH_SIZE 256
+
+#define TEST_NR_ROUNDS 1000
+
+struct test_thread {
+    struct thread *thread;
+    void *objs[TEST_BATCH_SIZE];
+    uint64_t alloc_cycles;
+    uint64_t free_cycles;
+};
+
+static struct kmem_cache test_cache;
+
+static struct test_thread *test_threads;
+
+static struct mutex test_lock;
+static struct condition test_barrier_cond;
+static unsigned int test_nr_waiting;
+static unsigned long test_barrier_generation;
+
+static void
+test_barrier(void)
+{
+    unsigned long generation;
+
+    mutex_lock(&test_lock);
+
+    generation = test_barrier_generation;
+    test_nr_waiting++;
+
+    if (test_nr_waiting == cpu_count()) {
+        test_nr_waiting = 0;
+        test_barrier_generation++;
+        condition_broadcast(&test_barrier_cond);
+    } else {
+        while (generation == test_barrier_generation) {
+            condition_wait(&test_barrier_cond, &test_lock);
+        }
+    }
+
+    mutex_unlock(&test_lock);
+}
+
+static void
+test_alloc_batch(struct test_thread *test)
+{
+    uint64_t start;
+
+    start = cpu_get_tsc();
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(test->objs); i++) {
+        test->objs[i] = kmem_cache_alloc(&test_cache);
+
+        if (test->objs[i] == NULL) {
+            panic("test: unable to allocate object");
+        }
+    }
+
+    test->alloc_cycles += cpu_get_tsc() - start;
+}
+
+static void
+test_free_batch(struct test_thread *test, struct test_thread *owner)
+{
+    uint64_t start;
+
+    start = cpu_get_tsc();
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(owner->objs); i++) {
+        kmem_cache_free(&test_cache, owner->objs[i]);
+    }
+
+    test->free_cycles += cpu_get_tsc() - start;
+}
+
+static void
+test_run_thread(void *arg)
+{
+    struct test_thread *test, *prev;
+    unsigned int cpu;
+
+    test = arg;
+    cpu = test - test_threads;
+    prev = &test_threads[(cpu + cpu_count() - 1) % cpu_count()];
+
+    test_barrier();
+
+    for (unsigned int i = 0; i < TEST_NR_ROUNDS; i++) {
+        test_alloc_batch(test);
+        test_free_batch(test, test);
+    }
+
+    test_barrier();
+
+    if (cpu == 0) {
+        log_info("test: local:");
+    }
+
+    test_barrier();
+
+    log_info("test: cpu%u: alloc: %llu cycles, free: %llu cycles", cpu,
+             (unsigned long long)(test->alloc_cycles
+                                  / (TEST_NR_ROUNDS * TEST_BATCH_SIZE)),
+             (unsigned long long)(test->free_cycles
+                                  / (TEST_NR_ROUNDS * TEST_BATCH_SIZE)));
+
+    test->alloc_cycles = 0;
+    test->free_cycles = 0;
+
+    test_barrier();
+
+    for (unsigned int i = 0; i < TEST_NR_ROUNDS; i++) {
+        test_alloc_batch(test);
+        test_barrier();
+        test_free_batch(test, prev);
+        test_barrier();
+    }
+
+    if (cpu == 0) {
+        log_info("test: remote:");
+    }
+
+    test_barrier();
+
+    log_info("test: cpu%u: alloc: %llu cycles, free: %llu cycles", cpu,
+             (unsigned long long)(test->alloc_cycles
+                                  / (TEST_NR_ROUNDS * TEST_BATCH_SIZE)),
+             (unsigned long long)(test->free_cycles
+                                  / (TEST_NR_ROUNDS * TEST_BATCH_SIZE)));
+}
+
+static void
+test_run(void *arg)
+{
+    char name[THREAD_NAME_SIZE];
+    struct thread_attr attr;
+    struct test_thread *test;
+    struct cpumap *cpumap;
+    int error;
+
+    (void)arg;
+
+    test_threads = kmem_zalloc(cpu_count() * sizeof(*test_threads));
+
+    if (test_threads == NULL) {
+        panic("test: unable to allocate threads");
+    }
+
+    error = cpumap_create(&cpumap);
+    error_check(error, "cpumap_create");
+
+    for (unsigned int i = 0; i < cpu_count(); i++) {
+        test = &test_threads[i];
+        cpumap_zero(cpumap);
+        cpumap_set(cpumap, i);
+        snprintf(name, sizeof(name), THREAD_KERNEL_PREFIX "test_kmem:%u", i);
+        thread_attr_init(&attr, name);
+        thread_attr_set_cpumap(&attr, cpumap);
+        error = thread_create(&test->thread, &attr, test_run_thread, test);
+        error_check(error, "thread_create");
+    }
+
+    cpumap_destroy(cpumap);
+
+    for (unsigned int i = 0; i < cpu_count(); i++) {
+        thread_join(test_threads[i].thread);
+    }
+
+    kmem_cache_info(&test_cache);
+    kmem_free(test_threads, cpu_count() * sizeof(*test_threads));
+
+    log_info("test: done");
+}
+
+void __init
+test_setup(void)
+{
+    struct thread_attr attr;
+    struct thread *thread;
+    int error;
+
+    kmem_cache_init(&test_cache, "test_kmem_cpu_pool", TEST_OBJ_SIZE, 0,
+                    NULL, 0);
+    mutex_init(&test_lock);
+    condition_init(&test_barrier_cond);
+
+    thread_attr_init(&attr, THREAD_KERNEL_PREFIX "test_run");
+    thread_attr_set_detached(&attr);
+    error = thread_create(&thread, &attr, test_run, NULL);
+    error_check(error, "thread_create");
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * This test module checks that deadline threads meet their deadlines
+ * under load.
+ *
+ * On each processor, two periodic deadline threads run jobs consuming
+ * half of their runtime, while a greedy deadline thread and a
+ * fair-scheduling hog thread never sleep. Periodic threads check that
+ * each of their jobs completes before its deadline. The hog thread
+ * measures the processor time it gets, which must be significant, since
+ * the runtime of the greedy thread is enforced.
+ *
+ * Admission control is also checked, by requesting more bandwidth than
+ * is available on a processor.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kern/atomic.h>
+#include <kern/clock.h>
+#include <kern/cpumap.h>
+#include <kern/error.h>
+#include <kern/init.h>
+#include <kern/kmem.h>
+#include <kern/log.h>
+#include <kern/macros.h>
+#include <kern/panic.h>
+#include <kern/thread.h>
+#include <machine/cpu.h>
+#include <test/test.h>
+
+/*
+ * Duration of the test, in milliseconds.
+ */
+#define TEST_DURATION 10000
+
+/*
+ * Minimum share of processor time the hog threads must get, in percents.
+ */
+#define TEST_HOG_MIN_SHARE 25
+
+#define TEST_NR_PERIODIC_THREADS 2
+
+struct test_params {
+    unsigned int runtime_ticks;
+    unsigned int deadline_ticks;
+    unsigned int period_ticks;
+};
+
+static const struct test_params test_periodic_params[] = {
+    { 1, 4, 4 },
+    { 2, 6, 8 },
+};
+
+static const struct test_params test_greedy_params = { 1, 8, 8 };
+
+struct test_thread {
+    struct thread *thread;
+    const struct test_params *params;
+    unsigned int nr_jobs;
+    unsigned int nr_misses;
+    uint64_t consumed;
+};
+
+struct test_cpu {
+    struct test_thread periodic[TEST_NR_PERIODIC_THREADS];
+    struct test_thread greedy;
+    struct test_thread hog;
+};
+
+static struct test_cpu *test_cpus;
+
+static uint64_t test_start;
+
+static bool test_done;
+
+/*
+ * Number of cycles between two consecutive time stamp counter reads beyond
+ * which the calling thread is assumed to have been interrupted or preempted.
+ */
+static uint64_t test_gap_cycles;
+
+static uint64_t test_tick_cycles;
+
+static uint64_t
+test_consume(struct test_thread *test, uint64_t *prevp)
+{
+    uint64_t now, delta;
+
+    now = cpu_get_tsc();
+    delta = now - *prevp;
+    *prevp = now;
+
+    if (delta >= test_gap_cycles) {
+        return 0;
+    }
+
+    test->consumed += delta;
+    return delta;
+}
+
+static void
+test_run_periodic(void *arg)
+{
+    struct test_thread *test;
+    uint64_t release, now, prev, work, consumed;
+
+    test = arg;
+    work = (test->params->runtime_ticks * test_tick_cycles) / 2;
+    release = test_start;
+
+    for (unsigned int i = 0; i < test->nr_jobs; i++) {
+        thread_delay(release, true);
+
+        consumed = 0;
+        prev = cpu_get_tsc();
+
+        while (consumed < work) {
+            consumed += test_consume(test, &prev);
+        }
+
+        now = clock_get_time();
+
+        if (clock_time_occurred(release + test->params->deadline_ticks, now)) {
+            test->nr_misses++;
+        }
+
+        release += test->params->period_ticks;
+
+        if (clock_time_occurred(release, now)) {
+            release = now + 1;
+        }
+    }
+}
+
+static void
+test_run_greedy(void *arg)
+{
+    struct test_thread *test;
+    uint64_t prev;
+
+    test = arg;
+
+    thread_delay(test_start, true);
+    prev = cpu_get_tsc();
+
+    while (!atomic_load(&test_done, ATOMIC_RELAXED)) {
+        test_consume(test, &prev);
+    }
+}
+
+static void
+test_create(struct test_thread *test, const char *name, unsigned int cpu,
+            void (*fn)(void *), const struct test_params *params)
+{
+    struct thread_deadline_params dl_params;
+    char buf[THREAD_NAME_SIZE];
+    struct thread_attr attr;
+    struct cpumap *cpumap;
+    uint64_t tick_us;
+    int error;
+
+    test->params = params;
+    test->nr_jobs = 0;
+    test->nr_misses = 0;
+    test->consumed = 0;
+
+    if (params != NULL) {
+        test->nr_jobs = clock_ticks_from_ms(TEST_DURATION)
+                        / params->period_ticks;
+    }
+
+    error = cpumap_create(&cpumap);
+    error_check(error, "cpumap_create");
+    cpumap_zero(cpumap);
+    cpumap_set(cpumap, cpu);
+
+    snprintf(buf, sizeof(buf), THREAD_KERNEL_PREFIX "%s/%u", name, cpu);
+    thread_attr_init(&attr, buf);
+    thread_attr_set_cpumap(&attr, cpumap);
+    error = thread_create(&test->thread, &attr, fn, test);
+    error_check(error, "thread_create");
+
+    cpumap_destroy(cpumap);
+
+    if (params == NULL) {
+        return;
+    }
+
+    tick_us = 1000000 / CLOCK_FREQ;
+    dl_params.runtime = params->runtime_ticks * tick_us;
+    dl_params.deadline = params->deadline_ticks * tick_us;
+    dl_params.period = params->period_ticks * tick_us;
+    error = thread_setscheduler_deadline(test->thread, &dl_params);
+    error_check(error, "thread_setscheduler_deadline");
+}
+
+static void
+test_check_admission(void)
+{
+    struct thread_deadline_params params;
+    struct cpumap *cpumap;
+    int error;
+
+    error = cpumap_create(&cpumap);
+    error_check(error, "cpumap_create");
+    cpumap_zero(cpumap);
+    cpumap_set(cpumap, 0);
+    error = thread_setaffinity(thread_self(), cpumap);
+    error_check(error, "thread_setaffinity");
+    cpumap_destroy(cpumap);
+
+    params.runtime = 2000;
+    params.deadline = 1000;
+    params.period = 4000;
+    error = thread_setscheduler_deadline(thread_self(), &params);
+
+    if (error != EINVAL) {
+        panic("test: invalid parameters accepted");
+    }
+
+    params.deadline = 4000;
+    error = thread_setscheduler_deadline(thread_self(), &params);
+
+    if (error != EBUSY) {
+        panic("test: admission control failed");
+    }
+}
+
+static void
+test_run(void *arg)
+{
+    unsigned int nr_jobs, nr_misses, hog_share;
+    uint64_t start_tsc, elapsed;
+    struct test_cpu *test_cpu;
+
+    (void)arg;
+
+    test_tick_cycles = cpu_get_freq() / CLOCK_FREQ;
+    test_gap_cycles = cpu_get_freq() / 100000;
+    test_start = clock_get_time() + clock_ticks_from_ms(100);
+
+    test_cpus = kmem_alloc(cpu_count() * sizeof(*test_cpus));
+
+    if (test_cpus == NULL) {
+        panic("test: unable to allocate processor data");
+    }
+
+    for (unsigned int i = 0; i < cpu_count(); i++) {
+        test_cpu = &test_cpus[i];
+
+        for (unsigned int j = 0; j < ARRAY_SIZE(test_cpu->periodic); j++) {
+            test_create(&test_cpu->periodic[j], "test_periodic", i,
+                        test_run_periodic, &test_periodic_params[j]);
+        }
+
+        test_create(&test_cpu->greedy, "test_greedy", i,
+                    test_run_greedy, &test_greedy_params);
+        test_create(&test_cpu->hog, "test_hog", i, test_run_greedy, NULL);
+    }
+
+    test_check_admission();
+
+    thread_delay(test_start, true);
+    start_tsc = cpu_get_tsc();
+
+    nr_jobs = 0;
+    nr_misses = 0;
+
+    for (unsigned int i = 0; i < cpu_count(); i++) {
+        test_cpu = &test_cpus[i];
+
+        for (unsigned int j = 0; j < ARRAY_SIZE(test_cpu->periodic); j++) {
+            thread_join(test_cpu->periodic[j].thread);
+            nr_jobs += test_cpu->periodic[j].nr_jobs;
+            nr_misses += test_cpu->periodic[j].nr_misses;
+        }
+    }
+
+    atomic_store(&test_done, true, ATOMIC_RELAXED);
+    elapsed = cpu_get_tsc() - start_tsc;
+
+    for (unsigned int i = 0; i < cpu_count(); i++) {
+        test_cpu = &test_cpus[i];
+        thread_join(test_cpu->greedy.thread);
+        thread_join(test_cpu->hog.thread);
+
+        hog_share = (test_cpu->hog.consumed * 100) / elapsed;
+        log_info("test: cpu%u: hog: %u%%, greedy: %llu cycles", i, hog_share,
+                 (unsigned long long)test_cpu->greedy.consumed);
+
+        if (hog_share < TEST_HOG_MIN_SHARE) {
+            panic("test: runtime not enforced");
+        }
+    }
+
+    log_info("test: jobs: %u, deadline misses: %u", nr_jobs, nr_misses);
+
+    if (nr_misses != 0) {
+        panic("test: deadline missed");
+    }
+
+    log_info("test: done");
+}
+
+void __init
+test_setup(void)
+{
+    struct thread_attr attr;
+    struct thread *thread;
+    int error;
+
+    thread_attr_init(&attr, THREAD_KERNEL_PREFIX "test_run");
+    thread_attr_set_detached(&attr);
+    error = thread_create(&thread, &attr, test_run, NULL);
+    error_check(error, "thread_create");
+}
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * This test module measures the fairness error of the fair-scheduling
+ * policy in the presence of threads that sleep and wake up within a tick.
+ *
+ * Two fair-scheduling threads of the same priority are bound to the same
+ * processor. The hog thread always consumes processor time. The sleeper
+ * thread sleeps until the next tick, then consumes most of the tick before
+ * sleeping again, so that it's never running when the timer interrupt
+ * occurs. Both threads measure the processor time they actually consume
+ * using the time stamp counter. Since they have the same weight, both
+ * should get half of the processor time.
+ *
+ * When execution time is charged one tick at a time to the thread running
+ * when the timer interrupt occurs, the sleeper thread is never charged and
+ * gets most of the processor time. To compare both accounting methods on
+ * the same execution, the threads also record the ticks that tick-based
+ * accounting would have charged to each of them, and the difference between
+ * the processor time they consumed and the ticks they would have been
+ * charged is reported as the accounting error of tick-based accounting.
+ * The test fails if the fairness error exceeds TEST_MAX_ERROR.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kern/atomic.h>
+#include <kern/clock.h>
+#include <kern/cpumap.h>
+#include <kern/error.h>
+#include <kern/init.h>
+#include <kern/log.h>
+#include <kern/panic.h>
+#include <kern/thread.h>
+#include <machine/cpu.h>
+#include <test/test.h>
+
+/*
+ * Duration of the test, in milliseconds.
+ */
+#define TEST_DURATION 10000
+
+/*
+ * Part of a tick consumed by the sleeper thread, in percents.
+ */
+#define TEST_SLEEPER_LOAD 80
+
+/*
+ * Maximum fairness error, in percents.
+ */
+#define TEST_MAX_ERROR 10
+
+struct test_thread {
+    struct thread *thread;
+    uint64_t consumed;
+    uint64_t ticks;
+};
+
+static struct test_thread test_hog;
+static struct test_thread test_sleeper;
+
+/*
+ * Thread which last sampled the time, and the time it sampled.
+ */
+static struct test_thread *test_owner;
+static uint64_t test_owner_time;
+
+static bool test_done;
+
+/*
+ * Number of cycles between two consecutive time stamp counter reads beyond
+ * which the calling thread is assumed to have been interrupted or preempted.
+ */
+static uint64_t test_gap_cycles;
+
+static uint64_t test_tick_cycles;
+
+/*
+ * Charge the ticks elapsed since the last sample to the thread that took it,
+ * as tick-based accounting would have done.
+ *
+ * Both threads are bound to the same processor, and sample the time very
+ * frequently while running, so the thread that took the last sample is the
+ * one that was running when the timer interrupts occurred.
+ */
+static void
+test_sample_ticks(struct test_thread *test)
+{
+    uint64_t time;
+
+    thread_preempt_disable();
+
+    time = clock_get_time();
+
+    if (test_owner != NULL) {
+        test_owner->ticks += time - test_owner_time;
+    }
+
+    test_owner = test;
+    test_owner_time = time;
+
+    thread_preempt_enable();
+}
+
+static uint64_t
+test_consume(struct test_thread *test, uint64_t *prevp)
+{
+    uint64_t now, delta;
+
+    test_sample_ticks(test);
+
+    now = cpu_get_tsc();
+    delta = now - *prevp;
+    *prevp = now;
+
+    if (delta >= test_gap_cycles) {
+        return 0;
+    }
+
+    test->consumed += delta;
+    return delta;
+}
+
+static void
+test_run_hog(void *arg)
+{
+    struct test_thread *test;
+    uint64_t prev;
+
+    test = arg;
+    prev = cpu_get_tsc();
+
+    while (!atomic_load(&test_done, ATOMIC_RELAXED)) {
+        test_consume(test, &prev);
+    }
+}
+
+static void
+test_run_sleeper(void *arg)
+{
+    struct test_thread *test;
+    uint64_t prev, burst;
+
+    test = arg;
+
+    while (!atomic_load(&test_done, ATOMIC_RELAXED)) {
+        thread_delay(clock_get_time() + 1, true);
+
+        burst = 0;
+        prev = cpu_get_tsc();
+
+        while (burst < ((test_tick_cycles * TEST_SLEEPER_LOAD) / 100)) {
+            burst += test_consume(test, &prev);
+        }
+    }
+}
+
+static void
+test_create(struct test_thread *test, const char *name,
+            void (*fn)(void *), struct cpumap *cpumap)
+{
+    struct thread_attr attr;
+    int error;
+
+    test->consumed = 0;
+    test->ticks = 0;
+
+    thread_attr_init(&attr, name);
+    thread_attr_set_cpumap(&attr, cpumap);
+    error = thread_create(&test->thread, &attr, fn, test);
+    error_check(error, "thread_create");
+}
+
+static unsigned int
+test_diff(unsigned int a, unsigned int b)
+{
+    return (a > b) ? (a - b) : (b - a);
+}
+
+static void
+test_run(void *arg)
+{
+    unsigned int hog_share, sleeper_share, error_share;
+    unsigned int hog_charged, sleeper_charged, tick_error;
+    struct cpumap *cpumap;
+    uint64_t total, total_ticks;
+    int error;
+
+    (void)arg;
+
+    test_tick_cycles = cpu_get_freq() / CLOCK_FREQ;
+    test_gap_cycles = cpu_get_freq() / 100000;
+
+    error = cpumap_create(&cpumap);
+    error_check(error, "cpumap_create");
+    cpumap_zero(cpumap);
+    cpumap_set(cpumap, cpu_count() - 1);
+
+    test_create(&test_hog, THREAD_KERNEL_PREFIX "test_run_hog",
+                test_run_hog, cpumap);
+    test_create(&test_sleeper, THREAD_KERNEL_PREFIX "test_run_sleeper",
+                test_run_sleeper, cpumap);
+
+    cpumap_destroy(cpumap);
+
+    thread_delay(clock_ticks_from_ms(TEST_DURATION), false);
+    atomic_store(&test_done, true, ATOMIC_RELAXED);
+
+    thread_join(test_hog.thread);
+    thread_join(test_sleeper.thread);
+
+    total = test_hog.consumed + test_sleeper.consumed;
+
+    if (total == 0) {
+        panic("test: no processor time consumed");
+    }
+
+    total_ticks = test_hog.ticks + test_sleeper.ticks;
+
+    if (total_ticks == 0) {
+        panic("test: no tick charged");
+    }
+
+    hog_share = (test_hog.consumed * 100) / total;
+    sleeper_share = (test_sleeper.consumed * 100) / total;
+    error_share = test_diff(hog_share, 50);
+
+    hog_charged = (test_hog.ticks * 100) / total_ticks;
+    sleeper_charged = (test_sleeper.ticks * 100) / total_ticks;
+    tick_error = test_diff(hog_charged, hog_share);
+
+    log_info("test: consumed: hog: %u%%, sleeper: %u%%, fairness error: %u%%",
+             hog_share, sleeper_share, error_share);
+    log_info("test: tick-based charges: hog: %u%%, sleeper: %u%%, "
+             "accounting error: %u%%",
+             hog_charged, sleeper_charged, tick_error);
+
+    if (tick_error <= TEST_MAX_ERROR) {
+        log_warning("test: workload not affected by tick-based accounting");
+    }
+
+    if (error_share > TEST_MAX_ERROR) {
+        panic("test: fairness error too high");
+    }
+
+    log_info("test: done");
+}
+
+void __init
+test_setup(void)
+{
+    struct thread_attr attr;
+    struct thread *thread;
+    int error;
+
+    thread_attr_init(&attr, THREAD_KERNEL_PREFIX "test_run");
+    thread_attr_set_detached(&attr);
+    thread_attr_set_policy(&attr, THREAD_SCHED_POLICY_FIFO);
+    thread_attr_set_priority(&attr, THREAD_SCHED_RT_PRIO_MIN);
+    error = thread_create(&thread, &attr, test_run, NULL);
+    error_check(error, "thread_create");
+}
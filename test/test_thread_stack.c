@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * This test module checks that threads can run on stacks smaller than
+ * the default size, and that the memory saved is accounted.
+ *
+ * The test thread creates a thread with the smallest stack size, which
+ * sleeps for a tick, so that it's scheduled out and back in, and records
+ * how much of its stack it used. While it exists, the saved stack memory
+ * counter must have grown by the difference between the default and the
+ * actual stack size, and must be back to its previous value once the
+ * thread is joined.
+ *
+ * Other threads are assumed not to be created or destroyed while the test
+ * runs.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kern/atomic.h>
+#include <kern/clock.h>
+#include <kern/error.h>
+#include <kern/init.h>
+#include <kern/log.h>
+#include <kern/panic.h>
+#include <kern/syscnt.h>
+#include <kern/thread.h>
+#include <machine/tcb.h>
+#include <test/test.h>
+
+static size_t test_usage;
+
+static void
+test_run_small(void *arg)
+{
+    (void)arg;
+
+    thread_delay(1, false);
+    atomic_store(&test_usage, thread_stack_usage(thread_self()),
+                 ATOMIC_RELEASE);
+}
+
+static void
+test_run(void *arg)
+{
+    uint64_t saved, prev_saved;
+    struct thread_attr attr;
+    struct thread *thread;
+    struct syscnt *syscnt;
+    size_t size, usage;
+    int error;
+
+    (void)arg;
+
+    syscnt = syscnt_lookup("thread_stack_saved_bytes");
+
+    if (syscnt == NULL) {
+        panic("test: stack counter not found");
+    }
+
+    prev_saved = syscnt_read(syscnt);
+
+    thread_attr_init(&attr, THREAD_KERNEL_PREFIX "test_run_small");
+    thread_attr_set_stack_size(&attr, THREAD_STACK_MIN_SIZE);
+    error = thread_create(&thread, &attr, test_run_small, NULL);
+    error_check(error, "thread_create");
+
+    size = thread_stack_size(thread);
+    saved = syscnt_read(syscnt);
+
+#ifndef CONFIG_THREAD_STACK_GUARD
+    if (size != THREAD_STACK_MIN_SIZE) {
+        panic("test: invalid stack size");
+    }
+#endif /* CONFIG_THREAD_STACK_GUARD */
+
+    if ((saved - prev_saved) != (TCB_STACK_SIZE - size)) {
+        panic("test: invalid saved stack memory");
+    }
+
+    thread_join(thread);
+
+    usage = atomic_load(&test_usage, ATOMIC_ACQUIRE);
+
+    if (usage == 0) {
+        panic("test: thread didn't run");
+    } else if (usage > size) {
+        panic("test: invalid stack usage");
+    }
+
+    if (syscnt_read(syscnt) != prev_saved) {
+        panic("test: saved stack memory not released");
+    }
+
+    log_info("test: stack size: %zu, usage: %zu, saved: %llu bytes",
+             size, usage, (unsigned long long)(saved - prev_saved));
+    log_info("test: total saved: %llu bytes", (unsigned long long)prev_saved);
+    log_info("test: done");
+}
+
+void __init
+test_setup(void)
+{
+    struct thread_attr attr;
+    struct thread *thread;
+    int error;
+
+    thread_attr_init(&attr, THREAD_KERNEL_PREFIX "test_run");
+    thread_attr_set_detached(&attr);
+    error = thread_create(&thread, &attr, test_run, NULL);
+    error_check(error, "thread_create");
+}
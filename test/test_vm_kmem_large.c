@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * This test module measures the benefit of large page mappings on a
+ * TLB-miss-bound workload, and checks that partially removing them
+ * preserves the remaining mappings.
+ *
+ * A buffer is allocated from the kernel map, which backs it with large
+ * pages when possible, and aliased with a small page mapping of the same
+ * physical memory. The test thread then reads one word per page, in a
+ * pseudo-random order, through both mappings, and reports the average
+ * number of cycles per access for each of them.
+ *
+ * Finally, a page is removed from the middle of the buffer, which splits
+ * the large mapping containing it, and the other pages are checked to
+ * still be mapped to the same physical pages.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kern/cpumap.h>
+#include <kern/error.h>
+#include <kern/init.h>
+#include <kern/log.h>
+#include <kern/panic.h>
+#include <kern/thread.h>
+#include <machine/cpu.h>
+#include <machine/page.h>
+#include <machine/pmap.h>
+#include <test/test.h>
+#include <vm/vm_kmem.h>
+#include <vm/vm_page.h>
+#include <vm/vm_prot.h>
+
+#define TEST_SIZE (32 * 1024 * 1024)
+
+#define TEST_NR_PAGES (TEST_SIZE / PAGE_SIZE)
+
+#define TEST_NR_ACCESSES (TEST_NR_PAGES * 16)
+
+static phys_addr_t test_pas[TEST_NR_PAGES];
+
+static uint64_t
+test_access(const char *buf)
+{
+    unsigned long sum;
+    unsigned int index;
+    uint64_t start;
+
+    sum = 0;
+    index = 0;
+    start = cpu_get_tsc();
+
+    for (unsigned int i = 0; i < TEST_NR_ACCESSES; i++) {
+        /* Full period linear congruential generator */
+        index = ((index * 1103515245) + 12345) & (TEST_NR_PAGES - 1);
+        sum += *(const volatile unsigned long *)&buf[index * PAGE_SIZE];
+    }
+
+    if (sum != ((unsigned long)TEST_NR_ACCESSES * 0x5a5a5a5aUL)) {
+        panic("test: invalid content");
+    }
+
+    return cpu_get_tsc() - start;
+}
+
+static void
+test_fill(char *buf)
+{
+    for (unsigned int i = 0; i < TEST_NR_PAGES; i++) {
+        *(unsigned long *)&buf[i * PAGE_SIZE] = 0x5a5a5a5aUL;
+    }
+}
+
+static char *
+test_alias(const char *buf)
+{
+    struct pmap *kernel_pmap;
+    uintptr_t va;
+    int error;
+
+    kernel_pmap = pmap_get_kernel_pmap();
+    va = (uintptr_t)vm_kmem_alloc_va(TEST_SIZE);
+
+    if (va == 0) {
+        panic("test: unable to allocate alias");
+    }
+
+    for (unsigned int i = 0; i < TEST_NR_PAGES; i++) {
+        error = pmap_kextract((uintptr_t)buf + (i * PAGE_SIZE), &test_pas[i]);
+        error_check(error, "pmap_kextract");
+        error = pmap_enter(kernel_pmap, va + (i * PAGE_SIZE), test_pas[i],
+                           VM_PROT_READ | VM_PROT_WRITE, PMAP_PEF_GLOBAL);
+        error_check(error, "pmap_enter");
+    }
+
+    error = pmap_update(kernel_pmap);
+    error_check(error, "pmap_update");
+
+    return (char *)va;
+}
+
+static void
+test_unalias(char *alias)
+{
+    struct pmap *kernel_pmap;
+    uintptr_t va;
+    int error;
+
+    kernel_pmap = pmap_get_kernel_pmap();
+    va = (uintptr_t)alias;
+
+    for (unsigned int i = 0; i < TEST_NR_PAGES; i++) {
+        error = pmap_remove(kernel_pmap, va + (i * PAGE_SIZE), cpumap_all());
+        error_check(error, "pmap_remove");
+    }
+
+    error = pmap_update(kernel_pmap);
+    error_check(error, "pmap_update");
+    vm_kmem_free_va(alias, TEST_SIZE);
+}
+
+static void
+test_demote(char *buf)
+{
+    struct pmap *kernel_pmap;
+    unsigned int index;
+    phys_addr_t pa;
+    int error;
+
+    kernel_pmap = pmap_get_kernel_pmap();
+    index = (TEST_NR_PAGES / 2) + 1;
+
+    error = pmap_remove(kernel_pmap, (uintptr_t)buf + (index * PAGE_SIZE),
+                        cpumap_all());
+    error_check(error, "pmap_remove");
+    error = pmap_update(kernel_pmap);
+    error_check(error, "pmap_update");
+
+    for (unsigned int i = 0; i < TEST_NR_PAGES; i++) {
+        error = pmap_kextract((uintptr_t)buf + (i * PAGE_SIZE), &pa);
+
+        if (i == index) {
+            if (error != EFAULT) {
+                panic("test: page not removed");
+            }
+
+            continue;
+        }
+
+        error_check(error, "pmap_kextract");
+
+        if (pa != test_pas[i]) {
+            panic("test: invalid mapping after split");
+        }
+    }
+
+    error = pmap_enter(kernel_pmap, (uintptr_t)buf + (index * PAGE_SIZE),
+                       test_pas[index], VM_PROT_READ | VM_PROT_WRITE,
+                       PMAP_PEF_GLOBAL);
+    error_check(error, "pmap_enter");
+    error = pmap_update(kernel_pmap);
+    error_check(error, "pmap_update");
+}
+
+static void
+test_run(void *arg)
+{
+    uint64_t small, large;
+    char *buf, *alias;
+
+    (void)arg;
+
+    log_info("test: max page size: %zu", pmap_max_page_size(TEST_SIZE));
+
+    buf = vm_kmem_alloc(TEST_SIZE);
+
+    if (buf == NULL) {
+        panic("test: unable to allocate buffer");
+    }
+
+    alias = test_alias(buf);
+    test_fill(buf);
+
+    /* Warm up the caches */
+    test_access(buf);
+
+    small = test_access(alias);
+    large = test_access(buf);
+
+    log_info("test: small pages: %llu cycles/access, "
+             "large pages: %llu cycles/access",
+             (unsigned long long)(small / TEST_NR_ACCESSES),
+             (unsigned long long)(large / TEST_NR_ACCESSES));
+
+    test_unalias(alias);
+    test_demote(buf);
+    test_access(buf);
+    vm_kmem_free(buf, TEST_SIZE);
+
+    log_info("test: done");
+}
+
+void __init
+test_setup(void)
+{
+    struct thread_attr attr;
+    struct thread *thread;
+    int error;
+
+    thread_attr_init(&attr, THREAD_KERNEL_PREFIX "test_run");
+    thread_attr_set_detached(&attr);
+    error = thread_create(&thread, &attr, test_run, NULL);
+    error_check(error, "thread_create");
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * This test module measures the cost of finding free space in a large and
+ * fragmented map.
+ *
+ * A map is filled with single page entries, which are prevented from being
+ * merged by alternating their protection. Every other entry is then removed,
+ * leaving single page holes between the remaining ones. The test thread
+ * measures the average number of cycles per allocation for mappings which
+ * don't fit in any hole, with and without an alignment constraint, and
+ * finally for mappings that refill the holes.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <kern/error.h>
+#include <kern/init.h>
+#include <kern/kmem.h>
+#include <kern/log.h>
+#include <kern/macros.h>
+#include <kern/panic.h>
+#include <kern/thread.h>
+#include <machine/cpu.h>
+#include <machine/page.h>
+#include <test/test.h>
+#include <vm/vm_adv.h>
+#include <vm/vm_inherit.h>
+#include <vm/vm_map.h>
+#include <vm/vm_prot.h>
+
+#define TEST_NR_ENTRIES 100000
+
+#define TEST_NR_ALLOCS 1000
+
+#define TEST_ALIGN (16 * PAGE_SIZE)
+
+static struct vm_map *test_map;
+
+static uintptr_t *test_starts;
+
+static uintptr_t test_alloc_starts[TEST_NR_ALLOCS];
+
+static int
+test_flags(unsigned int i)
+{
+    int prot;
+
+    prot = (i & 1) ? VM_PROT_READ : VM_PROT_ALL;
+    return VM_MAP_FLAGS(prot, VM_PROT_ALL, VM_INHERIT_NONE,
+                        VM_ADV_DEFAULT, 0);
+}
+
+static uintptr_t
+test_enter(size_t size, size_t align, int flags)
+{
+    uintptr_t start;
+    int error;
+
+    start = 0;
+    error = vm_map_enter(test_map, &start, size, align, flags, NULL, 0);
+    error_check(error, "vm_map_enter");
+    return start;
+}
+
+static uint64_t
+test_fill(void)
+{
+    uint64_t start;
+
+    start = cpu_get_tsc();
+
+    for (unsigned int i = 0; i < TEST_NR_ENTRIES; i++) {
+        test_starts[i] = test_enter(PAGE_SIZE, 0, test_flags(i));
+    }
+
+    return cpu_get_tsc() - start;
+}
+
+static void
+test_fragment(void)
+{
+    for (unsigned int i = 1; i < TEST_NR_ENTRIES; i += 2) {
+        vm_map_remove(test_map, test_starts[i], test_starts[i] + PAGE_SIZE);
+    }
+}
+
+static uint64_t
+test_alloc(size_t size, size_t align)
+{
+    uint64_t start;
+
+    start = cpu_get_tsc();
+
+    for (unsigned int i = 0; i < TEST_NR_ALLOCS; i++) {
+        test_alloc_starts[i] = test_enter(size, align, test_flags(i));
+
+        if ((align != 0) && !P2ALIGNED(test_alloc_starts[i], align)) {
+            panic("test: invalid alignment");
+        }
+    }
+
+    start = cpu_get_tsc() - start;
+
+    for (unsigned int i = 0; i < TEST_NR_ALLOCS; i++) {
+        vm_map_remove(test_map, test_alloc_starts[i],
+                      test_alloc_starts[i] + size);
+    }
+
+    return start;
+}
+
+static uint64_t
+test_refill(void)
+{
+    uintptr_t addr;
+    uint64_t start;
+
+    start = cpu_get_tsc();
+
+    for (unsigned int i = 1; i < TEST_NR_ENTRIES; i += 2) {
+        addr = test_enter(PAGE_SIZE, 0, test_flags(i));
+
+        if (addr != test_starts[i]) {
+            panic("test: hole not refilled in order");
+        }
+    }
+
+    return cpu_get_tsc() - start;
+}
+
+static void
+test_run(void *arg)
+{
+    uint64_t fill, large, aligned, refill;
+    int error;
+
+    (void)arg;
+
+    error = vm_map_create(&test_map);
+    error_check(error, "vm_map_create");
+
+    test_starts = kmem_alloc(TEST_NR_ENTRIES * sizeof(*test_starts));
+
+    if (test_starts == NULL) {
+        panic("test: unable to allocate start addresses");
+    }
+
+    fill = test_fill();
+    test_fragment();
+    large = test_alloc(2 * PAGE_SIZE, 0);
+    aligned = test_alloc(PAGE_SIZE, TEST_ALIGN);
+    refill = test_refill();
+
+    log_info("test: entries: %u, fill: %llu cycles/alloc",
+             TEST_NR_ENTRIES, (unsigned long long)(fill / TEST_NR_ENTRIES));
+    log_info("test: fragmented: large: %llu cycles/alloc, "
+             "aligned: %llu cycles/alloc",
+             (unsigned long long)(large / TEST_NR_ALLOCS),
+             (unsigned long long)(aligned / TEST_NR_ALLOCS));
+    log_info("test: refill: %llu cycles/alloc",
+             (unsigned long long)(refill / (TEST_NR_ENTRIES / 2)));
+
+    vm_map_info(test_map);
+    vm_map_remove(test_map, test_starts[0],
+                  test_starts[TEST_NR_ENTRIES - 1] + PAGE_SIZE);
+    kmem_free(test_starts, TEST_NR_ENTRIES * sizeof(*test_starts));
+
+    log_info("test: done");
+}
+
+void __init
+test_setup(void)
+{
+    struct thread_attr attr;
+    struct thread *thread;
+    int error;
+
+    thread_attr_init(&attr, THREAD_KERNEL_PREFIX "test_run");
+    thread_attr_set_detached(&attr);
+    error = thread_create(&thread, &attr, test_run, NULL);
+    error_check(error, "thread_create");
+}
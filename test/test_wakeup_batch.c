@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2018 Richard Braun.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * This test module measures the cost of waking up a herd of threads
+ * waiting on a condition variable.
+ *
+ * A few waiter threads are bound to each processor. For each round, the
+ * controller thread increments a generation counter and wakes up all
+ * waiters, either with a single broadcast, or by signalling each of them
+ * in turn. It then waits until all waiters have observed the new
+ * generation. The average number of cycles spent in the wake-up calls,
+ * and until all waiters have run, is reported for both methods.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kern/condition.h>
+#include <kern/cpumap.h>
+#include <kern/error.h>
+#include <kern/init.h>
+#include <kern/kmem.h>
+#include <kern/log.h>
+#include <kern/mutex.h>
+#include <kern/panic.h>
+#include <kern/thread.h>
+#include <machine/cpu.h>
+#include <test/test.h>
+
+#define TEST_WAITERS_PER_CPU 4
+
+#define TEST_NR_ROUNDS 1000
+
+static struct mutex test_lock;
+static struct condition test_wake_cond;
+static struct condition test_done_cond;
+
+static unsigned long test_generation;
+static unsigned int test_nr_waiters;
+static unsigned int test_nr_started;
+static unsigned int test_nr_awake;
+static bool test_done;
+
+static void
+test_wait(void *arg)
+{
+    unsigned long generation;
+
+    (void)arg;
+
+    mutex_lock(&test_lock);
+
+    generation = test_generation;
+    test_nr_started++;
+
+    /*
+     * The lock is held until waiting on the condition variable, so that the
+     * controller can't start a round before all waiters wait.
+     */
+    if (test_nr_started == test_nr_waiters) {
+        condition_signal(&test_done_cond);
+    }
+
+    for (;;) {
+        while (!test_done && (generation == test_generation)) {
+            condition_wait(&test_wake_cond, &test_lock);
+        }
+
+        if (test_done) {
+            break;
+        }
+
+        generation = test_generation;
+        test_nr_awake++;
+
+        if (test_nr_awake == test_nr_waiters) {
+            condition_signal(&test_done_cond);
+        }
+    }
+
+    mutex_unlock(&test_lock);
+}
+
+static void
+test_wait_all_started(void)
+{
+    while (test_nr_started != test_nr_waiters) {
+        condition_wait(&test_done_cond, &test_lock);
+    }
+}
+
+static void
+test_wait_all_awake(void)
+{
+    while (test_nr_awake != test_nr_waiters) {
+        condition_wait(&test_done_cond, &test_lock);
+    }
+}
+
+static void
+test_run_rounds(const char *name, bool broadcast)
+{
+    uint64_t wake_cycles, total_cycles, t0, t1;
+
+    wake_cycles = 0;
+    total_cycles = 0;
+
+    mutex_lock(&test_lock);
+
+    for (unsigned int i = 0; i < TEST_NR_ROUNDS; i++) {
+        test_nr_awake = 0;
+        test_generation++;
+
+        t0 = cpu_get_tsc();
+
+        if (broadcast) {
+            condition_broadcast(&test_wake_cond);
+        } else {
+            for (unsigned int j = 0; j < test_nr_waiters; j++) {
+                condition_signal(&test_wake_cond);
+            }
+        }
+
+        t1 = cpu_get_tsc();
+        test_wait_all_awake();
+
+        wake_cycles += t1 - t0;
+        total_cycles += cpu_get_tsc() - t0;
+    }
+
+    mutex_unlock(&test_lock);
+
+    log_info("test: %s: waiters: %u, wake: %llu cycles, all awake: %llu cycles",
+             name, test_nr_waiters,
+             (unsigned long long)(wake_cycles / TEST_NR_ROUNDS),
+             (unsigned long long)(total_cycles / TEST_NR_ROUNDS));
+}
+
+static void
+test_run(void *arg)
+{
+    struct thread_attr attr;
+    struct thread **threads;
+    struct cpumap *cpumap;
+    char name[THREAD_NAME_SIZE];
+    unsigned int i;
+    int error;
+
+    (void)arg;
+
+    test_nr_waiters = cpu_count() * TEST_WAITERS_PER_CPU;
+    threads = kmem_alloc(test_nr_waiters * sizeof(*threads));
+
+    if (threads == NULL) {
+        panic("test: unable to allocate threads");
+    }
+
+    error = cpumap_create(&cpumap);
+    error_check(error, "cpumap_create");
+
+    for (i = 0; i < test_nr_waiters; i++) {
+        cpumap_zero(cpumap);
+        cpumap_set(cpumap, i % cpu_count());
+        snprintf(name, sizeof(name), THREAD_KERNEL_PREFIX "test_wait:%u", i);
+        thread_attr_init(&attr, name);
+        thread_attr_set_cpumap(&attr, cpumap);
+        error = thread_create(&threads[i], &attr, test_wait, NULL);
+        error_check(error, "thread_create");
+    }
+
+    cpumap_destroy(cpumap);
+
+    /*
+     * Wait for all waiters to sleep, and run a first round so that they're
+     * all warmed up before measurements start.
+     */
+    mutex_lock(&test_lock);
+    test_wait_all_started();
+    test_nr_awake = 0;
+    test_generation++;
+    condition_broadcast(&test_wake_cond);
+    test_wait_all_awake();
+    mutex_unlock(&test_lock);
+
+    test_run_rounds("broadcast", true);
+    test_run_rounds("signal", false);
+
+    mutex_lock(&test_lock);
+    test_done = true;
+    condition_broadcast(&test_wake_cond);
+    mutex_unlock(&test_lock);
+
+    for (i = 0; i < test_nr_waiters; i++) {
+        thread_join(threads[i]);
+    }
+
+    kmem_free(threads, test_nr_waiters * sizeof(*threads));
+
+    log_info("test: done");
+}
+
+void __init
+test_setup(void)
+{
+    struct thread_attr attr;
+    struct thread *thread;
+    int error;
+
+    mutex_init(&test_lock);
+    condition_init(&test_wake_cond);
+    condition_init(&test_done_cond);
+
+    thread_attr_init(&attr, THREAD_KERNEL_PREFIX "test_run");
+    thread_attr_set_detached(&attr);
+    error = thread_create(&thread, &attr, test_run, NULL);
+    error_check(error, "thread_create");
+}
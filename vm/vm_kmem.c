@@ -33,6 +33,11 @@
 #include <vm/vm_page.h>
 #include <vm/vm_prot.h>
 
+/*
+ * Maximum size of the physical blocks backing large page mappings.
+ */
+#define VM_KMEM_MAX_BLOCK_SIZE vm_page_ptob(1UL << VM_PAGE_MAX_ORDER)
+
 static uint64_t
 vm_kmem_offset(uintptr_t va)
 {
@@ -77,8 +82,27 @@ vm_kmem_free_check(uintptr_t va, size_t size)
     return vm_kmem_alloc_check(size);
 }
 
-void *
-vm_kmem_alloc_va(size_t size)
+/*
+ * Return the size of the largest page that can map the given virtual and
+ * physical addresses, in a region of the given size.
+ */
+static size_t
+vm_kmem_page_size(uintptr_t va, phys_addr_t pa, size_t size)
+{
+    size_t page_size;
+
+    page_size = pmap_max_page_size(size);
+
+    while ((page_size != PAGE_SIZE)
+           && (!P2ALIGNED(va, page_size) || !P2ALIGNED(pa, page_size))) {
+        page_size = pmap_max_page_size(page_size - 1);
+    }
+
+    return page_size;
+}
+
+static void *
+vm_kmem_alloc_va_aligned(size_t size, size_t align)
 {
     int error, flags;
     uintptr_t va;
@@ -88,7 +112,8 @@ vm_kmem_alloc_va(size_t size)
     va = 0;
     flags = VM_MAP_FLAGS(VM_PROT_ALL, VM_PROT_ALL, VM_INHERIT_NONE,
                          VM_ADV_DEFAULT, 0);
-    error = vm_map_enter(vm_map_get_kernel_map(), &va, size, 0, flags, NULL, 0);
+    error = vm_map_enter(vm_map_get_kernel_map(), &va, size, align, flags,
+                         NULL, 0);
 
     if (error) {
         return NULL;
@@ -97,6 +122,12 @@ vm_kmem_alloc_va(size_t size)
     return (void *)va;
 }
 
+void *
+vm_kmem_alloc_va(size_t size)
+{
+    return vm_kmem_alloc_va_aligned(size, 0);
+}
+
 void
 vm_kmem_free_va(void *addr, size_t size)
 {
@@ -107,44 +138,99 @@ vm_kmem_free_va(void *addr, size_t size)
     vm_map_remove(vm_map_get_kernel_map(), va, va + vm_page_round(size));
 }
 
+/*
+ * Insert a block of physical pages in the kernel object.
+ *
+ * The pages become managed by the object, and are all freed in case of
+ * failure.
+ */
+static int
+vm_kmem_insert_block(struct vm_page *page, uintptr_t va, size_t size)
+{
+    struct vm_object *kernel_object;
+    size_t i, nr_pages;
+    int error;
+
+    kernel_object = vm_object_get_kernel_object();
+    nr_pages = vm_page_btop(size);
+
+    for (i = 0; i < nr_pages; i++) {
+        error = vm_object_insert(kernel_object, &page[i],
+                                 vm_kmem_offset(va + vm_page_ptob(i)));
+
+        if (error) {
+            for (i++; i < nr_pages; i++) {
+                vm_page_free(&page[i], 0);
+            }
+
+            return error;
+        }
+    }
+
+    return 0;
+}
+
 void *
 vm_kmem_alloc(size_t size)
 {
-    struct vm_object *kernel_object;
     struct pmap *kernel_pmap;
     struct vm_page *page;
     uintptr_t va, start, end;
+    size_t page_size;
     int error;
 
     size = vm_page_round(size);
-    va = (uintptr_t)vm_kmem_alloc_va(size);
+
+    /*
+     * Use large pages when possible, in which case the virtual region
+     * must be aligned on the largest one.
+     */
+    page_size = pmap_max_page_size(MIN(size, VM_KMEM_MAX_BLOCK_SIZE));
+    va = (uintptr_t)vm_kmem_alloc_va_aligned(size, page_size);
 
     if (va == 0) {
         return NULL;
     }
 
-    kernel_object = vm_object_get_kernel_object();
     kernel_pmap = pmap_get_kernel_pmap();
 
-    for (start = va, end = va + size; start < end; start += PAGE_SIZE) {
-        page = vm_page_alloc(0, VM_PAGE_SEL_HIGHMEM, VM_PAGE_KERNEL);
+    for (start = va, end = va + size; start < end; start += page_size) {
+        page_size = vm_kmem_page_size(start, 0, MIN(end - start,
+                                                    VM_KMEM_MAX_BLOCK_SIZE));
+        page = NULL;
+
+        if (page_size != PAGE_SIZE) {
+            page = vm_page_alloc(vm_page_order(page_size),
+                                 VM_PAGE_SEL_HIGHMEM, VM_PAGE_KERNEL);
+
+            /* Fall back to small pages if memory is fragmented */
+            if (page == NULL) {
+                page_size = PAGE_SIZE;
+            }
+        }
 
         if (page == NULL) {
-            goto error;
+            page = vm_page_alloc(0, VM_PAGE_SEL_HIGHMEM, VM_PAGE_KERNEL);
+
+            if (page == NULL) {
+                goto error;
+            }
         }
 
-        /*
-         * The page becomes managed by the object and is freed in case
-         * of failure.
-         */
-        error = vm_object_insert(kernel_object, page, vm_kmem_offset(start));
+        error = vm_kmem_insert_block(page, start, page_size);
 
         if (error) {
             goto error;
         }
 
-        error = pmap_enter(kernel_pmap, start, vm_page_to_pa(page),
-                           VM_PROT_READ | VM_PROT_WRITE, PMAP_PEF_GLOBAL);
+        if (page_size == PAGE_SIZE) {
+            error = pmap_enter(kernel_pmap, start, vm_page_to_pa(page),
+                               VM_PROT_READ | VM_PROT_WRITE, PMAP_PEF_GLOBAL);
+        } else {
+            error = pmap_enter_large(kernel_pmap, start, vm_page_to_pa(page),
+                                     page_size, VM_PROT_READ | VM_PROT_WRITE,
+                                     PMAP_PEF_GLOBAL);
+        }
 
         if (error || (start - va == vm_page_ptob(1000))) {
             goto error;
@@ -195,7 +281,7 @@ vm_kmem_map_pa(phys_addr_t pa, size_t size,
 {
     struct pmap *kernel_pmap;
     uintptr_t offset, map_va;
-    size_t map_size;
+    size_t map_size, page_size;
     phys_addr_t start;
     int error;
 
@@ -203,15 +289,31 @@ vm_kmem_map_pa(phys_addr_t pa, size_t size,
 
     start = vm_page_trunc(pa);
     map_size = vm_page_round(pa + size) - start;
-    map_va = (uintptr_t)vm_kmem_alloc_va(map_size);
+
+    /*
+     * Use large pages when possible, in which case the virtual region
+     * must be aligned like the physical one.
+     */
+    page_size = vm_kmem_page_size(0, start, map_size);
+    map_va = (uintptr_t)vm_kmem_alloc_va_aligned(map_size, page_size);
 
     if (map_va == 0) {
         return NULL;
     }
 
-    for (offset = 0; offset < map_size; offset += PAGE_SIZE) {
-        error = pmap_enter(kernel_pmap, map_va + offset, start + offset,
-                           VM_PROT_READ | VM_PROT_WRITE, PMAP_PEF_GLOBAL);
+    for (offset = 0; offset < map_size; offset += page_size) {
+        page_size = vm_kmem_page_size(map_va + offset, start + offset,
+                                      map_size - offset);
+
+        if (page_size == PAGE_SIZE) {
+            error = pmap_enter(kernel_pmap, map_va + offset, start + offset,
+                               VM_PROT_READ | VM_PROT_WRITE, PMAP_PEF_GLOBAL);
+        } else {
+            error = pmap_enter_large(kernel_pmap, map_va + offset,
+                                     start + offset, page_size,
+                                     VM_PROT_READ | VM_PROT_WRITE,
+                                     PMAP_PEF_GLOBAL);
+        }
 
         if (error) {
             goto error;
@@ -43,11 +43,6 @@
 #include <vm/vm_page.h>
 #include <vm/vm_prot.h>
 
-/*
- * Special threshold which disables the use of the free area cache address.
- */
-#define VM_MAP_NO_FIND_CACHE (~(size_t)0)
-
 /*
  * Mapping request.
  *
@@ -184,13 +179,6 @@ vm_map_lookup_nearest(struct vm_map *map, uintptr_t addr)
     return NULL;
 }
 
-static void
-vm_map_reset_find_cache(struct vm_map *map)
-{
-    map->find_cache = 0;
-    map->find_cache_threshold = VM_MAP_NO_FIND_CACHE;
-}
-
 static int
 vm_map_find_fixed(struct vm_map *map, struct vm_map_request *request)
 {
@@ -224,108 +212,201 @@ vm_map_find_fixed(struct vm_map *map, struct vm_map_request *request)
     return 0;
 }
 
-static int
-vm_map_find_avail(struct vm_map *map, struct vm_map_request *request)
+static inline struct vm_map_entry *
+vm_map_next(struct vm_map *map, struct vm_map_entry *entry)
 {
-    struct vm_map_entry *next;
     struct list *node;
-    uintptr_t base, start;
-    size_t size, align, space;
-    int error;
 
-    /* If there is a hint, try there */
-    if (request->start != 0) {
-        error = vm_map_find_fixed(map, request);
+    node = list_next(&entry->list_node);
 
-        if (!error) {
-            return 0;
-        }
+    if (list_end(&map->entry_list, node)) {
+        return NULL;
+    } else {
+        return list_entry(node, struct vm_map_entry, list_node);
     }
+}
 
-    size = request->size;
-    align = request->align;
+static inline struct vm_map_entry *
+vm_map_prev(struct vm_map *map, struct vm_map_entry *entry)
+{
+    struct list *node;
 
-    if (size > map->find_cache_threshold) {
-        base = map->find_cache;
+    node = list_prev(&entry->list_node);
+
+    if (list_end(&map->entry_list, node)) {
+        return NULL;
     } else {
-        base = map->start;
+        return list_entry(node, struct vm_map_entry, list_node);
+    }
+}
 
-        /*
-         * Searching from the map start means the area which size is the
-         * threshold (or a smaller one) may be selected, making the threshold
-         * invalid. Reset it.
-         */
-        map->find_cache_threshold = 0;
+static inline size_t
+vm_map_subtree_max_gap(const struct rbtree_node *node)
+{
+    const struct vm_map_entry *entry;
+
+    if (node == NULL) {
+        return 0;
     }
 
-retry:
-    start = base;
-    next = vm_map_lookup_nearest(map, start);
+    entry = rbtree_entry(node, struct vm_map_entry, tree_node);
+    return entry->max_gap;
+}
 
-    for (;;) {
-        assert(start <= map->end);
+/*
+ * Augmented tree update function.
+ */
+static void
+vm_map_entry_update(struct rbtree_node *node)
+{
+    struct vm_map_entry *entry;
+    size_t max_gap;
 
-        if (align != 0) {
-            start = P2ROUND(start, align);
-        }
+    entry = rbtree_entry(node, struct vm_map_entry, tree_node);
+    max_gap = MAX(entry->gap,
+                  vm_map_subtree_max_gap(node->children[RBTREE_LEFT]));
+    entry->max_gap = MAX(max_gap,
+                         vm_map_subtree_max_gap(node->children[RBTREE_RIGHT]));
+}
 
-        /*
-         * The end of the map has been reached, and no space could be found.
-         * If the search didn't start at map->start, retry from there in case
-         * space is available below the previous start address.
-         */
-        if ((map->end - start) < size) {
-            if (base != map->start) {
-                base = map->start;
-                map->find_cache_threshold = 0;
-                goto retry;
-            }
+/*
+ * Compute the gap preceding an entry from its position in the entry list.
+ *
+ * This function doesn't update the tree.
+ */
+static void
+vm_map_entry_set_gap(struct vm_map *map, struct vm_map_entry *entry)
+{
+    struct vm_map_entry *prev;
+    uintptr_t prev_end;
 
-            return ENOMEM;
-        }
+    prev = vm_map_prev(map, entry);
+    prev_end = (prev == NULL) ? map->start : prev->end;
+    assert(prev_end <= entry->start);
+    entry->gap = entry->start - prev_end;
+}
 
-        if (next == NULL) {
-            space = map->end - start;
-        } else if (start >= next->start) {
-            space = 0;
-        } else {
-            space = next->start - start;
-        }
+/*
+ * Check whether a free range can hold a mapping of the given size and
+ * alignment.
+ *
+ * If it can, the start address of the mapping is returned in *startp.
+ */
+static int
+vm_map_range_fits(uintptr_t start, uintptr_t end, size_t size, size_t align,
+                  uintptr_t *startp)
+{
+    uintptr_t aligned;
 
-        if (space >= size) {
-            map->find_cache = start + size;
-            request->start = start;
-            request->next = next;
+    if (align != 0) {
+        aligned = P2ROUND(start, align);
+
+        if (aligned < start) {
             return 0;
         }
 
-        if (space > map->find_cache_threshold) {
-            map->find_cache_threshold = space;
+        start = aligned;
+    }
+
+    if ((start > end) || ((end - start) < size)) {
+        return 0;
+    }
+
+    *startp = start;
+    return 1;
+}
+
+/*
+ * Find the lowest entry preceded by a gap that can hold a mapping of the
+ * given size and alignment.
+ *
+ * Subtrees are skipped when their max gap is smaller than the size of the
+ * mapping, padded so that any gap at least as large can hold the mapping
+ * whatever the alignment of its start address. This bounds the search to
+ * a single path from the root, at the cost of possibly skipping a lower gap
+ * that is smaller than the padded size but happens to be suitably aligned.
+ */
+static struct vm_map_entry *
+vm_map_find_gap(struct vm_map *map, size_t size, size_t align,
+                uintptr_t *startp)
+{
+    struct vm_map_entry *entry;
+    struct rbtree_node *node;
+    size_t min_gap;
+
+    min_gap = size;
+
+    if (align > PAGE_SIZE) {
+        min_gap += align - PAGE_SIZE;
+
+        if (min_gap < size) {
+            return NULL;
         }
+    }
 
-        start = next->end;
-        node = list_next(&next->list_node);
+    node = map->entry_tree.root;
 
-        if (list_end(&map->entry_list, node)) {
-            next = NULL;
-        } else {
-            next = list_entry(node, struct vm_map_entry, list_node);
+    if (vm_map_subtree_max_gap(node) < min_gap) {
+        return NULL;
+    }
+
+    for (;;) {
+        if (vm_map_subtree_max_gap(node->children[RBTREE_LEFT]) >= min_gap) {
+            node = node->children[RBTREE_LEFT];
+            continue;
         }
+
+        entry = rbtree_entry(node, struct vm_map_entry, tree_node);
+
+        if (vm_map_range_fits(entry->start - entry->gap, entry->start,
+                              size, align, startp)) {
+            return entry;
+        }
+
+        node = node->children[RBTREE_RIGHT];
+        assert(vm_map_subtree_max_gap(node) >= min_gap);
     }
 }
 
-static inline struct vm_map_entry *
-vm_map_next(struct vm_map *map, struct vm_map_entry *entry)
+static int
+vm_map_find_avail(struct vm_map *map, struct vm_map_request *request)
 {
+    struct vm_map_entry *next, *last;
+    uintptr_t start;
     struct list *node;
+    int error;
 
-    node = list_next(&entry->list_node);
+    /* If there is a hint, try there */
+    if (request->start != 0) {
+        error = vm_map_find_fixed(map, request);
 
-    if (list_end(&map->entry_list, node)) {
-        return NULL;
-    } else {
-        return list_entry(node, struct vm_map_entry, list_node);
+        if (!error) {
+            return 0;
+        }
+    }
+
+    next = vm_map_find_gap(map, request->size, request->align, &start);
+
+    if (next == NULL) {
+        /* Try the space after the last entry */
+        node = list_last(&map->entry_list);
+
+        if (list_end(&map->entry_list, node)) {
+            start = map->start;
+        } else {
+            last = list_entry(node, struct vm_map_entry, list_node);
+            start = last->end;
+        }
+
+        if (!vm_map_range_fits(start, map->end, request->size,
+                               request->align, &start)) {
+            return ENOMEM;
+        }
     }
+
+    request->start = start;
+    request->next = next;
+    return 0;
 }
 
 static void
@@ -340,21 +421,39 @@ vm_map_link(struct vm_map *map, struct vm_map_entry *entry,
         list_insert_before(&entry->list_node, &next->list_node);
     }
 
-    rbtree_insert(&map->entry_tree, &entry->tree_node, vm_map_entry_cmp_insert);
+    vm_map_entry_set_gap(map, entry);
+    rbtree_insert_augmented(&map->entry_tree, &entry->tree_node,
+                            vm_map_entry_cmp_insert, vm_map_entry_update);
+
+    if (next != NULL) {
+        vm_map_entry_set_gap(map, next);
+        rbtree_propagate(&next->tree_node, vm_map_entry_update);
+    }
+
     map->nr_entries++;
 }
 
 static void
 vm_map_unlink(struct vm_map *map, struct vm_map_entry *entry)
 {
+    struct vm_map_entry *next;
+
     assert(entry->start < entry->end);
 
     if (map->lookup_cache == entry) {
         map->lookup_cache = NULL;
     }
 
+    next = vm_map_next(map, entry);
     list_remove(&entry->list_node);
-    rbtree_remove(&map->entry_tree, &entry->tree_node);
+    rbtree_remove_augmented(&map->entry_tree, &entry->tree_node,
+                            vm_map_entry_update);
+
+    if (next != NULL) {
+        vm_map_entry_set_gap(map, next);
+        rbtree_propagate(&next->tree_node, vm_map_entry_update);
+    }
+
     map->nr_entries--;
 }
 
@@ -580,7 +679,6 @@ vm_map_enter(struct vm_map *map, uintptr_t *startp,
     return 0;
 
 error_enter:
-    vm_map_reset_find_cache(map);
     mutex_unlock(&map->lock);
     return error;
 }
@@ -673,8 +771,6 @@ vm_map_remove(struct vm_map *map, uintptr_t start, uintptr_t end)
         entry = list_entry(node, struct vm_map_entry, list_node);
     }
 
-    vm_map_reset_find_cache(map);
-
 out:
     mutex_unlock(&map->lock);
 }
@@ -695,7 +791,6 @@ vm_map_init(struct vm_map *map, struct pmap *pmap,
     map->end = end;
     map->size = 0;
     map->lookup_cache = NULL;
-    vm_map_reset_find_cache(map);
     map->pmap = pmap;
 }
 
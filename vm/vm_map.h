@@ -64,12 +64,18 @@
 
 /*
  * Memory range descriptor.
+ *
+ * The gap is the free space between the previous entry, or the start of
+ * the map, and the entry. The tree of entries is augmented with the largest
+ * gap of each subtree, so that free space can be found in logarithmic time.
  */
 struct vm_map_entry {
     struct list list_node;
     struct rbtree_node tree_node;
     uintptr_t start;
     uintptr_t end;
+    size_t gap;
+    size_t max_gap;
     struct vm_object *object;
     uint64_t offset;
     int flags;
@@ -87,8 +93,6 @@ struct vm_map {
     uintptr_t end;
     size_t size;
     struct vm_map_entry *lookup_cache;
-    uintptr_t find_cache;
-    size_t find_cache_threshold;
     struct pmap *pmap;
 };
 
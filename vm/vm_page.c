@@ -27,6 +27,17 @@
  * multiprocessor systems. When a pool is empty and cannot provide a page,
  * it is filled by transferring multiple pages from the backend buddy system.
  * The symmetric case is handled likewise.
+ *
+ * When the number of free pages in a zone falls below its low watermark,
+ * the shrink thread is awaken, and runs all registered shrinkers so that
+ * other modules release the memory they can spare.
+ *
+ * On NUMA systems, physical memory is split into nodes, each having its
+ * own set of zones. Allocations are served by the node of the local
+ * processor when possible, and fall back to other nodes in increasing
+ * order of distance. All nodes are tried for a zone before falling back
+ * to a lower zone, so that low zones are preserved for the allocations
+ * that actually need them.
  */
 
 #include <assert.h>
@@ -37,6 +48,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <kern/clock.h>
+#include <kern/condition.h>
 #include <kern/init.h>
 #include <kern/list.h>
 #include <kern/log.h>
@@ -45,6 +58,7 @@
 #include <kern/panic.h>
 #include <kern/printf.h>
 #include <kern/shell.h>
+#include <kern/syscnt.h>
 #include <kern/thread.h>
 #include <machine/boot.h>
 #include <machine/cpu.h>
@@ -56,7 +70,7 @@
 /*
  * Number of free block lists per zone.
  */
-#define VM_PAGE_NR_FREE_LISTS 11
+#define VM_PAGE_NR_FREE_LISTS (VM_PAGE_MAX_ORDER + 1)
 
 /*
  * The size of a CPU pool is computed by dividing the number of pages in its
@@ -75,6 +89,23 @@
  */
 #define VM_PAGE_CPU_POOL_TRANSFER_RATIO 2
 
+/*
+ * The low watermark of a zone is computed by dividing the number of pages
+ * in the zone by this value.
+ */
+#define VM_PAGE_LOW_WATERMARK_RATIO 32
+
+/*
+ * Minimum interval between two shrinking passes, in milliseconds.
+ */
+#define VM_PAGE_SHRINK_INTERVAL 100
+
+/*
+ * Default node distances, as defined by the ACPI specification.
+ */
+#define VM_PAGE_LOCAL_DISTANCE  10
+#define VM_PAGE_REMOTE_DISTANCE 20
+
 /*
  * Per-processor cache of pages.
  */
@@ -118,6 +149,19 @@ struct vm_page_zone {
     struct mutex lock;
     struct vm_page_free_list free_lists[VM_PAGE_NR_FREE_LISTS];
     unsigned long nr_free_pages;
+    unsigned long low_free_pages;
+};
+
+/*
+ * Memory node.
+ *
+ * The fallback array contains the indexes of all nodes, in increasing
+ * order of distance, the first entry being the node itself.
+ */
+struct vm_page_node {
+    struct vm_page_zone zones[PMEM_MAX_ZONES];
+    unsigned int fallback[PMEM_MAX_NODES];
+    struct syscnt sc_remote_allocs;
 };
 
 /*
@@ -131,12 +175,20 @@ struct vm_page_boot_zone {
     phys_addr_t avail_end;
 };
 
+/*
+ * Bootstrap information about a node.
+ */
+struct vm_page_boot_node {
+    phys_addr_t start;
+    phys_addr_t end;
+};
+
 static int vm_page_is_ready __read_mostly;
 
 /*
- * Zone table.
+ * Node table, each node having its own zone table.
  *
- * The system supports a maximum of 4 zones :
+ * The system supports a maximum of 4 zones per node :
  *  - DMA: suitable for DMA
  *  - DMA32: suitable for DMA when devices support 32-bits addressing
  *  - DIRECTMAP: direct physical mapping, allows direct access from
@@ -149,7 +201,7 @@ static int vm_page_is_ready __read_mostly;
  * the direct physical mapping, DMA and DMA32 are aliases for DIRECTMAP,
  * in which case the zone table contains DIRECTMAP and HIGHMEM only.
  */
-static struct vm_page_zone vm_page_zones[PMEM_MAX_ZONES];
+static struct vm_page_node vm_page_nodes[PMEM_MAX_NODES];
 
 /*
  * Bootstrap zone table.
@@ -162,12 +214,43 @@ static struct vm_page_boot_zone vm_page_boot_zones[PMEM_MAX_ZONES]
  */
 static unsigned int vm_page_zones_size __read_mostly;
 
+/*
+ * Bootstrap node table, and distances between nodes.
+ */
+static struct vm_page_boot_node vm_page_boot_nodes[PMEM_MAX_NODES]
+    __initdata;
+static unsigned int vm_page_boot_distances[PMEM_MAX_NODES][PMEM_MAX_NODES]
+    __initdata;
+
+/*
+ * Number of nodes.
+ *
+ * Nodes may have no memory, in which case all their zones are empty.
+ */
+static unsigned int vm_page_nr_nodes __read_mostly = 1;
+
+/*
+ * Registered shrinkers.
+ *
+ * The list lock is held while shrinkers run. The shrink lock only protects
+ * the request flag, so that shrinkers may allocate pages.
+ */
+static struct list vm_page_shrinkers;
+static struct mutex vm_page_shrinkers_lock;
+
+static struct mutex vm_page_shrink_lock;
+static struct condition vm_page_shrink_cond;
+static bool vm_page_shrink_requested;
+static bool vm_page_shrink_ready __read_mostly;
+
 static void __init
-vm_page_init(struct vm_page *page, unsigned short zone_index, phys_addr_t pa)
+vm_page_init(struct vm_page *page, unsigned short node_index,
+             unsigned short zone_index, phys_addr_t pa)
 {
     memset(page, 0, sizeof(*page));
     page->type = VM_PAGE_RESERVED;
     page->zone_index = zone_index;
+    page->node_index = node_index;
     page->order = VM_PAGE_ORDER_UNLISTED;
     page->phys_addr = pa;
 
@@ -215,6 +298,36 @@ vm_page_free_list_remove(struct vm_page_free_list *free_list,
     list_remove(&page->node);
 }
 
+static void
+vm_page_shrink_request(void)
+{
+    if (!vm_page_shrink_ready) {
+        return;
+    }
+
+    mutex_lock(&vm_page_shrink_lock);
+
+    if (!vm_page_shrink_requested) {
+        vm_page_shrink_requested = true;
+        condition_signal(&vm_page_shrink_cond);
+    }
+
+    mutex_unlock(&vm_page_shrink_lock);
+}
+
+/*
+ * Check the low watermark of a zone.
+ *
+ * The zone must be locked.
+ */
+static void
+vm_page_zone_check_watermark(const struct vm_page_zone *zone)
+{
+    if (zone->nr_free_pages < zone->low_free_pages) {
+        vm_page_shrink_request();
+    }
+}
+
 static struct vm_page *
 vm_page_zone_alloc_from_buddy(struct vm_page_zone *zone, unsigned int order)
 {
@@ -233,6 +346,7 @@ vm_page_zone_alloc_from_buddy(struct vm_page_zone *zone, unsigned int order)
     }
 
     if (i == VM_PAGE_NR_FREE_LISTS) {
+        vm_page_shrink_request();
         return NULL;
     }
 
@@ -248,6 +362,7 @@ vm_page_zone_alloc_from_buddy(struct vm_page_zone *zone, unsigned int order)
     }
 
     zone->nr_free_pages -= (1 << order);
+    vm_page_zone_check_watermark(zone);
     return page;
 }
 
@@ -396,8 +511,15 @@ vm_page_zone_compute_pool_size(struct vm_page_zone *zone)
     return size;
 }
 
+static bool
+vm_page_zone_loaded(const struct vm_page_zone *zone)
+{
+    return (zone->pages != NULL);
+}
+
 static void __init
-vm_page_zone_init(struct vm_page_zone *zone, phys_addr_t start, phys_addr_t end,
+vm_page_zone_init(struct vm_page_zone *zone, unsigned int node_index,
+                  unsigned int zone_index, phys_addr_t start, phys_addr_t end,
                   struct vm_page *pages)
 {
     phys_addr_t pa;
@@ -421,10 +543,12 @@ vm_page_zone_init(struct vm_page_zone *zone, phys_addr_t start, phys_addr_t end,
     }
 
     zone->nr_free_pages = 0;
-    i = zone - vm_page_zones;
+    zone->low_free_pages = vm_page_btop(vm_page_zone_size(zone))
+                           / VM_PAGE_LOW_WATERMARK_RATIO;
 
     for (pa = zone->start; pa < zone->end; pa += PAGE_SIZE) {
-        vm_page_init(&pages[vm_page_btop(pa - zone->start)], i, pa);
+        vm_page_init(&pages[vm_page_btop(pa - zone->start)],
+                     node_index, zone_index, pa);
     }
 }
 
@@ -547,6 +671,50 @@ vm_page_load_heap(unsigned int zone_index, phys_addr_t start, phys_addr_t end)
               (unsigned long long)start, (unsigned long long)end);
 }
 
+static bool __init
+vm_page_boot_node_loaded(const struct vm_page_boot_node *node)
+{
+    return (node->end != 0);
+}
+
+void __init
+vm_page_load_node(unsigned int node_index, phys_addr_t start, phys_addr_t end)
+{
+    struct vm_page_boot_node *node;
+
+    assert(node_index < ARRAY_SIZE(vm_page_boot_nodes));
+    assert(vm_page_aligned(start));
+    assert(vm_page_aligned(end));
+    assert(start < end);
+
+    node = &vm_page_boot_nodes[node_index];
+
+    if (!vm_page_boot_node_loaded(node)) {
+        node->start = start;
+        node->end = end;
+    } else {
+        node->start = MIN(node->start, start);
+        node->end = MAX(node->end, end);
+    }
+
+    if (node_index >= vm_page_nr_nodes) {
+        vm_page_nr_nodes = node_index + 1;
+    }
+
+    log_debug("vm_page: node%u: %llx:%llx", node_index,
+              (unsigned long long)start, (unsigned long long)end);
+}
+
+void __init
+vm_page_set_node_distance(unsigned int node1, unsigned int node2,
+                          unsigned int distance)
+{
+    assert(node1 < ARRAY_SIZE(vm_page_boot_distances));
+    assert(node2 < ARRAY_SIZE(vm_page_boot_distances[node1]));
+
+    vm_page_boot_distances[node1][node2] = distance;
+}
+
 int
 vm_page_ready(void)
 {
@@ -617,6 +785,149 @@ vm_page_boot_zone_avail_size(struct vm_page_boot_zone *zone)
     return zone->avail_end - zone->avail_start;
 }
 
+static unsigned int __init
+vm_page_boot_distance(unsigned int node1, unsigned int node2)
+{
+    unsigned int distance;
+
+    distance = vm_page_boot_distances[node1][node2];
+
+    if (distance != 0) {
+        return distance;
+    }
+
+    return (node1 == node2) ? VM_PAGE_LOCAL_DISTANCE : VM_PAGE_REMOTE_DISTANCE;
+}
+
+/*
+ * Make sure node ranges don't overlap.
+ *
+ * If they do, node information is ignored and all physical memory is
+ * assigned to node 0. The number of nodes is kept so that processors
+ * may still refer to the nodes they belong to.
+ */
+static void __init
+vm_page_check_boot_nodes(void)
+{
+    const struct vm_page_boot_node *node1, *node2;
+
+    for (unsigned int i = 0; i < vm_page_nr_nodes; i++) {
+        node1 = &vm_page_boot_nodes[i];
+
+        if (!vm_page_boot_node_loaded(node1)) {
+            continue;
+        }
+
+        for (unsigned int j = i + 1; j < vm_page_nr_nodes; j++) {
+            node2 = &vm_page_boot_nodes[j];
+
+            if (!vm_page_boot_node_loaded(node2)
+                || (node1->end <= node2->start)
+                || (node2->end <= node1->start)) {
+                continue;
+            }
+
+            log_warning("vm_page: overlapping memory nodes, "
+                        "ignoring node information");
+            memset(vm_page_boot_nodes, 0, sizeof(vm_page_boot_nodes));
+            return;
+        }
+    }
+}
+
+/*
+ * Return the range of physical memory assigned to a node.
+ *
+ * Nodes extend up to the start of the next node. The lowest node
+ * also extends down to the start of physical memory, so that all memory
+ * is assigned to a node. If no node has been loaded, node 0 covers all
+ * physical memory.
+ */
+static bool __init
+vm_page_boot_node_range(unsigned int node_index, phys_addr_t *startp,
+                        phys_addr_t *endp)
+{
+    const struct vm_page_boot_node *node, *tmp;
+    phys_addr_t start, end;
+    bool lowest, loaded;
+
+    node = &vm_page_boot_nodes[node_index];
+
+    if (!vm_page_boot_node_loaded(node)) {
+        loaded = false;
+
+        for (unsigned int i = 0; i < vm_page_nr_nodes; i++) {
+            if (vm_page_boot_node_loaded(&vm_page_boot_nodes[i])) {
+                loaded = true;
+                break;
+            }
+        }
+
+        if (loaded || (node_index != 0)) {
+            return false;
+        }
+
+        *startp = 0;
+        *endp = (phys_addr_t)-1;
+        return true;
+    }
+
+    start = node->start;
+    end = (phys_addr_t)-1;
+    lowest = true;
+
+    for (unsigned int i = 0; i < vm_page_nr_nodes; i++) {
+        tmp = &vm_page_boot_nodes[i];
+
+        if ((tmp == node) || !vm_page_boot_node_loaded(tmp)) {
+            continue;
+        }
+
+        if (tmp->start < node->start) {
+            lowest = false;
+        } else if (tmp->start < end) {
+            end = tmp->start;
+        }
+    }
+
+    *startp = lowest ? 0 : start;
+    *endp = end;
+    return true;
+}
+
+static void __init
+vm_page_node_init(struct vm_page_node *node)
+{
+    char name[SYSCNT_NAME_SIZE];
+    unsigned int i, j, index, distance, node_index;
+
+    node_index = node - vm_page_nodes;
+    assert(vm_page_nr_nodes <= ARRAY_SIZE(node->fallback));
+
+    /*
+     * Build the fallback array with an insertion sort. The node itself
+     * comes first, unless firmware reports an unusual distance.
+     */
+    for (i = 0; i < vm_page_nr_nodes; i++) {
+        index = (node_index + i) % vm_page_nr_nodes;
+        distance = vm_page_boot_distance(node_index, index);
+
+        for (j = i; j > 0; j--) {
+            if (vm_page_boot_distance(node_index, node->fallback[j - 1])
+                <= distance) {
+                break;
+            }
+
+            node->fallback[j] = node->fallback[j - 1];
+        }
+
+        node->fallback[j] = index;
+    }
+
+    snprintf(name, sizeof(name), "vm_page_remote_allocs/%u", node_index);
+    syscnt_register(&node->sc_remote_allocs, name);
+}
+
 static void * __init
 vm_page_bootalloc(size_t size)
 {
@@ -648,14 +959,21 @@ vm_page_info_common(int (*print_fn)(const char *format, ...))
 {
     struct vm_page_zone *zone;
     unsigned long pages;
-    unsigned int i;
 
-    for (i = 0; i < vm_page_zones_size; i++) {
-        zone = &vm_page_zones[i];
-        pages = (unsigned long)(zone->pages_end - zone->pages);
-        print_fn("vm_page: %s: pages: %lu (%luM), free: %lu (%luM)\n",
-                 vm_page_zone_name(i), pages, pages >> (20 - PAGE_SHIFT),
-                 zone->nr_free_pages, zone->nr_free_pages >> (20 - PAGE_SHIFT));
+    for (unsigned int i = 0; i < vm_page_nr_nodes; i++) {
+        for (unsigned int j = 0; j < vm_page_zones_size; j++) {
+            zone = &vm_page_nodes[i].zones[j];
+
+            if (!vm_page_zone_loaded(zone)) {
+                continue;
+            }
+
+            pages = (unsigned long)(zone->pages_end - zone->pages);
+            print_fn("vm_page: node%u: %s: pages: %lu (%luM), "
+                     "free: %lu (%luM)\n", i, vm_page_zone_name(j),
+                     pages, pages >> (20 - PAGE_SHIFT), zone->nr_free_pages,
+                     zone->nr_free_pages >> (20 - PAGE_SHIFT));
+        }
     }
 }
 
@@ -695,18 +1013,65 @@ INIT_OP_DEFINE(vm_page_setup_shell,
 
 #endif /* CONFIG_SHELL */
 
-static int __init
-vm_page_setup(void)
+/*
+ * Initialize the part of a zone that belongs to a node.
+ *
+ * Return the number of page descriptors used from the page table.
+ */
+static size_t __init
+vm_page_setup_zone(unsigned int node_index, unsigned int zone_index,
+                   struct vm_page *table)
 {
     struct vm_page_boot_zone *boot_zone;
+    phys_addr_t start, end, avail_start, avail_end;
     struct vm_page_zone *zone;
-    struct vm_page *table, *page, *end;
+    struct vm_page *page;
+    bool loaded;
+
+    loaded = vm_page_boot_node_range(node_index, &start, &end);
+
+    if (!loaded) {
+        return 0;
+    }
+
+    boot_zone = &vm_page_boot_zones[zone_index];
+    start = MAX(boot_zone->start, start);
+    end = MIN(boot_zone->end, end);
+
+    if (start >= end) {
+        return 0;
+    }
+
+    zone = &vm_page_nodes[node_index].zones[zone_index];
+    vm_page_zone_init(zone, node_index, zone_index, start, end, table);
+
+    if (!boot_zone->heap_present) {
+        return vm_page_btop(vm_page_zone_size(zone));
+    }
+
+    avail_start = MAX(boot_zone->avail_start, start);
+    avail_end = MIN(boot_zone->avail_end, end);
+
+    for (phys_addr_t pa = avail_start; pa < avail_end; pa += PAGE_SIZE) {
+        page = &zone->pages[vm_page_btop(pa - zone->start)];
+        page->type = VM_PAGE_FREE;
+        vm_page_zone_free_to_buddy(zone, page, 0);
+    }
+
+    return vm_page_btop(vm_page_zone_size(zone));
+}
+
+static int __init
+vm_page_setup(void)
+{
+    struct vm_page *table, *page;
     size_t nr_pages, table_size;
     uintptr_t va;
-    unsigned int i;
+    unsigned int i, j;
     phys_addr_t pa;
 
     vm_page_check_boot_zones();
+    vm_page_check_boot_nodes();
 
     /*
      * Compute the page table size.
@@ -724,26 +1089,17 @@ vm_page_setup(void)
     va = (uintptr_t)table;
 
     /*
-     * Initialize the zones, associating them to the page table. When
-     * the zones are initialized, all their pages are set allocated.
-     * Pages are then released, which populates the free lists.
+     * Initialize the zones, associating them to the page table. Zones are
+     * split at node boundaries. When the zones are initialized, all their
+     * pages are set allocated. Pages are then released, which populates
+     * the free lists.
      */
-    for (i = 0; i < vm_page_zones_size; i++) {
-        zone = &vm_page_zones[i];
-        boot_zone = &vm_page_boot_zones[i];
-        vm_page_zone_init(zone, boot_zone->start, boot_zone->end, table);
-        page = zone->pages + vm_page_btop(boot_zone->avail_start
-                                          - boot_zone->start);
-        end = zone->pages + vm_page_btop(boot_zone->avail_end
-                                         - boot_zone->start);
-
-        while (page < end) {
-            page->type = VM_PAGE_FREE;
-            vm_page_zone_free_to_buddy(zone, page, 0);
-            page++;
-        }
+    for (i = 0; i < vm_page_nr_nodes; i++) {
+        vm_page_node_init(&vm_page_nodes[i]);
 
-        table += vm_page_btop(vm_page_zone_size(zone));
+        for (j = 0; j < vm_page_zones_size; j++) {
+            table += vm_page_setup_zone(i, j, table);
+        }
     }
 
     while (va < (uintptr_t)table) {
@@ -754,6 +1110,11 @@ vm_page_setup(void)
         va += PAGE_SIZE;
     }
 
+    list_init(&vm_page_shrinkers);
+    mutex_init(&vm_page_shrinkers_lock);
+    mutex_init(&vm_page_shrink_lock);
+    condition_init(&vm_page_shrink_cond);
+
     vm_page_is_ready = 1;
 
     return 0;
@@ -762,30 +1123,104 @@ vm_page_setup(void)
 INIT_OP_DEFINE(vm_page_setup,
                INIT_OP_DEP(boot_load_vm_page_zones, true),
                INIT_OP_DEP(log_setup, true),
-               INIT_OP_DEP(printf_setup, true));
+               INIT_OP_DEP(printf_setup, true),
+               INIT_OP_DEP(syscnt_setup, true));
+
+static void
+vm_page_shrink(void)
+{
+    struct vm_page_shrinker *shrinker;
+
+    mutex_lock(&vm_page_shrinkers_lock);
+
+    list_for_each_entry(&vm_page_shrinkers, shrinker, node) {
+        shrinker->fn(shrinker);
+    }
+
+    mutex_unlock(&vm_page_shrinkers_lock);
+}
+
+static void
+vm_page_shrink_run(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        mutex_lock(&vm_page_shrink_lock);
+
+        while (!vm_page_shrink_requested) {
+            condition_wait(&vm_page_shrink_cond, &vm_page_shrink_lock);
+        }
+
+        vm_page_shrink_requested = false;
+
+        mutex_unlock(&vm_page_shrink_lock);
+
+        vm_page_shrink();
+
+        /*
+         * Allocations keep requesting shrinking as long as memory is low.
+         * Bound the rate at which shrinkers run in that case.
+         */
+        thread_delay(clock_ticks_from_ms(VM_PAGE_SHRINK_INTERVAL), false);
+    }
+}
+
+static int __init
+vm_page_start(void)
+{
+    struct thread_attr attr;
+    struct thread *thread;
+    int error;
+
+    thread_attr_init(&attr, THREAD_KERNEL_PREFIX "vm_page_shrink");
+    thread_attr_set_detached(&attr);
+    error = thread_create(&thread, &attr, vm_page_shrink_run, NULL);
+
+    if (error) {
+        panic("vm_page: unable to create shrink thread");
+    }
+
+    vm_page_shrink_ready = true;
+
+    return 0;
+}
+
+INIT_OP_DEFINE(vm_page_start,
+               INIT_OP_DEP(panic_setup, true),
+               INIT_OP_DEP(thread_setup, true),
+               INIT_OP_DEP(vm_page_setup, true));
+
+static struct vm_page_zone *
+vm_page_get_zone(const struct vm_page *page)
+{
+    assert(page->node_index < vm_page_nr_nodes);
+    assert(page->zone_index < vm_page_zones_size);
+    return &vm_page_nodes[page->node_index].zones[page->zone_index];
+}
 
 /* TODO Rename to avoid confusion with "managed pages" */
 void __init
 vm_page_manage(struct vm_page *page)
 {
-    assert(page->zone_index < ARRAY_SIZE(vm_page_zones));
     assert(page->type == VM_PAGE_RESERVED);
 
     vm_page_set_type(page, 0, VM_PAGE_FREE);
-    vm_page_zone_free_to_buddy(&vm_page_zones[page->zone_index], page, 0);
+    vm_page_zone_free_to_buddy(vm_page_get_zone(page), page, 0);
 }
 
 struct vm_page *
 vm_page_lookup(phys_addr_t pa)
 {
     struct vm_page_zone *zone;
-    unsigned int i;
 
-    for (i = 0; i < vm_page_zones_size; i++) {
-        zone = &vm_page_zones[i];
+    for (unsigned int i = 0; i < vm_page_nr_nodes; i++) {
+        for (unsigned int j = 0; j < vm_page_zones_size; j++) {
+            zone = &vm_page_nodes[i].zones[j];
 
-        if ((pa >= zone->start) && (pa < zone->end)) {
-            return &zone->pages[vm_page_btop(pa - zone->start)];
+            if ((pa >= zone->start) && (pa < zone->end)) {
+                return &zone->pages[vm_page_btop(pa - zone->start)];
+            }
         }
     }
 
@@ -811,13 +1246,40 @@ vm_page_block_referenced(const struct vm_page *page, unsigned int order)
 struct vm_page *
 vm_page_alloc(unsigned int order, unsigned int selector, unsigned short type)
 {
+    struct vm_page_node *local, *node;
+    unsigned int zone_index, node_index;
+    struct vm_page_zone *zone;
     struct vm_page *page;
-    unsigned int i;
 
-    for (i = vm_page_select_alloc_zone(selector); i < vm_page_zones_size; i--) {
-        page = vm_page_zone_alloc(&vm_page_zones[i], order, type);
+    zone_index = vm_page_select_alloc_zone(selector);
+
+    /*
+     * The local node is only a hint, there is no need to prevent
+     * migration while it's used.
+     */
+    node_index = cpu_node();
+    assert(node_index < vm_page_nr_nodes);
+    local = &vm_page_nodes[node_index];
+
+    for (unsigned int i = zone_index; i < vm_page_zones_size; i--) {
+        for (unsigned int j = 0; j < vm_page_nr_nodes; j++) {
+            node = &vm_page_nodes[local->fallback[j]];
+            zone = &node->zones[i];
+
+            if (!vm_page_zone_loaded(zone)) {
+                continue;
+            }
+
+            page = vm_page_zone_alloc(zone, order, type);
+
+            if (page == NULL) {
+                continue;
+            }
+
+            if (node != local) {
+                syscnt_inc(&local->sc_remote_allocs);
+            }
 
-        if (page != NULL) {
             assert(!vm_page_block_referenced(page, order));
             return page;
         }
@@ -829,10 +1291,20 @@ vm_page_alloc(unsigned int order, unsigned int selector, unsigned short type)
 void
 vm_page_free(struct vm_page *page, unsigned int order)
 {
-    assert(page->zone_index < ARRAY_SIZE(vm_page_zones));
     assert(!vm_page_block_referenced(page, order));
 
-    vm_page_zone_free(&vm_page_zones[page->zone_index], page, order);
+    vm_page_zone_free(vm_page_get_zone(page), page, order);
+}
+
+void
+vm_page_register_shrinker(struct vm_page_shrinker *shrinker,
+                          vm_page_shrink_fn_t fn)
+{
+    shrinker->fn = fn;
+
+    mutex_lock(&vm_page_shrinkers_lock);
+    list_insert_tail(&vm_page_shrinkers, &shrinker->node);
+    mutex_unlock(&vm_page_shrinkers_lock);
 }
 
 const char *
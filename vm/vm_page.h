@@ -67,6 +67,11 @@
 #define VM_PAGE_SEL_DIRECTMAP   2
 #define VM_PAGE_SEL_HIGHMEM     3
 
+/*
+ * Maximum order of blocks of physical pages.
+ */
+#define VM_PAGE_MAX_ORDER 10
+
 /*
  * Page usage types.
  */
@@ -85,6 +90,7 @@ struct vm_page {
     struct list node;
     unsigned short type;
     unsigned short zone_index;
+    unsigned short node_index;
     unsigned short order;
     phys_addr_t phys_addr;
     void *priv;
@@ -105,6 +111,15 @@ vm_page_type(const struct vm_page *page)
 void vm_page_set_type(struct vm_page *page, unsigned int order,
                       unsigned short type);
 
+/*
+ * Return the memory node of a page.
+ */
+static inline unsigned int
+vm_page_node(const struct vm_page *page)
+{
+    return page->node_index;
+}
+
 static inline unsigned int
 vm_page_order(size_t size)
 {
@@ -168,6 +183,27 @@ vm_page_unlink(struct vm_page *page)
     page->object = NULL;
 }
 
+/*
+ * Memory shrinker.
+ *
+ * Shrinkers are run from a dedicated thread when the number of free pages
+ * in a zone falls below its low watermark. They should release as much
+ * memory as they can spare. They may allocate memory, but are run with the
+ * lock protecting the list of shrinkers held, and must not register
+ * shrinkers.
+ */
+struct vm_page_shrinker;
+
+/*
+ * Type for shrinker functions.
+ */
+typedef void (*vm_page_shrink_fn_t)(struct vm_page_shrinker *);
+
+struct vm_page_shrinker {
+    struct list node;
+    vm_page_shrink_fn_t fn;
+};
+
 /*
  * Load physical memory into the vm_page module at boot time.
  *
@@ -184,6 +220,28 @@ void vm_page_load(unsigned int zone_index, phys_addr_t start, phys_addr_t end);
 void vm_page_load_heap(unsigned int zone_index, phys_addr_t start,
                        phys_addr_t end);
 
+/*
+ * Report the memory node of a range of physical memory at boot time.
+ *
+ * Nodes are identified by an index lower than PMEM_MAX_NODES. Ranges
+ * reported for a node are merged, and the ranges of different nodes must
+ * not overlap. Physical memory is split at node boundaries when zones are
+ * initialized, memory outside all reported ranges being assigned to the
+ * nearest node below it, or to the lowest node.
+ *
+ * If this function isn't called, all physical memory belongs to node 0.
+ */
+void vm_page_load_node(unsigned int node, phys_addr_t start, phys_addr_t end);
+
+/*
+ * Report the relative distance between two memory nodes at boot time.
+ *
+ * By convention, the distance from a node to itself is 10. Unreported
+ * distances between different nodes default to 20.
+ */
+void vm_page_set_node_distance(unsigned int node1, unsigned int node2,
+                               unsigned int distance);
+
 /*
  * Return true if the vm_page module is completely initialized, false
  * otherwise, in which case only vm_page_bootalloc() can be used for
@@ -208,7 +266,9 @@ struct vm_page * vm_page_lookup(phys_addr_t pa);
  * Allocate a block of 2^order physical pages.
  *
  * The selector is used to determine the zones from which allocation can
- * be attempted.
+ * be attempted. Each zone is tried on the memory node of the local
+ * processor first, then on other nodes in increasing order of distance,
+ * before falling back to a lower zone.
  *
  * If successful, the returned pages have no references.
  */
@@ -222,6 +282,16 @@ struct vm_page * vm_page_alloc(unsigned int order, unsigned int selector,
  */
 void vm_page_free(struct vm_page *page, unsigned int order);
 
+/*
+ * Register a shrinker.
+ *
+ * The shrinker structure should be embedded in an object related to the
+ * memory it releases, and is passed to the shrinker function as its only
+ * parameter. Shrinkers can't be unregistered.
+ */
+void vm_page_register_shrinker(struct vm_page_shrinker *shrinker,
+                               vm_page_shrink_fn_t fn);
+
 /*
  * Return the name of the given zone.
  */
@@ -281,6 +351,7 @@ vm_page_tryref(struct vm_page *page)
 /*
  * This init operation provides :
  *  - module fully initialized
+ *  - shrinker registration
  */
 INIT_OP_DECLARE(vm_page_setup);
 